@@ -0,0 +1,78 @@
+/* -------------------------------------------------------------------------
+ * admit.h - htun admission control of connections at accept
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __ADMIT_H
+#define __ADMIT_H
+
+#include <netinet/in.h>
+
+/*
+ * Every accepted connection is checked here before it is given to a worker
+ * thread. A source address may connect admit_rate times a minute, with a
+ * burst of admit_burst. The last quarter of the request queue is kept for
+ * sources that a client has had a channel from lately, so its channels get
+ * in while port scans and reconnect storms of others fill the rest. With
+ * admit_check, a connection whose first bytes are not an HTTP request (or a
+ * TLS handshake on a TLS server) is dropped without a worker ever seeing it.
+ */
+
+/* How many sources are remembered. Past that the oldest are forgotten. */
+#define ADMIT_SLOTS 4096
+
+/* How many slots a source may be in, from the one its address hashes to */
+#define ADMIT_PROBE 4
+
+/* The burst of admit_rate when admit_burst is not set */
+#define ADMIT_BURST 10
+
+/* The part of max_pending kept for sources with a client: one in this */
+#define ADMIT_RESERVE 4
+
+/* How long accept() waits for the first bytes of a connection */
+#define ADMIT_DEFER_SECS 5
+
+/* What admit() decided */
+#define ADMIT_OK   0
+#define ADMIT_RATE 1        /* the source connects too often */
+#define ADMIT_LOAD 2        /* too busy for sources without a client */
+#define ADMIT_JUNK 3        /* what it sent first is not for htun */
+
+/*
+ * Makes accept() on the listening socket sock wait for the first bytes of
+ * a connection, so that admit() can look at them.
+ */
+void admit_listen( int sock );
+
+/*
+ * Notes that a client has a channel from src, which will be let in ahead of
+ * others until clidata_timeout after the last call.
+ */
+void admit_known( struct in_addr src );
+
+/*
+ * Decides whether the connection fd from src is given to a worker while
+ * pending requests are queued for one. tls is nonzero if it should start
+ * with a TLS handshake. Returns ADMIT_OK or why it is to be closed.
+ */
+int admit( int fd, struct in_addr src, int pending, int tls );
+
+#endif
@@ -0,0 +1,134 @@
+/* -------------------------------------------------------------------------
+ * aead.h - htun batch encryption defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __AEAD_H
+#define __AEAD_H
+
+#include <sys/types.h>
+
+/*
+ * With a pre-shared key (the psk option) on both ends, every batch is
+ * sealed as a whole with an AEAD cipher after it is compressed. The client
+ * sends a random nonce and the cipher it wants on a CRYPT_LINE at connect,
+ * and both ends derive a key for each direction from the psk, the nonce
+ * and the session token. The keys live as long as the session, so batches
+ * sealed before a reconnect can be sent again after it.
+ *
+ * The client proves it has the psk with an HMAC over its MAC address, its
+ * session token, its nonce and the time, which the server checks before it
+ * lets a connect take over or reset a session. A proof is good for
+ * AEAD_AUTH_WINDOW seconds either way, and the server takes none that is
+ * older than, or has the same nonce as, the last one that client sent.
+ * The server answers every connect with the same HMAC under another label,
+ * over the token it hands out and that connect's nonce, so an answer
+ * cannot be played back to a later connect.
+ *
+ * A sealed batch is an 8 byte counter, which makes up the nonce and only
+ * ever goes up, then the ciphertext and the 16 byte tag.
+ */
+
+#define AEAD_CHACHA20_POLY1305 1
+#define AEAD_AES_256_GCM       2
+
+#define AEAD_KEY_LEN   32
+#define AEAD_NONCE_LEN 16   /* of the client's connect nonce */
+#define AEAD_PROOF_LEN 16
+#define AEAD_AUTH_WINDOW 300
+#define AEAD_TAG_LEN   16
+#define AEAD_OVERHEAD  (8 + AEAD_TAG_LEN)
+
+typedef struct {
+    int cipher;             /* AEAD_*, 0 until the keys are set up */
+    unsigned char tx[AEAD_KEY_LEN];
+    unsigned char rx[AEAD_KEY_LEN];
+    unsigned long long txctr;   /* the last counter we sealed with */
+    unsigned long long rxctr;   /* and the last one we opened */
+} aead_t;
+
+/*
+ * Returns the AEAD_* cipher called name, or 0 if there is none.
+ */
+int aead_cipher( const char *name );
+
+/*
+ * Returns the name of the AEAD_* cipher.
+ */
+const char *aead_name( int cipher );
+
+/*
+ * Fills buf with len random bytes.
+ */
+void aead_random( unsigned char *buf, size_t len );
+
+/*
+ * Writes the len bytes at in as 2*len hex digits and a '\0' to out.
+ */
+void aead_hex( char *out, const unsigned char *in, size_t len );
+
+/*
+ * Reads 2*len hex digits at in into len bytes at out. Returns 0 on success,
+ * -1 if there are not that many.
+ */
+int aead_unhex( unsigned char *out, const char *in, size_t len );
+
+/*
+ * Derives the keys for a session from the psk, its token and
+ * the client's nonce. server says which end we are.
+ */
+void aead_setup( aead_t *a, int cipher, const char *psk, const char *token,
+                 const unsigned char *nonce, int server );
+
+/*
+ * Places in out the AEAD_PROOF_LEN byte proof that whoever connects as mac
+ * in the session token (NULL or "" for none) with nonce at time t has the
+ * psk. server makes it the server's answer to that connect instead.
+ */
+void aead_auth( unsigned char *out, const char *psk, int server,
+                const char *mac, const char *token,
+                const unsigned char *nonce, unsigned long t );
+
+/*
+ * Returns nonzero if auth is the proof aead_auth() makes of the rest.
+ */
+int aead_auth_ok( const unsigned char *auth, const char *psk, int server,
+                  const char *mac, const char *token,
+                  const unsigned char *nonce, unsigned long t );
+
+/*
+ * Forgets the keys, for a new session.
+ */
+void aead_reset( aead_t *a );
+
+/*
+ * Seals the len bytes at buf into a DYNAMICALLY ALLOCATED buffer, placing
+ * its length in *outlen. Returns NULL on failure.
+ */
+char *aead_seal( aead_t *a, const char *buf, size_t len, size_t *outlen );
+
+/*
+ * Opens what the peer sealed into a DYNAMICALLY ALLOCATED buffer, placing
+ * its length in *outlen. Returns NULL if it does not authenticate or is
+ * older than the last batch opened.
+ */
+char *aead_open( aead_t *a, const char *buf, size_t len, size_t *outlen );
+
+#endif
@@ -25,6 +25,13 @@
 
 #include "iprange.h"
 #include "queue.h"
+#include "http.h"
+#include "rtx.h"
+#include "pep.h"
+#include "frame.h"
+#include "shape.h"
+#include "metrics.h"
+#include "lat.h"
 
 #ifdef __EI
 #undef __EI
@@ -38,6 +45,7 @@ typedef struct _clidata {
     struct in_addr cliaddr;
     struct in_addr srvaddr;
     int tunfd;
+    int mtu;                /* of tunfd, agreed with the client */
     pthread_t writer;
     pthread_t reader;
     int chan1;
@@ -45,7 +53,18 @@ typedef struct _clidata {
     time_t lastuse;
     queue_t *sendq;
     queue_t *recvq;
+    rtx_t *rtx;             /* batches sent to the client, see rtx.h */
+    pep_t *pep;             /* its split TCP streams, see pep.h */
+    fr_t *fr;               /* frames sent to the client, see frame.h */
+    int framed;             /* its WebSocket channel runs protocol 3 */
+    shape_t *shape_tx;      /* the rate of what we send it, see shape.h */
+    shape_t *shape_rx;      /* and of what it sends */
+    met_client_t met;       /* its bytes and packets, see metrics.h */
+    lat_t *lat;             /* where its packets spend their time */
     iprange_t *iprange;
+    char token[SESSION_TOKEN_LEN+1];
+    unsigned char nonce[AEAD_NONCE_LEN]; /* of its last psk proof */
+    unsigned long authtime;             /* and the time in it */
     struct _clidata *next;
     struct _clidata *prev;
 } clidata_t;
@@ -69,6 +88,12 @@ int ip_used( clidata_list_t *list, struct in_addr ip ) {
 }
 
 
+/*
+ * Returns nonzero if macaddr is a MAC address the way clients send it: 12
+ * hex digits and nothing else.
+ */
+int mac_ok( const char *macaddr );
+
 /*
  * Pass in a MAC address, and get_clidata() returns the data for the client
  * with that MAC address, or NULL if it does not exist.
@@ -88,6 +113,20 @@ clidata_t *add_clidata( clidata_list_t *list, char *macaddr );
  */
 void remove_clidata( clidata_list_t *list, char *macaddr );
 
+/*
+ * Marks the channel *chan (&client->chan1 or &client->chan2) down if it is
+ * still fd, which it is not once the client has connected it again. Returns
+ * nonzero if it was. The handler of a channel closes its own socket, after
+ * this.
+ */
+int drop_chan( clidata_list_t *list, int *chan, int fd );
+
+/*
+ * Shuts down the channel *chan of a client that is connecting it again, so
+ * its handler lets go of it, and marks it down.
+ */
+void replace_chan( clidata_list_t *list, int *chan );
+
 /*
  * Malloc()s a new clidata_list_t and returns it
  */
@@ -29,6 +29,9 @@
 #include "log.h"
 #include "server.h"
 #include "iprange.h"
+#include "util.h"
+#include "dns.h"
+#include "shape.h"
 
 #define HTUN_MAXPACKET 65536
 #define HTUN_DEFAULT_CFGFILE "/etc/htund.conf"
@@ -45,6 +48,14 @@
 #define iplen(pkt) \
     ( (unsigned short)( ((((pkt)[6]&0xFF)<<8) | ((pkt)[7]&0xFF)) + 4 ) )
 
+/* The protocol in the tun header, and the length of an IPv4 or IPv6
+ * packet with it */
+#define PI_IPV4 0x0800
+#define PI_IPV6 0x86DD
+#define pi_proto(pkt) ( (((pkt)[2]&0xFF)<<8) | ((pkt)[3]&0xFF) )
+#define pktlen(pkt) ( pi_proto(pkt) == PI_IPV6 ? \
+    ((((pkt)[8]&0xFF)<<8) | ((pkt)[9]&0xFF)) + 44 : (int)iplen(pkt) )
+
 #define ipdst(pkt) htonl(((pkt)[20]<<24 | (pkt)[21]<<16 | (pkt)[22]<<8 | (pkt)[23]))
 #define ipsrc(pkt) htonl(((pkt)[16]<<24 | (pkt)[17]<<16 | (pkt)[18]<<8 | (pkt)[19]))
 #define max(a,b) ((a)>(b)?(a):(b))
@@ -63,6 +74,29 @@ struct server_config {
     iprange_t *ipr;
     char *redir_host;
     unsigned short redir_port;
+    unsigned short split_tcp; /* take split TCP streams from clients */
+    unsigned short compress; /* deflate batches for clients that ask */
+    unsigned short compress_headers; /* and compress their TCP/IP headers */
+    char psk[81]; /* seal batches with keys derived from this */
+    char tls_cert[PATH_MAX]; /* all ports take TLS if set */
+    char tls_key[PATH_MAX]; /* the cert file if not set */
+    unsigned long rate_limit; /* bytes/s each way per client, 0 is none */
+    unsigned long rate_burst; /* 0 picks one for the rate */
+    unsigned long rate_total; /* shared out among the limited clients */
+    shape_rule_t *rates; /* per MAC addresses, instead of rate_limit */
+    unsigned long admit_rate; /* connections a minute per source, 0 any */
+    unsigned long admit_burst; /* 0 is ADMIT_BURST */
+    unsigned short admit_check; /* drop those that send no request first */
+    unsigned short metrics_port; /* GET /metrics on 127.0.0.1, 0 is off */
+};
+
+/* The most proxies a client can spread its channels over */
+#define MAX_PROXIES 8
+
+struct proxy_addr {
+    struct in_addr ip;
+    unsigned short port;
+    char host[DNS_NAME_MAX]; /* looked up again as its TTL runs out */
 };
 
 struct client_config {
@@ -73,6 +107,19 @@ struct client_config {
     struct in_addr local_ip;
     struct in_addr peer_ip;
     unsigned short do_routing;
+    unsigned short websocket;
+    unsigned short event_loop;
+    unsigned short tcp_fastopen;
+    int spare_connections;
+    int spare_max_idle_sec;
+    unsigned short split_tcp_port; /* takes REDIRECTed TCP, 0 is off */
+    unsigned short thin_acks; /* a newer pure ACK replaces a queued one */
+    unsigned short compress; /* ask the server to deflate batches */
+    unsigned short compress_headers; /* and to compress TCP/IP headers */
+    int cipher; /* AEAD_* to seal batches with, see aead.h */
+    int tls; /* TLS_* how channels make TLS, see tls.h */
+    int nr_extra_proxies;
+    struct proxy_addr extra_proxies[MAX_PROXIES-1]; /* besides proxy_ip */
     unsigned short max_poll_interval;
     unsigned long  min_poll_interval_msec;
     unsigned short poll_backoff_rate;
@@ -85,13 +132,16 @@ struct client_config {
     iprange_t *ipr;
     /* Put the large data at the end to speed up access to smaller data */
     char proxy_ip_str[16];
-    char server_ip_str[16];
+    char proxy_host[DNS_NAME_MAX];
+    char server_ip_str[DNS_NAME_MAX]; /* a host name is left to the proxy */
     char local_ip_str[16]; /* virual tun if */
     char peer_ip_str[16]; /* server virtual tun if */
     char if_name[16]; /* eth0, eth1 etc.. */
     char proxy_user[41];
     char proxy_pass[81];
     char base64_user_pass[300];
+    char psk[81]; /* seal batches with keys derived from this */
+    char tls_ca[PATH_MAX]; /* the system's CAs if empty */
 };
 
 typedef struct {
@@ -101,6 +151,7 @@ typedef struct {
     int is_server;
     int demonize;
     int debug;
+    int tun_mtu; /* 0 derives it from the connection to the peer */
 
     union {
         struct server_config s;
@@ -119,6 +170,10 @@ void print_config( config_data_t *configfile );
  * dynamically allocated char buffer. */
 char *get_packet( int tunfd );
 
+/* Reads exactly one packet from the connection buffered by rb and returns it
+ * in a dynamically allocated char buffer of just the right size. */
+char *rb_get_packet( rbuf_t *rb );
+
 /* Become a daemon: fork, die, setsid, fork, die, disconnect */
 void daemonize( void );
 
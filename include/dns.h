@@ -0,0 +1,58 @@
+/* -------------------------------------------------------------------------
+ * dns.h - htun cached host name resolver
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __DNS_H
+#define __DNS_H
+
+#include <netinet/in.h>
+
+/*
+ * Host names are looked up by a thread of their own and the answers kept
+ * for as long as their TTL says, and looked up again a little before that
+ * runs out while someone still asks for them. So whoever needs an address
+ * gets it from the cache at once, and only waits the first time a name
+ * comes up.
+ */
+
+/* The longest host name we keep */
+#define DNS_NAME_MAX 256
+
+/* Bounds on how long an answer is kept, and how long a failure is */
+#define DNS_MIN_TTL 30
+#define DNS_MAX_TTL 3600
+#define DNS_FAIL_TTL 30
+/* Names that come from /etc/hosts and the like have no TTL */
+#define DNS_DEFAULT_TTL 300
+/* Names nobody asked for in this long are forgotten */
+#define DNS_IDLE_MAX 3600
+
+/*
+ * Places the address of name in *addr. Dotted quads are converted right
+ * away. Otherwise the cached address is returned, even if it is past its
+ * TTL while the lookup thread gets a fresh one. A name never seen before is
+ * handed to the lookup thread, and then this waits up to wait seconds for
+ * the answer.
+ * Returns 0 on success, -1 if there is no address (yet).
+ */
+int dns_lookup( const char *name, struct in_addr *addr, int wait );
+
+#endif
@@ -0,0 +1,144 @@
+/* -------------------------------------------------------------------------
+ * frame.h - htun protocol 3 framing defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __FRAME_H
+#define __FRAME_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#include "queue.h"
+#include "util.h"
+#include "lat.h"
+
+/*
+ * Protocol 3 runs over the same upgraded connection as the websocket
+ * option, but each binary message holds explicit frames instead of bare
+ * packets, so that every frame says what it is and how long it is. A frame
+ * is an 8 byte header, all in network order, followed by its payload:
+ *
+ *  0   type, one of FR_*   1   flags (0)
+ *  2   payload length      4   sequence number
+ *
+ * IPv4, IPv6 and split TCP (see pep.h) frames carry a packet without its
+ * tun header and are numbered one after the other in each direction. The
+ * peer acks the last one it took, and frames are kept until they are acked
+ * so that after the connection drops the rest of the session is resent.
+ * Keepalives go out when the connection is otherwise quiet, and control
+ * frames carry a short text, "close" when the client goes away for good.
+ * A time frame leads every message, its payload the three 32 bit times of
+ * lat_stamp() (see lat.h). Frames of a type we do not know are skipped.
+ */
+
+#define FR_HDR_LEN 8
+
+#define FR_IPV4      1
+#define FR_IPV6      2
+#define FR_ACK       3
+#define FR_KEEPALIVE 4
+#define FR_CONTROL   5
+#define FR_PEP       6
+#define FR_TIME      7
+
+#define FR_TIME_LEN  12
+
+/* Seconds of silence after which a keepalive goes out */
+#define FR_KEEPALIVE_SECS 15
+
+/* The most bytes of packets held for the peer before we wait for acks */
+#define FR_MAX_HELD (4*1048576)
+
+/* Sequence numbers are 32 bits on the wire and wrap */
+#define FR_SEQ_AFTER(a,b) ((int)((unsigned int)(a) - (unsigned int)(b)) > 0)
+
+typedef struct _fr_held_t {
+    unsigned int seq;
+    char *pkt;              /* with its tun header */
+    struct _fr_held_t *next;
+} fr_held_t;
+
+typedef struct {
+    unsigned int next_seq;  /* of the next data frame we send */
+    unsigned int rcvd;      /* the last data frame we took */
+    unsigned int acked;     /* the last one we told the peer about */
+    fr_held_t *head;        /* data frames the peer has not acked */
+    fr_held_t **tail;
+    fr_held_t *resend;      /* where resending after a reconnect is at */
+    size_t held;            /* bytes of packets on the list */
+    time_t last_send;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* signalled when acks free up room */
+    pthread_mutex_t wlock;  /* held while writing a message */
+    lat_t *lat;             /* times the peer, if set */
+} fr_t;
+
+/*
+ * Returns a new frame state in dynamic memory, or NULL on failure.
+ */
+fr_t *fr_init( void );
+
+/*
+ * Frees the frame state and what it holds, setting *f to NULL.
+ */
+void fr_destroy( fr_t **f );
+
+/*
+ * Forgets everything, for a new session.
+ */
+void fr_reset( fr_t *f );
+
+/*
+ * Makes the next fr_send() start over with the unacked frames, after the
+ * same session has reconnected.
+ */
+void fr_resume( fr_t *f );
+
+/*
+ * Sends one message on fd: an ack if one is due, then whatever has to be
+ * resent, then packets off q, up to about WS_MAX_MESSAGE bytes. Waits a
+ * second for acks instead if FR_MAX_HELD bytes are unacked. Returns the
+ * number of data frames sent, or -1 on failure.
+ */
+int fr_send( fr_t *f, int fd, queue_t *q, int mask );
+
+/*
+ * Sends a lone frame of the given type, with seq as its sequence number and
+ * len bytes of data as its payload. Returns 0 on success, -1 on failure.
+ */
+int fr_send_ctl( fr_t *f, int fd, int type, unsigned int seq,
+                 const char *data, size_t len, int mask );
+
+/*
+ * For the writer to call when it has had nothing to send for a while:
+ * sends an ack if one is due and a keepalive if we have been quiet for
+ * FR_KEEPALIVE_SECS. Returns 0 on success, -1 on failure.
+ */
+int fr_tick( fr_t *f, int fd, int mask );
+
+/*
+ * Receives one message from rb, places the packets of its data frames on q
+ * and acks them. Returns the number of packets queued, -1 on failure, or -2
+ * if the peer sent "close".
+ */
+int fr_recv( fr_t *f, rbuf_t *rb, queue_t *q, int mask );
+
+#endif
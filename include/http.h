@@ -23,7 +23,13 @@
 #ifndef __HTTP_H
 #define __HTTP_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include "util.h"
+#include "queue.h"
+#include "rtx.h"
+#include "lat.h"
 
 #define MATCH_204_HTTP10  "HTTP/1.0 204 "
 #define MATCH_204_HTTP11  "HTTP/1.1 204 "
@@ -34,109 +40,141 @@
 #define HDR_CONNECTION "Connection: "
 #define HDR_CONTENT_TYPE "Content-Type: "
 #define HDR_HOST "Host: "
-#define PROXY_AUTH_LINE "%s%s"
 #define HDR_PROXY_AUTH "Proxy-Authorization: Basic "
+#define HDR_SEQ "X-Htun-Seq: "
+#define HDR_ACK "X-Htun-Ack: "
+#define HDR_ENC "X-Htun-Enc: "
+#define HDR_WIN "X-Htun-Win: "
+#define HDR_TIME "X-Htun-Time: "
+
+/*
+ * The canned headers below stop right after "Content-Length: " (the _HEAD
+ * part) and pick up again after the number (the _TAIL part), so a response
+ * can be sent without formatting anything but its length.
+ */
+#define TAIL_PLAIN   "\r\n" \
+                     HDR_CONTENT_TYPE "text/plain\r\n" \
+                     "\r\n"
+#define TAIL_NONE    "\r\n" \
+                     "\r\n"
 
 #define BODY_500_BUSY "Sorry, the server is too busy to process your " \
                      "request, or the client limit has been reached. " \
                      "Try again later.\n"
-#define RESPONSE_500_BUSY "HTTP/1.0 500 Busy\r\n" \
+#define HEAD_500_BUSY "HTTP/1.0 500 Busy\r\n" \
                      HDR_CONNECTION "Close\r\n" \
-                     HDR_CONTENT_LENGTH "%d\r\n" \
-                     HDR_CONTENT_TYPE "text/plain\r\n" \
-                     "\r\n" \
-                     BODY_500_BUSY, (sizeof(BODY_500_BUSY)-1)
+                     HDR_CONTENT_LENGTH
 #define BODY_500_ERR "An server error occurred while processing your " \
                      "request. Please contact the system administrator.\n"
-#define RESPONSE_500_ERR "HTTP/1.0 500 Internal Server Error\r\n" \
+#define HEAD_500_ERR "HTTP/1.0 500 Internal Server Error\r\n" \
                      HDR_CONNECTION "Close\r\n" \
-                     HDR_CONTENT_LENGTH "%d\r\n" \
-                     HDR_CONTENT_TYPE "text/plain\r\n" \
-                     "\r\n" \
-                     BODY_500_ERR, (sizeof(BODY_500_ERR)-1)
+                     HDR_CONTENT_LENGTH
 #define BODY_501     "Sorry, I don't know how to service your request"
-#define RESPONSE_501 "HTTP/1.0 501 Not Implemented\r\n" \
+#define HEAD_501     "HTTP/1.0 501 Not Implemented\r\n" \
                      HDR_CONNECTION "Close\r\n" \
-                     HDR_CONTENT_LENGTH "%d\r\n" \
-                     HDR_CONTENT_TYPE "text/plain\r\n" \
-                     "\r\n" \
-                     BODY_501, (sizeof(BODY_501)-1)
+                     HDR_CONTENT_LENGTH
 #define BODY_503     "Sorry, could not assign IP address within range.\n"
-#define RESPONSE_503 "HTTP/1.0 503 Service Unavailable\r\n" \
+#define HEAD_503     "HTTP/1.0 503 Service Unavailable\r\n" \
                      HDR_CONNECTION "Close\r\n" \
-                     HDR_CONTENT_LENGTH "%d\r\n" \
-                     HDR_CONTENT_TYPE "text/plain\r\n" \
-                     "\r\n" \
-                     BODY_503, (sizeof(BODY_503)-1)
-#define RESPONSE_200 "HTTP/1.0 200 OK\r\n" \
+                     HDR_CONTENT_LENGTH
+#define HEAD_200     "HTTP/1.0 200 OK\r\n" \
                      HDR_CONNECTION "Keep-Alive\r\n" \
-                     HDR_CONTENT_LENGTH "%lu\r\n" \
-                     "\r\n" \
-                     "%s"
-#define RESPONSE_200_NOBODY \
-                     "HTTP/1.0 200 OK\r\n" \
-                     HDR_CONNECTION "Keep-Alive\r\n" \
-                     HDR_CONTENT_LENGTH "%d\r\n" \
-                     "\r\n"
+                     HDR_CONTENT_LENGTH
 #define BODY_400     "Your user agent sent an invalid request.\n"
-#define RESPONSE_400 "HTTP/1.0 400 Bad Request\r\n" \
+#define HEAD_400     "HTTP/1.0 400 Bad Request\r\n" \
                      HDR_CONNECTION "Close\r\n" \
-                     HDR_CONTENT_LENGTH "%lu\r\n" \
-                     HDR_CONTENT_TYPE "text/plain\r\n" \
-                     "\r\n" \
-                     BODY_400, (sizeof(BODY_400)-1)
+                     HDR_CONTENT_LENGTH
 #define BODY_412     "That MAC address has no registered send channel up. " \
                      "Connect the send channel before the receive channel\n"
-#define RESPONSE_412 "HTTP/1.0 412 Precondition Failed\r\n" \
+#define HEAD_412     "HTTP/1.0 412 Precondition Failed\r\n" \
                      HDR_CONNECTION "Close\r\n" \
-                     HDR_CONTENT_LENGTH "%lu\r\n" \
-                     "\r\n" \
-                     BODY_412, (sizeof(BODY_412)-1)
-#define RESPONSE_204 "HTTP/1.0 204 No Data\r\n" \
+                     HDR_CONTENT_LENGTH
+#define HEAD_204     "HTTP/1.0 204 No Data\r\n" \
                      HDR_CONNECTION "Keep-Alive\r\n" \
-                     HDR_CONTENT_LENGTH "0\r\n" \
-                     "\r\n"
+                     HDR_CONTENT_LENGTH
 
-#define REQ_P2_CS   "POST http://%s:%d/CP2 HTTP/1.0\r\n" \
-                    HDR_PROXY_CONNECTION "Keep-Alive\r\n" \
-                    HDR_CONTENT_LENGTH "%d\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n"
-#define REQ_P2_CR   "POST http://%s:%d/CR HTTP/1.0\r\n" \
-                    HDR_PROXY_CONNECTION "Keep-Alive\r\n" \
-                    HDR_CONTENT_LENGTH "%d\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n"
-#define REQ_P2_R    "POST http://%s:%d/R HTTP/1.0\r\n" \
-                    HDR_PROXY_CONNECTION "Keep-Alive\r\n" \
-                    HDR_CONTENT_LENGTH "%d\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n"
-#define REQ_P2_S    "POST http://%s:%d/S HTTP/1.0\r\n" \
-                    HDR_PROXY_CONNECTION "Keep-Alive\r\n" \
-                    HDR_CONTENT_LENGTH "%d\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n"
-#define REQ_P1_S    REQ_P2_S
-#define REQ_P1_P    "POST http://%s:%d/P HTTP/1.0\r\n" \
+/*
+ * The client's requests. REQ_LINE is rendered once per session with the
+ * server address and the request URI, followed by the proxy credentials
+ * if any, and then REQ_KEEPALIVE_HEAD or REQ_CLOSE_HEAD.
+ */
+#define REQ_LINE    "POST http://%s:%d/%s HTTP/1.0\r\n"
+#define REQ_AUTH_LINE HDR_PROXY_AUTH "%s\r\n"
+#define REQ_KEEPALIVE_HEAD \
                     HDR_PROXY_CONNECTION "Keep-Alive\r\n" \
-                    HDR_CONTENT_LENGTH "2\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n" \
-                    ":)"
-#define REQ_P2_F    "POST http://%s:%d/F HTTP/1.0\r\n" \
+                    HDR_CONTENT_LENGTH
+#define REQ_CLOSE_HEAD \
                     HDR_PROXY_CONNECTION "Close\r\n" \
-                    HDR_CONTENT_LENGTH "2\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n" \
-                    ":("
-#define REQ_P1_F    REQ_P2_F
+                    HDR_CONTENT_LENGTH
+/* With "tls connect" each channel first asks the proxy for a tunnel */
+#define REQ_CONNECT "CONNECT %s:%d HTTP/1.1\r\n" \
+                    HDR_HOST "%s:%d\r\n"
+#define BODY_P1_P   ":)"
+#define BODY_P2_F   ":("
 
-#define REQ_P1_CS   "POST http://%s:%d/CP1 HTTP/1.0\r\n" \
-                    HDR_PROXY_CONNECTION "Keep-Alive\r\n" \
-                    HDR_CONTENT_LENGTH "%d\r\n" \
-                    PROXY_AUTH_LINE \
-                    "\r\n"
+/* Messages whose Content-Length says more than this are refused */
+#define HTTP_MAX_LENGTH (1L << 30)
+/* The longest body getbody() reads into memory */
+#define HTTP_MAX_BODY 65536
+
+/*
+ * A header block split around its Content-Length value, plus an optional
+ * canned body that is sent when the caller has none of its own.
+ */
+typedef struct {
+    const char *head;
+    size_t headlen;
+    const char *tail;
+    size_t taillen;
+    const char *body;
+    size_t bodylen;
+} http_tmpl_t;
+
+#define HTTP_TMPL(head, tail, body) \
+    { head, sizeof(head)-1, tail, sizeof(tail)-1, body, sizeof(body)-1 }
+
+/* The server's canned responses */
+extern const http_tmpl_t rsp_200, rsp_204, rsp_400, rsp_412, rsp_500_busy,
+             rsp_500_err, rsp_501, rsp_503;
+
+/* The number of iovecs http_sendv() needs in front of the body */
+#define HTTP_IOV_HDR 3
+
+/*
+ * The server hands out a session token with the IPs when a client connects.
+ * The client sends it back on a line starting with SESSION_LINE when it
+ * reconnects, so the server knows it may keep what it queued for it.
+ */
+#define SESSION_TOKEN_LEN 32
+#define SESSION_LINE "session "
+
+/*
+ * The client proposes the tun MTU on a line starting with MTU_LINE, and the
+ * server answers with the one both ends use on the line after the token.
+ */
+#define MTU_LINE "mtu "
+
+/*
+ * The client lists the batch encodings it wants (see zbatch.h) on a line
+ * starting with COMPRESS_LINE, and the server answers with those it agrees
+ * to on a line of its own.
+ */
+#define COMPRESS_LINE "compress "
+
+/*
+ * A client that wants protocol 3 (see frame.h) on its WebSocket channel sends
+ * a line of FRAMES_LINE followed by 3, and the server sends the same line
+ * back if it agrees.
+ */
+#define FRAMES_LINE "frames "
+
+/*
+ * A client with a psk sends a line of CRYPT_LINE, the cipher it wants, its
+ * nonce in hex, the time and its proof in hex, and the server answers with
+ * the cipher and its own proof over that nonce (see aead.h). A server with a psk takes no
+ * client that does not ask, or cannot prove it has the psk.
+ */
+#define CRYPT_LINE "crypt "
 
 #define P1_CS 1
 #define P1_S  2
@@ -168,6 +206,7 @@
 #define REQ_R   6
 #define REQ_F   7
 #define REQ_P   8
+#define REQ_WS  9
                    
 #define max(a,b) ((a)>(b)?(a):(b))
 #define min(a,b) ((b)>(a)?(a):(b))
@@ -178,26 +217,83 @@ typedef struct {
     int pollonly;
 } http_request_t;
                    
-/* 
- * Return a pointer to the location in headers corresponding to the start of
- * the value of the header field given in header_name.  
+/*
+ * A piece of a buffer. Not null-terminated; print it with "%.*s".
  */
-char *header_value( const char *headers, const char *header_name );
+typedef struct {
+    const char *ptr;
+    size_t len;
+} slice_t;
+
+/*
+ * What htun needs to know about a request or response. The slices point
+ * into the read buffer the message came from, and are only valid until the
+ * next read from that buffer.
+ */
+typedef struct {
+    int reqtype;            /* one of the REQ_* above for a request */
+    int status;             /* the status code of a response, else 0 */
+    long content_length;    /* -1 if no Content-Length was given */
+    int keepalive;          /* nonzero unless "Connection: close" */
+    int chunked;            /* nonzero for "Transfer-Encoding: chunked" */
+    int nocache;            /* not to be cached, or a request with
+                             * credentials or cookies */
+    int cacheable;          /* Cache-Control: public or a max-age */
+    slice_t line;           /* request or status line, without the EOL */
+    slice_t head;           /* the whole header block, status line included */
+    slice_t hdrs;           /* just the header lines, with the blank line */
+    slice_t upgrade;        /* value of Upgrade: */
+    slice_t ws_key;         /* value of Sec-WebSocket-Key: */
+    slice_t ws_accept;      /* value of Sec-WebSocket-Accept: */
+    unsigned long seq;      /* batch number of the body, 0 if none */
+    unsigned long ack;      /* the last batch the peer got */
+    int rtx;                /* nonzero if there was an ack, see rtx.h */
+    long win;               /* the peer's window, -1 if it sent none */
+    int enc;                /* ZB_* encodings of the body, see zbatch.h */
+    unsigned int ts;        /* X-Htun-Time: when the peer sent it, 0 if */
+    unsigned int echo;      /* it did not say, our last time it got */
+    unsigned int held;      /* and how long ago, see lat.h */
+} http_msg_t;
 
 /*
- * Gets all HTTP headers from the socket fd, and puts at most len bytes of
- * them into buf.
+ * Looks for a complete header block in the len bytes at buf, resuming the
+ * search for its end at *scan. Returns the length of the header block with
+ * msg filled in, 0 if the block is not complete yet (with *scan advanced),
+ * or -1 if the message is malformed.
  */
-int getheaders( int fd, char *buf, size_t len );
+int http_parse( const char *buf, size_t len, size_t *scan, http_msg_t *msg );
+
+/*
+ * Takes the next request or response header block out of what is already
+ * buffered in rb, without reading. Returns 1 with msg filled in, 0 if more
+ * has to be read first, or -1 if the message is malformed.
+ */
+int http_take_msg( rbuf_t *rb, http_msg_t *msg );
+
+/*
+ * Reads the next request or response header block from rb into msg, reading
+ * the fd as needed. Returns 0 on success, or -1 on failure.
+ */
+int http_read_msg( rbuf_t *rb, http_msg_t *msg );
+
+/*
+ * Copies the slice s into buf (at most len bytes including the terminating
+ * null), returning buf.
+ */
+char *slice_copy( const slice_t *s, char *buf, size_t len );
+
+/*
+ * Returns nonzero if the slice s is equal to the string str, ignoring case.
+ */
+int slice_eq( const slice_t *s, const char *str );
 
 /* 
- * Reads the request line from clisock and returns one of the REQ_* types
- * above depending on the type of request made.  returns -1 on failure.
- * If you supply a buffer in reqbuf, parse_request will place the full request
- * into the buffer so you can use it later. Buffer must be at least size
- * HTTP_REQUESTLINE_MAX to prevent buffer overflows.
+ * Waits up to idle_disconnect seconds for a request on rb, reads its headers
+ * into msg and returns one of the REQ_* types above depending on the type of
+ * request made. Returns REQ_NONE if no request could be read, in which case
+ * msg is not valid.
  */
-int parse_request( int clisock, char *reqbuf );
+int parse_request( rbuf_t *rb, http_msg_t *msg );
 
 /*
  * Handles a post request on the server
@@ -205,20 +301,121 @@ int parse_request( int clisock, char *reqbuf );
 int handle_post( int clisock );
 
 /*
- * Gets the body of an HTTP request from the file descriptor fd, based on the
- * content length given in the supplied headers, and returns it in a
- * DYNAMICALLY ALLOCATED BUFFER. Puts the length of the data into *len.
+ * Gets the body of the HTTP message msg from rb, based on its content length,
+ * and returns it in a DYNAMICALLY ALLOCATED BUFFER. Puts the length of the
+ * data into *len. Returns NULL if there is no body or it is longer than
+ * HTTP_MAX_BODY.
  */
-char *getbody( int fd, char *headers, int *len );
+char *getbody( rbuf_t *rb, http_msg_t *msg, long *len );
 
 /*
  * Sends a 503 error to the client
  */
 void send_err( int clisock );
 
-int proxy_request( int clisock, char *req, char *hdrs );
+/*
+ * Sends the header block t with a Content-Length of clen, followed by the
+ * cnt-HTTP_IOV_HDR body pieces at iov[HTTP_IOV_HDR] onwards, in as few
+ * writev() calls as possible. The first HTTP_IOV_HDR entries of iov are
+ * filled in here. Returns 0 on success, -1 on failure.
+ */
+int http_sendv( int fd, const http_tmpl_t *t, size_t clen,
+                struct iovec *iov, int cnt );
+
+/*
+ * Sends the header block t followed by the len bytes at body, or by the
+ * canned body of t if body is NULL. Returns 0 on success, -1 on failure.
+ */
+int http_send( int fd, const http_tmpl_t *t, const char *body, size_t len );
+
+/*
+ * A message being written to a possibly non-blocking fd, kept between
+ * writes. Set up with http_out_queue() or http_out_body().
+ */
+typedef struct {
+    struct iovec *iov;      /* header slots, then the body pieces */
+    int cur;                /* the first iov entry not fully written */
+    int cnt;
+    char **pkts;            /* queued packets to free when done */
+    int npkts;
+    void *mem;              /* what iov and pkts were allocated in */
+    size_t clen;
+    int enc;                /* ZB_* encodings of the body */
+    char num[224];          /* the Content-Length digits, and any X-Htun */
+    struct iovec small[HTTP_IOV_HDR + 1];
+} http_out_t;
+
+#define http_out_pending(o) ((o)->cur < (o)->cnt)
+
+/*
+ * Sets o up to send amount bytes worth of packets off q as the body of t.
+ * Returns the number of packets taken off q, or -1 on failure.
+ */
+int http_out_queue( http_out_t *o, const http_tmpl_t *t, queue_t *q,
+                    size_t amount );
+
+/*
+ * Sets o up to send the header block t followed by the len bytes at body,
+ * which must stay valid until o is written, or by the canned body of t if
+ * body is NULL.
+ */
+void http_out_body( http_out_t *o, const http_tmpl_t *t, const char *body,
+                    size_t len );
 
-/* Returns the content length from the headers, or -1 on error */
-int get_content_length( char *headers );
+/*
+ * Sets o up to send the npkts packets at pkts, size bytes in all, as the
+ * body of t. The packets are not freed with o.
+ */
+void http_out_batch( http_out_t *o, const http_tmpl_t *t, char **pkts,
+                     int npkts, size_t size );
+
+/*
+ * Sets o up to send the batch b as the body of t, encoded if rtx_next() did
+ * so, with its number, an ack of the batch we got last, our window and the
+ * times from lat if it is set.
+ */
+void http_out_rtx( http_out_t *o, const http_tmpl_t *t, rtx_batch_t *b,
+                   unsigned long ack, long win, lat_t *lat );
+
+/*
+ * Adds the batch number seq of the body (unless 0), its encodings if it is
+ * encoded, an ack of the last batch we got from the peer and the window we
+ * advertise (see rtx.h) to the headers of o, before it is written. With lat
+ * set, the times of lat_stamp() go along as well.
+ */
+void http_out_seq( http_out_t *o, unsigned long seq, unsigned long ack,
+                   long win, lat_t *lat );
+
+/*
+ * Writes as much of o to fd as it takes without blocking. Returns 1 once all
+ * of it has been written, 0 if some is left for when fd becomes writable, or
+ * -1 on failure. o is freed unless 0 is returned.
+ */
+int http_out_write( int fd, http_out_t *o );
+
+/*
+ * Frees what is left of o without writing it.
+ */
+void http_out_free( http_out_t *o );
+
+/*
+ * Writes all of o to the blocking fd. o is freed either way. Returns 0 on
+ * success, -1 on failure.
+ */
+int http_out_send( int fd, http_out_t *o );
+
+/*
+ * Takes amount bytes worth of packets off q and sends them as the body of t.
+ * The packets are freed either way. Returns the number of packets sent, or
+ * -1 on failure.
+ */
+int http_send_queue( int fd, const http_tmpl_t *t, queue_t *q, size_t amount );
+
+/*
+ * Answers the request msg, which is not for htun, with what redirect_host
+ * has at that URI, so the server looks like an ordinary web server. Returns
+ * 0 if it was answered, or -1 if the caller has to send an error instead.
+ */
+int proxy_request( rbuf_t *rb, http_msg_t *msg );
 
 #endif /* __HTTP_H */
@@ -0,0 +1,137 @@
+/* -------------------------------------------------------------------------
+ * lat.h - htun per stage latency histograms and clock exchange
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __LAT_H
+#define __LAT_H
+
+#include <pthread.h>
+
+/*
+ * Where the time goes on the way through the tunnel, per peer. A packet is
+ * timed from when it is read off the tun device until it is queued, while
+ * it waits on the sendq, and the batch it goes in while it is written out.
+ * On the far side the batch is taken off the connection, then timed while
+ * it waits on the recvq and while it is written to the tun device.
+ *
+ * Times are in usec of a monotonic clock, kept in 32 bits so they wrap
+ * about every 71 minutes, which only matters for intervals that long.
+ *
+ * Every batch, ack or poll also carries the time it was sent, the last time
+ * the peer sent us and how long ago we got that. The peer takes the round
+ * trip from that, less what we held it for. Its clock differs from ours by
+ * some unknown amount, so the one way delay from us is taken as how much
+ * our time plus that amount exceeds the least it has been yet: what the
+ * queues and buffers along the way added to it.
+ *
+ * Each stage has a log-linear histogram, as in HdrHistogram: 8 buckets per
+ * power of two, so what a quantile comes out as is at most 12.5% over.
+ */
+
+#define LAT_SUB_BITS 3
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS  ((33 - LAT_SUB_BITS) << LAT_SUB_BITS)
+
+/* The stages */
+#define LAT_TUN    0        /* from reading a packet off the tun to queueing */
+#define LAT_SENDQ  1        /* waiting on the sendq */
+#define LAT_SEND   2        /* writing a batch out */
+#define LAT_RECVQ  3        /* waiting on the recvq */
+#define LAT_TUNW   4        /* writing a packet to the tun */
+#define LAT_RTT    5        /* round trip to the peer, less what it held us */
+#define LAT_OWD    6        /* one way from the peer, over the least yet */
+#define LAT_STAGES 7
+
+typedef struct {
+    unsigned long count;
+    unsigned long sum;      /* of the usec counted */
+    unsigned long b[LAT_BUCKETS];
+} lat_hist_t;
+
+typedef struct {
+    lat_hist_t h[LAT_STAGES];
+    unsigned int peer_ts;   /* the last time the peer sent us, 0 if none */
+    unsigned int peer_at;   /* and when we got it, by our clock */
+    int owd_base;           /* the least (our clock - the peer's) yet */
+    int have_base;
+    pthread_mutex_t lock;   /* of the clock exchange */
+} lat_t;
+
+/* The names of the stages, for output */
+extern const char *lat_stages[LAT_STAGES];
+
+/*
+ * Returns the monotonic clock in usec, never 0.
+ */
+unsigned int lat_now( void );
+
+/*
+ * Returns a new lat_t with nothing counted, or NULL on failure.
+ */
+lat_t *lat_new( void );
+
+/*
+ * Frees the lat_t at *l and sets *l to NULL.
+ */
+void lat_free( lat_t **l );
+
+/*
+ * Forgets the peer's clock, for a new session.
+ */
+void lat_reset( lat_t *l );
+
+/*
+ * Counts usec in h.
+ */
+void lat_add( lat_hist_t *h, unsigned int usec );
+
+/*
+ * Counts the time since start (from lat_now()) in stage of l, unless l is
+ * NULL.
+ */
+void lat_since( lat_t *l, int stage, unsigned int start );
+
+/*
+ * Returns the q quantile (0 to 1) of h in usec, 0 if h is empty.
+ */
+unsigned int lat_quantile( const lat_hist_t *h, double q );
+
+/*
+ * Fills in what to send the peer: our time, the last of the peer's times
+ * and how long ago we got that.
+ */
+void lat_stamp( lat_t *l, unsigned int *ts, unsigned int *echo,
+                unsigned int *held );
+
+/*
+ * Takes in what lat_stamp() filled in on the peer's side, counting the
+ * round trip and the one way delay.
+ */
+void lat_peer( lat_t *l, unsigned int ts, unsigned int echo,
+               unsigned int held );
+
+/*
+ * Logs the quantiles of each stage of l that has counted anything, with
+ * who in front.
+ */
+void lat_log( lat_t *l, const char *who );
+
+#endif
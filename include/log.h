@@ -24,14 +24,31 @@
 #define __LOG_H
 
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 #include <semaphore.h>
 
 #define LOGLINE_MAX 1024
 
+/*
+ * Once log_start() has been called, each thread formats its lines into a
+ * ring buffer of its own, without taking any lock, and a writer thread
+ * gathers them from all rings into as few write()s as it can. Lines of
+ * different threads may reach the file slightly out of order; the times on
+ * them are right. A thread whose ring is full drops the line, and the
+ * writer says how many it had to drop.
+ */
+#define LOG_RING_SIZE   16384   /* bytes, a power of two */
+#define LOG_FLUSH_MSEC  100     /* the writer's longest nap */
+
 typedef struct {
     int fd;
-    sem_t sem;
+    sem_t sem;              /* wakes the writer */
     int flags;
+    pthread_t writer;
+    volatile int running;   /* lines go through the rings */
+    volatile int stop;
+    volatile int waking;    /* the writer has been woken already */
 } log_t;
 
 
@@ -52,7 +69,42 @@ typedef struct {
  */
 int lprintf_real( const char *func, log_t *log, unsigned int level, char *fmt, ... );
 
-#define lprintf(args...) lprintf_real(__FUNCTION__, ## args)
+/* Whether a line of level would be logged at all */
+#define log_on(log, level) \
+    ((log) && ((level) != DEBUG || ((log)->flags & LOG_DEBUG)))
+
+/* The arguments are not even evaluated for a level that is not logged */
+#define lprintf(log, level, args...) \
+    (log_on(log, level) ? lprintf_real(__FUNCTION__, log, level, args) : 0)
+
+/*
+ * For lines that may come once per packet or connection: each place
+ * lprintf_rl() is used logs at most LOG_RL_BURST lines every LOG_RL_SECS
+ * seconds, and then says how many it left out.
+ */
+#define LOG_RL_BURST 10
+#define LOG_RL_SECS  10
+
+typedef struct {
+    time_t window;
+    unsigned int lines;
+    unsigned int dropped;
+} log_rl_t;
+
+/*
+ * Returns nonzero if the place rl stands for may log another line, logging
+ * how many it left out first if a new window starts.
+ */
+int log_rl_pass( const char *func, log_t *log, unsigned int level,
+                 log_rl_t *rl );
+
+#define lprintf_rl(log, level, args...) do { \
+        static log_rl_t lprintf_rl_state_; \
+        if( log_on(log, level) && \
+            log_rl_pass(__FUNCTION__, log, level, &lprintf_rl_state_) ) { \
+            lprintf_real(__FUNCTION__, log, level, args); \
+        } \
+    } while(0)
 
 #define LOG_TRUNC   1<<0
 #define LOG_NODATE  1<<1
@@ -80,7 +132,18 @@ int lprintf_real( const char *func, log_t *log, unsigned int level, char *fmt, .
 log_t *log_open( char *fname, int flags );
 
 /*
- * Closes a logfile when it's no longer needed
+ * Starts the writer thread, after which lines are written by it. Until
+ * then each line is written as it is logged. Call it after daemonizing,
+ * as fork() only keeps the calling thread. The rings are flushed at exit().
+ *
+ * Returns 0 on success, or -1 on failure, in which case lines are still
+ * written as they are logged.
+ */
+int log_start( log_t *log );
+
+/*
+ * Closes a logfile when it's no longer needed, after stopping the writer
+ * thread and writing out what it had not yet.
  * 
  * log  - The log_t corresponding to the log you want to close
  */
@@ -0,0 +1,97 @@
+/* -------------------------------------------------------------------------
+ * metrics.h - htun server counters and their Prometheus endpoint
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include <sys/types.h>
+
+/*
+ * The server counts what goes on in a few counters and histograms, and
+ * serves them with the per client numbers on GET /metrics at 127.0.0.1 on
+ * metrics_port, in the Prometheus text format.
+ *
+ * Each thread adds to one of MET_SHARDS copies of the counters, picked the
+ * first time it counts, so threads seldom write the same cache line. The
+ * copies are summed when they are read. Gauges such as queue depths are
+ * taken from the clients only then.
+ */
+
+#define MET_SHARDS 16
+
+/* Counters */
+#define MET_ACCEPTED     0  /* connections given to a worker */
+#define MET_REFUSED_RATE 1  /* and those closed by admit() and why */
+#define MET_REFUSED_LOAD 2
+#define MET_REFUSED_JUNK 3
+#define MET_REFUSED_FULL 4  /* closed because the request queue was full */
+#define MET_BATCHES_TX   5
+#define MET_BATCHES_RX   6
+#define MET_RESENDS      7  /* batches sent again for want of an ack */
+#define MET_DROP_PROTO   8  /* packets the client could not be told about */
+#define MET_DROP_DUPSEG  9  /* resent TCP segments already queued */
+#define MET_DROP_DUPBAT  10 /* packets of batches that came in twice */
+#define MET_SESSIONS     11 /* sessions started */
+#define MET_RECONNECTS   12 /* channels of known clients connected again */
+#define MET_COUNTERS     13
+
+/* Histograms */
+#define MET_H_BATCH_TX   0  /* packets in each batch */
+#define MET_H_BATCH_RX   1
+#define MET_H_HANDLER    2  /* usec taken by requests that do not wait */
+#define MET_HISTS        3
+
+/* The most buckets of a histogram, the +Inf one not counted */
+#define MET_BUCKETS      10
+
+/* A client's own numbers, which live in its clidata_t */
+#define MET_TX 0            /* to the client */
+#define MET_RX 1            /* from it */
+
+typedef struct {
+    unsigned long bytes[2];
+    unsigned long pkts[2];
+} met_client_t;
+
+/*
+ * Adds n to counter id.
+ */
+void met_add( int id, unsigned long n );
+
+/*
+ * Counts value in histogram id.
+ */
+void met_observe( int id, unsigned long value );
+
+/*
+ * Adds a packet of len bytes in direction dir to the numbers at m. Each
+ * direction has one thread of its own, so these are not sharded.
+ */
+void met_client( met_client_t *m, int dir, size_t len );
+
+/*
+ * Starts serving the metrics on 127.0.0.1:port. Returns 0 on success, -1
+ * on failure.
+ */
+int met_start( unsigned short port );
+
+#endif
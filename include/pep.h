@@ -0,0 +1,99 @@
+/* -------------------------------------------------------------------------
+ * pep.h - htun split TCP, carrying TCP byte streams instead of packets
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __PEP_H
+#define __PEP_H
+
+#include <sys/types.h>
+
+/*
+ * With split TCP the client takes TCP connections headed into the tunnel
+ * itself (they are sent to it with an iptables REDIRECT rule), and only the
+ * bytes go through the tunnel. The server makes the connection to the real
+ * destination and passes the bytes on. So the connections never run their
+ * own retransmits and congestion control on top of the tunnel's.
+ *
+ * The streams are carried in frames that travel the send and recv queues
+ * like packets do. A frame has the 4 byte tun header, with PEP_PROTO where
+ * a packet has its ethertype, and its length - 4 where an IPv4 packet has
+ * its total length, so iplen() works on it:
+ *
+ *  0   flags (0)       2   PEP_PROTO
+ *  4   0               5   type, one of PEP_OPEN...
+ *  6   length - 4      8   stream id
+ *  12  OPEN: destination address, DATA: stream offset of the data,
+ *      ACK: bytes written out since the last ACK
+ *  16  OPEN: destination port
+ *  24  DATA: the bytes
+ */
+#define PEP_PROTO 0x88B5
+#define PEP_HDR_LEN 24
+
+#define PEP_OPEN 1      /* client: connect to this destination */
+#define PEP_OK   2      /* server: connected */
+#define PEP_DATA 3
+#define PEP_ACK  4      /* the bytes were written out, send more */
+#define PEP_FIN  5      /* no more bytes this way */
+#define PEP_RST  6      /* the stream is gone */
+
+/* The most bytes in one frame, and in flight per stream and direction */
+#define PEP_MAX_DATA 16384
+#define PEP_WINDOW (256*1024)
+
+/* How long the client waits for PEP_OK, and the server for connect() */
+#define PEP_OPEN_TIMEOUT 30
+
+#define is_pep(pkt) \
+    ( (((pkt)[2]&0xFF)<<8 | ((pkt)[3]&0xFF)) == PEP_PROTO )
+
+/*
+ * Passes a DYNAMICALLY ALLOCATED frame on towards the peer. It must take
+ * the frame even on failure, and must not block.
+ */
+typedef int (*pep_send_t)( void *arg, char *frame );
+
+typedef struct _pep_t pep_t;
+
+/*
+ * Returns a new split TCP endpoint that sends its frames with send(arg, ..),
+ * or NULL if out of memory. If accept_opens is zero, PEP_OPEN is refused.
+ */
+pep_t *pep_new( pep_send_t send, void *arg, int accept_opens );
+
+/*
+ * Starts taking redirected connections on port, and opening a stream to
+ * the peer for each. Returns 0 on success, -1 on failure.
+ */
+int pep_listen( pep_t *p, unsigned short port );
+
+/*
+ * Handles a frame from the peer, and frees it.
+ */
+void pep_input( pep_t *p, char *frame );
+
+/*
+ * Resets all streams and stops listening. The endpoint is freed once the
+ * last stream has wound down, and *p is set to NULL right away.
+ */
+void pep_destroy( pep_t **p );
+
+#endif
@@ -25,6 +25,7 @@
 
 #include <semaphore.h>
 #include <pthread.h>
+#include "lat.h"
 
 #define Q_WAIT 1<<0
 #define Q_PUSH 1<<1
@@ -35,12 +36,18 @@
 typedef struct _qnode_t {
     void *data;
     size_t size;
+    unsigned int added;     /* lat_now() when queued, if wait is set */
     struct _qnode_t *next;
+    struct _qnode_t *prev;
 } qnode_t;
 
+/* The most items at the tail q_add_unique() and q_replace() look over */
+#define Q_SCAN_MAX 64
+
 typedef struct {
     qnode_t *head;
     qnode_t **tail;
+    qnode_t *last;      /* the node at the tail, NULL if empty */
     size_t nr_nodes;
     size_t max_nodes;
     pthread_mutex_t mutex;
@@ -48,10 +55,12 @@ typedef struct {
     pthread_cond_t writer_cond;
     sem_t cleanup_sem;
     size_t totsize;
+    size_t dupsize;     /* bytes q_add_unique() turned away */
     int readers;
     int writers;
     int shutdown;
     struct timeval lastadd;
+    lat_hist_t *wait;   /* if set, counts how long items were queued */
 } queue_t;
 
 /*
@@ -74,6 +83,28 @@ void q_destroy( queue_t **q );
  */
 int q_add( queue_t *q, void *data, int flags, size_t elem_size );
 
+/*
+ * Like q_add() without flags, unless same(item, data) is nonzero for one of
+ * the last Q_SCAN_MAX items on the queue. Then data is not added, its size
+ * is counted in dupsize, and 1 is returned for the caller to free it.
+ * Returns 0 if data was added, or -1 on failure.
+ */
+int q_add_unique( queue_t *q, void *data, size_t elem_size,
+                  int (*same)( const void *item, const void *data ) );
+
+/*
+ * Like q_add() without flags, except that data may take the place of an
+ * item already on the queue. supersedes(item, data) returns > 0 if it may,
+ * < 0 if item must stay ahead of data, and 0 if they are unrelated. data
+ * replaces the last item it supersedes that no item after it must stay
+ * ahead of, among the last Q_SCAN_MAX items. That item is then returned in
+ * *old for the caller to free, else *old is set to NULL. Returns 0 on
+ * success, or -1 on failure.
+ */
+int q_replace( queue_t *q, void *data, size_t elem_size,
+               int (*supersedes)( const void *item, const void *data ),
+               void **old );
+
 /*
  * Returns the item at the top of the queue, or NULL if there is no data on
  * the queue and Q_WAIT is not set.
@@ -88,9 +119,15 @@ void *q_remove( queue_t *q, int flags, const struct timespec *wait );
  * Returns 0 if the queue does not get data on it before the amount of time
  * specified in ts.
  * Returns nonzero if the queue already has data on it, or if it gets data on
- * it before the time runs out.
+ * it before the time runs out, or if q_wake() is called meanwhile.
  */
 int q_timedwait( queue_t *q, struct timespec *ts );
 
+/*
+ * Wakes up whoever waits in q_timedwait(), to look at something other than
+ * the queue.
+ */
+void q_wake( queue_t *q );
+
 #endif
 
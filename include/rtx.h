@@ -0,0 +1,157 @@
+/* -------------------------------------------------------------------------
+ * rtx.h - htun retransmit buffer for packet batches
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __RTX_H
+#define __RTX_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#include "aead.h"
+#include "queue.h"
+#include "vj.h"
+
+/*
+ * Each batch of packets sent in a request or response body gets a sequence
+ * number, and the peer acks the last batch it got in every message it sends
+ * back. Batches are kept until they are acked, so that after a channel
+ * drops whatever the peer did not get is sent again, and a batch the peer
+ * got before the ack was lost is recognised and thrown away.
+ *
+ * A new batch is only made once the last one has been acked, so the peer
+ * takes them one at a time and in order, which the header compression
+ * contexts rely on.
+ *
+ * Every ack also advertises how many more bytes of packets the sender's
+ * recvq has room for, and a new batch is no bigger than what the peer last
+ * advertised. When the window is shut a batch still carries one packet, so
+ * that its ack tells us when the window opens again.
+ */
+
+/* The most bytes of packets put in one batch, and so held for the peer */
+#define RTX_MAX_BATCH (4*65536)
+
+/* The bytes of packets from the peer we let wait on our recvq */
+#define RTX_WINDOW (4*RTX_MAX_BATCH)
+
+/* The window to advertise with q as our recvq, shut once it is gone */
+#define rtx_window(q) ((q) && (q)->totsize < RTX_WINDOW ? \
+    (long)(RTX_WINDOW - (q)->totsize) : 0L)
+
+/* Sequence numbers wrap, so compare them this way */
+#define SEQ_AFTER(a,b) ((long)((a) - (b)) > 0)
+
+typedef struct _rtx_batch_t {
+    unsigned long seq;
+    char **pkts;
+    int npkts;
+    size_t size;            /* bytes of packets */
+    char *z;                /* the packets encoded, if that paid off */
+    size_t zlen;
+    int enc;                /* the ZB_* encodings of z, see zbatch.h */
+    int refs;               /* the list, plus whoever is sending it */
+    int sends;              /* how often rtx_next() handed it out */
+    struct _rtx_batch_t *next;
+} rtx_batch_t;
+
+typedef struct {
+    rtx_batch_t *head;      /* oldest unacked batch first */
+    rtx_batch_t **tail;
+    rtx_batch_t *ready;     /* the next new batch, made by rtx_prepare() */
+    unsigned long next_seq; /* what the next new batch gets */
+    unsigned long rcvd;     /* the last batch taken from the peer */
+    int enc;                /* the ZB_* encodings the peer takes */
+    size_t win;             /* what the peer last advertised */
+    vj_t vjtx;              /* header compression of what we send */
+    vj_t vjrx;              /* and of what we take */
+    aead_t aead;            /* the keys batches are sealed with, if any */
+    pthread_mutex_t mutex;
+    pthread_mutex_t txmutex; /* held while a batch is made, before mutex */
+} rtx_t;
+
+/*
+ * Returns a dynamically allocated rtx_t with nothing sent or received.
+ */
+rtx_t *rtx_init( void );
+
+/*
+ * Frees r and all the batches in it, and sets *r to NULL.
+ */
+void rtx_destroy( rtx_t **r );
+
+/*
+ * Forgets all batches, sequence numbers and keys, for when the peer has.
+ */
+void rtx_reset( rtx_t *r );
+
+/*
+ * Returns the batch to send next, held for the caller until rtx_put(): the
+ * oldest one the peer has not acked, or else a new one made of up to amount
+ * bytes of packets off q, within the peer's window. Returns NULL if there is
+ * nothing to send.
+ * New batches are encoded into b->z with the encodings in r->enc that pay
+ * off, and sealed with r->aead if r->enc has ZB_AEAD. Callers on different
+ * channels make them one after the other. A batch rtx_prepare() made goes
+ * next whatever amount is.
+ */
+rtx_batch_t *rtx_next( rtx_t *r, queue_t *q, size_t amount );
+
+/*
+ * Makes the next new batch ahead of time, encoded and sealed, once a full
+ * one is queued on q while another is still out, so that rtx_next() only
+ * has to hand it out. For whoever queues the packets, to keep deflate off
+ * the thread that sends. Does nothing if r->enc is 0.
+ */
+void rtx_prepare( rtx_t *r, queue_t *q );
+
+/*
+ * Returns nonzero if some batch has not been acked yet, or one made ahead
+ * has not been sent.
+ */
+int rtx_pending( rtx_t *r );
+
+/*
+ * Gives back a batch got from rtx_next() once it has been sent (or not).
+ */
+void rtx_put( rtx_t *r, rtx_batch_t *b );
+
+/*
+ * Drops all batches up to and including seq, which the peer has got, and
+ * takes win as its window unless it is negative (the peer did not say).
+ */
+void rtx_ack( rtx_t *r, unsigned long seq, long win );
+
+/*
+ * Returns nonzero if the batch seq from the peer has been taken already.
+ */
+int rtx_dup( rtx_t *r, unsigned long seq );
+
+/*
+ * Records that the batch seq from the peer has been taken in full.
+ */
+void rtx_recv( rtx_t *r, unsigned long seq );
+
+/*
+ * Returns the sequence number to ack to the peer.
+ */
+unsigned long rtx_rcvd( rtx_t *r );
+
+#endif
@@ -0,0 +1,111 @@
+/* -------------------------------------------------------------------------
+ * shape.h - htun per-client rate limit defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __SHAPE_H
+#define __SHAPE_H
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+/*
+ * Each client's traffic is shaped with a token bucket per direction: what
+ * comes off its tun device for it, and what goes onto the tun from it.
+ * Packets that find the bucket empty are let through late, not dropped, so
+ * the sendq and the tun device back up, and so does the recvq, whose window
+ * then keeps the client's batches small.
+ *
+ * With a total rate, what the limited clients leave of it is split evenly
+ * once a second among those that ran into their limit, on top of their own
+ * rate.
+ */
+
+/* How often the spare rate is shared out again, in msec */
+#define SHAPE_PERIOD_MSEC 1000
+
+/* The burst of a rate that has none set is an eighth of it, or this */
+#define SHAPE_MIN_BURST 65536
+
+typedef struct _shape_t {
+    unsigned long rate;     /* bytes per second it always gets, 0 is free */
+    unsigned long burst;    /* the most bytes that may go at once */
+    unsigned long extra;    /* its share of the spare rate */
+    double tokens;          /* bytes that may go now, negative when owed */
+    struct timeval last;    /* when tokens were last topped up */
+    unsigned long used;     /* bytes taken this period */
+    int throttled;          /* had to wait this period */
+    struct _shape_t *next;
+} shape_t;
+
+/* A per MAC address rate from the config */
+typedef struct _shape_rule_t {
+    char macaddr[13];
+    unsigned long rate;
+    unsigned long burst;
+    struct _shape_rule_t *next;
+} shape_rule_t;
+
+/*
+ * Returns a new bucket with no limit, or NULL on failure.
+ */
+shape_t *shape_new( void );
+
+/*
+ * Frees the bucket at *s and sets *s to NULL.
+ */
+void shape_free( shape_t **s );
+
+/*
+ * Sets the rate and burst of s in bytes. A rate of 0 lifts the limit, and a
+ * burst of 0 picks one for the rate.
+ */
+void shape_set( shape_t *s, unsigned long rate, unsigned long burst );
+
+/*
+ * Sets the total rate the limited clients share, 0 for none.
+ */
+void shape_total( unsigned long rate );
+
+/*
+ * Takes len bytes from s, first waiting for as long as the bucket is
+ * owed. Returns at once if s is NULL or has no limit.
+ */
+void shape_wait( shape_t *s, size_t len );
+
+/*
+ * Takes len bytes from s without waiting, for callers that must not block.
+ * The next shape_wait() on s then waits for what the bucket owes.
+ */
+void shape_charge( shape_t *s, size_t len );
+
+/*
+ * Adds a rule for macaddr, written with or without colons, to the list at
+ * *rules. Returns 0 on success, -1 if macaddr is not one or on failure.
+ */
+int shape_add_rule( shape_rule_t **rules, const char *macaddr,
+                    unsigned long rate, unsigned long burst );
+
+/*
+ * Returns the rule for macaddr in rules, or NULL if there is none.
+ */
+shape_rule_t *shape_rule( shape_rule_t *rules, const char *macaddr );
+
+#endif
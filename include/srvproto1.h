@@ -24,11 +24,12 @@
 #define __SRVPROTO1_H
 
 #include "clidata.h"
+#include "http.h"
 
 int handle_f_p1( clidata_t **clientp );
 
-int handle_s_p1( clidata_t *client, char *hdrs );
+int handle_s_p1( clidata_t *client, rbuf_t *rb, http_msg_t *msg );
 
-int handle_p_p1( clidata_t *client, char *hdrs );
+int handle_p_p1( clidata_t *client, rbuf_t *rb, http_msg_t *msg );
 
 #endif
@@ -24,17 +24,55 @@
 #define __SRVPROTO2_H
 
 #include "clidata.h"
+#include "http.h"
 
-#define CP2_OK_MAXBODY 50
+#define CP2_OK_MAXBODY 256
 
-clidata_t *handle_cp( int clisock, char *hdrs, int protover );
+/*
+ * Registers the client described by lines (MAC address, then one IP range per
+ * line, and its session token if it has one) with clisock as its first
+ * channel, allocating its tun device and starting its tunfile threads if it
+ * is new. A known client that presents the right token picks its session up
+ * where it left off, anything else starts a new one. Returns the clidata, or
+ * NULL on failure with *err set to the HTTP status the client should be given.
+ */
+clidata_t *register_client( int clisock, char **lines, int proto, int *err );
+
+/*
+ * Puts the reply to a successful connect into buf: the client's IP, the
+ * server's IP and the session token, one per line. Returns its length.
+ */
+int connect_reply( clidata_t *client, char *buf, size_t len );
+
+/*
+ * Reads the packets of the client's request body from rb onto its recvq,
+ * unless the client already sent that batch before, and takes note of what
+ * it acks. Sends a 500 to fd and returns -1 on failure, returns 0 on success.
+ */
+int take_batch( clidata_t *client, rbuf_t *rb, http_msg_t *msg, int fd );
+
+/*
+ * Responds to the request msg on fd with amount bytes off the client's
+ * sendq, or with a 204 if amount is 0. A client that acks what it gets is
+ * sent the batch it did not ack yet first. Returns the number of packets
+ * sent, or -1 on failure.
+ */
+int send_batch( clidata_t *client, int fd, http_msg_t *msg, size_t amount );
+
+/*
+ * Responds to the request msg on fd with a 204, acking the client's batches
+ * if it does so too. Returns 0 on success, -1 on failure.
+ */
+int send_ack( clidata_t *client, int fd, http_msg_t *msg );
+
+clidata_t *handle_cp( rbuf_t *rb, http_msg_t *msg, int protover );
 
-clidata_t *handle_cr( int clisock, char *hdrs );
+clidata_t *handle_cr( rbuf_t *rb, http_msg_t *msg );
 
 int handle_f_p2( clidata_t **client );
 
-int handle_s_p2( clidata_t *client, char *hdrs );
+int handle_s_p2( clidata_t *client, rbuf_t *rb, http_msg_t *msg );
 
-int handle_r_p2( clidata_t *client, char *hdrs );
+int handle_r_p2( clidata_t *client, rbuf_t *rb, http_msg_t *msg );
 
 #endif
@@ -0,0 +1,61 @@
+/* -------------------------------------------------------------------------
+ * srvws.h - htun WebSocket channel functions for the server side
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>, 
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __SRVWS_H
+#define __SRVWS_H
+
+#include "clidata.h"
+#include "http.h"
+
+/*
+ * A WebSocket channel, used by the handler thread reading from it and the
+ * sender thread writing to it. Whichever lets go of it last closes it.
+ */
+typedef struct {
+    clidata_t *client;
+    int fd;
+    int refs;
+    volatile int stop;      /* one of them has let go */
+} ws_chan_t;
+
+/*
+ * Completes the WebSocket handshake for the upgrade request msg, reads the
+ * client's MAC address and IP ranges from its first message and answers with
+ * the assigned addresses. Returns the client's data and places the channel
+ * in *chan, or returns NULL on failure.
+ */
+clidata_t *handle_ws( rbuf_t *rb, http_msg_t *msg, ws_chan_t **chan );
+
+/*
+ * Carries packets for the client over its WebSocket channel until the
+ * connection fails. Returns -1, or 0 if a protocol 3 client said it is
+ * leaving for good.
+ */
+int handle_ws_data( ws_chan_t *ch, rbuf_t *rb );
+
+/*
+ * Lets go of the channel: shuts it down so the other thread stops using it
+ * too, and closes it if the other thread has let go already.
+ */
+void ws_release( ws_chan_t *ch );
+
+#endif
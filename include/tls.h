@@ -0,0 +1,78 @@
+/* -------------------------------------------------------------------------
+ * tls.h - htun TLS transport defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __TLS_H
+#define __TLS_H
+
+#include <openssl/ssl.h>
+
+/*
+ * With TLS the channels between client and server are plain TLS 1.2
+ * connections, made straight to the server or through a CONNECT to the
+ * proxy. OpenSSL only does the handshake: after it the kernel (kTLS) takes
+ * over the records in both directions, and the socket is used as before,
+ * so read(), writev() and sendfile() still go straight to it. kTLS cannot
+ * take the post-handshake messages of TLS 1.3 through a plain read(),
+ * hence 1.2, with the AEAD ciphers the kernel knows.
+ *
+ * Where kTLS is not there (no tls module, or an OpenSSL without it), a
+ * thread per connection relays between the TLS connection and a
+ * socketpair, and the rest of htun uses the other end of that instead.
+ */
+
+#define TLS_NONE    0
+#define TLS_DIRECT  1   /* the handshake goes to proxy_ip itself */
+#define TLS_CONNECT 2   /* through a CONNECT to the server first */
+
+/* The TLS 1.2 ciphers the kernel can take over */
+#define TLS_CIPHERS "ECDHE+AESGCM:ECDHE+CHACHA20"
+
+/* The longest a handshake may take, in seconds */
+#define TLS_HANDSHAKE_SECS 15
+
+/*
+ * Returns a context for the server with the certificate (chain) in the PEM
+ * file cert and the private key in key, or NULL on failure.
+ */
+SSL_CTX *tls_server_ctx( const char *cert, const char *key );
+
+/*
+ * Returns a context for the client that checks the server's certificate
+ * against the CAs in the PEM file ca, or the system's if ca is empty, or
+ * NULL on failure.
+ */
+SSL_CTX *tls_client_ctx( const char *ca );
+
+/*
+ * Makes the server end of a TLS connection on fd. Returns the descriptor to
+ * use from now on, or -1 on failure, in which case fd is left open.
+ */
+int tls_accept( SSL_CTX *ctx, int fd );
+
+/*
+ * Makes the client end of a TLS connection on fd to host, an IP address or
+ * a name, which the certificate must be for. Returns the descriptor to use
+ * from now on, or -1 on failure, in which case fd is left open.
+ */
+int tls_connect( SSL_CTX *ctx, int fd, const char *host );
+
+#endif
@@ -54,6 +54,20 @@
 #define IFF_NO_PI	0x1000
 #define IFF_ONE_QUEUE	0x2000
 
+/*
+ * The tun MTU is kept within these. Below 576 IPv4 would not work, and
+ * above 1500 inner packets only get fragmented elsewhere.
+ */
+#define TUN_MIN_MTU 576
+#define TUN_MAX_MTU 1500
+
+/* What each packet costs on the wire besides itself: the tun header, the
+ * frame header of a WebSocket message carrying it alone, and with protocol 3
+ * its own frame header in place of the tun header */
+#define TUN_PKT_OVERHEAD 4
+#define TUN_WS_OVERHEAD (TUN_PKT_OVERHEAD + 14)
+#define TUN_FR_OVERHEAD (8 + 14)
+
 struct tun_pi {
 	unsigned short flags;
 	unsigned short proto;
@@ -97,9 +111,56 @@ char *get_mac( char *ifname );
 
 /*
  * sets up the tun dev according to the specidied
- * local and peer ip
+ * local and peer ip, and mtu
+ */
+int cli_tun_alloc(struct in_addr local, struct in_addr peer, int mtu);
+
+/*
+ * Returns the tun MTU that lets a packet and overhead bytes of framing fit
+ * in one segment of the TCP connection sock, within TUN_MIN_MTU and
+ * TUN_MAX_MTU.
+ */
+int tun_transport_mtu( int sock, int overhead );
+
+/*
+ * Returns mtu within TUN_MIN_MTU and TUN_MAX_MTU.
+ */
+int tun_clip_mtu( int mtu );
+
+/*
+ * If pkt is a TCP SYN announcing an MSS too large for mtu, lowers the MSS
+ * and updates the TCP checksum in place.
+ */
+void tun_clamp_mss( char *pkt, int mtu );
+
+/*
+ * Returns nonzero if pkt is a TCP segment that only acknowledges data: no
+ * payload, no flags but ACK, and no options but timestamps.
+ */
+int tun_pure_ack( const char *pkt );
+
+/*
+ * Returns nonzero if pkt is a whole TCP segment that may be retransmitted:
+ * one with data, or SYN, FIN or RST. Empty ACKs are not.
+ */
+int tun_is_segment( const char *pkt );
+
+/*
+ * Returns nonzero if item is the same TCP segment as pkt, which must pass
+ * tun_is_segment(): same connection, sequence number, length and SYN/FIN/RST
+ * flags. Fits q_add_unique(), to drop retransmissions of segments that have
+ * not even been sent yet.
+ */
+int tun_same_segment( const void *item, const void *pkt );
+
+/*
+ * Returns > 0 if the pure ACK pkt makes the queued pure ACK item redundant:
+ * same connection, sequence number and window, and it acks more. Duplicate
+ * ACKs are never merged, TCP counts them. Returns < 0 for other segments of
+ * the connection, which pkt must not overtake, and 0 for the rest. Fits
+ * q_replace().
  */
-int cli_tun_alloc(struct in_addr local, struct in_addr peer);
+int tun_ack_supersedes( const void *item, const void *pkt );
 
 
 #endif /* __IF_TUN_H */
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <ctype.h>
 
@@ -41,17 +42,83 @@ int xstrcasecmp( const char *s1, const char *s2 ) {
     return xstrncasecmp( s1, s2, 0 );
 }
 
-/* 
- * fprintf()-like function but uses a file descriptor or socket descriptor
- * instead of a FILE*.
+/*
+ * Writes out all cnt buffers in iov, resuming after short writes. The iovecs
+ * are modified. Returns 0 on success, -1 on failure.
+ */
+int writev_all( int fd, struct iovec *iov, int cnt );
+
+/* The most iovecs handed to one writev(); POSIX guarantees at least 16 and
+ * every system we run on takes 1024. IOV_MAX is not declared without the
+ * XSI feature macros. */
+#define HTUN_IOV_MAX 1024
+
+#define RBUF_SIZE 65536
+
+/*
+ * A per-connection read buffer. Bytes from start up to end have been read
+ * from fd but not consumed yet. scan is used by the HTTP parser to remember
+ * how far past start it has already looked for the end of the headers.
+ */
+typedef struct {
+    int fd;
+    size_t start;
+    size_t end;
+    size_t scan;
+    char buf[RBUF_SIZE];
+} rbuf_t;
+
+/*
+ * Returns a new, empty, DYNAMICALLY ALLOCATED read buffer for fd, or NULL if
+ * out of memory.
+ */
+rbuf_t *rb_new( int fd );
+
+/*
+ * Frees the read buffer pointed to by *rb and sets *rb to NULL. Does not close
+ * the file descriptor.
+ */
+void rb_free( rbuf_t **rb );
+
+/*
+ * Throws away anything buffered and points the buffer at a new fd.
+ */
+__EI
+void rb_reset( rbuf_t *rb, int fd ) {
+    rb->fd = fd;
+    rb->start = rb->end = rb->scan = 0;
+}
+
+/*
+ * Returns the number of bytes that can be consumed without reading fd.
+ */
+__EI
+size_t rb_avail( rbuf_t *rb ) {
+    return rb->end - rb->start;
+}
+
+/*
+ * Marks len buffered bytes as consumed.
+ */
+__EI
+void rb_consume( rbuf_t *rb, size_t len ) {
+    rb->start += len;
+    if( rb->start == rb->end ) rb->start = rb->end = 0;
+}
+
+/*
+ * Does one read() from fd into the free space of the buffer, moving unconsumed
+ * data to the front first if needed. Returns the number of bytes read, 0 if
+ * the peer closed the connection, or -1 on error or if the buffer is full.
+ * errno is EAGAIN if fd is non-blocking and has nothing to read.
  */
-int fdprintf(int fd, char *fmt, ...);
+int rb_fill( rbuf_t *rb );
 
 /*
- * receives a line of data from fd, and puts up to len bytes into buf.
- * Returns NULL if there was no data, or buf on success.
+ * Reads exactly len bytes into buf, taking what is buffered first and then
+ * reading fd. Returns 0 on success, -1 on failure.
  */
-char *recvline( char *buf, int len, int fd );
+int rb_read( rbuf_t *rb, char *buf, size_t len );
 
 /*
  * Ensures there is no extra data waiting to be received on fd.  If there is,
@@ -60,10 +127,10 @@ char *recvline( char *buf, int len, int fd );
 int recvflush( int fd ); 
 
 /* 
- * Reads exactly len bytes from fd and returns the data in a dynamically
- * allocated buffer
+ * Reads exactly len bytes from rb and returns the data in a dynamically
+ * allocated, null-terminated buffer
  */
-char *readloop( int fd, size_t len );
+char *readloop( rbuf_t *rb, size_t len );
 
 /*
  * Takes in a char * and returns a dynamically allocated array of pointers to
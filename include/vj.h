@@ -0,0 +1,82 @@
+/* -------------------------------------------------------------------------
+ * vj.h - htun TCP/IP header compression defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __VJ_H
+#define __VJ_H
+
+#include <sys/types.h>
+
+/*
+ * TCP/IP header compression in the manner of Van Jacobson (RFC 1144).
+ * Both ends keep the headers of the last packet of up to VJ_SLOTS TCP
+ * connections. A packet of a known connection goes as the differences to
+ * those, a few bytes instead of 40 to 60. Batches of one direction are
+ * made one at a time and taken in order (see rtx.h), so the contexts carry
+ * over from batch to batch; they are reset with the rtx state.
+ *
+ * An encoded batch is a run of records, each starting with a type byte:
+ *   VJ_RAW   the packet as it is, for anything we do not compress
+ *   VJ_FULL  slot byte, then the packet as it is, which sets up the slot
+ *   VJ_DELTA slot byte, change bits, the TCP checksum, the changed fields,
+ *            then the payload length and the payload
+ */
+
+#define VJ_SLOTS 64
+
+#define VJ_RAW   0
+#define VJ_FULL  1
+#define VJ_DELTA 2
+
+/* PI header, IPv4 without options, and TCP with up to 40 bytes of options */
+#define VJ_MAX_HDR (4 + 20 + 60)
+
+typedef struct {
+    unsigned char hdr[VJ_MAX_HDR];
+    int len;                /* of hdr, 0 if the slot is free */
+    unsigned long used;     /* when the encoder last used it */
+} vj_slot_t;
+
+typedef struct {
+    vj_slot_t slot[VJ_SLOTS];
+    unsigned long clock;
+} vj_t;
+
+/*
+ * Forgets all connections, for a new session.
+ */
+void vj_reset( vj_t *c );
+
+/*
+ * Encodes the npkts packets at pkts, size bytes in all, with the context c
+ * into a DYNAMICALLY ALLOCATED buffer, placing its length in *len. Returns
+ * NULL if out of memory, in which case c is unchanged.
+ */
+char *vj_encode( vj_t *c, char **pkts, int npkts, size_t size, size_t *len );
+
+/*
+ * Decodes a batch made by vj_encode() with the context c into a DYNAMICALLY
+ * ALLOCATED buffer of packets, placing its length in *len. Returns NULL if
+ * the batch is corrupt, in which case c is unchanged.
+ */
+char *vj_decode( vj_t *c, const char *buf, size_t blen, size_t *len );
+
+#endif
@@ -0,0 +1,108 @@
+/* -------------------------------------------------------------------------
+ * websock.h - htun WebSocket (RFC 6455) framing and handshake defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __WEBSOCK_H
+#define __WEBSOCK_H
+
+#include <sys/types.h>
+#include "queue.h"
+#include "http.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OP_CONT  0x0
+#define WS_OP_TEXT  0x1
+#define WS_OP_BIN   0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING  0x9
+#define WS_OP_PONG  0xA
+
+/* The largest message (one batch of packets) we send or accept */
+#define WS_MAX_MESSAGE (16*65536)
+
+/* Length of a base64-encoded 16-byte key and of an accept value */
+#define WS_KEY_LEN 24
+#define WS_ACCEPT_LEN 28
+
+#define HDR_UPGRADE "Upgrade: "
+#define HDR_WS_KEY "Sec-WebSocket-Key: "
+#define HDR_WS_ACCEPT "Sec-WebSocket-Accept: "
+#define HDR_WS_VERSION "Sec-WebSocket-Version: "
+
+#define REQ_WS_UPGRADE "GET http://%s:%d/WS HTTP/1.1\r\n" \
+                    HDR_HOST "%s:%d\r\n" \
+                    HDR_UPGRADE "websocket\r\n" \
+                    HDR_CONNECTION "Upgrade\r\n" \
+                    HDR_WS_KEY "%s\r\n" \
+                    HDR_WS_VERSION "13\r\n"
+/* The accept value goes between these, followed by TAIL_NONE */
+#define HEAD_101    "HTTP/1.1 101 Switching Protocols\r\n" \
+                    HDR_UPGRADE "websocket\r\n" \
+                    HDR_CONNECTION "Upgrade\r\n" \
+                    HDR_WS_ACCEPT
+
+/*
+ * Returns nonzero if the given request asks for a WebSocket upgrade and
+ * carries a key we can answer.
+ */
+int ws_is_upgrade( const http_msg_t *msg );
+
+/*
+ * Fills key (at least WS_KEY_LEN+1 bytes) with a fresh random client key.
+ */
+void ws_make_key( char *key );
+
+/*
+ * Computes the Sec-WebSocket-Accept value for the given client key into
+ * accept, which must be at least WS_ACCEPT_LEN+1 bytes.
+ */
+void ws_accept_key( const char *key, char *accept );
+
+/*
+ * Sends one unfragmented frame of the given opcode. The payload is masked
+ * (modifying data in place) if mask is nonzero, which clients must do.
+ * Returns 0 on success, -1 on failure.
+ */
+int ws_send_frame( int fd, int opcode, char *data, size_t len, int mask );
+
+/*
+ * Dequeues at most WS_MAX_MESSAGE bytes worth of packets from q and sends
+ * them as a single binary message. Returns the number of packets sent, or -1
+ * on failure, in which case the dequeued packets are lost.
+ */
+int ws_send_batch( int fd, queue_t *q, int mask );
+
+/*
+ * Receives one complete (possibly fragmented) data message from rb and
+ * returns it in a DYNAMICALLY ALLOCATED buffer, placing its length in *len
+ * and its opcode in *opcode. Pings are answered and pongs ignored on the
+ * way. Returns NULL on error or when the peer closes the connection.
+ */
+char *ws_recv_message( rbuf_t *rb, int *opcode, size_t *len, int mask );
+
+/*
+ * Receives one binary message from rb and places each packet in it on q.
+ * Returns the number of packets queued, or -1 on failure.
+ */
+int ws_recv_batch( rbuf_t *rb, queue_t *q, int mask );
+
+#endif
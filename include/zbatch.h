@@ -0,0 +1,102 @@
+/* -------------------------------------------------------------------------
+ * zbatch.h - htun packet batch encoding defs
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#ifndef __ZBATCH_H
+#define __ZBATCH_H
+
+#include <sys/types.h>
+#include "aead.h"
+#include "common.h"
+#include "queue.h"
+#include "rtx.h"
+#include "util.h"
+#include "vj.h"
+
+/*
+ * When both ends agree, each batch of packets is encoded as a whole and
+ * sent with an X-Htun-Enc header listing the encodings in the order they
+ * were applied: the TCP/IP headers as deltas (see vj.h), then deflate,
+ * then sealing (see aead.h). Small batches, and batches that hardly shrink
+ * (already compressed or encrypted traffic), are not deflated.
+ */
+
+#define ZB_VJ      0x01
+#define ZB_DEFLATE 0x02
+#define ZB_AEAD    0x04
+
+/* Once there are keys, only sealed batches are taken */
+#define zbatch_allowed(a,enc) (!(a)->cipher || ((enc) & ZB_AEAD))
+
+/* Batches smaller than this are not worth deflating */
+#define ZBATCH_MIN 256
+
+/* What a batch may decode to: rtx_next() can overshoot by one packet */
+#define ZBATCH_MAX (RTX_MAX_BATCH + HTUN_MAXPACKET)
+
+/*
+ * Returns the ZB_* encodings named in the len bytes at s, separated by
+ * commas or blanks. Names we do not know are left out.
+ */
+int zbatch_parse( const char *s, size_t len );
+
+/*
+ * Returns the names of the encodings enc, in the order they are applied.
+ */
+const char *zbatch_names( int enc );
+
+/*
+ * Encodes the given packets with those of the encodings enc that pay off
+ * into one DYNAMICALLY ALLOCATED buffer, placing its length in *zlen and
+ * the encodings used in *used. Header compression always pays off, and
+ * moves vj on, and with ZB_AEAD the batch is always sealed with a. Returns
+ * NULL if no encoding was used, in which case the packets should go out as
+ * they are, or if sealing failed.
+ */
+char *zbatch_encode( vj_t *vj, aead_t *a, int enc, char **pkts, int npkts,
+                     size_t size, size_t *zlen, int *used );
+
+/*
+ * Decodes a batch that zbatch_encode() made with the encodings enc into a
+ * DYNAMICALLY ALLOCATED buffer of packets, placing its length in *len.
+ * Returns NULL if the data does not authenticate, is corrupt or would
+ * decode to more than a batch can hold, in which case vj is unchanged.
+ */
+char *zbatch_decode( vj_t *vj, aead_t *a, int enc, const char *z,
+                     size_t zlen, size_t *len );
+
+/*
+ * Places each packet in the decoded batch buf on q, or just counts them if
+ * q is NULL. Returns the number of packets, or -1 if a packet length does
+ * not fit the buffer or queueing failed.
+ */
+int zbatch_queue( const char *buf, size_t len, queue_t *q );
+
+/*
+ * Reads a batch body of len bytes with the encodings enc from rb, decodes
+ * it with vj and a and places the packets in it on q. If q is NULL the
+ * batch is one we had before and is only read: its headers were decoded
+ * already. Returns the number of packets queued, or -1 on failure.
+ */
+int zbatch_recv( rbuf_t *rb, size_t len, int enc, vj_t *vj, aead_t *a,
+                 queue_t *q );
+
+#endif
@@ -0,0 +1,165 @@
+/* -------------------------------------------------------------------------
+ * admit.c - htun admission control of connections at accept
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "log.h"
+#include "admit.h"
+
+typedef struct {
+    struct in_addr addr;
+    double tokens;          /* connections it may make now */
+    struct timeval last;    /* when it last connected, 0 if slot is free */
+    time_t known;           /* until when it is let in ahead of others */
+} admit_src_t;
+
+static admit_src_t srcs[ADMIT_SLOTS];
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The number of bytes of a connection looked at by admit_first() */
+#define ADMIT_PEEK 8
+
+/* Nonzero if a is sooner missed than b: it has no client, then it's older */
+static inline int admit_worse( const admit_src_t *a, const admit_src_t *b,
+                               time_t now ) {
+    int ak = a->known > now, bk = b->known > now;
+
+    if( ak != bk ) return bk;
+    return timercmp(&a->last, &b->last, <);
+}
+
+/*
+ * Returns the slot of src, taking over the one sooner missed of those it
+ * may be in if it has none. Call with admit_lock held.
+ */
+static admit_src_t *admit_find( struct in_addr src, time_t now ) {
+    unsigned long h = (ntohl(src.s_addr) * 2654435761UL) & 0xFFFFFFFF;
+    admit_src_t *e, *old = NULL;
+    int i;
+
+    for( i=0; i<ADMIT_PROBE; i++ ) {
+        e = &srcs[((h >> 20) + i) % ADMIT_SLOTS];
+        if( e->last.tv_sec && e->addr.s_addr == src.s_addr ) return e;
+        if( !old || admit_worse(e, old, now) ) old = e;
+    }
+
+    memset(old, 0, sizeof(*old));
+    old->addr = src;
+    old->tokens = -1;
+    return old;
+}
+
+/*
+ * Returns nonzero if what has come in on fd so far can be the start of a
+ * request to htun: an HTTP method, or a TLS handshake record if tls is set.
+ */
+static int admit_first( int fd, int tls ) {
+    unsigned char buf[ADMIT_PEEK];
+    ssize_t n;
+    int i;
+
+    /* Nothing yet means nothing came for ADMIT_DEFER_SECS */
+    if( (n=recv(fd, buf, sizeof(buf), MSG_PEEK|MSG_DONTWAIT)) <= 0 ) {
+        return 0;
+    }
+    if( tls ) return buf[0] == 0x16 && (n < 2 || buf[1] == 0x03);
+
+    for( i=0; i<n && isupper(buf[i]); i++ );
+    return i > 0 && (i == n || buf[i] == ' ');
+}
+
+void admit_listen( int sock ) {
+    int secs = ADMIT_DEFER_SECS;
+
+    if( setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs,
+                   sizeof(secs)) == -1 ) {
+        lprintf(log, WARN, "Setting TCP_DEFER_ACCEPT: %s.", strerror(errno));
+    }
+}
+
+void admit_known( struct in_addr src ) {
+    struct timeval now;
+    admit_src_t *e;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&admit_lock);
+    e = admit_find(src, now.tv_sec);
+    if( !e->last.tv_sec ) e->last = now;
+    e->known = now.tv_sec + config->u.s.clidata_timeout;
+    pthread_mutex_unlock(&admit_lock);
+}
+
+int admit( int fd, struct in_addr src, int pending, int tls ) {
+    struct server_config *s = &config->u.s;
+    unsigned long burst = s->admit_burst ? s->admit_burst : ADMIT_BURST;
+    struct timeval now;
+    admit_src_t *e;
+    int known, rc = ADMIT_OK;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&admit_lock);
+    e = admit_find(src, now.tv_sec);
+    known = e->known > now.tv_sec;
+
+    if( s->admit_rate ) {
+        if( e->tokens < 0 ) {
+            e->tokens = burst;
+        } else {
+            e->tokens += ((now.tv_sec - e->last.tv_sec) +
+                (now.tv_usec - e->last.tv_usec) / 1e6) * s->admit_rate / 60.0;
+            if( e->tokens > burst ) e->tokens = burst;
+        }
+        if( e->tokens < 1 ) rc = ADMIT_RATE;
+        else e->tokens--;
+    }
+    e->last = now;
+    pthread_mutex_unlock(&admit_lock);
+
+    if( rc == ADMIT_RATE ) {
+        lprintf_rl(log, INFO, "%s connects too often. Dumping client.",
+                inet_ntoa(src));
+        return rc;
+    }
+    if( !known && pending >= s->max_pending - s->max_pending/ADMIT_RESERVE ) {
+        lprintf_rl(log, INFO, "Request queue nearly full. Dumping client %s.",
+                inet_ntoa(src));
+        return ADMIT_LOAD;
+    }
+    if( s->admit_check && !admit_first(fd, tls) ) {
+        lprintf_rl(log, INFO, "%s did not send a request. Dumping client.",
+                inet_ntoa(src));
+        return ADMIT_JUNK;
+    }
+    return ADMIT_OK;
+}
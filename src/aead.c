@@ -0,0 +1,235 @@
+/* -------------------------------------------------------------------------
+ * aead.c - htun batch encryption functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#include "common.h"
+#include "log.h"
+#include "http.h"
+#include "aead.h"
+
+static const EVP_CIPHER *aead_evp( int cipher ) {
+    return cipher == AEAD_AES_256_GCM ? EVP_aes_256_gcm() :
+        EVP_chacha20_poly1305();
+}
+
+/* The 12 byte IV for the counter the sealed batch at p starts with */
+static unsigned long long aead_iv( const unsigned char *p, unsigned char *iv ) {
+    unsigned long long ctr = 0;
+    int i;
+
+    for( i=0; i<8; i++ ) ctr = ctr << 8 | p[i];
+    memset(iv, 0, 4);
+    memcpy(iv + 4, p, 8);
+    return ctr;
+}
+
+int aead_cipher( const char *name ) {
+    if( !strcasecmp(name, "chacha20-poly1305") ) return AEAD_CHACHA20_POLY1305;
+    if( !strcasecmp(name, "aes-256-gcm") ) return AEAD_AES_256_GCM;
+    return 0;
+}
+
+const char *aead_name( int cipher ) {
+    return cipher == AEAD_AES_256_GCM ? "aes-256-gcm" : "chacha20-poly1305";
+}
+
+void aead_random( unsigned char *buf, size_t len ) {
+    size_t i;
+
+    if( RAND_bytes(buf, len) == 1 ) return;
+    lprintf(log, WARN, "Unable to get random bytes from OpenSSL, using rand()");
+    for( i=0; i < len; i++ ) buf[i] = rand() & 0xFF;
+}
+
+void aead_hex( char *out, const unsigned char *in, size_t len ) {
+    size_t i;
+
+    for( i=0; i < len; i++ ) sprintf(out + 2*i, "%02x", in[i]);
+    out[2*len] = '\0';
+}
+
+int aead_unhex( unsigned char *out, const char *in, size_t len ) {
+    unsigned int b;
+    size_t i;
+
+    for( i=0; i < len; i++ ) {
+        if( !isxdigit((unsigned char)in[2*i]) ||
+            !isxdigit((unsigned char)in[2*i+1]) ||
+            sscanf(in + 2*i, "%2x", &b) != 1 ) return -1;
+        out[i] = b;
+    }
+    return 0;
+}
+
+void aead_setup( aead_t *a, int cipher, const char *psk, const char *token,
+                 const unsigned char *nonce, int server ) {
+    unsigned char msg[4 + SESSION_TOKEN_LEN + AEAD_NONCE_LEN];
+    unsigned char prk[32], c2s[32], s2c[32];
+    unsigned int n;
+
+    memcpy(msg, "htun", 4);
+    memcpy(msg + 4, token, SESSION_TOKEN_LEN);
+    memcpy(msg + 4 + SESSION_TOKEN_LEN, nonce, AEAD_NONCE_LEN);
+    HMAC(EVP_sha256(), psk, strlen(psk), msg, sizeof(msg), prk, &n);
+
+    HMAC(EVP_sha256(), prk, sizeof(prk),
+         (const unsigned char *)"client to server", 16, c2s, &n);
+    HMAC(EVP_sha256(), prk, sizeof(prk),
+         (const unsigned char *)"server to client", 16, s2c, &n);
+
+    memcpy(a->tx, server ? s2c : c2s, AEAD_KEY_LEN);
+    memcpy(a->rx, server ? c2s : s2c, AEAD_KEY_LEN);
+    a->txctr = a->rxctr = 0;
+    a->cipher = cipher;
+
+    OPENSSL_cleanse(prk, sizeof(prk));
+    OPENSSL_cleanse(c2s, sizeof(c2s));
+    OPENSSL_cleanse(s2c, sizeof(s2c));
+}
+
+void aead_auth( unsigned char *out, const char *psk, int server,
+                const char *mac, const char *token,
+                const unsigned char *nonce, unsigned long t ) {
+    unsigned char msg[11 + 12 + SESSION_TOKEN_LEN + AEAD_NONCE_LEN + 8];
+    unsigned char hmac[32];
+    unsigned int n;
+    int i;
+
+    /* the mac and the token are zero padded to their full length, and the
+     * mac in lower case, as clients are told apart regardless of case */
+    memset(msg, 0, sizeof(msg));
+    memcpy(msg, server ? "htun server" : "htun client", 11);
+    for( i=0; i<12 && mac[i]; i++ ) {
+        msg[11 + i] = tolower((unsigned char)mac[i]);
+    }
+    strncpy((char *)msg + 11 + 12, token ? token : "", SESSION_TOKEN_LEN);
+    memcpy(msg + 11 + 12 + SESSION_TOKEN_LEN, nonce, AEAD_NONCE_LEN);
+    for( i=0; i<8; i++ ) {
+        msg[sizeof(msg) - 8 + i] = ((unsigned long long)t >> (56 - 8*i)) &
+            0xFF;
+    }
+    HMAC(EVP_sha256(), psk, strlen(psk), msg, sizeof(msg), hmac, &n);
+    memcpy(out, hmac, AEAD_PROOF_LEN);
+}
+
+int aead_auth_ok( const unsigned char *auth, const char *psk, int server,
+                  const char *mac, const char *token,
+                  const unsigned char *nonce, unsigned long t ) {
+    unsigned char proof[AEAD_PROOF_LEN];
+
+    aead_auth(proof, psk, server, mac, token, nonce, t);
+    return !CRYPTO_memcmp(proof, auth, AEAD_PROOF_LEN);
+}
+
+void aead_reset( aead_t *a ) {
+    OPENSSL_cleanse(a, sizeof(*a));
+}
+
+char *aead_seal( aead_t *a, const char *buf, size_t len, size_t *outlen ) {
+    unsigned long long ctr;
+    unsigned char iv[12], *out;
+    EVP_CIPHER_CTX *ctx;
+    int i, n, ok;
+
+    if( !a->cipher ) return NULL;
+    if( (out=malloc(len + AEAD_OVERHEAD)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() sealing buffer!");
+        return NULL;
+    }
+
+    ctr = ++a->txctr;
+    for( i=0; i<8; i++ ) out[i] = (ctr >> (56 - 8*i)) & 0xFF;
+    aead_iv(out, iv);
+
+    ok = (ctx=EVP_CIPHER_CTX_new()) != NULL &&
+        EVP_EncryptInit_ex(ctx, aead_evp(a->cipher), NULL, a->tx, iv) == 1 &&
+        EVP_EncryptUpdate(ctx, out + 8, &n, (const unsigned char *)buf,
+                          len) == 1 &&
+        EVP_EncryptFinal_ex(ctx, out + 8 + n, &n) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN,
+                            out + 8 + len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+
+    if( !ok ) {
+        lprintf(log, ERROR, "Unable to seal batch with %s.",
+                aead_name(a->cipher));
+        free(out);
+        return NULL;
+    }
+    *outlen = len + AEAD_OVERHEAD;
+    return (char *)out;
+}
+
+char *aead_open( aead_t *a, const char *buf, size_t len, size_t *outlen ) {
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned long long ctr;
+    unsigned char iv[12], *out;
+    EVP_CIPHER_CTX *ctx;
+    size_t clen;
+    int n, ok;
+
+    if( !a->cipher ) {
+        lprintf(log, WARN, "Got a sealed batch without having keys.");
+        return NULL;
+    }
+    if( len < AEAD_OVERHEAD ) {
+        lprintf(log, WARN, "Sealed batch of %lu bytes is too short.", len);
+        return NULL;
+    }
+    clen = len - AEAD_OVERHEAD;
+    if( (ctr=aead_iv(p, iv)) <= a->rxctr ) {
+        lprintf(log, WARN, "Sealed batch %llu came again, after %llu.",
+                ctr, a->rxctr);
+        return NULL;
+    }
+    if( (out=malloc(clen + 1)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() opening buffer!");
+        return NULL;
+    }
+
+    ok = (ctx=EVP_CIPHER_CTX_new()) != NULL &&
+        EVP_DecryptInit_ex(ctx, aead_evp(a->cipher), NULL, a->rx, iv) == 1 &&
+        EVP_DecryptUpdate(ctx, out, &n, p + 8, clen) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN,
+                            (void *)(p + 8 + clen)) == 1 &&
+        EVP_DecryptFinal_ex(ctx, out + n, &n) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+
+    if( !ok ) {
+        lprintf(log, WARN, "Sealed batch %llu did not authenticate.", ctr);
+        free(out);
+        return NULL;
+    }
+    a->rxctr = ctr;
+    *outlen = clen;
+    return (char *)out;
+}
@@ -22,7 +22,9 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #undef __EI
 #include "clidata.h"
@@ -30,6 +32,16 @@
 #include "common.h"
 #include "iprange.h"
 
+int mac_ok( const char *macaddr )
+{
+    int i;
+
+    for( i = 0; i < 12; i++ ) {
+        if( !isxdigit((unsigned char)macaddr[i]) ) return 0;
+    }
+    return macaddr[i] == '\0';
+}
+
 /*
  * Pass in a MAC address, and get_clidata() returns the data for the client
  * with that MAC address, or NULL if it does not exist.
@@ -89,6 +101,29 @@ clidata_t *add_clidata( clidata_list_t *list, char *macaddr )
     return c;
 }
 
+int drop_chan( clidata_list_t *list, int *chan, int fd )
+{
+    int rc;
+
+    /* under the lock, so replace_chan() never sees it after it is closed */
+    pthread_mutex_lock(&list->lock);
+    if( (rc = *chan == fd) ) *chan = -1;
+    pthread_mutex_unlock(&list->lock);
+    return rc;
+}
+
+void replace_chan( clidata_list_t *list, int *chan )
+{
+    pthread_mutex_lock(&list->lock);
+    if( *chan != -1 ) {
+        lprintf(log, WARN, "Client channel on fd #%d appears to be "
+                "connected already. Dropping old.", *chan);
+        shutdown(*chan, SHUT_RDWR);
+        *chan = -1;
+    }
+    pthread_mutex_unlock(&list->lock);
+}
+
 /*
  * Takes a pointer-pointer to a clidata_t and deletes the clidata_t from the
  * list it's in. free()s the clidata_t after it has been removed.
@@ -136,10 +171,17 @@ void remove_clidata( clidata_list_t *list, char *macaddr )
         close(tmp->tunfd);
         tmp->tunfd = -1;
     }
+    /* the streams send on sendq until they are reset */
+    pep_destroy(&tmp->pep);
     dprintf(log, DEBUG, "destroying sendq");
     if( tmp->sendq ) q_destroy(&tmp->sendq);
     dprintf(log, DEBUG, "destroying recvq");
     if( tmp->recvq ) q_destroy(&tmp->recvq);
+    rtx_destroy(&tmp->rtx);
+    fr_destroy(&tmp->fr);
+    shape_free(&tmp->shape_tx);
+    shape_free(&tmp->shape_rx);
+    lat_free(&tmp->lat);
     dprintf(log, DEBUG, "freeing iprange list");
     free_iprange_list(&tmp->iprange);
     dprintf(log, DEBUG, "freeing clidata struct itself");
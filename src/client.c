@@ -34,17 +34,31 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <time.h>
 #include <limits.h> /* path max */
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <semaphore.h> /* posix semaphores */
 
+#include "aead.h"
 #include "client.h"
 #include "common.h"
+#include "frame.h"
 #include "http.h"
+#include "lat.h"
+#include "pep.h"
 #include "queue.h"
+#include "rtx.h"
+#include "tls.h"
 #include "tun.h"
 #include "util.h"
+#include "websock.h"
+#include "zbatch.h"
 
 #define SERVER_ACK_WAIT 1
 #define SERVER_MAX_RETRIES 4
@@ -57,94 +71,134 @@ static int restart_connection = 0;
 static pthread_mutex_t restart_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t restart_cond = PTHREAD_COND_INITIALIZER;
 
+/* The WebSocket channel, shared by the ws reader and writer threads */
+static int ws_sock = -1;
+static pthread_mutex_t ws_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ws_cond = PTHREAD_COND_INITIALIZER;
+
 /********************************************************************
  *** General IO Utility routines
  ********************************************************************/
 
 /*
- * Sends a request of the passed-in type, which can be one of P2_CS P2_CR P2_R
- * P2_S P1_S P1_P P2_F P1_F P1_CS. Writes to tye passed-in filedes fd.
- * Takes a variable number of arguments. You need to pass in all arguments
- * that the function cannot figure out on its own (such as config struct
- * values), in the order they appear in the message. Usually this will only
- * be the content length.
+ * The request header templates, rendered once per session by
+ * render_requests() so that only the Content-Length is filled in per request.
  */
-static inline int send_req( int fd, int type, ... ) {
-    va_list ap;
-    char msg[3] = {0}, *reqname;
-    int contentlen = 2;
-    int rc = 0;
-    short port = ntohs(config->u.c.server_ports[0]);
-    int error = 0;
+static char req_head[P2_F+1][HTTP_REQUESTLINE_MAX];
+static http_tmpl_t req_tmpl[P2_F+1];
 
-    va_start(ap, type);
+/*
+ * The session token the server gave us. It is sent back on every connect so
+ * that the server keeps our IPs and whatever it has queued for us.
+ */
+static char session[SESSION_TOKEN_LEN+1];
 
-    switch(type) {
-        case P1_CS:
-            contentlen = va_arg(ap, int);
-            reqname = "CP1";
-            break;
-        case P1_S:
-        case P2_S:
-            contentlen = va_arg(ap, int);
-            reqname = "S";
-            break;
-        case P1_P:
-            strcpy(msg, ":)");
-            reqname = "P";
-            break;
-        case P1_F:
-        case P2_F:
-            strcpy(msg, ":(");
-            reqname = "F";
-            break;
-        case P2_CS:
-            contentlen = va_arg(ap, int);
-            reqname = "CP2";
-            break;
-        case P2_CR:
-            port = ntohs(config->u.c.server_ports[1]);
-            contentlen = va_arg(ap, int);
-            reqname = "CR";
-            break;
-        case P2_R:
-            port = ntohs(config->u.c.server_ports[1]);
-            contentlen = va_arg(ap, int);
-            reqname = "R";
-            break;
-        default:
-            lprintf(log, ERROR, "send_req() passed invalid message type.");
-            return -1;
-    }
+/* the tun MTU agreed with the server */
+static int tun_mtu;
+
+/* the nonce sent with the last connect, which new keys are derived from,
+ * and when it was sent */
+static unsigned char crypt_nonce[AEAD_NONCE_LEN];
+static unsigned long crypt_time;
 
-    dprintf(log, DEBUG, "Sending: "
-          "POST http://%s:%d/%s HTTP/1.0\r\n", config->u.c.server_ip_str, port, reqname);
-    rc = fdprintf(fd, 
-          "POST http://%s:%d/%s HTTP/1.0\r\n", config->u.c.server_ip_str, port, reqname);
-    if ( rc < 0 ) error = -1;
+/*
+ * The batches sent and not acked yet, and the last one the server sent us.
+ * Servers that hand out a session token number and ack batches too.
+ */
+static rtx_t *rtx;
+
+/*
+ * the frames sent and taken with protocol 3, kept like rtx, and whether the
+ * server agreed to it on the current channel
+ */
+static fr_t *fr;
+static int framed;
 
+/* carries the REDIRECTed TCP connections in split_tcp mode */
+static pep_t *pep;
 
-    if( *config->u.c.base64_user_pass ) {
-        dprintf(log, DEBUG, "Sending: "
-              "%s%s\r\n", HDR_PROXY_AUTH, config->u.c.base64_user_pass);
-        rc = fdprintf(fd, 
-              "%s%s\r\n", HDR_PROXY_AUTH, config->u.c.base64_user_pass);
-        if ( rc < 0 ) error = -1;
-    }
+/* where the packets spend their time, logged on SIGUSR1 */
+static lat_t *lat;
+#define use_rtx() (*session != '\0')
 
-    dprintf(log, DEBUG, "Sending: "
-        HDR_PROXY_CONNECTION "%s\r\n" HDR_CONTENT_LENGTH "%d\r\n" "\r\n" "%s",
-        ((type == P1_F || type == P2_F) ? "Close" : "Keep-Alive"), contentlen, msg);
-    rc = fdprintf(fd, 
-        HDR_PROXY_CONNECTION "%s\r\n" HDR_CONTENT_LENGTH "%d\r\n" "\r\n" "%s",
-        ((type == P1_F || type == P2_F) ? "Close" : "Keep-Alive"), contentlen, msg);
-    if ( rc < 0 ) error = -1;
+/*
+ * Renders the header templates of all request types from the config.
+ * returns  0 success
+ * returns -1 if a request does not fit in its template
+ */
+static int render_requests( void )
+{
+    static const struct {
+        int type;
+        const char *uri;
+        int chan;           /* which of the server ports it goes to */
+        int close;
+        const char *body;   /* canned body, if any */
+    } reqs[] = {
+        { P1_CS, "CP1", 0, 0, ""        },
+        { P1_S,  "S",   0, 0, ""        },
+        { P1_P,  "P",   0, 0, BODY_P1_P },
+        { P1_F,  "F",   0, 1, BODY_P2_F },
+        { P2_CS, "CP2", 0, 0, ""        },
+        { P2_CR, "CR",  1, 0, ""        },
+        { P2_S,  "S",   0, 0, ""        },
+        { P2_R,  "R",   1, 0, ""        },
+        { P2_F,  "F",   0, 1, BODY_P2_F },
+    };
+    unsigned int i;
+    int n;
+
+    for( i = 0; i < sizeof(reqs)/sizeof(*reqs); i++ ) {
+        char *buf = req_head[reqs[i].type];
+        size_t len = sizeof(req_head[0]);
+
+        n = snprintf(buf, len, REQ_LINE, config->u.c.server_ip_str,
+                ntohs(config->u.c.server_ports[reqs[i].chan]), reqs[i].uri);
+        if( *config->u.c.base64_user_pass && n >= 0 && (size_t)n < len ) {
+            n += snprintf(buf + n, len - n, REQ_AUTH_LINE,
+                    config->u.c.base64_user_pass);
+        }
+        if( n >= 0 && (size_t)n < len ) {
+            n += snprintf(buf + n, len - n, "%s", reqs[i].close ?
+                    REQ_CLOSE_HEAD : REQ_KEEPALIVE_HEAD);
+        }
+        if( n < 0 || (size_t)n >= len ) {
+            lprintf(log, ERROR, "%s request header too long", reqs[i].uri);
+            return -1;
+        }
 
-    va_end(ap);
-    return error;
+        req_tmpl[reqs[i].type].head = buf;
+        req_tmpl[reqs[i].type].headlen = n;
+        req_tmpl[reqs[i].type].tail = TAIL_NONE;
+        req_tmpl[reqs[i].type].taillen = sizeof(TAIL_NONE)-1;
+        req_tmpl[reqs[i].type].body = reqs[i].body;
+        req_tmpl[reqs[i].type].bodylen = strlen(reqs[i].body);
+    }
+    return 0;
 }
-    
 
+/*
+ * Sends a request of the passed-in type, which can be one of P2_CS P2_CR P2_R
+ * P2_S P1_S P1_P P2_F P1_F P1_CS, with the len bytes at body as its body, to
+ * the passed-in filedes fd. P1_P and the F requests carry their own body;
+ * pass NULL for those.
+ *
+ * returns  0 success
+ * returns -1 failure
+ */
+static inline int send_req( int fd, int type, const char *body, int len )
+{
+    http_out_t o;
+
+    dprintf(log, DEBUG, "Sending: %.*s", (int)req_tmpl[type].headlen,
+            req_tmpl[type].head);
+    if( !use_rtx() ) return http_send(fd, &req_tmpl[type], body, len);
+
+    /* every request acks what the server sent us */
+    http_out_body(&o, &req_tmpl[type], body, len);
+    http_out_seq(&o, 0, rtx_rcvd(rtx), rtx_window(recvq), lat);
+    return http_out_send(fd, &o);
+}
 
 /*
  * creates a socket 
@@ -186,7 +240,517 @@ static inline int open_connection( struct sockaddr_in *srvaddr, int sock )
  * sends shutdown headers to server
  * returns status of socket write
  */
-#define send_shutdown(sock) send_req((sock), P2_F)
+#define send_shutdown(sock) send_req((sock), P2_F, NULL, 0)
+
+/********************************************************************
+ *** Proxy pool
+ ********************************************************************/
+
+/* The channels a proxy can be carrying: chan1 (or the WebSocket), chan2 */
+#define CHAN_1 0
+#define CHAN_2 1
+#define NCHANS 2
+
+/* How much dearer a proxy looks when it carries the other channel already */
+#define PROXY_SHARE_PENALTY 2
+/* The throughput (bytes per second) that halves what a proxy costs */
+#define PROXY_RATE_REF (1024*1024)
+/* A failing proxy is left alone for up to this many reconnect_sleep_sec */
+#define PROXY_MAX_BACKOFF 8
+/* Throughput is counted over about this many seconds */
+#define PROXY_RATE_WINDOW 60
+
+/*
+ * What we know about each proxy. Channels go to the proxy that costs the
+ * least, by its round trip time, how often it failed lately and how much
+ * it carried, and proxies that just failed are left alone for a while.
+ */
+typedef struct {
+    struct sockaddr_in addr;
+    char host[DNS_NAME_MAX];
+    long srtt;              /* smoothed handshake time in msec, 0 if none */
+    double err;             /* smoothed failure rate, 0 to 1 */
+    unsigned long long bytes; /* carried since 'since' */
+    time_t since;
+    int fails;              /* failures in a row */
+    time_t down_until;      /* left alone until then */
+} proxy_t;
+
+static proxy_t proxies[MAX_PROXIES];
+static int nproxies = 0;
+static int chan_proxy[NCHANS] = { -1, -1 };
+static int chan_fd[NCHANS] = { -1, -1 };
+static pthread_mutex_t proxy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* set if the channels talk TLS to the server */
+static SSL_CTX *tls_ctx;
+
+static inline long long now_msec( void )
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static inline const char *proxy_name( int px )
+{
+    return proxies[px].host;
+}
+
+static inline void spares_drop( void );
+
+/*
+ * (re)reads the proxy list from the config. Proxies that stay keep what
+ * we know about them.
+ */
+static void proxy_pool_load( void )
+{
+    struct client_config *c = &config->u.c;
+    proxy_t old[MAX_PROXIES];
+    struct in_addr addr;
+    int nold, i, j;
+
+    pthread_mutex_lock(&proxy_mutex);
+    memcpy(old, proxies, sizeof(old));
+    nold = nproxies;
+
+    memset(proxies, 0, sizeof(proxies));
+    for( nproxies = 0; nproxies <= c->nr_extra_proxies; nproxies++ ) {
+        proxy_t *p = &proxies[nproxies];
+
+        p->addr.sin_family = AF_INET;
+        if( nproxies == 0 ) {
+            p->addr.sin_addr.s_addr = c->proxy_ip.s_addr;
+            p->addr.sin_port = c->proxy_port;
+            strcpy(p->host, c->proxy_host);
+        } else {
+            p->addr.sin_addr.s_addr = c->extra_proxies[nproxies-1].ip.s_addr;
+            p->addr.sin_port = c->extra_proxies[nproxies-1].port;
+            strcpy(p->host, c->extra_proxies[nproxies-1].host);
+        }
+        if( *p->host == '\0' ) strcpy(p->host, inet_ntoa(p->addr.sin_addr));
+        p->since = time(NULL);
+
+        for( j = 0; j < nold; j++ ) {
+            if( strcmp(old[j].host, p->host) == 0 &&
+                old[j].addr.sin_port == p->addr.sin_port ) {
+                *p = old[j];
+                break;
+            }
+        }
+    }
+    for( i = 0; i < NCHANS; i++ ) chan_proxy[i] = -1;
+    pthread_mutex_unlock(&proxy_mutex);
+
+    /* have the names looked up, and kept fresh, from now on */
+    for( i = 0; i < nproxies; i++ ) dns_lookup(proxies[i].host, &addr, 0);
+
+    /* the spares may go to proxies no longer on the list */
+    spares_drop();
+}
+
+/* what using proxy px for chan would cost, lower is better */
+static double proxy_cost( int px, int chan, time_t now )
+{
+    proxy_t *p = &proxies[px];
+    double cost, rate;
+    int i;
+
+    /* a proxy never measured is tried before one known to be slow */
+    cost = (p->srtt ? p->srtt : 1) * (1 + 4 * p->err);
+    rate = (double)p->bytes / max(now - p->since, 1);
+    cost /= 1 + rate / PROXY_RATE_REF;
+
+    for( i = 0; i < NCHANS; i++ ) {
+        if( i != chan && chan_proxy[i] == px ) cost *= PROXY_SHARE_PENALTY;
+    }
+    return cost;
+}
+
+/*
+ * picks the proxy for chan (-1 for a spare): the cheapest one that is not
+ * being left alone, or if all are, the one that is back soonest.
+ * Call with proxy_mutex held.
+ */
+static int proxy_pick( int chan )
+{
+    time_t now = time(NULL);
+    double cost, best = 0;
+    int px, pick = -1;
+
+    for( px = 0; px < nproxies; px++ ) {
+        if( proxies[px].down_until > now ) continue;
+        cost = proxy_cost(px, chan, now);
+        if( pick == -1 || cost < best ) {
+            best = cost;
+            pick = px;
+        }
+    }
+    if( pick != -1 ) return pick;
+
+    for( px = 0; px < nproxies; px++ ) {
+        if( pick == -1 || proxies[px].down_until < proxies[pick].down_until )
+            pick = px;
+    }
+    return pick;
+}
+
+/* records how proxy px did; ms is the round trip time if it worked */
+static void proxy_report_px( int px, int ok, long ms )
+{
+    proxy_t *p;
+    int backoff = 0;
+
+    if( px < 0 ) return;
+
+    pthread_mutex_lock(&proxy_mutex);
+    p = &proxies[px];
+    if( ok ) {
+        p->srtt = p->srtt ? (7 * p->srtt + ms) / 8 : max(ms, 1);
+        p->err *= 0.75;
+        p->fails = 0;
+        p->down_until = 0;
+    } else {
+        p->err = p->err * 0.75 + 0.25;
+        p->fails++;
+        backoff = max(config->u.c.reconnect_sleep_sec, 1) *
+            min(p->fails, PROXY_MAX_BACKOFF);
+        /* with only one proxy there is nothing to steer to */
+        if( nproxies > 1 ) p->down_until = time(NULL) + backoff;
+    }
+    pthread_mutex_unlock(&proxy_mutex);
+
+    if( !ok && nproxies > 1 ) {
+        lprintf(log, WARN, "proxy %s failed, avoiding it for %d sec",
+                proxy_name(px), backoff);
+    }
+}
+
+/* records how the proxy carrying chan did */
+static inline void proxy_report( int chan, int ok, long ms )
+{
+    proxy_report_px(chan_proxy[chan], ok, ms);
+}
+
+/*
+ * the proxy carrying chan dropped it. That counts against it, but it is
+ * not left alone for it, a reconnect through it usually works.
+ */
+static void proxy_lost( int chan )
+{
+    int px;
+
+    pthread_mutex_lock(&proxy_mutex);
+    if( (px=chan_proxy[chan]) >= 0 ) {
+        proxies[px].err = proxies[px].err * 0.75 + 0.25;
+    }
+    chan_proxy[chan] = -1;
+    chan_fd[chan] = -1;
+    pthread_mutex_unlock(&proxy_mutex);
+}
+
+/* counts len bytes carried over the channel on fd towards its throughput */
+static void proxy_bytes( int fd, size_t len )
+{
+    proxy_t *p;
+    time_t now;
+    int i;
+
+    pthread_mutex_lock(&proxy_mutex);
+    for( i = 0; i < NCHANS; i++ ) {
+        if( chan_fd[i] != fd || chan_proxy[i] < 0 ) continue;
+        p = &proxies[chan_proxy[i]];
+        now = time(NULL);
+        if( now - p->since > PROXY_RATE_WINDOW ) {
+            p->bytes /= 2;
+            p->since = now - PROXY_RATE_WINDOW / 2;
+        }
+        p->bytes += len;
+        break;
+    }
+    pthread_mutex_unlock(&proxy_mutex);
+}
+
+/********************************************************************
+ *** Spare proxy connections
+ ********************************************************************/
+
+/* The most spares kept, and how long one may sit idle unless configured */
+#define SPARE_MAX 4
+#define SPARE_MAX_IDLE 20
+
+/*
+ * Connected but unused sockets to the proxies, so that a lost channel can
+ * be replaced without waiting for a TCP handshake first. The keeper thread
+ * tops them up and replaces them before the proxy would time them out.
+ */
+static struct {
+    int fd;
+    int px;                 /* which proxy it goes to */
+    time_t since;
+} spares[SPARE_MAX];
+static int nspares = 0;
+static pthread_t spare_tid;
+static int spare_running = 0;
+static pthread_mutex_t spare_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spare_cond = PTHREAD_COND_INITIALIZER;
+
+static inline int spare_idle_max( void )
+{
+    return config->u.c.spare_max_idle_sec > 0 ?
+        config->u.c.spare_max_idle_sec : SPARE_MAX_IDLE;
+}
+
+/*
+ * a spare is no good once the proxy has closed it or sent something on it,
+ * and nothing is expected before we send a request
+ */
+static inline int spare_alive( int fd, time_t since )
+{
+    struct pollfd pfd;
+
+    if( time(NULL) - since >= spare_idle_max() ) return 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/* closes all spares */
+static inline void spares_drop( void )
+{
+    pthread_mutex_lock(&spare_mutex);
+    while( nspares > 0 ) close(spares[--nspares].fd);
+    pthread_mutex_unlock(&spare_mutex);
+}
+
+/* opens a fresh connection to proxy px, returns the socket or -1 */
+static int proxy_open( int px, int fastopen )
+{
+    struct sockaddr_in proxy_addr;
+    int sock;
+
+    pthread_mutex_lock(&proxy_mutex);
+    proxy_addr = proxies[px].addr;
+    pthread_mutex_unlock(&proxy_mutex);
+
+    /* the name may point somewhere else by now. Never wait for it, the
+     * address we had will do until the cache knows */
+    if( dns_lookup(proxies[px].host, &proxy_addr.sin_addr, 0) == 0 ) {
+        pthread_mutex_lock(&proxy_mutex);
+        proxies[px].addr.sin_addr = proxy_addr.sin_addr;
+        pthread_mutex_unlock(&proxy_mutex);
+    }
+
+    if( (sock=create_socket()) < 0 ) return -1;
+
+    /* with TCP_FASTOPEN_CONNECT connect() returns at once, and the SYN
+     * goes out with the request */
+    if( fastopen ) {
+#ifdef TCP_FASTOPEN_CONNECT
+        int one = 1;
+
+        if( setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one,
+                    sizeof(one)) == -1 ) {
+            dprintf(log, DEBUG, "TCP_FASTOPEN_CONNECT: %s", strerror(errno));
+        }
+#endif
+    }
+
+    if( open_connection(&proxy_addr, sock) < 0 ) {
+        close(sock);
+        proxy_report_px(px, 0, 0);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * asks the proxy on sock for a tunnel to the server port of chan
+ * returns 0 once the proxy agrees, -1 on failure
+ */
+static int proxy_tunnel( int sock, int chan )
+{
+    char buf[1024];
+    short port = ntohs(config->u.c.server_ports[chan]);
+    int i, done = 0;
+
+    i = snprintf(buf, sizeof(buf), REQ_CONNECT, config->u.c.server_ip_str,
+            port, config->u.c.server_ip_str, port);
+    if( *config->u.c.base64_user_pass ) {
+        i += snprintf(buf + i, sizeof(buf) - i, REQ_AUTH_LINE,
+                config->u.c.base64_user_pass);
+    }
+    i += snprintf(buf + i, sizeof(buf) - i, "\r\n");
+    if( write(sock, buf, i) != i ) {
+        lprintf(log, WARN, "failed to send CONNECT: %s", strerror(errno));
+        return -1;
+    }
+
+    /* a byte at a time, whatever comes after the header is the server's */
+    for( i = 0; !done && i < (int)sizeof(buf) - 1; i++ ) {
+        if( read(sock, buf + i, 1) != 1 ) break;
+        done = i >= 3 && !memcmp(buf + i - 3, "\r\n\r\n", 4);
+    }
+    buf[i] = '\0';
+
+    if( !done || strncmp(buf, "HTTP/1.", 7) || atoi(buf + 9) != 200 ) {
+        lprintf(log, WARN, "proxy refused CONNECT: %.*s",
+                (int)strcspn(buf, "\r\n"), buf);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * makes a TLS connection to the server for chan on fd, through a CONNECT
+ * if the config says so. fd is closed on failure
+ * returns the descriptor to use from now on, or -1 on failure
+ */
+static int tls_channel( int fd, int chan )
+{
+    int tfd = -1;
+
+    if( config->u.c.tls != TLS_CONNECT || proxy_tunnel(fd, chan) == 0 ) {
+        tfd = tls_connect(tls_ctx, fd, config->u.c.server_ip_str);
+    }
+    if( tfd < 0 ) close(fd);
+    return tfd;
+}
+
+/*
+ * returns a connection to the best proxy for chan, a spare one if there is
+ * one that is still good, else a fresh one. With tls the handshake is made
+ * on it before it is returned. Proxies that cannot be reached
+ * are passed over for the next best.
+ * returns -1 on failure
+ */
+static int proxy_connect( int chan )
+{
+    int fd = -1, px = -1, i, tries;
+    time_t since;
+
+    for( tries = 0; fd < 0 && tries < nproxies; tries++ ) {
+        pthread_mutex_lock(&proxy_mutex);
+        px = proxy_pick(chan);
+        pthread_mutex_unlock(&proxy_mutex);
+
+        pthread_mutex_lock(&spare_mutex);
+        for( i = nspares - 1; i >= 0 && fd < 0; i-- ) {
+            if( spares[i].px != px ) continue;
+            fd = spares[i].fd;
+            since = spares[i].since;
+            spares[i] = spares[--nspares];
+            if( !spare_alive(fd, since) ) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        pthread_cond_signal(&spare_cond);
+        pthread_mutex_unlock(&spare_mutex);
+
+        if( fd >= 0 ) {
+            dprintf(log, DEBUG, "using spare connection fd #%d", fd);
+        } else {
+            fd = proxy_open(px, config->u.c.tcp_fastopen);
+        }
+        if( fd >= 0 && tls_ctx ) fd = tls_channel(fd, chan);
+    }
+
+    pthread_mutex_lock(&proxy_mutex);
+    chan_proxy[chan] = fd < 0 ? -1 : px;
+    chan_fd[chan] = fd;
+    pthread_mutex_unlock(&proxy_mutex);
+
+    if( fd >= 0 && nproxies > 1 ) {
+        lprintf(log, INFO, "channel %d goes through proxy %s:%d", chan + 1,
+                proxy_name(px), ntohs(proxies[px].addr.sin_port));
+    }
+    return fd;
+}
+
+static void spare_unlock( void *unused )
+{
+    unused = unused;
+    pthread_mutex_unlock(&spare_mutex);
+}
+
+/*
+ * thread
+ *
+ * keeps spare_connections idle connections to the best proxies open
+ */
+static void *spare_keeper( void *unused )
+{
+    struct timespec ts;
+    int i, fd, px, want;
+
+    unused = unused;
+
+    for(;;) {
+        /* let go of the spares the proxy closed or is about to. poll()
+         * may be a cancellation point, so not while holding the lock */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&spare_mutex);
+        for( i = 0; i < nspares; ) {
+            if( spare_alive(spares[i].fd, spares[i].since) ) {
+                i++;
+                continue;
+            }
+            close(spares[i].fd);
+            spares[i] = spares[--nspares];
+        }
+        want = min(config->u.c.spare_connections, SPARE_MAX) - nspares;
+        pthread_mutex_unlock(&spare_mutex);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+        /* connect outside the lock, so channels are not held up */
+        for( ; want > 0; want-- ) {
+            pthread_mutex_lock(&proxy_mutex);
+            px = proxy_pick(-1);
+            pthread_mutex_unlock(&proxy_mutex);
+
+            if( px < 0 || (fd=proxy_open(px, 0)) < 0 ) break;
+            pthread_mutex_lock(&spare_mutex);
+            spares[nspares].fd = fd;
+            spares[nspares].px = px;
+            spares[nspares].since = time(NULL);
+            nspares++;
+            pthread_mutex_unlock(&spare_mutex);
+        }
+
+        /* sleep until a spare is taken, or the oldest has to be replaced,
+         * or a failed connect is to be retried */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += want > 0 ? max(config->u.c.reconnect_sleep_sec, 1) :
+            (spare_idle_max() + 1) / 2;
+        pthread_mutex_lock(&spare_mutex);
+        pthread_cleanup_push(spare_unlock, NULL);
+        pthread_cond_timedwait(&spare_cond, &spare_mutex, &ts);
+        pthread_cleanup_pop(1);
+    }
+    return NULL;
+}
+
+/* starts the spare keeper if spares are wanted */
+static inline void spares_start( void )
+{
+    if( config->u.c.spare_connections <= 0 ) return;
+    if( pthread_create(&spare_tid, NULL, spare_keeper, NULL) == 0 )
+        spare_running = 1;
+}
+
+/* stops the spare keeper and closes the spares */
+static inline void spares_stop( void )
+{
+    if( spare_running ) {
+        pthread_cancel(spare_tid);
+        pthread_join(spare_tid, NULL);
+        spare_running = 0;
+    }
+    spares_drop();
+}
 
 /*
  * recieves incoming data on proxy socket, places it on the recv queue
@@ -194,44 +758,58 @@ static inline int open_connection( struct sockaddr_in *srvaddr, int sock )
  * returns  0 success
  * returns -1 failture
  */
-static inline int recv_data( int p_sock )
+static inline int recv_data( rbuf_t *rb )
 {
     int data_len, c;
-    int num;
+    int num, dup;
     char *pkt;
-    char buf[HTTP_HEADERS_MAX];
+    http_msg_t msg;
 
-    memset(buf, '\0', HTTP_HEADERS_MAX);
-
-    if( getheaders(p_sock, buf, HTTP_HEADERS_MAX-1) == -1 ) {
+    if( http_read_msg(rb, &msg) == -1 ) {
         lprintf(log, WARN, "failed to read response headers\n");
-        dprintf(log, DEBUG, "string: %s", buf);
         return -1;
     }
 
-    if( !strncmp(buf, MATCH_204_HTTP10, strlen(MATCH_204_HTTP10)) || 
-        !strncmp(buf, MATCH_204_HTTP11, strlen(MATCH_204_HTTP11)) ) { 
+    if( msg.rtx ) rtx_ack(rtx, msg.ack, msg.win);
+    lat_peer(lat, msg.ts, msg.echo, msg.held);
+
+    if( msg.status == 204 ) { 
         dprintf(log, DEBUG, "Nack returned\n");
         return 0;
     }
 
     /* If we have a 200 response, we've got data */
-    if( !strncmp(buf, MATCH_200_HTTP10, strlen(MATCH_200_HTTP10)) ||
-        !strncmp(buf, MATCH_200_HTTP11, strlen(MATCH_200_HTTP11)) ) { 
+    if( msg.status == 200 ) { 
         dprintf(log, DEBUG, "Incoming data\n");
 
         /* Get the length of the payload */
-        data_len = get_content_length(buf);
-        if( data_len == 0 ) {
+        data_len = msg.content_length;
+        if( data_len < 1 ) {
             dprintf(log, DEBUG, "Unable to get Content-Length header value.");
             return -1;
         }
 
+        if( !zbatch_allowed(&rtx->aead, msg.enc) ) {
+            lprintf(log, WARN, "server sent a batch that is not sealed\n");
+            return -1;
+        }
+
+        /* a batch we got before the server saw our ack is thrown away */
+        dup = msg.seq && rtx_dup(rtx, msg.seq);
+
         /* Keep getting data until we've reached the expected data_len */
         num = 0;
         c = 0;
+        if( msg.enc ) {
+            if( (num=zbatch_recv(rb, data_len, msg.enc, &rtx->vjrx,
+                                 &rtx->aead, dup ? NULL : recvq)) == -1 ) {
+                lprintf(log, WARN, "bad encoded batch from server\n");
+                return -1;
+            }
+            c = data_len;
+        }
         while( c < data_len ) {
-            pkt = get_packet(p_sock);
+            pkt = rb_get_packet(rb);
             if( pkt == NULL ) {
                 lprintf(log, WARN, "premature end of data stream\n");
                 return -1;
@@ -239,7 +817,9 @@ static inline int recv_data( int p_sock )
             dprintf(log, DEBUG, "pkt len: %d", iplen(pkt));
             c += iplen(pkt); /* dec data len, prevent race condition
                               * which could occur after packet is in recvq */
-            if( q_add(recvq, pkt, Q_WAIT, iplen(pkt)) == -1 ) {
+            if( dup ) {
+                free(pkt);
+            } else if( q_add(recvq, pkt, Q_WAIT, iplen(pkt)) == -1 ) {
                 lprintf(log, WARN, "insert packet, discarding\n");
             } else {
                 num++;
@@ -247,11 +827,19 @@ static inline int recv_data( int p_sock )
         }
     } else { /* The response is not a 200 */
         lprintf(log, WARN, "Bad or Error HTTP response received from server");
-        dprintf(log, DEBUG, "Error response is: %s", buf);
+        dprintf(log, DEBUG, "Error response is: %.*s", (int)msg.line.len,
+                msg.line.ptr);
         return -1;
     }
 
-    lprintf(log, INFO, "rcvd %d packets, %d bytes\n", num, c);
+    proxy_bytes(rb->fd, c);
+    if( dup ) {
+        lprintf_rl(log, INFO, "dropped resent batch %lu\n", msg.seq);
+        return 0;
+    }
+    if( msg.seq ) rtx_recv(rtx, msg.seq);
+
+    dprintf(log, DEBUG, "rcvd %d packets, %d bytes\n", num, c);
     return 0;
 }
 
@@ -262,13 +850,17 @@ static inline int recv_data( int p_sock )
  * returns -1 if no data
  * returns -2 if connection died (EPIPE)
  */
-static inline int server_ack( int p_sock, int wait )
+static inline int server_ack( rbuf_t *rb, int wait )
 {
+    int p_sock = rb->fd;
     fd_set rfds;
     struct timeval tv;
     int retval;
     char buf;
 
+    /* the response may have come in with the last one */
+    if( rb_avail(rb) ) return 0;
+
     /* Watch proxy socket to see when it has input
      * Wait up to five seconds.
      */
@@ -296,171 +888,407 @@ static inline int server_ack( int p_sock, int wait )
 }
 
 /*
- * dequeues all current data from the sendq send to proxy
+ * dequeues all current data from the sendq send to proxy, after any batch
+ * the server has not acked yet
  *
  * returns  0 success
+ * returns  1 if there was nothing to send after all
  * returns -1 failure
  */
 static inline int send_data( int p_sock )
 {
-    char *pkt;
-    int total_len = 0, len;
-    int rv, c;
+    int type = config->u.c.protocol == 1 ? P1_S : P2_S;
+    int total_len, c;
+    unsigned int t;
+    rtx_batch_t *b;
+    http_out_t o;
 
-    /* we know there is data on the queue, send it */
+    /* we know there is data on the queue, or a batch to send again */
     total_len = sendq->totsize;
 
-    dprintf(log, DEBUG, "sending HTTP headers, content len: %d",
-            total_len);
+    if( use_rtx() ) {
+        /* the batch may have been acked on the other channel meanwhile */
+        if( (b=rtx_next(rtx, sendq, total_len)) == NULL ) return 1;
+        if( b->sends > 1 ) {
+            lprintf_rl(log, INFO, "resending batch %lu", b->seq);
+        }
 
-    /* write headers */
-    if( config->u.c.protocol == 1 ) {
-        rv = send_req(p_sock, P1_S, total_len);
-        /* rv = fdprintf(p_sock, REQ_P1_S, config->u.c.server_ip_str,
-                ntohs(config->u.c.server_ports[0]), total_len); */
-    } else {
-        rv = send_req(p_sock, P2_S, total_len);
-        /* rv = fdprintf(p_sock, REQ_P2_S, config->u.c.server_ip_str,
-                ntohs(config->u.c.server_ports[0]), total_len); */
-    }
+        http_out_rtx(&o, &req_tmpl[type], b, rtx_rcvd(rtx),
+                     rtx_window(recvq), lat);
+        t = lat_now();
+        c = http_out_send(p_sock, &o);
+        lat_since(lat, LAT_SEND, t);
+        total_len = b->size;
+        if( c != -1 ) c = b->npkts;
+        rtx_put(rtx, b);
+        if( c == -1 ) {
+            lprintf(log, WARN, "#%d: sending data failed", p_sock);
+            return -1;
+        }
 
-    if( rv < 0 ) {
-        dprintf(log, DEBUG, "sending HTTP headers failed");
-        return -1;
+        proxy_bytes(p_sock, total_len);
+        dprintf(log, DEBUG, "sent %d packets, %d bytes\n",
+            c, total_len);
+        return 0;
     }
 
-    dprintf(log, DEBUG, "sent headers");
-
-    c = 0;
-    len = total_len;
-    while( total_len > 0 ) {
-        dprintf(log, DEBUG, "sending HTTP data");
+    dprintf(log, DEBUG, "sending HTTP request, content len: %d",
+            total_len);
 
-        if( (pkt = q_remove(sendq, 0, NULL) ) == NULL) {
-            lprintf(log, WARN, "premature end of sendq");
-            return -1;
-        }
-        c++;
-        total_len -= iplen(pkt);
-        if( send(p_sock, pkt, iplen(pkt), 0 ) != iplen(pkt) ) {
-            if( errno == ENOTCONN ) {
-                lprintf(log, WARN,
-                        "#%d: Client disconnected prematurely!", p_sock);
-                q_add(sendq, pkt, Q_PUSH, iplen(pkt));
-                return -1;
-            }
-        }
-        free(pkt);
+    /* headers and packets go out together */
+    t = lat_now();
+    c = http_send_queue(p_sock, &req_tmpl[type], sendq, total_len);
+    lat_since(lat, LAT_SEND, t);
+    if( c == -1 ) {
+        lprintf(log, WARN, "#%d: sending data failed", p_sock);
+        return -1;
     }
-    lprintf(log, INFO, "sent %d packets, %d bytes\n",
-        c, len);
+
+    proxy_bytes(p_sock, total_len);
+    dprintf(log, DEBUG, "sent %d packets, %d bytes\n",
+        c, total_len);
     return 0;
 }
 
-/* 
- * negotiates the desired protocol connection with the server
- * saves the peer and local ip in the config
- * returns the socket on success
- * returns -1 on error
+/*
+ * returns nonzero if we talk to the server over a WebSocket channel, which
+ * protocol 3 does as well
  */
-static inline int do_negotiate_protocol(void)
+static inline int use_websocket( void )
 {
-    struct sockaddr_in proxy_addr;
-    iprange_t *ipr = config->u.c.ipr;
-    int p_sock, rv;
-    char hdr[HTTP_HEADERS_MAX];
-    char buf[1024];
-    char *body, **content;
-    int i, len;
+    return config->u.c.websocket || config->u.c.protocol == 3;
+}
 
-    /* construct the addr */
-    memset(&proxy_addr, 0, sizeof(proxy_addr));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_addr.s_addr = config->u.c.proxy_ip.s_addr;
-    proxy_addr.sin_port = config->u.c.proxy_port;
+/*
+ * returns the batch encodings we want (see zbatch.h). WebSocket messages are
+ * not numbered batches, so they are never encoded.
+ */
+static int batch_encodings( void )
+{
+    if( use_websocket() ) return 0;
+    return (config->u.c.compress ? ZB_DEFLATE : 0) |
+        (config->u.c.compress_headers ? ZB_VJ : 0);
+}
 
-    /* open the proxy connection */
-    if(( p_sock = open_connection(&proxy_addr, create_socket())) < 0 ) {
-        return -1;
-    }
+/*
+ * creates the connect body, MAC followed by ipranges, in buf, proposing the
+ * tun MTU for the connection sock
+ * returns the length of the body
+ */
+static inline int make_connect_body( char *buf, int len, int sock )
+{
+    iprange_t *ipr = config->u.c.ipr;
+    int i;
 
-    /* create the POST body, MAC followed by ipranges */
-    i = snprintf( buf, 1024,  "%s\n", get_mac(config->u.c.if_name));
+    i = snprintf( buf, len,  "%s\n", get_mac(config->u.c.if_name));
     dprintf(log, DEBUG, "mac: \"%s\"\n",get_mac(config->u.c.if_name));
-    while( i < 1023 && ipr != NULL ) {
-        i += snprintf(buf+i, 1023 - i,  "%s/%d\n",
+    while( i < len-1 && ipr != NULL ) {
+        i += snprintf(buf+i, len-1 - i,  "%s/%d\n",
                 inet_ntoa(ipr->net), ipr->maskbits);
         ipr = ipr->next;
     }
+    if( *session && i < len-1 ) {
+        snprintf(buf+i, len-1 - i, SESSION_LINE "%s\n", session);
+    }
+
+    tun_mtu = config->tun_mtu ? tun_clip_mtu(config->tun_mtu) :
+        tun_transport_mtu(sock, !use_websocket() ? TUN_PKT_OVERHEAD :
+                          config->u.c.protocol == 3 ? TUN_FR_OVERHEAD :
+                          TUN_WS_OVERHEAD);
+    i = strlen(buf);
+    if( i < len-1 ) snprintf(buf+i, len-1 - i, MTU_LINE "%d\n", tun_mtu);
+
+    i = strlen(buf);
+    if( batch_encodings() && i < len-1 ) {
+        snprintf(buf+i, len-1 - i, COMPRESS_LINE "%s\n",
+                 zbatch_names(batch_encodings()));
+    }
+
+    i = strlen(buf);
+    if( config->u.c.protocol == 3 && i < len-1 ) {
+        snprintf(buf+i, len-1 - i, FRAMES_LINE "3\n");
+    }
+
+    i = strlen(buf);
+    if( *config->u.c.psk && i < len-1 ) {
+        char hex[2*AEAD_NONCE_LEN+1], authhex[2*AEAD_PROOF_LEN+1];
+        unsigned char auth[AEAD_PROOF_LEN];
+
+        crypt_time = time(NULL);
+        aead_random(crypt_nonce, sizeof(crypt_nonce));
+        aead_hex(hex, crypt_nonce, sizeof(crypt_nonce));
+        aead_auth(auth, config->u.c.psk, 0, get_mac(config->u.c.if_name),
+                  session, crypt_nonce, crypt_time);
+        aead_hex(authhex, auth, sizeof(auth));
+        snprintf(buf+i, len-1 - i, CRYPT_LINE "%s %s %lu %s\n",
+                 aead_name(config->u.c.cipher), hex, crypt_time, authhex);
+    }
 
     i = strlen(buf);
     dprintf(log, DEBUG, "buf len: %d i: %d str: \"%s\"\n", strlen(buf), i, buf);
+    return i;
+}
 
-    /* send the header & body */
-    if( config->u.c.protocol == 1 )
-        rv = send_req(p_sock, P1_CS, i);
-        /* rv = fdprintf(p_sock, REQ_P1_CS, config->u.c.server_ip_str,
-            ntohs(config->u.c.server_ports[0]), i);  */
-            
-    else if ( config->u.c.protocol == 2 )
-        rv = send_req(p_sock, P2_CS, i);
-        /* rv = fdprintf(p_sock, REQ_P2_CS, config->u.c.server_ip_str,
-            ntohs(config->u.c.server_ports[0]), i);  */
+/*
+ * checks the server's answer to our CRYPT_LINE, the cipher and its proof
+ * over the nonce we just sent, setting up the keys first if the session
+ * is new
+ * returns nonzero if the server knows the psk
+ */
+static int crypt_answer( char *line )
+{
+    unsigned char proof[AEAD_PROOF_LEN];
+    char *hex = strchr(line, ' ');
+    int cipher = aead_cipher(aead_name(config->u.c.cipher));
+
+    if( hex == NULL ) return 0;
+    *hex++ = '\0';
+    if( aead_cipher(line) != cipher ||
+        aead_unhex(proof, chomp(hex), sizeof(proof)) == -1 ) {
+        return 0;
+    }
+    if( !rtx->aead.cipher ) {
+        aead_setup(&rtx->aead, cipher, config->u.c.psk, session,
+                   crypt_nonce, 0);
+    }
+    return aead_auth_ok(proof, config->u.c.psk, 1,
+                        get_mac(config->u.c.if_name), session, crypt_nonce,
+                        crypt_time);
+}
 
-    if( send(p_sock, buf, i, 0) != i ) {
+/*
+ * saves the local and peer ip the server sent us in the config,
+ * the session token if there is one, and what else the server agreed to
+ * returns -1 if the batches cannot be sealed as the psk asks, else 0
+ */
+static inline int set_tun_ips( char *body )
+{
+    char **content = splitlines(body);
+    int i, sealed = 0;
+
+    snprintf(config->u.c.local_ip_str, 16, "%s", content[0]);
+    snprintf(config->u.c.peer_ip_str, 16, "%s", content[1]);
+
+    dprintf(log, DEBUG, "got ips, local: %s, peer: %s", content[0], content[1]);
+
+    config->u.c.local_ip.s_addr = inet_addr(config->u.c.local_ip_str);
+    config->u.c.peer_ip.s_addr = inet_addr(config->u.c.peer_ip_str);
+
+    if( content[2] && strlen(chomp(content[2])) == SESSION_TOKEN_LEN ) {
+        if( strcmp(session, content[2]) ) {
+            lprintf(log, INFO, "server started a new session");
+            strcpy(session, content[2]);
+            /* the server has forgotten our batches, and starts over */
+            rtx_reset(rtx);
+            fr_reset(fr);
+        } else {
+            /* the frames it did not ack go again */
+            fr_resume(fr);
+        }
+    }
+
+    /* older servers do not answer, then what we proposed stands, and
+     * batches go out as they are */
+    rtx->enc = 0;
+    framed = 0;
+    for( i = 3; content[2] && content[i]; i++ ) {
+        if( !strncmp(content[i], MTU_LINE, sizeof(MTU_LINE)-1) ) {
+            tun_mtu = tun_clip_mtu(atoi(content[i] + sizeof(MTU_LINE)-1));
+        } else if( !strncmp(content[i], COMPRESS_LINE,
+                            sizeof(COMPRESS_LINE)-1) ) {
+            rtx->enc = batch_encodings() &
+                zbatch_parse(content[i], strlen(content[i]));
+        } else if( !strncmp(content[i], FRAMES_LINE, sizeof(FRAMES_LINE)-1) ) {
+            framed = config->u.c.protocol == 3 &&
+                atoi(content[i] + sizeof(FRAMES_LINE)-1) == 3;
+        } else if( !strncmp(content[i], CRYPT_LINE, sizeof(CRYPT_LINE)-1) ) {
+            sealed = *config->u.c.psk &&
+                crypt_answer(content[i] + sizeof(CRYPT_LINE)-1);
+        }
+    }
+    if( *config->u.c.psk ) {
+        if( !sealed ) {
+            lprintf(log, WARN, "server does not know our psk");
+            free(content);
+            return -1;
+        }
+        rtx->enc |= ZB_AEAD;
+    }
+    if( rtx->enc ) {
+        lprintf(log, INFO, "batches are encoded: %s", zbatch_names(rtx->enc));
+    }
+    if( config->u.c.protocol == 3 && !framed ) {
+        lprintf(log, WARN, "server does not speak protocol 3, "
+                "using plain WebSocket messages");
+    }
+
+    free(content);
+    return 0;
+}
+
+/* 
+ * negotiates the desired protocol connection with the server
+ * saves the peer and local ip in the config
+ * points rb at the new socket
+ * returns the socket on success
+ * returns -1 on error
+ */
+static inline int do_negotiate_protocol( rbuf_t *rb )
+{
+    int p_sock, rv;
+    http_msg_t msg;
+    char buf[1024];
+    char *body;
+    long len;
+    int i;
+
+    /* open the proxy connection, or take a spare one */
+    if(( p_sock = proxy_connect(CHAN_1)) < 0 ) {
+        return -1;
+    }
+    rb_reset(rb, p_sock);
+
+    /* create the POST body, MAC followed by ipranges */
+    i = make_connect_body(buf, sizeof(buf), p_sock);
+
+    /* send the header & body */
+    rv = send_req(p_sock, config->u.c.protocol == 1 ? P1_CS : P2_CS, buf, i);
+    if( rv < 0 ) {
         lprintf(log, WARN, "failed to send post\n" );
     }
 
     /* await the response */
-    memset(hdr, '\0', HTTP_HEADERS_MAX);
-
     dprintf(log, DEBUG, "waiting for response\n");
 
-    if( getheaders(p_sock, hdr, HTTP_HEADERS_MAX-1) == -1 ) {
+    if( http_read_msg(rb, &msg) == -1 ) {
         lprintf(log, WARN, "failed to read response headers\n");
-        dprintf(log, DEBUG, "string: %s", hdr);
         return -1;
     }
 
     dprintf(log, DEBUG, "got response headers");
 
-    if( !strncmp(hdr, RESPONSE_204, strlen(RESPONSE_204)) ) { 
+    if( msg.status == 204 ) { 
         dprintf(log, DEBUG, "Nack returned\n");
         return -1;
     }
 
-    if( strncmp(hdr, MATCH_200_HTTP10, strlen(MATCH_200_HTTP10)) != 0 &&
-        strncmp(hdr, MATCH_200_HTTP11, strlen(MATCH_200_HTTP11)) != 0 ) {
-        char *cp = strchr(hdr, '\n');
-
-        if( cp ) *cp = '\0';
-
+    if( msg.status != 200 ) {
         lprintf(log, WARN, "Received unknown error response from proxy or server:");
-        lprintf(log, WARN, "  %s", hdr);
+        lprintf(log, WARN, "  %.*s", (int)msg.line.len, msg.line.ptr);
         return -1;
     }
 
-    if( (body = getbody(p_sock, hdr, &len)) == NULL ) {
+    if( (body = getbody(rb, &msg, &len)) == NULL ) {
         dprintf(log, DEBUG, "reading body failed\n");
         return -1;
     }
 
     /* now get the ips */
-    content = splitlines(body);
-     
-    snprintf(config->u.c.local_ip_str, 16, "%s", content[0]);
-    snprintf(config->u.c.peer_ip_str, 16, "%s", content[1]);
+    if( set_tun_ips(body) == -1 ) {
+        free(body);
+        close(p_sock);
+        return -1;
+    }
 
-    dprintf(log, DEBUG, "got ips, local: %s, peer: %s", content[0], content[1]);
+    /* clean up */
+    free(body);
 
-    config->u.c.local_ip.s_addr = inet_addr(config->u.c.local_ip_str);
-    config->u.c.peer_ip.s_addr = inet_addr(config->u.c.peer_ip_str);
+    return p_sock;
+}
 
-    /* clean up */
-    free(content);
+/* 
+ * negotiates a WebSocket channel with the server: upgrades a GET through
+ * the proxy, then exchanges the connect body and ips as messages
+ * saves the peer and local ip in the config
+ * returns the socket on success
+ * returns -1 on error
+ */
+static inline int do_negotiate_websocket( rbuf_t *rb )
+{
+    int p_sock, opcode;
+    http_msg_t msg;
+    char buf[2048];
+    char key[WS_KEY_LEN+1], accept[WS_ACCEPT_LEN+1];
+    char *body;
+    short port = ntohs(config->u.c.server_ports[0]);
+    size_t len;
+    int i;
+
+    /* open the proxy connection, or take a spare one */
+    if(( p_sock = proxy_connect(CHAN_1)) < 0 ) {
+        return -1;
+    }
+    rb_reset(rb, p_sock);
+
+    ws_make_key(key);
+    ws_accept_key(key, accept);
+
+    /* the server address, key and credentials always fit in buf */
+    i = snprintf(buf, sizeof(buf), REQ_WS_UPGRADE, config->u.c.server_ip_str,
+            port, config->u.c.server_ip_str, port, key);
+    if( *config->u.c.base64_user_pass ) {
+        i += snprintf(buf + i, sizeof(buf) - i, REQ_AUTH_LINE,
+                config->u.c.base64_user_pass);
+    }
+    i += snprintf(buf + i, sizeof(buf) - i, "\r\n");
+    if( send(p_sock, buf, i, 0) != i ) {
+        lprintf(log, WARN, "failed to send upgrade request\n" );
+        goto err;
+    }
+
+    /* await the response */
+    if( http_read_msg(rb, &msg) == -1 ) {
+        lprintf(log, WARN, "failed to read response headers\n");
+        goto err;
+    }
+
+    if( msg.status != 101 ) {
+        lprintf(log, WARN, "WebSocket upgrade refused by proxy or server:");
+        lprintf(log, WARN, "  %.*s", (int)msg.line.len, msg.line.ptr);
+        goto err;
+    }
+
+    if( msg.ws_accept.len != WS_ACCEPT_LEN ||
+        memcmp(msg.ws_accept.ptr, accept, WS_ACCEPT_LEN) != 0 ) {
+        lprintf(log, WARN, "Server sent a bad WebSocket accept key");
+        goto err;
+    }
+
+    /* the first message carries what the POST body would */
+    i = make_connect_body(buf, sizeof(buf), p_sock);
+    if( ws_send_frame(p_sock, WS_OP_BIN, buf, i, 1) == -1 ) goto err;
+
+    if( (body = ws_recv_message(rb, &opcode, &len, 0)) == NULL ) {
+        dprintf(log, DEBUG, "reading ips failed\n");
+        goto err;
+    }
+
+    /* now get the ips */
+    i = set_tun_ips(body);
     free(body);
+    if( i == -1 ) goto err;
 
     return p_sock;
+
+err:
+    close(p_sock);
+    rb_reset(rb, -1);
+    return -1;
+}
+
+/*
+ * negotiates whichever channel the config asks for
+ */
+static inline int negotiate( rbuf_t *rb )
+{
+    long long start = now_msec();
+    int sock;
+
+    if( use_websocket() ) sock = do_negotiate_websocket(rb);
+    else sock = do_negotiate_protocol(rb);
+
+    proxy_report(CHAN_1, sock >= 0, now_msec() - start);
+    return sock;
 }
 
 /*
@@ -470,16 +1298,18 @@ static inline int do_negotiate_protocol(void)
  * if they differ, returns -1,
  * if unable to re-establish connection returns -2
  */
-static inline int restablish_connection( int sock )
+static inline int restablish_connection( rbuf_t *rb )
 {
+    int sock;
     struct in_addr old_local_ip;
     struct in_addr old_peer_ip;
 
     old_local_ip.s_addr  = config->u.c.local_ip.s_addr;
     old_peer_ip.s_addr  = config->u.c.peer_ip.s_addr;
 
-    close(sock);
-    sock = do_negotiate_protocol();
+    proxy_lost(CHAN_1);
+    close(rb->fd);
+    sock = negotiate(rb);
     if( sock < 0 ) {
         lprintf(log, FATAL, "Unable to reopen send channel " 
                 "with server %s\n", config->u.c.server_ip_str);
@@ -511,6 +1341,40 @@ static inline int restablish_connection( int sock )
  *** Tunfile reader and writer, service the send and recv queues
  ********************************************************************/
 
+/* pure ACKs that a newer one replaced on the sendq */
+static unsigned long acks_thinned;
+
+/*
+ * Queues a packet from the tun device, in place of a pure ACK it makes
+ * redundant if thin_acks is on. A TCP segment that is still queued from
+ * before is dropped. Returns what q_add() does.
+ */
+static int sendq_add( char *pkt, int flags )
+{
+    void *old;
+    int rc;
+
+    if( tun_is_segment(pkt) ) {
+        if( (rc=q_add_unique(sendq, pkt, pktlen(pkt), tun_same_segment)) == 1 ) {
+            dprintf(log, DEBUG, "dropped a retransmission still queued");
+            free(pkt);
+            rc = 0;
+        }
+        return rc;
+    }
+    if( !config->u.c.thin_acks || !tun_pure_ack(pkt) ) {
+        return q_add(sendq, pkt, flags, pktlen(pkt));
+    }
+    if( q_replace(sendq, pkt, pktlen(pkt), tun_ack_supersedes, &old) != 0 ) {
+        return -1;
+    }
+    if( old ) {
+        acks_thinned++;
+        free(old);
+    }
+    return 0;
+}
+
 /* 
  * thread
  *
@@ -519,6 +1383,7 @@ static inline int restablish_connection( int sock )
 static void *tunfile_reader( void *tunfd )
 {
     int fd = *((int*)tunfd);
+    unsigned int t;
     char *pkt;
 
     dprintf(log, DEBUG, "starting...");
@@ -529,13 +1394,22 @@ static void *tunfile_reader( void *tunfd )
             lprintf(log, INFO, "get_packet failed, quitting");
             return NULL;
         }
+        t = lat_now();
+
+        dprintf(log, DEBUG, "got packet: %d",pktlen(pkt));
 
-        dprintf(log, DEBUG, "got packet: %d",iplen(pkt));
+        /* only protocol 3 frames tell the server what else a packet is */
+        if( pi_proto(pkt) != PI_IPV4 && !framed ) {
+            free(pkt);
+            continue;
+        }
+        tun_clamp_mss(pkt, tun_mtu);
 
-        if( q_add(sendq, pkt, Q_WAIT, iplen(pkt)) != 0 ) {
+        if( sendq_add(pkt, Q_WAIT) != 0 ) {
             lprintf(log, INFO, "q_add failed, quitting");
             return NULL;
         }
+        lat_since(lat, LAT_TUN, t);
 
         dprintf(log, DEBUG, "inserted packed into queue");
     }
@@ -549,6 +1423,7 @@ static void *tunfile_reader( void *tunfd )
 static void *tunfile_writer( void *tunfd )
 {
     int fd = *((int*)tunfd);
+    unsigned int t;
     char *data;
 
     dprintf(log, DEBUG, "starting...");
@@ -558,12 +1433,19 @@ static void *tunfile_writer( void *tunfd )
         if(( data = q_remove(recvq, Q_WAIT, NULL)) == NULL)
             return NULL;
 
-        if(write(fd, data, iplen(data)) < 0) {
-            lprintf(log, WARN, "write failed: %s",
+        if( pep && is_pep(data) ) {
+            pep_input(pep, data);
+            continue;
+        }
+
+        t = lat_now();
+        if(write(fd, data, pktlen(data)) < 0) {
+            lprintf_rl(log, WARN, "write failed: %s",
                     strerror(errno));
         }
+        lat_since(lat, LAT_TUNW, t);
 
-        dprintf(log, DEBUG, "wrote %d", iplen(data));
+        dprintf(log, DEBUG, "wrote %d", pktlen(data));
         free(data);
     }
 }
@@ -583,10 +1465,7 @@ static void *tunfile_writer( void *tunfd )
 static inline int poll_server_p1( int sock )
 {
     dprintf(log, DEBUG, "attempting to poll server");
-    return send_req(sock, P1_P) > 0 ? -1 : 0;
-    /* rv = fdprintf(sock, REQ_P1_P, config->u.c.server_ip_str,
-            ntohs(config->u.c.server_ports[0]),
-            config->u.c.local_ip_str, 0); */
+    return send_req(sock, P1_P, NULL, 0);
 }
 
 
@@ -597,10 +1476,11 @@ static inline int poll_server_p1( int sock )
  * it talks to the proxy, sends and recieves data, polls
  * server when idle (using exponential backoff rate)
  */
-static void *proxy_channel( void *sock )
+static void *proxy_channel( void *rbuf )
 {
+    rbuf_t *rb = (rbuf_t *)rbuf;
     int need_reestablish = 0;
-    int psock = *(int *)sock;
+    int psock = rb->fd;
     struct timespec wait;
     int state_counter = 0;
 
@@ -624,7 +1504,7 @@ static void *proxy_channel( void *sock )
         if( need_reestablish ) {
            lprintf(log, INFO, "connection closed, attempting reopen");
 
-           psock = restablish_connection(psock);
+           psock = restablish_connection(rb);
            switch( psock ) {
                case -1:
                    /* signal the parent thread to shutdown */
@@ -642,20 +1522,25 @@ static void *proxy_channel( void *sock )
            need_reestablish = 0;
         }
 
-        if( !q_isempty(sendq) ) {
+        if( !q_isempty(sendq) || (use_rtx() && rtx_pending(rtx)) ) {
             dprintf(log, DEBUG, "q is not empty!\n");
 
-            if( send_data(psock) == -1 ) {
-                lprintf(log, WARN, "client send failed");
-                need_reestablish = 1;
-                continue;
+            switch( send_data(psock) ) {
+                case -1:
+                    lprintf(log, WARN, "client send failed");
+                    need_reestablish = 1;
+                    continue;
+                case 1:
+                    continue;
+                default:
+                    break;
             }
 
             dprintf(log, DEBUG, "attempting to get server ack\n");
-            if( server_ack(psock, 10) == 0) {
+            if( server_ack(rb, 10) == 0) {
                 dprintf(log, DEBUG, "got server ack - recving data!\n");
 
-                if( recv_data(psock) == -1 ) {
+                if( recv_data(rb) == -1 ) {
                     dprintf(log, DEBUG, "recv_data failed - reopening conn\n");
                     need_reestablish = 1;
                     continue;
@@ -679,7 +1564,7 @@ static void *proxy_channel( void *sock )
                 }
 
                 /* expect ack from server */
-                if( recv_data(psock) == -1 ) {
+                if( recv_data(rb) == -1 ) {
                     dprintf(log, DEBUG, "Poll ack recv failure");
                     need_reestablish = 1;
                     continue;
@@ -727,229 +1612,1096 @@ static void *proxy_channel( void *sock )
  * returns  0 success
  * returns -1 failure
  */
-static inline int poll_server_p2( int sock, int wait )
+static inline int poll_server_p2( int sock, int wait )
+{
+    char buf[8];
+
+    snprintf(buf, 8, "%d", wait);
+
+    return send_req(sock, P2_R, buf, strlen(buf));
+}
+
+/* 
+ * opens the recieiver channel and points rb at it
+ * returns a newly recieve channel socket
+ */
+static inline int do_open_recieve_channel( rbuf_t *rb )
+{
+    int p_sock, rv;
+    http_msg_t msg;
+    char buf[1024];
+    char *body;
+    long len;
+    int i, port;
+
+    /* open the proxy connection, or take a spare one */
+    if(( p_sock = proxy_connect(CHAN_2)) < 0 )
+        return -1;
+    rb_reset(rb, p_sock);
+
+    /* create the POST body, MAC addr and session token */
+    i = snprintf( buf, 1023 ,  "%s", get_mac(config->u.c.if_name));
+    if( *session ) {
+        i += snprintf(buf+i, 1023 - i, "\n" SESSION_LINE "%s", session);
+    }
+
+    /* send the header */
+    port = ntohs(config->u.c.server_ports[1]);
+    dprintf( log, DEBUG, "port: %d", port);
+    rv = send_req(p_sock, P2_CR, buf, i);
+    if( rv < 0 ) {
+        lprintf(log, WARN, "failed to send hdr\n" );
+    }
+
+    /* await the response */
+    if( http_read_msg(rb, &msg) == -1 ) {
+        lprintf(log,WARN,"failed to read response headers");
+        return -1;
+    }
+
+    if( msg.status == 204 ) { 
+        lprintf(log, INFO, "channel opened\n");
+        return p_sock;
+    }
+
+    /* this only gets executed if the server returned an error */
+
+    if( (body = getbody(rb, &msg, &len)) == NULL ) {
+        lprintf(log, WARN, "reading body failed\n");
+        return -1;
+    }
+
+    lprintf(log, WARN, "failed to open channel\n");
+    lprintf(log, WARN, "reason: %s", body);
+
+    free(body);
+
+    return -1;
+}
+
+/*
+ * opens the recieiver channel through the best proxy, and lets the pool
+ * know how that went
+ */
+static inline int open_recieve_channel( rbuf_t *rb )
+{
+    long long start = now_msec();
+    int sock;
+
+    sock = do_open_recieve_channel(rb);
+    proxy_report(CHAN_2, sock >= 0, now_msec() - start);
+    return sock;
+}
+
+/* 
+ * thread
+ *
+ * continually waits for data from the server and adds
+ * it to the recv queue
+ */
+static void rb_release( void *rb )
+{
+    rb_free((rbuf_t **)&rb);
+}
+
+static void *reciever( void *unused )
+{
+    rbuf_t *rb;
+    /* live across the setjmp() in pthread_cleanup_push() */
+    volatile int sock = -1;
+    int wait = config->u.c.channel_2_idle_allow;
+    int reconnect = 0;
+    volatile int retry = config->u.c.reconnect_tries;
+
+    unused = unused; /* :) */
+
+    if( (rb = rb_new(-1)) == NULL ) {
+        lprintf(log, FATAL, "Unable to allocate the recieve buffer");
+        pthread_kill(main_th_id, SIGTERM);
+        return NULL;
+    }
+    pthread_cleanup_push(rb_release, rb);
+
+    reconnect = 1;
+
+    for(;;) {
+        if( reconnect ) {
+            if( sock > 0 ) {
+                proxy_lost(CHAN_2);
+                close(sock);
+            }
+
+            while( retry != 0 || config->u.c.reconnect_tries == -1 ) {
+                sock = open_recieve_channel(rb);
+                if(sock < 0) {
+                    lprintf(log, WARN,
+                    "Recive Channel Connect failed, Sleeping before retry...");
+                    --retry;
+                    sleep(config->u.c.reconnect_sleep_sec);
+                } else {
+                    /* resent the retries so that if we disconnect
+                     * again we can re connect */
+                    retry = config->u.c.reconnect_tries;
+                    break;
+                }
+            }
+            reconnect = 0;
+        }
+
+        if(sock < 0) {
+            lprintf(log, FATAL, "Recive Channel Connect failed, quitting...");
+            /* signal the parent signal handler to shut down */
+            pthread_kill(main_th_id, SIGTERM);
+            break;
+        }
+
+        if( poll_server_p2(sock, wait) != 0 ) {
+            reconnect = 1;
+            continue;
+        }
+
+        if( server_ack(rb, wait) != 0 ) {
+            reconnect = 1;
+            continue;
+        }
+       
+        if( recv_data(rb) != 0 ) {
+            reconnect = 1;
+            continue;
+        }
+    }
+
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/* 
+ * thread
+ *
+ * send data to server over the established socket
+ */
+static void *sender( void *rbuf )
+{
+    rbuf_t *rb = (rbuf_t *)rbuf;
+    int sock = rb->fd;
+    struct sockaddr_in proxy_addr;
+    struct timespec wait = {10, 500000};
+    int need_reestablish = 0;
+    int rc;
+
+    /* construct the addr */
+    memset(&proxy_addr, 0, sizeof(proxy_addr));
+    proxy_addr.sin_family = AF_INET;
+    proxy_addr.sin_addr.s_addr = config->u.c.proxy_ip.s_addr;
+    proxy_addr.sin_port = config->u.c.proxy_port;
+
+    for(;;) {
+        /* a batch lost with the last connection goes first */
+        if( (sendq && use_rtx() && rtx_pending(rtx)) ||
+            q_timedwait(sendq, &wait) ) {
+
+            if( (rc=send_data(sock)) == 1 )
+                continue;
+            if( rc != 0 )
+                need_reestablish = 1;
+
+            /* recvieve the 204 No Data (ack) */
+            if( recv_data(rb) != 0  && !need_reestablish )
+                need_reestablish = 1;
+        } else {
+
+            /* sendq is destroyed, we are exiting, signal the server
+             * and clean up */
+            if(sendq == NULL) {
+                lprintf(log, INFO, "sendq is NULL, exiting");
+                send_shutdown(sock);
+                close(sock);
+                return NULL;
+            }
+
+            /* we timed out, possibly send NO data to server
+             * to keep connection alive */
+        }
+
+        if( need_reestablish ) {
+
+            sock = restablish_connection(rb);
+            switch( sock ) {
+                case -1:
+                    /* signal the parent thread to shutdown */
+                    pthread_kill(main_th_id, SIGTERM);
+                    return NULL;
+                case -2:
+                    send_shutdown(sock);
+                    close(sock);
+                    /* signal parent to restart threads */
+                    pthread_kill(main_th_id, SIGCHLD);
+                    return NULL;
+                default:
+                    break;
+            }
+
+            need_reestablish = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/********************************************************************
+ *** WebSocket - Full Duplex over one upgraded connection
+ ********************************************************************/
+
+static void ws_unlock( void *unused )
+{
+    unused = unused;
+    pthread_mutex_unlock(&ws_mutex);
+}
+
+/*
+ * thread
+ *
+ * reads batches, or frames with protocol 3, off the WebSocket into the
+ * recvq, and re-establishes the connection when it goes down
+ */
+static void *ws_reader( void *rbuf )
+{
+    rbuf_t *rb = (rbuf_t *)rbuf;
+    /* lives across the setjmp() in pthread_cleanup_push() */
+    volatile int sock = rb->fd;
+    int rv;
+
+    for(;;) {
+        if( framed ) rv = fr_recv(fr, rb, recvq, 0);
+        else rv = ws_recv_batch(rb, recvq, 0);
+        if( rv >= 0 ) continue;
+
+        /* recvq is destroyed, we are exiting */
+        if( recvq == NULL ) return NULL;
+
+        lprintf(log, INFO, "WebSocket channel went down, reconnecting");
+
+        /* make the writer let go of the socket before we close it */
+        shutdown(sock, SHUT_RDWR);
+        pthread_cleanup_push(ws_unlock, NULL);
+        pthread_mutex_lock(&ws_mutex);
+        ws_sock = -1;
+        pthread_cleanup_pop(1);
+
+        sock = restablish_connection(rb);
+        switch( sock ) {
+            case -1:
+                /* signal the parent thread to shutdown */
+                pthread_kill(main_th_id, SIGTERM);
+                return NULL;
+            case -2:
+                /* signal parent to restart threads */
+                pthread_kill(main_th_id, SIGCHLD);
+                return NULL;
+            default:
+                break;
+        }
+
+        pthread_cleanup_push(ws_unlock, NULL);
+        pthread_mutex_lock(&ws_mutex);
+        ws_sock = sock;
+        pthread_cond_broadcast(&ws_cond);
+        pthread_cleanup_pop(1);
+    }
+
+    return NULL;
+}
+
+/*
+ * thread
+ *
+ * sends everything on the sendq to the server as one message per batch,
+ * and with protocol 3 keeps the channel alive while there is nothing to send
+ */
+static void *ws_writer( void *unused )
+{
+    struct timespec wait = {1, 0};
+    char bye[2] = { 1000 >> 8, 1000 & 0xFF }; /* normal closure */
+    unsigned int t;
+    int sock, rv;
+
+    unused = unused;
+
+    for(;;) {
+        if( !q_timedwait(sendq, &wait) ) {
+            /* sendq is destroyed, we are exiting, tell the server */
+            if( sendq == NULL ) {
+                lprintf(log, INFO, "sendq is NULL, exiting");
+                pthread_mutex_lock(&ws_mutex);
+                if( ws_sock != -1 ) {
+                    if( framed ) {
+                        fr_send_ctl(fr, ws_sock, FR_CONTROL, 0, "close", 5, 1);
+                    }
+                    ws_send_frame(ws_sock, WS_OP_CLOSE, bye, 2, 1);
+                }
+                pthread_mutex_unlock(&ws_mutex);
+                return NULL;
+            }
+            if( framed ) {
+                pthread_cleanup_push(ws_unlock, NULL);
+                pthread_mutex_lock(&ws_mutex);
+                if( ws_sock != -1 && fr_tick(fr, ws_sock, 1) == -1 ) {
+                    shutdown(ws_sock, SHUT_RDWR);
+                }
+                pthread_cleanup_pop(1);
+            }
+            continue;
+        }
+
+        /* hold the socket while sending so the reader cannot swap it */
+        pthread_cleanup_push(ws_unlock, NULL);
+        pthread_mutex_lock(&ws_mutex);
+        while( ws_sock == -1 ) pthread_cond_wait(&ws_cond, &ws_mutex);
+        sock = ws_sock;
+        t = lat_now();
+        if( framed ) rv = fr_send(fr, sock, sendq, 1);
+        else rv = ws_send_batch(sock, sendq, 1);
+        if( rv > 0 ) lat_since(lat, LAT_SEND, t);
+        pthread_cleanup_pop(1);
+
+        /* wake up the reader, which re-establishes the connection */
+        if( rv == -1 ) shutdown(sock, SHUT_RDWR);
+    }
+
+    return NULL;
+}
+
+/********************************************************************
+ *** Event loop - one thread multiplexing the tun dev and channels
+ ********************************************************************/
+
+/* Wakes the event loop up when the main thread wants a restart or exit */
+static int wake_pipe[2] = { -1, -1 };
+
+#define EV_TUN   0
+#define EV_CHAN1 1
+#define EV_CHAN2 2
+#define EV_TIMER 3
+#define EV_WAKE  4
+#define EV_DONE  5
+
+/* The most packets read off the tun dev per wakeup, so the channels get
+ * their turn */
+#define EV_TUN_BURST 64
+
+/* Seconds to wait for a response before giving up on a channel, on top of
+ * any wait the request asked the server for */
+#define EV_ACK_TIMEOUT 10
+
+typedef struct {
+    rbuf_t *rb;             /* rb->fd is -1 while the channel is down */
+    http_out_t out;         /* what is left of the request being written */
+    int req;                /* the request type out, 0 if idle */
+    int have_hdr;           /* the response headers are in */
+    long body_left;         /* bytes of the response body still to come */
+    int nodata;             /* the response carried no packets */
+    rtx_batch_t *batch;     /* what the request carries, if numbered */
+    unsigned long seq;      /* the batch in the response, if numbered */
+    int dup;                /* we had that batch already */
+    char *zbuf;             /* an encoded body, gathered until complete */
+    size_t zlen;
+    int enc;
+    long long deadline;     /* when to give up on the response, or 0 */
+    long long retry_at;     /* when to reopen the channel, or 0 */
+    int retries;
+    int id;                 /* 0 for chan1, 1 for chan2 */
+    int donefd;             /* where the helper says it is done */
+    pthread_t helper;       /* reopening the channel, while connecting */
+    int connecting;
+    int opened;             /* what the helper's reopen came back with */
+} ev_chan_t;
+
+typedef struct {
+    int epfd;
+    int timerfd;
+    int tunfd;
+    ev_chan_t c[2];         /* chan1, and chan2 for protocol 2 */
+    int nchans;
+    long long poll_at;      /* protocol 1: when to poll next, or 0 */
+    long poll_ms;           /* protocol 1: the current poll interval */
+    int poll_count;
+    char rbody[8];          /* protocol 2: the R request body */
+    int done[2];            /* the helpers write their channel id here */
+} ev_t;
+
+static inline int use_event_loop( void )
+{
+    return config->u.c.event_loop && !use_websocket() &&
+        !config->u.c.split_tcp_port;
+}
+
+static inline int set_nonblock( int fd, int on )
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    if( flags == -1 ) return -1;
+    return fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+/*
+ * (re)registers channel i with epoll, asking for writability too while a
+ * request is only partly written
+ */
+static int ev_watch( ev_t *ev, int i, int op )
+{
+    struct epoll_event e;
+
+    e.events = EPOLLIN;
+    if( http_out_pending(&ev->c[i].out) ) e.events |= EPOLLOUT;
+    e.data.u32 = EV_CHAN1 + i;
+    if( epoll_ctl(ev->epfd, op, ev->c[i].rb->fd, &e) == -1 ) {
+        lprintf(log, ERROR, "epoll_ctl() on fd #%d failed: %s",
+                ev->c[i].rb->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes a freshly (re)opened channel into the loop */
+static int ev_up( ev_t *ev, int i )
+{
+    ev_chan_t *ch = &ev->c[i];
+
+    ch->req = ch->have_hdr = 0;
+    ch->deadline = ch->retry_at = 0;
+    ch->retries = config->u.c.reconnect_tries;
+    if( set_nonblock(ch->rb->fd, 1) == -1 ) return -1;
+    return ev_watch(ev, i, EPOLL_CTL_ADD);
+}
+
+/* Gives the batch a request carried back, acked or not */
+static void ev_release( ev_chan_t *ch )
+{
+    if( ch->batch ) rtx_put(rtx, ch->batch);
+    ch->batch = NULL;
+    free(ch->zbuf);
+    ch->zbuf = NULL;
+}
+
+/*
+ * thread
+ *
+ * reopens a channel, which blocks on the proxy and the server, so the event
+ * loop goes on meanwhile, and tells the loop through its pipe once done
+ */
+static void *ev_reopen( void *chan )
+{
+    ev_chan_t *ch = (ev_chan_t *)chan;
+    char id = ch->id;
+
+    ch->opened = ch->id == 0 ? restablish_connection(ch->rb) :
+        open_recieve_channel(ch->rb);
+    if( write(ch->donefd, &id, 1) != 1 ) {
+        lprintf(log, ERROR, "Unable to wake the event loop: %s",
+                strerror(errno));
+    }
+    return NULL;
+}
+
+/*
+ * channel i failed. A helper thread re-negotiates chan1 or reopens chan2,
+ * and ev_opened() takes it back once it is done.
+ *
+ * returns  0 if the loop can go on
+ * returns -1 if the client has to restart or quit (main has been told)
+ */
+static int ev_down( ev_t *ev, int i )
+{
+    ev_chan_t *ch = &ev->c[i];
+    rbuf_t *rb = ch->rb;
+
+    http_out_free(&ch->out);
+    ev_release(ch);
+    if( rb->fd != -1 ) {
+        lprintf(log, INFO, "channel %d closed, attempting reopen", i + 1);
+        if( i == 1 ) proxy_lost(CHAN_2);
+        close(rb->fd);
+        rb_reset(rb, -1);
+    }
+
+    ch->req = ch->have_hdr = 0;
+    ch->deadline = ch->retry_at = 0;
+    if( pthread_create(&ch->helper, NULL, ev_reopen, ch) != 0 ) {
+        lprintf(log, FATAL, "Unable to start a thread to reopen channel %d",
+                i + 1);
+        pthread_kill(main_th_id, SIGTERM);
+        return -1;
+    }
+    ch->connecting = 1;
+    return 0;
+}
+
+/*
+ * takes channel i back from its helper, into the loop if it was reopened,
+ * else retrying on the timer
+ * returns as ev_down()
+ */
+static int ev_opened( ev_t *ev, int i )
 {
-    int rv;
-    char buf[8];
+    ev_chan_t *ch = &ev->c[i];
+    rbuf_t *rb = ch->rb;
 
-    snprintf(buf, 8, "%d", wait);
-
-    rv = send_req(sock, P2_R, strlen(buf));
-    /* rv = fdprintf(sock, REQ_P2_R, config->u.c.server_ip_str,
-            ntohs(config->u.c.server_ports[1]), strlen(buf)); */
- 
-    if( rv < 0 ) return -1;
+    if( i < 0 || i >= ev->nchans || !ch->connecting ) return 0;
+    pthread_join(ch->helper, NULL);
+    ch->connecting = 0;
 
-    if( send(sock, buf, strlen(buf), 0) != (int)strlen(buf) ) return -1; 
+    switch( ch->opened ) {
+        case -2:
+            /* signal parent to restart with the new ips */
+            pthread_kill(main_th_id, SIGCHLD);
+            return -1;
+        case -1:
+            if( rb->fd != -1 ) {
+                close(rb->fd);
+                rb_reset(rb, -1);
+            }
+            if( ch->retries == 0 ) {
+                lprintf(log, FATAL, "Unable to reopen channel %d, quitting",
+                        i + 1);
+                /* signal the parent thread to shutdown */
+                pthread_kill(main_th_id, SIGTERM);
+                return -1;
+            }
+            if( ch->retries > 0 ) ch->retries--;
+            lprintf(log, WARN, "Channel %d connect failed, "
+                    "retrying in %d sec", i + 1, config->u.c.reconnect_sleep_sec);
+            ch->retry_at = now_msec() + config->u.c.reconnect_sleep_sec * 1000LL;
+            return 0;
+        default:
+            break;
+    }
 
+    if( ev_up(ev, i) == -1 ) {
+        pthread_kill(main_th_id, SIGTERM);
+        return -1;
+    }
     return 0;
 }
 
-/* 
- * opens the recieiver channel
- * returns a newly recieve channel socket
+/*
+ * starts writing the request set up in channel i's out state
+ * returns 0, or -1 if the channel failed
  */
-static inline int open_recieve_channel( void )
+static int ev_send( ev_t *ev, int i, int type, int timeout )
 {
-    struct sockaddr_in proxy_addr;
-    int p_sock, rv;
-    char hdr[HTTP_HEADERS_MAX];
-    char buf[1024];
-    char *body;
-    int i, len, port;
-
-    /* construct the addr */
-    memset(&proxy_addr, 0, sizeof(proxy_addr));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_addr.s_addr = config->u.c.proxy_ip.s_addr;
-    proxy_addr.sin_port = config->u.c.proxy_port;
+    ev_chan_t *ch = &ev->c[i];
+    int rc;
 
-    /* open the proxy connection */
-    if(( p_sock = open_connection(&proxy_addr, create_socket())) < 0 )
-        return -1;
+    ch->req = type;
+    ch->have_hdr = 0;
+    ch->deadline = now_msec() + timeout * 1000LL;
 
-    /* create the POST body, MAC addr */
-    i = snprintf( buf, 1023 ,  "%s", get_mac(config->u.c.if_name));
+    if( (rc=http_out_write(ch->rb->fd, &ch->out)) == -1 ) return -1;
+    if( rc == 0 ) return ev_watch(ev, i, EPOLL_CTL_MOD);
+    return 0;
+}
 
-    /* send the header */
-    port = ntohs(config->u.c.server_ports[1]);
-    dprintf( log, DEBUG, "port: %d", port);
-    rv = send_req(p_sock, P2_CR, i);
-    /* rv = fdprintf(p_sock, REQ_P2_CR, config->u.c.server_ip_str, port, i); */
+/*
+ * sets chan1 up to send the next batch, numbered if the server acks them
+ * returns the number of packets in it, or -1 on failure
+ */
+static int ev_batch( ev_chan_t *ch, int type )
+{
+    rtx_batch_t *b;
 
-    /* send the body (MAC) */
-    if( send(p_sock, buf, i, 0) != i ) {
-        lprintf(log, WARN, "failed to send hdr\n" );
+    if( !use_rtx() ) {
+        return http_out_queue(&ch->out, &req_tmpl[type], sendq,
+                sendq->totsize);
     }
 
-    /* await the response */
-    memset(hdr, '\0', HTTP_HEADERS_MAX);
+    if( (b=rtx_next(rtx, sendq, sendq->totsize)) == NULL ) return -1;
+    if( b->sends > 1 ) {
+        lprintf_rl(log, INFO, "resending batch %lu", b->seq);
+    }
+    http_out_rtx(&ch->out, &req_tmpl[type], b, rtx_rcvd(rtx),
+                 rtx_window(recvq), lat);
+    ch->batch = b;
+    return b->npkts;
+}
 
-    if( getheaders(p_sock, hdr, HTTP_HEADERS_MAX-1) == -1 ) {
-        lprintf(log,WARN,"failed to read response headers");
-        dprintf(log,DEBUG,"reason: %s", hdr);
-        return -1;
+/* Sets channel ch up to send a request without packets */
+static void ev_request( ev_chan_t *ch, int type, const char *body, size_t len )
+{
+    http_out_body(&ch->out, &req_tmpl[type], body, len);
+    if( use_rtx() ) {
+        http_out_seq(&ch->out, 0, rtx_rcvd(rtx), rtx_window(recvq), lat);
     }
+}
 
-    if( !strncmp(hdr, MATCH_204_HTTP10, strlen(MATCH_204_HTTP10)) ||
-        !strncmp(hdr, MATCH_204_HTTP10, strlen(MATCH_204_HTTP10)) ) { 
-        lprintf(log, INFO, "channel opened\n");
-        return p_sock;
+/* Puts whatever is due on the idle channels */
+static int ev_kick( ev_t *ev )
+{
+    ev_chan_t *c1 = &ev->c[0], *c2 = &ev->c[1];
+    int type, cnt;
+
+    if( !c1->connecting && c1->rb->fd != -1 && !c1->req ) {
+        if( !q_isempty(sendq) || (use_rtx() && rtx_pending(rtx)) ) {
+            type = config->u.c.protocol == 1 ? P1_S : P2_S;
+            cnt = ev_batch(c1, type);
+            if( cnt == -1 || ev_send(ev, 0, type, EV_ACK_TIMEOUT) == -1 )
+                return ev_down(ev, 0);
+            dprintf(log, DEBUG, "sending %d packets", cnt);
+
+            /* there is data, go back to the fastest polling */
+            ev->poll_ms = config->u.c.min_poll_interval_msec;
+            ev->poll_count = 0;
+            ev->poll_at = 0;
+        } else if( config->u.c.protocol == 1 ) {
+            if( !ev->poll_at ) {
+                ev->poll_at = now_msec() + ev->poll_ms;
+            } else if( now_msec() >= ev->poll_at ) {
+                ev->poll_at = 0;
+                ev_request(c1, P1_P, NULL, 0);
+                if( ev_send(ev, 0, P1_P, EV_ACK_TIMEOUT) == -1 )
+                    return ev_down(ev, 0);
+            }
+        }
     }
 
-    /* this only gets executed if the server returned an error */
+    if( ev->nchans > 1 && !c2->connecting && c2->rb->fd != -1 &&
+        !c2->req ) {
+        ev_request(c2, P2_R, ev->rbody, strlen(ev->rbody));
+        if( ev_send(ev, 1, P2_R, config->u.c.channel_2_idle_allow +
+                    EV_ACK_TIMEOUT) == -1 )
+            return ev_down(ev, 1);
+    }
+    return 0;
+}
 
-    if( (body = getbody(p_sock, hdr, &len)) == NULL ) {
-        lprintf(log, WARN, "reading body failed\n");
+/*
+ * gathers an encoded response body on ch, and once it is all there writes
+ * the packets in it to the tun dev. A batch we had already is not decoded,
+ * its headers moved the header compression on the first time.
+ * returns 0 once the body is done, 1 if more has to be read, -1 on error
+ */
+static int ev_zbody( ev_t *ev, ev_chan_t *ch )
+{
+    rbuf_t *rb = ch->rb;
+    size_t len = min(rb_avail(rb), (size_t)ch->body_left), off;
+    char *buf;
+    int cnt;
+
+    memcpy(ch->zbuf + ch->zlen, rb->buf + rb->start, len);
+    proxy_bytes(rb->fd, len);
+    rb_consume(rb, len);
+    ch->zlen += len;
+    ch->body_left -= len;
+    if( ch->body_left > 0 ) return 1;
+
+    buf = ch->dup ? NULL :
+        zbatch_decode(&rtx->vjrx, &rtx->aead, ch->enc, ch->zbuf, ch->zlen,
+                      &len);
+    free(ch->zbuf);
+    ch->zbuf = NULL;
+    if( ch->dup ) return 0;
+    if( buf == NULL || (cnt=zbatch_queue(buf, len, NULL)) == -1 ) {
+        lprintf(log, WARN, "Bad encoded batch from fd #%d", rb->fd);
+        free(buf);
         return -1;
     }
 
-    lprintf(log, WARN, "failed to open channel\n");
-    lprintf(log, WARN, "reason: %s", body);
-
-    free(body);
-
-    return -1;
+    for( off = 0; off < len; off += iplen(buf + off) ) {
+        if( write(ev->tunfd, buf + off, iplen(buf + off)) < 0 ) {
+            lprintf_rl(log, WARN, "write failed: %s", strerror(errno));
+        }
+    }
+    dprintf(log, DEBUG, "decoded %d pkts, %lu bytes", cnt,
+            (unsigned long)len);
+    free(buf);
+    return 0;
 }
 
-/* 
- * thread
- *
- * continually waits for data from the server and adds
- * it to the recv queue
+/*
+ * writes the complete packets of the response body buffered on ch to the
+ * tun dev, straight out of the read buffer
+ * returns 0 once the body is done, 1 if more has to be read, -1 on error
  */
-static void *reciever( void *unused )
+static int ev_body( ev_t *ev, ev_chan_t *ch )
 {
-    int sock = -1;
-    int wait = config->u.c.channel_2_idle_allow;
-    int reconnect = 0;
-    int retry = config->u.c.reconnect_tries;
+    rbuf_t *rb = ch->rb;
+    unsigned int t;
+    size_t len;
+
+    if( ch->zbuf ) return ev_zbody(ev, ch);
+
+    while( ch->body_left > 0 ) {
+        if( rb_avail(rb) < 8 ) return 1;
+        len = iplen(rb->buf + rb->start);
+        if( len < 24 || (long)len > ch->body_left || len > sizeof(rb->buf) ) {
+            lprintf(log, WARN, "Bogus packet length %lu from fd #%d",
+                    (unsigned long)len, rb->fd);
+            return -1;
+        }
+        if( rb_avail(rb) < len ) return 1;
 
-    unused = unused; /* :) */
+        if( ch->dup ) {
+            /* a batch we had already, dropped */
+        } else {
+            t = lat_now();
+            if( write(ev->tunfd, rb->buf + rb->start, len) < 0 ) {
+                lprintf_rl(log, WARN, "write failed: %s", strerror(errno));
+            }
+            lat_since(lat, LAT_TUNW, t);
+        }
+        dprintf(log, DEBUG, "wrote %lu", (unsigned long)len);
+        proxy_bytes(rb->fd, len);
+        rb_consume(rb, len);
+        ch->body_left -= len;
+    }
+    return 0;
+}
 
-    reconnect = 1;
+/* Called when the response to chan1's request is complete */
+static void ev_done( ev_t *ev, ev_chan_t *ch )
+{
+    if( ch->dup ) {
+        lprintf_rl(log, INFO, "dropped resent batch %lu", ch->seq);
+    } else if( ch->seq ) {
+        rtx_recv(rtx, ch->seq);
+    }
+    ev_release(ch);
+
+    /* protocol 1 backs off polling while the server has nothing */
+    if( ch->req == P1_P ) {
+        if( !ch->nodata ) {
+            ev->poll_ms = config->u.c.min_poll_interval_msec;
+            ev->poll_count = 0;
+        } else if( ++ev->poll_count >= config->u.c.poll_backoff_rate ) {
+            ev->poll_ms *= 2;
+            if( ev->poll_ms > config->u.c.max_poll_interval * 1000L )
+                ev->poll_ms = config->u.c.max_poll_interval * 1000L;
+            ev->poll_count = 0;
+        }
+    }
+    ch->req = ch->have_hdr = 0;
+    ch->deadline = 0;
+}
 
-    for(;;) {
-        if( reconnect ) {
-            if( sock > 0 ) 
-                close(sock);
+/*
+ * reads what channel i has for us and handles any complete responses
+ * returns 0, or -1 if the channel failed
+ */
+static int ev_read( ev_t *ev, int i )
+{
+    ev_chan_t *ch = &ev->c[i];
+    http_msg_t msg;
+    int rc;
 
-            while( retry != 0 || config->u.c.reconnect_tries == -1 ) {
-                sock = open_recieve_channel();
-                if(sock < 0) {
-                    lprintf(log, WARN,
-                    "Recive Channel Connect failed, Sleeping before retry...");
-                    --retry;
-                    sleep(config->u.c.reconnect_sleep_sec);
-                } else {
-                    /* resent the retries so that if we disconnect
-                     * again we can re connect */
-                    retry = config->u.c.reconnect_tries;
-                    break;
+    if( (rc=rb_fill(ch->rb)) == 0 || (rc < 0 && errno != EAGAIN) )
+        return -1;
+
+    while( ch->req && !http_out_pending(&ch->out) ) {
+        if( !ch->have_hdr ) {
+            if( (rc=http_take_msg(ch->rb, &msg)) <= 0 ) return rc;
+            if( msg.status == 204 ) {
+                ch->body_left = 0;
+            } else if( msg.status == 200 ) {
+                ch->body_left = max(msg.content_length, 0);
+            } else {
+                lprintf(log, WARN, "Bad or Error HTTP response received "
+                        "from server: %.*s", (int)msg.line.len, msg.line.ptr);
+                return -1;
+            }
+            if( msg.rtx ) rtx_ack(rtx, msg.ack, msg.win);
+            lat_peer(lat, msg.ts, msg.echo, msg.held);
+            ch->seq = msg.seq;
+            ch->dup = msg.seq && rtx_dup(rtx, msg.seq);
+            ch->nodata = !ch->body_left;
+            ch->have_hdr = 1;
+            if( ch->body_left && !zbatch_allowed(&rtx->aead, msg.enc) ) {
+                lprintf(log, WARN, "Batch from fd #%d is not sealed",
+                        ch->rb->fd);
+                return -1;
+            }
+            if( msg.enc && ch->body_left ) {
+                if( ch->body_left > ZBATCH_MAX + AEAD_OVERHEAD ) {
+                    lprintf(log, WARN, "Encoded batch of %ld bytes from "
+                            "fd #%d is too big", ch->body_left, ch->rb->fd);
+                    return -1;
                 }
+                if( (ch->zbuf=malloc(ch->body_left)) == NULL ) {
+                    lprintf(log, ERROR, "Unable to malloc() %ld bytes for "
+                            "an encoded batch!", ch->body_left);
+                    return -1;
+                }
+                ch->zlen = 0;
+                ch->enc = msg.enc;
             }
-            reconnect = 0;
         }
+        if( (rc=ev_body(ev, ch)) != 0 ) return rc == 1 ? 0 : -1;
+        ev_done(ev, ch);
+    }
 
-        if(sock < 0) {
-            lprintf(log, FATAL, "Recive Channel Connect failed, quitting...");
-            /* signal the parent signal handler to shut down */
-            pthread_kill(main_th_id, SIGTERM);
-            return NULL;
-        }
+    if( rb_avail(ch->rb) ) {
+        lprintf(log, WARN, "Unexpected data from server on fd #%d",
+                ch->rb->fd);
+        return -1;
+    }
+    return 0;
+}
 
-        if( poll_server_p2(sock, wait) != 0 ) {
-            reconnect = 1;
-            continue;
+/* Moves whatever the tun dev has onto the sendq */
+static int ev_tun( ev_t *ev )
+{
+    char buf[HTUN_MAXPACKET], *pkt;
+    unsigned int t;
+    int i, n;
+
+    for( i = 0; i < EV_TUN_BURST; i++ ) {
+        if( (n=read(ev->tunfd, buf, sizeof(buf))) < 0 ) {
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN ) break;
+            lprintf(log, FATAL, "Reading IP pkt from tun fd #%d: %s",
+                    ev->tunfd, strerror(errno));
+            pthread_kill(main_th_id, SIGTERM);
+            return -1;
         }
+        if( n < 8 || iplen(buf) > n || pi_proto(buf) != PI_IPV4 ) continue;
+        t = lat_now();
 
-        if( server_ack(sock, wait) != 0 ) {
-            reconnect = 1;
-            continue;
+        if( (pkt=malloc(iplen(buf))) == NULL ) {
+            lprintf(log, ERROR, "Unable to malloc() space for next packet!");
+            break;
         }
-       
-        if( recv_data(sock) != 0 ) {
-            reconnect = 1;
-            continue;
+        memcpy(pkt, buf, iplen(buf));
+        tun_clamp_mss(pkt, tun_mtu);
+        if( sendq_add(pkt, 0) != 0 ) {
+            dprintf(log, DEBUG, "sendq full, dropping packet");
+            free(pkt);
+        } else {
+            lat_since(lat, LAT_TUN, t);
         }
     }
+    return 0;
+}
 
-    return NULL;
+/* Arms the timer for the earliest thing waiting on the clock */
+static void ev_arm( ev_t *ev )
+{
+    struct itimerspec its;
+    long long next = 0, t[5];
+    int i;
+
+    t[0] = ev->c[0].deadline;
+    t[1] = ev->c[0].retry_at;
+    t[2] = ev->nchans > 1 ? ev->c[1].deadline : 0;
+    t[3] = ev->nchans > 1 ? ev->c[1].retry_at : 0;
+    t[4] = ev->poll_at;
+    for( i = 0; i < 5; i++ ) {
+        if( t[i] && (!next || t[i] < next) ) next = t[i];
+    }
+
+    memset(&its, 0, sizeof(its));
+    if( next ) {
+        /* a zero it_value disarms the timer, so never ask for time 0 */
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000 + 1;
+    }
+    timerfd_settime(ev->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
 }
 
-/* 
- * thread
- *
- * send data to server over the established socket
- */
-static void *sender( void *socket )
+/* Handles whatever the timer went off for */
+static int ev_timeout( ev_t *ev )
 {
-    int sock = *(int *)socket;
-    struct sockaddr_in proxy_addr;
-    struct timespec wait = {10, 500000};
-    int need_reestablish = 0;
+    long long now = now_msec();
+    ev_chan_t *ch;
+    int i;
+
+    for( i = 0; i < ev->nchans; i++ ) {
+        ch = &ev->c[i];
+        if( ch->deadline && now >= ch->deadline ) {
+            lprintf(log, WARN, "No response on channel %d", i + 1);
+            if( ev_down(ev, i) == -1 ) return -1;
+        } else if( ch->retry_at && now >= ch->retry_at ) {
+            ch->retry_at = 0;
+            if( ev_down(ev, i) == -1 ) return -1;
+        }
+    }
+    return 0;
+}
 
-    /* construct the addr */
-    memset(&proxy_addr, 0, sizeof(proxy_addr));
-    proxy_addr.sin_family = AF_INET;
-    proxy_addr.sin_addr.s_addr = config->u.c.proxy_ip.s_addr;
-    proxy_addr.sin_port = config->u.c.proxy_port;
+/*
+ * runs the client for protocol 1 or 2 in the calling thread until the main
+ * thread asks for a restart or exit, or the channels cannot be kept up
+ * rb - the negotiated chan1
+ */
+static void event_loop( rbuf_t *rb, int tunfd )
+{
+    struct epoll_event e, events[8];
+    ev_t ev;
+    uint64_t ticks;
+    char drain[16];
+    int i, n, rc = 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.epfd = ev.timerfd = ev.done[0] = ev.done[1] = -1;
+    ev.tunfd = tunfd;
+    ev.c[0].rb = rb;
+    ev.nchans = config->u.c.protocol == 2 ? 2 : 1;
+    ev.poll_ms = config->u.c.min_poll_interval_msec;
+    snprintf(ev.rbody, sizeof(ev.rbody), "%d",
+            config->u.c.channel_2_idle_allow);
+
+    if( (ev.epfd=epoll_create(8)) == -1 ||
+        (ev.timerfd=timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1 ||
+        pipe(ev.done) == -1 ) {
+        lprintf(log, FATAL, "Unable to set up the event loop: %s",
+                strerror(errno));
+        pthread_kill(main_th_id, SIGTERM);
+        goto out;
+    }
 
-    for(;;) {
-        if( q_timedwait(sendq, &wait) ) {
+    /* throw away any wakeup left over from the last run */
+    while( read(wake_pipe[0], drain, sizeof(drain)) > 0 );
+
+    set_nonblock(tunfd, 1);
+    e.events = EPOLLIN;
+    e.data.u32 = EV_TUN;
+    epoll_ctl(ev.epfd, EPOLL_CTL_ADD, tunfd, &e);
+    e.data.u32 = EV_TIMER;
+    epoll_ctl(ev.epfd, EPOLL_CTL_ADD, ev.timerfd, &e);
+    e.data.u32 = EV_WAKE;
+    epoll_ctl(ev.epfd, EPOLL_CTL_ADD, wake_pipe[0], &e);
+    set_nonblock(ev.done[0], 1);
+    e.data.u32 = EV_DONE;
+    epoll_ctl(ev.epfd, EPOLL_CTL_ADD, ev.done[0], &e);
+    for( i = 0; i < 2; i++ ) {
+        ev.c[i].id = i;
+        ev.c[i].donefd = ev.done[1];
+    }
 
-            if( send_data(sock) != 0 )
-                need_reestablish = 1;
+    if( ev_up(&ev, 0) == -1 ) goto out;
+    if( ev.nchans > 1 ) {
+        if( (ev.c[1].rb=rb_new(-1)) == NULL ) goto out;
+        ev.c[1].retries = config->u.c.reconnect_tries;
+        if( ev_down(&ev, 1) == -1 ) goto out;
+    }
 
-            /* recvieve the 204 No Data (ack) */
-            if( recv_data(sock) != 0  && !need_reestablish )
-                need_reestablish = 1;
-        } else {
+    lprintf(log, INFO, "Event loop running");
 
-            /* sendq is destroyed, we are exiting, signal the server
-             * and clean up */
-            if(sendq == NULL) {
-                lprintf(log, INFO, "sendq is NULL, exiting");
-                send_shutdown(sock);
-                close(sock);
-                return NULL;
-            }
+    while( rc == 0 ) {
+        if( ev_kick(&ev) == -1 ) break;
+        ev_arm(&ev);
 
-            /* we timed out, possibly send NO data to server
-             * to keep connection alive */
+        if( (n=epoll_wait(ev.epfd, events, 8, -1)) == -1 ) {
+            if( errno == EINTR ) continue;
+            lprintf(log, FATAL, "epoll_wait() failed: %s", strerror(errno));
+            pthread_kill(main_th_id, SIGTERM);
+            break;
         }
 
-        if( need_reestablish ) {
+        for( i = 0; i < n && rc == 0; i++ ) {
+            switch( events[i].data.u32 ) {
+                case EV_TUN:
+                    rc = ev_tun(&ev);
+                    break;
+                case EV_CHAN1:
+                case EV_CHAN2: {
+                    int c = events[i].data.u32 - EV_CHAN1;
+                    ev_chan_t *ch = &ev.c[c];
+
+                    if( ch->connecting || ch->rb->fd == -1 ) break;
+                    if( (events[i].events & EPOLLOUT) &&
+                        http_out_pending(&ch->out) ) {
+                        int w = http_out_write(ch->rb->fd, &ch->out);
+
+                        if( w == -1 ) {
+                            rc = ev_down(&ev, c);
+                            break;
+                        }
+                        if( w == 1 ) ev_watch(&ev, c, EPOLL_CTL_MOD);
+                    }
+                    if( events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ) {
+                        if( ev_read(&ev, c) == -1 ) rc = ev_down(&ev, c);
+                    }
+                    break;
+                }
+                case EV_TIMER:
+                    while( read(ev.timerfd, &ticks, sizeof(ticks)) > 0 );
+                    rc = ev_timeout(&ev);
+                    break;
+                case EV_WAKE:
+                    dprintf(log, DEBUG, "woken up by main thread");
+                    rc = -1;
+                    break;
+                case EV_DONE: {
+                    char id;
 
-            sock = restablish_connection(sock);
-            switch( sock ) {
-                case -1:
-                    /* signal the parent thread to shutdown */
-                    pthread_kill(main_th_id, SIGTERM);
-                    return NULL;
-                case -2:
-                    send_shutdown(sock);
-                    close(sock);
-                    /* signal parent to restart threads */
-                    pthread_kill(main_th_id, SIGCHLD);
-                    return NULL;
-                default:
+                    while( rc == 0 && read(ev.done[0], &id, 1) == 1 )
+                        rc = ev_opened(&ev, id);
                     break;
+                }
             }
-
-            need_reestablish = 0;
         }
     }
 
-    return NULL;
+out:
+    lprintf(log, INFO, "Event loop exiting");
+
+    for( i = 0; i < 2; i++ ) {
+        if( ev.c[i].rb == NULL ) continue;
+        if( ev.c[i].connecting ) {
+            /* whatever it got so far is of no use any more */
+            pthread_cancel(ev.c[i].helper);
+            pthread_join(ev.c[i].helper, NULL);
+            ev.c[i].connecting = 0;
+            if( ev.c[i].rb->fd != -1 ) {
+                close(ev.c[i].rb->fd);
+                rb_reset(ev.c[i].rb, -1);
+            }
+            continue;
+        }
+        http_out_free(&ev.c[i].out);
+        ev_release(&ev.c[i]);
+        if( ev.c[i].rb->fd != -1 ) {
+            set_nonblock(ev.c[i].rb->fd, 0);
+            /* tell the server we are going away */
+            if( i == 0 ) send_shutdown(ev.c[i].rb->fd);
+            close(ev.c[i].rb->fd);
+            rb_reset(ev.c[i].rb, -1);
+        }
+    }
+    rb_free(&ev.c[1].rb);
+    if( ev.timerfd != -1 ) close(ev.timerfd);
+    if( ev.epfd != -1 ) close(ev.epfd);
+    if( ev.done[0] != -1 ) close(ev.done[0]);
+    if( ev.done[1] != -1 ) close(ev.done[1]);
 }
 
 /********************************************************************
  *** starup functions
  ********************************************************************/
 
+/* Queues a split TCP frame for the server like a packet from the tun */
+static int pep_to_server( void *unused, char *frame )
+{
+    unused = unused;
+    if( q_add(sendq, frame, 0, iplen(frame)) != 0 ) {
+        free(frame);
+        return -1;
+    }
+    return 0;
+}
+
 static inline int do_shutdown(pthread_t *tids, int tunfd)
 {
+    /* its streams send on the queues until it is gone */
+    pep_destroy(&pep);
+
+    if( acks_thinned ) {
+        lprintf(log, INFO, "%lu pure ACKs were replaced by newer ones",
+                acks_thinned);
+    }
+    if( sendq && sendq->dupsize ) {
+        lprintf(log, INFO, "%lu bytes of retransmissions were dropped",
+                sendq->dupsize);
+    }
+
     /* Kill queues */
     q_destroy(&sendq);
     q_destroy(&recvq);
@@ -958,12 +2710,15 @@ static inline int do_shutdown(pthread_t *tids, int tunfd)
     /*close(p_sock);*/
     close(tunfd);
 
-    lprintf(log, INFO, "shutting down tunfile reader and writer");
-    pthread_kill(tids[0], SIGCHLD);
-    pthread_kill(tids[1], SIGCHLD);
-    pthread_join(tids[0], (void **)NULL);
-    pthread_join(tids[1], (void **)NULL);
-    lprintf(log, INFO, "tunfile reader and writer exited");
+    /* the event loop has already closed its channels on the way out */
+    if( !use_event_loop() ) {
+        lprintf(log, INFO, "shutting down tunfile reader and writer");
+        pthread_kill(tids[0], SIGCHLD);
+        pthread_kill(tids[1], SIGCHLD);
+        pthread_join(tids[0], (void **)NULL);
+        pthread_join(tids[1], (void **)NULL);
+        lprintf(log, INFO, "tunfile reader and writer exited");
+    }
     
     /* restore default route */
     if( config->u.c.do_routing ) {
@@ -974,7 +2729,18 @@ static inline int do_shutdown(pthread_t *tids, int tunfd)
         lprintf( log, INFO, "restored default route" );
     }
 
-    if( config->u.c.protocol == 1 ) {
+    if( use_event_loop() ) {
+        /* nothing else running */
+    } else if( use_websocket() ) {
+        lprintf(log, INFO, "Cancelling WebSocket reader and writer" );
+        pthread_cancel(tids[2]);
+        pthread_cancel(tids[3]);
+        pthread_join(tids[2], (void **)NULL);
+        pthread_join(tids[3], (void **)NULL);
+        close(ws_sock);
+        ws_sock = -1;
+        lprintf(log, INFO, "WebSocket reader and writer threads killed");
+    } else if( config->u.c.protocol == 1 ) {
         lprintf(log, INFO, "shutting down proxy channel thread");
         pthread_kill(tids[2], SIGCHLD);
         /*pthread_join(tids[2], (void **)NULL);*/
@@ -996,23 +2762,34 @@ static inline int do_shutdown(pthread_t *tids, int tunfd)
 static void *starter(void *unused)
 {
     extern int tunfd; /* from common.c */
-    int sock;
+    rbuf_t *rb;
+    int sock = -1;
     int run, reconnect = config->u.c.connect_tries, quit = 0;
     pthread_t tids[4];
     config_data_t *tmp;
 
     unused = unused;
 
+    /* buffers the server connection, kept across reconnects */
+    if( (rb = rb_new(-1)) == NULL ) {
+        lprintf(log, FATAL, "Unable to allocate the recieve buffer");
+        pthread_kill(main_th_id, SIGTERM);
+        return NULL;
+    }
+
     run = 1;
     while( run ) {
         
         lprintf(log, INFO, "Initiating server connection");
 
+        if( render_requests() != 0 ) break;
+        proxy_pool_load();
+
         /* reconnect configfile specified number of times OR
          * try forever if "connect_tries" == -1 */
         while( reconnect != 0 || config->u.c.connect_tries == -1 ) {
             /* establish a channel to the server */
-            sock = do_negotiate_protocol();
+            sock = negotiate(rb);
             if( sock < 0 ) {
                 lprintf(log, WARN,
                         "Connect failed, Sleeping before retry...");
@@ -1042,11 +2819,21 @@ static void *starter(void *unused)
                     "unable to create client queues, quitting...");
             break;
         }
+        sendq->wait = &lat->h[LAT_SENDQ];
+        recvq->wait = &lat->h[LAT_RECVQ];
+
+        if( config->u.c.split_tcp_port &&
+            ((pep=pep_new(pep_to_server, NULL, 0)) == NULL ||
+             pep_listen(pep, config->u.c.split_tcp_port) == -1) ) {
+            lprintf(log, WARN, "split TCP is off for this connection");
+            pep_destroy(&pep);
+        }
 
         /* configure the tun dev */
         getprivs("setting up the tundev");
 
-        tunfd = cli_tun_alloc(config->u.c.local_ip, config->u.c.peer_ip);
+        tunfd = cli_tun_alloc(config->u.c.local_ip, config->u.c.peer_ip,
+                tun_mtu);
         dprintf(log, DEBUG, "tunfd: %d\n", tunfd);
         if( tunfd < 0 ) {
             lprintf(log, FATAL, "Unable configure the tun device");
@@ -1068,15 +2855,24 @@ static void *starter(void *unused)
 
         dropprivs("tundev up");
 
-        /* create the tun reader and writer */
-        pthread_create( &tids[0], NULL, tunfile_reader, &tunfd );
-        pthread_create( &tids[1], NULL, tunfile_writer, &tunfd );
-
-        if( config->u.c.protocol == 1 ) {
-            pthread_create( &tids[2], NULL, proxy_channel, (void*)&sock);
-        } else if ( config->u.c.protocol == 2 ) {
-            pthread_create( &tids[2], NULL, reciever, NULL );
-            pthread_create( &tids[3], NULL, sender, (void*)&sock);
+        if( use_event_loop() ) {
+            /* runs until main wakes us up or the channels are lost */
+            event_loop(rb, tunfd);
+        } else {
+            /* create the tun reader and writer */
+            pthread_create( &tids[0], NULL, tunfile_reader, &tunfd );
+            pthread_create( &tids[1], NULL, tunfile_writer, &tunfd );
+
+            if( use_websocket() ) {
+                ws_sock = sock;
+                pthread_create( &tids[2], NULL, ws_reader, rb );
+                pthread_create( &tids[3], NULL, ws_writer, NULL );
+            } else if( config->u.c.protocol == 1 ) {
+                pthread_create( &tids[2], NULL, proxy_channel, rb );
+            } else if ( config->u.c.protocol == 2 ) {
+                pthread_create( &tids[2], NULL, reciever, NULL );
+                pthread_create( &tids[3], NULL, sender, rb );
+            }
         }
 
         pthread_mutex_lock(&restart_mutex);
@@ -1103,6 +2899,7 @@ static void *starter(void *unused)
     
     /* just shutdown and exit */
     do_shutdown(tids, tunfd);
+    rb_free(&rb);
     /* make sure main thread (sig handler) knows to exit too */
     pthread_kill(main_th_id, SIGTERM);
     return NULL;
@@ -1127,6 +2924,42 @@ int client_main(void)
     /* setup main thread id so worker threads can signal us */
     main_th_id = pthread_self();
 
+    /* kept across reconnects and restarts, like the session */
+    if( (rtx=rtx_init()) == NULL ) return EXIT_FAILURE;
+    if( (fr=fr_init()) == NULL ) return EXIT_FAILURE;
+    if( (lat=lat_new()) == NULL ) return EXIT_FAILURE;
+    fr->lat = lat;
+
+    if( config->u.c.tls &&
+        (tls_ctx=tls_client_ctx(config->u.c.tls_ca)) == NULL ) {
+        lprintf(log, FATAL, "Unable to set up TLS");
+        return EXIT_FAILURE;
+    }
+
+    if( *config->u.c.psk && use_websocket() ) {
+        lprintf(log, FATAL, "psk needs protocol 1 or 2 without websocket");
+        return EXIT_FAILURE;
+    }
+
+    proxy_pool_load();
+    spares_start();
+
+    if( config->u.c.event_loop ) {
+        if( use_websocket() ) {
+            lprintf(log, WARN, "event_loop does not support the websocket "
+                    "transport, using threads");
+        } else if( config->u.c.split_tcp_port ) {
+            lprintf(log, WARN, "event_loop does not support split TCP, "
+                    "using threads");
+        }
+        if( pipe(wake_pipe) == -1 ) {
+            lprintf(log, FATAL, "Unable to create pipe: %s", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        set_nonblock(wake_pipe[0], 1);
+        set_nonblock(wake_pipe[1], 1);
+    }
+
     /* start the starter thread */
     pthread_create(&starter_tid, NULL, starter, NULL);
 
@@ -1143,6 +2976,9 @@ int client_main(void)
             case SIGTSTP:
                 kill(getpid(), SIGSTOP);
                 break;
+            case SIGUSR1:
+                lat_log(lat, "client");
+                break;
             case SIGINT:
             case SIGTERM:
                 goto cleanup;
@@ -1161,6 +2997,7 @@ restart:
         /* wake up the starter thread */
         pthread_mutex_unlock(&restart_mutex);
         pthread_cond_signal(&restart_cond);
+        if( wake_pipe[1] != -1 ) write(wake_pipe[1], "r", 1);
     }
 
 cleanup:
@@ -1169,10 +3006,15 @@ cleanup:
     /* wake up the starter thread */
     pthread_mutex_unlock(&restart_mutex);
     pthread_cond_signal(&restart_cond);
+    if( wake_pipe[1] != -1 ) write(wake_pipe[1], "q", 1);
 
     /*pthread_cancel(starter_tid);*/
     pthread_join(starter_tid, (void **)NULL);
 
+    spares_stop();
+
+    rtx_destroy(&rtx);
+
     lprintf( log, INFO, "HTun client daemon exiting." );
 
     log_close(log);
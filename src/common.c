@@ -38,16 +38,15 @@
 #include "y.tab.h"
 #include "log.h"
 #include "common.h"
+#include "aead.h"
+#include "tls.h"
 
 int tunfd;
 char *signames[64];
 
-/* Read exactly one packet from fd in a dynamic buffer */
+/* Read exactly one packet from the tun fd in a dynamic buffer */
 char *get_packet( int fd ) {
-    size_t len=0;
     char *pkt = malloc(HTUN_MAXPACKET);
-    size_t cnt;
-    struct stat st;
     int rc;
 
     dprintf( log, DEBUG, "Entering get_packet()" );
@@ -57,82 +56,55 @@ char *get_packet( int fd ) {
         return NULL;
     }
 
-    if( fstat(fd,&st) == -1 ) {
-        lprintf( log, ERROR, "Unable to fstat() fd #%d: %s", fd,
-                strerror(errno) );
+    do {
+        if( (rc=read(fd,pkt,HTUN_MAXPACKET)) == -1 ) {
+            lprintf( log, INFO, 
+                    "Reading IP pkt from tun fd #%d: %s",
+                    fd, strerror(errno) );
+        }
+    } while( rc == -1 && errno == EINTR );
+
+    if( rc == -1 ) {
         free(pkt);
         return NULL;
     }
+    dprintf( log, DEBUG, "Got %lu-byte pkt from tunfd #%d.",
+            (unsigned long)iplen(pkt), fd );
 
-    /* We have to treat the socket and the tunfile differently */
-    if( S_ISSOCK(st.st_mode) ) {
-
-        /* read 20 bytes, the size of an IP header */
-        cnt=0;
-        while( cnt < 20 ) {
-            if( (rc=read(fd,pkt+cnt,20)) <= 0 ) {
-                if( rc < 0 ) {
-                    if( errno == EINTR ) continue;
-                    lprintf( log, WARN, "Socket #%d: Reading IP hdr: %s.",
-                            fd, strerror(errno) );
-                } else if( rc == 0 ) {
-                    lprintf( log, WARN, 
-                            "Socket #%d: Read %d bytes, expected 20 (hdr).",
-                            fd, cnt );
-                }
-                free(pkt);
-                return NULL;
-            }
-            cnt += rc;
-        }
+    return pkt;
+}
 
-        len=iplen(pkt);
-
-        /* Read the rest of the packet */
-        while( cnt < len ) {
-            if( (rc=read(fd,pkt+cnt,len-cnt)) <= 0 ) {
-                if( rc < 0 ) {
-                    if( errno == EINTR ) continue;
-                    lprintf( log, WARN, "Socket #%d: Reading IP pkt: %s.",
-                            fd, strerror(errno) );
-                } else if( rc == 0 ) {
-                    lprintf( log, WARN, 
-                            "Socket #%d: Read %d bytes, expected %lu.",
-                            fd, cnt, len );
-                }
-                free(pkt);
-                return NULL;
-            }
-            cnt += rc;
+/* Read exactly one packet from a connection in a dynamic buffer */
+char *rb_get_packet( rbuf_t *rb ) {
+    size_t len;
+    char *pkt;
+
+    /* The length is in the first 8 bytes (tun header + start of IP header) */
+    while( rb_avail(rb) < 8 ) {
+        if( rb_fill(rb) <= 0 ) {
+            lprintf( log, WARN, "Socket #%d: Read %lu bytes, expected 8 (hdr).",
+                    rb->fd, rb_avail(rb) );
+            return NULL;
         }
+    }
 
-    } else if( S_ISCHR(st.st_mode) ) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-
-        do {
-            if( (rc=read(fd,pkt,HTUN_MAXPACKET)) == -1 ) {
-                lprintf( log, INFO, 
-                        "Reading IP pkt from tun fd #%d: %s",
-                        fd, strerror(errno) );
-            }
-        } while( rc == -1 && errno == EINTR );
-
-        if( rc == -1 ) {
-            free(pkt);
-            pkt = NULL;
-        } else {
-            len=iplen(pkt);
-        }
-    } else {
-        lprintf( log, ERROR, 
-                "fd #%d neither socket nor char special.", fd);
+    len = iplen(rb->buf + rb->start);
+    if( len < 24 ) {
+        lprintf( log, WARN, "Socket #%d: Bogus packet length %lu.",
+                rb->fd, len );
         return NULL;
     }
 
-    dprintf( log, DEBUG, "Got %lu-byte pkt from %s #%d.", 
-            len, S_ISCHR(st.st_mode)?"tunfd":"socket", fd );
+    if( (pkt=malloc(len)) == NULL ) {
+        lprintf( log, ERROR, "Unable to malloc() space for next packet!\n" );
+        return NULL;
+    }
+    if( rb_read(rb, pkt, len) == -1 ) {
+        free(pkt);
+        return NULL;
+    }
+
+    dprintf( log, DEBUG, "Got %lu-byte pkt from socket #%d.", len, rb->fd );
 
     return pkt;
 }
@@ -140,20 +112,45 @@ char *get_packet( int fd ) {
 void print_client_config( struct client_config *c )
 {
     iprange_t *ipr = c->ipr;
+    int i;
+
     if( c == NULL ) {
         fprintf(stderr, "Configfile is empty!\n");
         return;
     }
     lprintf( log, INFO, "protocol %d\n", c->protocol );
+    lprintf( log, INFO, "websocket transport: %s\n",
+            c->websocket ? "yes" : "no" );
+    lprintf( log, INFO, "event loop: %s\n",
+            c->event_loop ? "yes" : "no" );
     lprintf( log, INFO, "connect tries: %d\n", c->connect_tries );
     lprintf( log, INFO, "reconnect tries: %d\n", c->reconnect_tries );
     lprintf( log, INFO, "reconnect sleep time: %d\n", c->reconnect_sleep_sec );
+    lprintf( log, INFO, "spare connections: %d\n", c->spare_connections );
+    lprintf( log, INFO, "spare max idle time: %d\n", c->spare_max_idle_sec );
+    lprintf( log, INFO, "tcp fast open: %s\n",
+            c->tcp_fastopen ? "yes" : "no" );
+    lprintf( log, INFO, "split tcp port: %u\n", c->split_tcp_port );
+    lprintf( log, INFO, "thin acks: %s\n", c->thin_acks ? "yes" : "no" );
+    lprintf( log, INFO, "compress: %s\n", c->compress ? "yes" : "no" );
+    lprintf( log, INFO, "compress headers: %s\n",
+            c->compress_headers ? "yes" : "no" );
+    lprintf( log, INFO, "psk: %s\n", *c->psk ? "set" : "not set" );
+    lprintf( log, INFO, "cipher: %s\n", aead_name(c->cipher) );
+    lprintf( log, INFO, "tls: %s\n", c->tls == TLS_CONNECT ? "connect" :
+            c->tls == TLS_DIRECT ? "direct" : "no" );
+    lprintf( log, INFO, "tls ca: %s\n", *c->tls_ca ? c->tls_ca : "system" );
     lprintf( log, INFO, "channel 2 idle allowable time: %d\n", 
             c->channel_2_idle_allow);
     lprintf( log, INFO, "route table is %s\n", 
             c->do_routing ? "modified" : "not modified" );
     lprintf( log, INFO, "proxy ip: %s\n", c->proxy_ip_str );
     lprintf( log, INFO, "proxy port: %u\n", ntohs( c->proxy_port ));
+    for( i = 0; i < c->nr_extra_proxies; i++ ) {
+        lprintf( log, INFO, "proxy: %s:%u\n",
+                inet_ntoa(c->extra_proxies[i].ip),
+                ntohs( c->extra_proxies[i].port ));
+    }
     lprintf( log, INFO, "proxy user: '%s'\n", c->proxy_user );
     lprintf( log, INFO, "proxy pass: '%s'\n", c->proxy_pass );
     lprintf( log, INFO, "base64 user/pass: %s\n", c->base64_user_pass );
@@ -179,6 +176,7 @@ void print_client_config( struct client_config *c )
 void print_server_config( struct server_config *s )
 {
     iprange_t *ipr = s->ipr;
+    shape_rule_t *r;
 
     lprintf( log, INFO, "max_clients: %u\n", s->max_clients);
     lprintf( log, INFO, "max_pending: %u\n", s->max_pending);
@@ -195,6 +193,24 @@ void print_server_config( struct server_config *s )
             s->packet_max_interval);
     lprintf( log, INFO, "max_response_delay: %u\n",
             s->max_response_delay);
+    lprintf( log, INFO, "split_tcp: %s\n", s->split_tcp ? "yes" : "no" );
+    lprintf( log, INFO, "compress: %s\n", s->compress ? "yes" : "no" );
+    lprintf( log, INFO, "compress_headers: %s\n",
+            s->compress_headers ? "yes" : "no" );
+    lprintf( log, INFO, "psk: %s\n", *s->psk ? "set" : "not set" );
+    lprintf( log, INFO, "tls_cert: %s\n", s->tls_cert );
+    lprintf( log, INFO, "tls_key: %s\n", s->tls_key );
+    lprintf( log, INFO, "rate_limit: %lu\n", s->rate_limit );
+    lprintf( log, INFO, "rate_burst: %lu\n", s->rate_burst );
+    lprintf( log, INFO, "rate_total: %lu\n", s->rate_total );
+    for( r = s->rates; r != NULL; r = r->next ) {
+        lprintf( log, INFO, "client_rate: %s %lu %lu\n", r->macaddr,
+                r->rate, r->burst );
+    }
+    lprintf( log, INFO, "admit_rate: %lu\n", s->admit_rate );
+    lprintf( log, INFO, "admit_burst: %lu\n", s->admit_burst );
+    lprintf( log, INFO, "admit_check: %s\n", s->admit_check ? "yes" : "no" );
+    lprintf( log, INFO, "metrics_port: %u\n", s->metrics_port );
     while( ipr != NULL ) {
         lprintf( log, INFO, "iprange: %s, bits: %d\n",
                 inet_ntoa(ipr->net), ipr->maskbits);
@@ -219,6 +235,7 @@ void print_config( config_data_t *configfile )
         print_client_config( &configfile->u.c );
     lprintf( log, INFO, "config file: %s\n", configfile->cfgfile);
     lprintf( log, INFO, "tunfile: %s\n", configfile->tunfile);
+    lprintf( log, INFO, "tun mtu: %d\n", configfile->tun_mtu);
     lprintf( log, INFO, "logfile: %s\n", configfile->logfile);
     lprintf( log, INFO, "debugging is: %s\n", 
             configfile->debug ? "on" : "off" );
@@ -0,0 +1,246 @@
+/* -------------------------------------------------------------------------
+ * dns.c - htun cached host name resolver
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "common.h"
+#include "log.h"
+#include "util.h"
+#include "dns.h"
+
+typedef struct _dns_entry_t {
+    char name[DNS_NAME_MAX];
+    struct in_addr addr;
+    int valid;              /* addr has been resolved at least once */
+    int busy;               /* the lookup thread is on it */
+    time_t refresh;         /* when to look it up again */
+    time_t used;            /* when it was last asked for */
+    struct _dns_entry_t *next;
+} dns_entry_t;
+
+static dns_entry_t *entries = NULL;
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_wake = PTHREAD_COND_INITIALIZER; /* for the thread */
+static pthread_cond_t dns_done = PTHREAD_COND_INITIALIZER; /* for waiters */
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+static int dns_running = 0;
+
+/*
+ * asks the name servers for the A records of name, and places the first
+ * address in *addr and the smallest TTL in *ttl
+ * returns 0 on success, -1 if there was no answer
+ */
+static int dns_query( const char *name, struct in_addr *addr, int *ttl )
+{
+    unsigned char ans[NS_PACKETSZ * 4];
+    ns_msg msg;
+    ns_rr rr;
+    int len, i, found = 0;
+
+    if( (len=res_query(name, ns_c_in, ns_t_a, ans, sizeof(ans))) < 0 )
+        return -1;
+    if( ns_initparse(ans, min(len, (int)sizeof(ans)), &msg) < 0 ) return -1;
+
+    for( i = 0; i < ns_msg_count(msg, ns_s_an); i++ ) {
+        if( ns_parserr(&msg, ns_s_an, i, &rr) < 0 ) break;
+        if( ns_rr_type(rr) != ns_t_a || ns_rr_rdlen(rr) != 4 ) continue;
+        if( !found ) {
+            memcpy(&addr->s_addr, ns_rr_rdata(rr), 4);
+            *ttl = ns_rr_ttl(rr);
+            found = 1;
+        } else if( (int)ns_rr_ttl(rr) < *ttl ) {
+            *ttl = ns_rr_ttl(rr);
+        }
+    }
+    return found ? 0 : -1;
+}
+
+/*
+ * looks up name the slow way, with a TTL if the name servers know it.
+ * returns the TTL, or -1 on failure
+ */
+static int dns_resolve( const char *name, struct in_addr *addr )
+{
+    struct hostent host, *result;
+    char buf[4096];
+    int ttl;
+
+    if( dns_query(name, addr, &ttl) == 0 )
+        return max(DNS_MIN_TTL, min(ttl, DNS_MAX_TTL));
+
+    /* not in the DNS, but maybe in /etc/hosts */
+    if( (result=resolve(name, &host, buf, sizeof(buf))) == NULL )
+        return -1;
+    addr->s_addr = *(unsigned long *)(result->h_addr_list[0]);
+    return DNS_DEFAULT_TTL;
+}
+
+static void dns_unlock( void *unused )
+{
+    unused = unused;
+    pthread_mutex_unlock(&dns_mutex);
+}
+
+/*
+ * thread
+ *
+ * looks up new names, and names whose TTL is running out, and forgets the
+ * names nobody asks for anymore
+ */
+static void *dns_thread( void *unused )
+{
+    char name[DNS_NAME_MAX];
+    struct in_addr addr;
+    struct timespec ts;
+    dns_entry_t *e, **ep;
+    time_t now, next;
+    int ttl;
+
+    unused = unused;
+
+    pthread_mutex_lock(&dns_mutex);
+    pthread_cleanup_push(dns_unlock, NULL);
+    for(;;) {
+        now = time(NULL);
+        next = now + DNS_MIN_TTL;
+
+        for( ep = &entries; (e=*ep) != NULL; ) {
+            if( now - e->used > DNS_IDLE_MAX ) {
+                dprintf(log, DEBUG, "dns: forgetting %s", e->name);
+                *ep = e->next;
+                free(e);
+                continue;
+            }
+            ep = &e->next;
+            if( e->refresh > now ) {
+                next = min(next, e->refresh);
+                continue;
+            }
+
+            /* look it up without holding the lock. Only this thread
+             * removes entries, so e stays */
+            strcpy(name, e->name);
+            e->busy = 1;
+            pthread_mutex_unlock(&dns_mutex);
+            ttl = dns_resolve(name, &addr);
+            pthread_mutex_lock(&dns_mutex);
+            e->busy = 0;
+
+            now = time(NULL);
+            if( ttl < 0 ) {
+                lprintf(log, WARN, "Could not resolve host %s%s.", name,
+                        e->valid ? ", keeping the old address" : "");
+                e->refresh = now + DNS_FAIL_TTL;
+            } else {
+                if( e->valid && e->addr.s_addr != addr.s_addr ) {
+                    lprintf(log, INFO, "%s moved to %s", name,
+                            inet_ntoa(addr));
+                }
+                e->addr = addr;
+                e->valid = 1;
+                /* look again before it runs out */
+                e->refresh = now + ttl - ttl / 4;
+            }
+            next = min(next, e->refresh);
+            pthread_cond_broadcast(&dns_done);
+        }
+
+        ts.tv_sec = max(next, time(NULL) + 1);
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&dns_wake, &dns_mutex, &ts);
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+static void dns_start( void )
+{
+    pthread_t tid;
+
+    if( pthread_create(&tid, NULL, dns_thread, NULL) != 0 ) {
+        lprintf(log, ERROR, "Could not start the resolver thread.");
+        return;
+    }
+    pthread_detach(tid);
+    dns_running = 1;
+}
+
+int dns_lookup( const char *name, struct in_addr *addr, int wait )
+{
+    struct timespec ts;
+    dns_entry_t *e;
+    time_t now;
+    int rc = -1;
+
+    if( inet_aton(name, addr) ) return 0;
+    if( strlen(name) >= DNS_NAME_MAX ) return -1;
+
+    pthread_once(&dns_once, dns_start);
+    if( !dns_running ) {
+        /* no thread to do it, so do it here */
+        return dns_resolve(name, addr) < 0 ? -1 : 0;
+    }
+
+    now = time(NULL);
+    pthread_mutex_lock(&dns_mutex);
+    for( e = entries; e != NULL; e = e->next ) {
+        if( strcmp(e->name, name) == 0 ) break;
+    }
+    if( e == NULL ) {
+        if( (e=calloc(1, sizeof(dns_entry_t))) == NULL ) {
+            lprintf(log, ERROR, "Unable to malloc() resolver entry!");
+            goto out;
+        }
+        strcpy(e->name, name);
+        e->next = entries;
+        entries = e;
+        pthread_cond_signal(&dns_wake);
+    }
+    e->used = now;
+
+    if( !e->valid && wait > 0 ) {
+        ts.tv_sec = now + wait;
+        ts.tv_nsec = 0;
+        while( !e->valid && (e->busy || e->refresh <= now) ) {
+            if( pthread_cond_timedwait(&dns_done, &dns_mutex, &ts)
+                    == ETIMEDOUT ) break;
+        }
+    }
+    if( e->valid ) {
+        *addr = e->addr;
+        rc = 0;
+    }
+
+out:
+    pthread_mutex_unlock(&dns_mutex);
+    return rc;
+}
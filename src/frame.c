@@ -0,0 +1,388 @@
+/* -------------------------------------------------------------------------
+ * frame.c - htun protocol 3 framing functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "log.h"
+#include "queue.h"
+#include "util.h"
+#include "pep.h"
+#include "websock.h"
+#include "frame.h"
+
+/* The frame type for a packet, from its tun header, or 0 if it has none */
+static inline int fr_type( const char *pkt ) {
+    switch( pi_proto(pkt) ) {
+        case PI_IPV4:   return FR_IPV4;
+        case PI_IPV6:   return FR_IPV6;
+        case PEP_PROTO: return FR_PEP;
+    }
+    return 0;
+}
+
+/* The tun header protocol for a data frame type */
+static inline int fr_proto( int type ) {
+    return type == FR_IPV4 ? PI_IPV4 : type == FR_IPV6 ? PI_IPV6 : PEP_PROTO;
+}
+
+/* Writes a frame into buf, returning how many bytes it took */
+static size_t fr_put( char *buf, int type, unsigned int seq,
+                      const char *data, size_t len ) {
+    buf[0] = type;
+    buf[1] = 0;
+    buf[2] = (len >> 8) & 0xFF;
+    buf[3] = len & 0xFF;
+    buf[4] = (seq >> 24) & 0xFF;
+    buf[5] = (seq >> 16) & 0xFF;
+    buf[6] = (seq >> 8) & 0xFF;
+    buf[7] = seq & 0xFF;
+    if( len ) memcpy(buf + FR_HDR_LEN, data, len);
+    return FR_HDR_LEN + len;
+}
+
+/* Writes a time frame into buf if f has a lat_t, returning its length */
+static size_t fr_put_time( fr_t *f, char *buf ) {
+    unsigned int t[3];
+    char data[FR_TIME_LEN];
+    int i;
+
+    if( !f->lat ) return 0;
+    lat_stamp(f->lat, &t[0], &t[1], &t[2]);
+    for( i=0; i<3; i++ ) {
+        data[4*i] = (t[i] >> 24) & 0xFF;
+        data[4*i+1] = (t[i] >> 16) & 0xFF;
+        data[4*i+2] = (t[i] >> 8) & 0xFF;
+        data[4*i+3] = t[i] & 0xFF;
+    }
+    return fr_put(buf, FR_TIME, 0, data, FR_TIME_LEN);
+}
+
+/* Takes in the time frame payload at p */
+static void fr_got_time( fr_t *f, const unsigned char *p ) {
+    unsigned int t[3];
+    int i;
+
+    for( i=0; i<3; i++ ) {
+        t[i] = (unsigned int)p[4*i] << 24 | p[4*i+1] << 16 | p[4*i+2] << 8 |
+               p[4*i+3];
+    }
+    lat_peer(f->lat, t[0], t[1], t[2]);
+}
+
+static void fr_unlock( void *mutex ) {
+    pthread_mutex_unlock((pthread_mutex_t *)mutex);
+}
+
+/* Sends len bytes of frames in buf as one message */
+static int fr_write( fr_t *f, int fd, char *buf, size_t len, int mask ) {
+    int rc;
+
+    pthread_cleanup_push(fr_unlock, &f->wlock);
+    pthread_mutex_lock(&f->wlock);
+    rc = ws_send_frame(fd, WS_OP_BIN, buf, len, mask);
+    pthread_cleanup_pop(1);
+
+    if( rc != -1 ) f->last_send = time(NULL);
+    return rc;
+}
+
+/* Frees the held frames up to and including seq */
+static void fr_acked( fr_t *f, unsigned int seq ) {
+    fr_held_t *h;
+
+    pthread_mutex_lock(&f->lock);
+    if( FR_SEQ_AFTER(seq, f->next_seq - 1) ) {
+        lprintf(log, WARN, "Peer acked frame %u, we only sent %u.", seq,
+                f->next_seq - 1);
+    } else {
+        while( (h=f->head) != NULL && !FR_SEQ_AFTER(h->seq, seq) ) {
+            f->head = h->next;
+            if( f->resend == h ) f->resend = h->next;
+            f->held -= pktlen(h->pkt);
+            free(h->pkt);
+            free(h);
+        }
+        if( f->head == NULL ) f->tail = &f->head;
+        pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Frees the held frames, the lock must be held */
+static void fr_drop_held( fr_t *f ) {
+    fr_held_t *h;
+
+    while( (h=f->head) != NULL ) {
+        f->head = h->next;
+        free(h->pkt);
+        free(h);
+    }
+    f->tail = &f->head;
+    f->resend = NULL;
+    f->held = 0;
+}
+
+fr_t *fr_init( void ) {
+    fr_t *f;
+
+    if( (f=calloc(1, sizeof(fr_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() frame state!");
+        return NULL;
+    }
+    f->next_seq = 1;
+    f->tail = &f->head;
+    f->last_send = time(NULL);
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    pthread_mutex_init(&f->wlock, NULL);
+    return f;
+}
+
+void fr_destroy( fr_t **f ) {
+    if( !f || !*f ) return;
+
+    fr_drop_held(*f);
+    pthread_mutex_destroy(&(*f)->lock);
+    pthread_cond_destroy(&(*f)->cond);
+    pthread_mutex_destroy(&(*f)->wlock);
+    free(*f);
+    *f = NULL;
+}
+
+void fr_reset( fr_t *f ) {
+    pthread_mutex_lock(&f->lock);
+    fr_drop_held(f);
+    f->next_seq = 1;
+    f->rcvd = f->acked = 0;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+void fr_resume( fr_t *f ) {
+    pthread_mutex_lock(&f->lock);
+    f->resend = f->head;
+    /* the ack may have been lost with the connection */
+    f->acked = f->rcvd - 1;
+    pthread_mutex_unlock(&f->lock);
+}
+
+int fr_send( fr_t *f, int fd, queue_t *q, int mask ) {
+    size_t total = 0, stamp;
+    volatile size_t size;   /* these two live across the setjmp() in */
+    volatile int cnt = 0;   /* pthread_cleanup_push() */
+    struct timespec ts;
+    fr_held_t *h;
+    char *buf, *pkt;
+    int type, rc;
+
+    size = min(q->totsize + 4 * q->nr_nodes, WS_MAX_MESSAGE);
+    if( f->resend ) size = WS_MAX_MESSAGE;
+    if( (buf=malloc(size + 3*FR_HDR_LEN + FR_TIME_LEN +
+                    HTUN_MAXPACKET)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() message buffer!");
+        return -1;
+    }
+
+    pthread_cleanup_push(fr_unlock, &f->lock);
+    pthread_mutex_lock(&f->lock);
+
+    /* the peer has to catch up before we hold any more for it */
+    if( f->held >= FR_MAX_HELD && !f->resend ) {
+        ts.tv_sec = time(NULL) + 1;
+        ts.tv_nsec = 0;
+        pthread_cond_timedwait(&f->cond, &f->lock, &ts);
+        if( f->held >= FR_MAX_HELD ) size = 0;
+    }
+
+    total = stamp = fr_put_time(f, buf);
+    if( f->rcvd != f->acked ) {
+        total += fr_put(buf + total, FR_ACK, f->rcvd, NULL, 0);
+        f->acked = f->rcvd;
+    }
+
+    /* what the peer may have missed goes first, in order */
+    for( h=f->resend; h && total < size; h=h->next ) {
+        total += fr_put(buf + total, fr_type(h->pkt), h->seq, h->pkt + 4,
+                        pktlen(h->pkt) - 4);
+        cnt++;
+    }
+    f->resend = h;
+
+    while( !f->resend && total < size ) {
+        if( (pkt=q_remove(q, 0, NULL)) == NULL ) break;
+        if( !(type=fr_type(pkt)) || (h=malloc(sizeof(*h))) == NULL ) {
+            if( type ) lprintf(log, ERROR, "Unable to malloc() held frame!");
+            free(pkt);
+            continue;
+        }
+        h->seq = f->next_seq++;
+        h->pkt = pkt;
+        h->next = NULL;
+        *f->tail = h;
+        f->tail = &h->next;
+        f->held += pktlen(pkt);
+
+        total += fr_put(buf + total, type, h->seq, pkt + 4, pktlen(pkt) - 4);
+        cnt++;
+    }
+
+    pthread_cleanup_pop(1);
+
+    /* the time alone is not worth a message */
+    rc = total > stamp ? fr_write(f, fd, buf, total, mask) : 0;
+    free(buf);
+
+    dprintf(log, DEBUG, "sent %d frames (%lu bytes) in one message", cnt,
+            total);
+    return rc == -1 ? -1 : cnt;
+}
+
+int fr_send_ctl( fr_t *f, int fd, int type, unsigned int seq,
+                 const char *data, size_t len, int mask ) {
+    char buf[FR_HDR_LEN + 128];
+
+    if( len > sizeof(buf) - FR_HDR_LEN ) len = sizeof(buf) - FR_HDR_LEN;
+    return fr_write(f, fd, buf, fr_put(buf, type, seq, data, len), mask);
+}
+
+int fr_tick( fr_t *f, int fd, int mask ) {
+    char buf[3*FR_HDR_LEN + FR_TIME_LEN];
+    size_t len, stamp;
+
+    len = stamp = fr_put_time(f, buf);
+    pthread_mutex_lock(&f->lock);
+    if( f->rcvd != f->acked ) {
+        len += fr_put(buf + len, FR_ACK, f->rcvd, NULL, 0);
+        f->acked = f->rcvd;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    if( time(NULL) - f->last_send >= FR_KEEPALIVE_SECS ) {
+        len += fr_put(buf + len, FR_KEEPALIVE, 0, NULL, 0);
+    }
+    return len > stamp ? fr_write(f, fd, buf, len, mask) : 0;
+}
+
+int fr_recv( fr_t *f, rbuf_t *rb, queue_t *q, int mask ) {
+    int fd = rb->fd;
+    unsigned char *p;
+    unsigned int seq;
+    char *msg, *pkt;
+    size_t len, off, flen;
+    int opcode, type, cnt = 0, closing = 0;
+
+    if( (msg=ws_recv_message(rb, &opcode, &len, mask)) == NULL ) return -1;
+    if( opcode != WS_OP_BIN ) {
+        lprintf(log, WARN, "Ignoring non-binary message on fd #%d.", fd);
+        free(msg);
+        return 0;
+    }
+
+    for( off=0; off < len; off += FR_HDR_LEN + flen ) {
+        p = (unsigned char *)msg + off;
+        if( len - off < FR_HDR_LEN ||
+            (flen=p[2] << 8 | p[3]) > len - off - FR_HDR_LEN ) {
+            lprintf(log, WARN, "Truncated frame in message on fd #%d.", fd);
+            goto err;
+        }
+        type = p[0];
+        seq = (unsigned int)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+
+        switch( type ) {
+            case FR_IPV4:
+            case FR_IPV6:
+            case FR_PEP:
+                /* resent after a reconnect, but we had it */
+                if( !FR_SEQ_AFTER(seq, f->rcvd) ) break;
+                if( seq != f->rcvd + 1 ) {
+                    lprintf(log, WARN, "Frames %u to %u missing on fd #%d.",
+                            f->rcvd + 1, seq - 1, fd);
+                    goto err;
+                }
+                if( (pkt=malloc(flen + 4)) == NULL ) {
+                    lprintf(log, ERROR, "Unable to malloc() space for packet!");
+                    goto err;
+                }
+                pkt[0] = pkt[1] = 0;
+                pkt[2] = fr_proto(type) >> 8;
+                pkt[3] = fr_proto(type) & 0xFF;
+                memcpy(pkt + 4, p + FR_HDR_LEN, flen);
+                if( flen < 20 || (size_t)pktlen(pkt) != flen + 4 ) {
+                    lprintf(log, WARN, "Bad packet length in frame on fd #%d.",
+                            fd);
+                    free(pkt);
+                    goto err;
+                }
+                if( q_add(q, pkt, Q_WAIT, flen + 4) == -1 ) goto err;
+
+                pthread_mutex_lock(&f->lock);
+                f->rcvd = seq;
+                pthread_mutex_unlock(&f->lock);
+                cnt++;
+                break;
+            case FR_ACK:
+                fr_acked(f, seq);
+                break;
+            case FR_KEEPALIVE:
+                break;
+            case FR_TIME:
+                if( flen >= FR_TIME_LEN ) fr_got_time(f, p + FR_HDR_LEN);
+                break;
+            case FR_CONTROL:
+                if( flen == 5 && !memcmp(p + FR_HDR_LEN, "close", 5) ) {
+                    closing = 1;
+                } else {
+                    lprintf(log, INFO, "Peer on fd #%d sent control '%.*s'.",
+                            fd, (int)flen, p + FR_HDR_LEN);
+                }
+                break;
+            default:
+                dprintf(log, DEBUG, "skipping frame of type %d", type);
+                break;
+        }
+    }
+    free(msg);
+
+    if( closing ) return -2;
+
+    /* ack right away, the writer may have nothing to carry it */
+    if( cnt ) {
+        char ack[2*FR_HDR_LEN + FR_TIME_LEN];
+        size_t len = fr_put_time(f, ack);
+
+        pthread_mutex_lock(&f->lock);
+        seq = f->rcvd;
+        f->acked = seq;
+        pthread_mutex_unlock(&f->lock);
+        len += fr_put(ack + len, FR_ACK, seq, NULL, 0);
+        if( fr_write(f, fd, ack, len, !mask) == -1 ) return -1;
+    }
+    return cnt;
+
+err:
+    free(msg);
+    return -1;
+}
@@ -31,11 +31,17 @@
 #include "common.h"
 #include "iprange.h"
 #include "util.h"
+#include "aead.h"
+#include "tls.h"
+#include "shape.h"
 
 extern int lineno;
 extern int yylineno;
 config_data_t *config; /* the config struct, created in the lexer */
 char *linehead, *textpoint;
+
+static void add_proxy(char *hostport);
+static void set_server(char *name);
 %}
 
 %union {
@@ -44,7 +50,7 @@ char *linehead, *textpoint;
 
 
 /* global option tokens */
-%token DEMONIZE TEST TUN_FILE LOG_FILE ANSWER FNAME 
+%token DEMONIZE TEST TUN_FILE LOG_FILE ANSWER FNAME TUN_MTU
 
 /* grammar related tokens */
 %token SPACE NEWLINE LEFT_BRACE RIGHT_BRACE CLIENT SERVER OPTION
@@ -53,11 +59,17 @@ char *linehead, *textpoint;
 %token DO_ROUTING SERVER_IP PROXY_IP IP SERVER_PORT PROXY_PORT PORT 
 %token NUM IP_RANGE RANGE MAX_POLL_INTERVAL MIN_POLL_INTERVAL_MSEC
 %token POLL_BACKOFF_RATE ETHDEV IFNAME ACKWAIT PROTOCOL PROXY_USER USER
-%token PROXY_PASS PASS CON_T RECON_T RECON_SLEEP CHAN2_IDLE
+%token PROXY_PASS PASS CON_T RECON_T RECON_SLEEP CHAN2_IDLE WEBSOCKET
+%token EVENT_LOOP SPARE_CONNS SPARE_IDLE TCP_FASTOPEN PROXY HOSTPORT
+%token SPLIT_TCP_PORT THIN_ACKS COMPRESS COMPRESS_HEADERS PSK CIPHER
+%token TLS TLS_CA TLS_CERT TLS_KEY
+%token RATE_LIMIT RATE_BURST RATE_TOTAL CLIENT_RATE MACRATE
+%token ADMIT_RATE ADMIT_BURST ADMIT_CHECK METRICS_PORT
 
 /* server option tokens - some are shaed with the client, eg SERVER_PORT */
 %token SRV_RESPONSE_DELAY MAX_CLIENTS MAX_PENDING IDLE_DISCONNECT CLIDATA_TIMEOUT SERVER_PORT_2
 %token REDIR_HOST REDIR_PORT TEXT MIN_NACK_DELAY PKT_COUNT_THRESHOLD PKT_MAX_INTERVAL MAX_RESPONSE_DELAY
+%token SPLIT_TCP
 
 %start config 
 %%
@@ -132,6 +144,9 @@ g_opt:     DEMONIZE space ANSWER {
                                     memset(config->logfile, '\0', PATH_MAX);
                                     snprintf(config->logfile, PATH_MAX-1, "%s", yylval.name);
                                  }
+          | TUN_MTU space NUM {
+                                config->tun_mtu = atoi(yylval.name);
+                              }
           ;
 
 c_rules:    c_rule
@@ -149,13 +164,26 @@ c_opt:   DO_ROUTING space ANSWER
                 config->u.c.do_routing = get_answer(yylval.name, "yes", "no"); 
                 //yylval.name = "";
             }
+       | WEBSOCKET space ANSWER 
+            { 
+                config->u.c.websocket = get_answer(yylval.name, "yes", "no"); 
+            }
+       | EVENT_LOOP space ANSWER 
+            { 
+                config->u.c.event_loop = get_answer(yylval.name, "yes", "no"); 
+            }
+       | TCP_FASTOPEN space ANSWER 
+            { 
+                config->u.c.tcp_fastopen = get_answer(yylval.name, "yes", "no"); 
+            }
        | SERVER_IP space IP 
             {
-                set_ip(&config->u.c.server_ip, config->u.c.server_ip_str, yylval.name);
+                set_server(yylval.name);
             }
        | PROXY_IP space IP 
             {
                 set_ip(&config->u.c.proxy_ip, config->u.c.proxy_ip_str, yylval.name);
+                strncpy(config->u.c.proxy_host, yylval.name, DNS_NAME_MAX-1);
             }
        | SERVER_PORT space PORT 
             {
@@ -169,6 +197,10 @@ c_opt:   DO_ROUTING space ANSWER
             {
                 config->u.c.proxy_port = htons( atol(yylval.name) );
             }
+       | PROXY space HOSTPORT 
+            {
+                add_proxy(yylval.name);
+            }
        | MAX_POLL_INTERVAL space NUM 
             {
                 config->u.c.max_poll_interval = atoi(yylval.name);
@@ -191,12 +223,14 @@ c_opt:   DO_ROUTING space ANSWER
             }
        | PROTOCOL space NUM 
             {
-                if( strcmp(yylval.name,"2") == 0 ) {
+                if( strcmp(yylval.name,"3") == 0 ) {
+                    config->u.c.protocol = 3;
+                } else if( strcmp(yylval.name,"2") == 0 ) {
                     config->u.c.protocol = 2;
                 } else if( strcmp(yylval.name,"1") == 0 ) {
                     config->u.c.protocol = 1;
                 } else {
-                    yy_error("unrecognized protocol", "must be 1 or 2");
+                    yy_error("unrecognized protocol", "must be 1, 2 or 3");
                 }
             }
        | IP_RANGE space RANGE   
@@ -232,6 +266,59 @@ c_opt:   DO_ROUTING space ANSWER
             {
                 config->u.c.channel_2_idle_allow = atoi(yylval.name);
             }
+       | SPARE_CONNS space NUM
+            {
+                config->u.c.spare_connections = atoi(yylval.name);
+            }
+       | SPARE_IDLE space NUM
+            {
+                config->u.c.spare_max_idle_sec = atoi(yylval.name);
+            }
+       | SPLIT_TCP_PORT space PORT
+            {
+                config->u.c.split_tcp_port = atol(yylval.name);
+            }
+       | THIN_ACKS space ANSWER 
+            { 
+                config->u.c.thin_acks = get_answer(yylval.name, "yes", "no"); 
+            }
+       | COMPRESS space ANSWER 
+            { 
+                config->u.c.compress = get_answer(yylval.name, "yes", "no"); 
+            }
+       | COMPRESS_HEADERS space ANSWER 
+            { 
+                config->u.c.compress_headers = 
+                    get_answer(yylval.name, "yes", "no"); 
+            }
+       | PSK space PASS 
+            {
+                strncpy(config->u.c.psk, yylval.name, 80);
+            }
+       | CIPHER space TEXT 
+            {
+                if( !(config->u.c.cipher=aead_cipher(yylval.name)) ) {
+                    yy_error("unrecognized cipher",
+                             "must be chacha20-poly1305 or aes-256-gcm");
+                }
+            }
+       | TLS space TEXT 
+            {
+                if( strcmp(yylval.name, "connect") == 0 ) {
+                    config->u.c.tls = TLS_CONNECT;
+                } else if( strcmp(yylval.name, "direct") == 0 ) {
+                    config->u.c.tls = TLS_DIRECT;
+                } else if( strcmp(yylval.name, "no") == 0 ) {
+                    config->u.c.tls = TLS_NONE;
+                } else {
+                    yy_error("unrecognized tls mode",
+                             "must be no, direct or connect");
+                }
+            }
+       | TLS_CA space FNAME 
+            {
+                snprintf(config->u.c.tls_ca, PATH_MAX, "%s", yylval.name);
+            }
        ;
 
 s_rules:    s_rule
@@ -292,6 +379,71 @@ s_opt: MAX_CLIENTS space NUM
             {
                 config->u.s.max_response_delay = atoi( yylval.name );
             }
+       | SPLIT_TCP space ANSWER 
+            {
+                config->u.s.split_tcp = get_answer(yylval.name, "yes", "no");
+            }
+       | COMPRESS space ANSWER 
+            {
+                config->u.s.compress = get_answer(yylval.name, "yes", "no");
+            }
+       | COMPRESS_HEADERS space ANSWER 
+            {
+                config->u.s.compress_headers =
+                    get_answer(yylval.name, "yes", "no");
+            }
+       | PSK space PASS 
+            {
+                strncpy(config->u.s.psk, yylval.name, 80);
+            }
+       | TLS_CERT space FNAME 
+            {
+                snprintf(config->u.s.tls_cert, PATH_MAX, "%s", yylval.name);
+            }
+       | TLS_KEY space FNAME 
+            {
+                snprintf(config->u.s.tls_key, PATH_MAX, "%s", yylval.name);
+            }
+       | RATE_LIMIT space NUM 
+            {
+                config->u.s.rate_limit = strtoul(yylval.name, NULL, 10);
+            }
+       | RATE_BURST space NUM 
+            {
+                config->u.s.rate_burst = strtoul(yylval.name, NULL, 10);
+            }
+       | RATE_TOTAL space NUM 
+            {
+                config->u.s.rate_total = strtoul(yylval.name, NULL, 10);
+            }
+       | CLIENT_RATE space MACRATE 
+            {
+                char mac[18];
+                unsigned long rate, burst = 0;
+
+                if( sscanf(yylval.name, "%17s %lu %lu", mac, &rate, &burst) < 2
+                    || shape_add_rule(&config->u.s.rates, mac, rate,
+                                      burst) == -1 ) {
+                    die_error(yylineno, "not a valid client rate",
+                        "must be \"mac_address rate [burst]\"");
+                }
+            }
+       | ADMIT_RATE space NUM 
+            {
+                config->u.s.admit_rate = strtoul(yylval.name, NULL, 10);
+            }
+       | ADMIT_BURST space NUM 
+            {
+                config->u.s.admit_burst = strtoul(yylval.name, NULL, 10);
+            }
+       | ADMIT_CHECK space ANSWER 
+            {
+                config->u.s.admit_check = get_answer(yylval.name, "yes", "no");
+            }
+       | METRICS_PORT space PORT 
+            {
+                config->u.s.metrics_port = atol(yylval.name);
+            }
        | IP_RANGE space RANGE 
             {
                 if( !add_iprange(&config->u.s.ipr, yylval.name) ) {
@@ -343,6 +495,43 @@ static void set_ip(struct in_addr *a, char *dst, char *src)
     strncpy(dst, inet_ntoa(*a), 15);
 }
 
+/*
+ * the server is only named in requests, so a host name is passed on for
+ * the proxy to resolve, the client may not even be able to
+ */
+static void set_server(char *name)
+{
+    struct client_config *c = &config->u.c;
+
+    if( inet_aton(name, &c->server_ip) ) {
+        strncpy(c->server_ip_str, inet_ntoa(c->server_ip), 15);
+    } else {
+        c->server_ip.s_addr = 0;
+        strncpy(c->server_ip_str, name, DNS_NAME_MAX-1);
+    }
+}
+
+/* adds host:port to the proxies tried besides proxy_ip */
+static void add_proxy(char *hostport)
+{
+    struct client_config *c = &config->u.c;
+    struct proxy_addr *p;
+    char *colon, ipstr[16];
+
+    if( c->nr_extra_proxies >= MAX_PROXIES - 1 ) {
+        yy_error("too many proxies", "proxy_ip and up to 7 proxy lines");
+    }
+    p = &c->extra_proxies[c->nr_extra_proxies];
+
+    colon = strrchr(hostport, ':');
+    *colon = '\0';
+    set_ip(&p->ip, ipstr, hostport);
+    strncpy(p->host, hostport, DNS_NAME_MAX-1);
+    p->port = htons( atol(colon+1) );
+    *colon = ':';
+    c->nr_extra_proxies++;
+}
+
 static int get_answer(char *name, char *true_val, char *false_val)
 {
     if(strstr(name, true_val) != NULL)
@@ -29,278 +29,1057 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "http.h"
 #include "common.h"
 #include "log.h"
 #include "util.h"
+#include "dns.h"
+#include "zbatch.h"
+#include "tpool.h"
 
-int getheaders( int fd, char *buf, size_t len ){
-    char line[HTTP_HEADER_MAX], *cp;
+/* How many pieces proxy_request() gathers into one writev() */
+#define PROXY_IOV 64
 
-    *line=*buf='\0';
-    /* Keep getting lines until we get a blank line ("\n" or "\r\n") */
-    while( !(*line == '\n' || (line[0] == '\r' && line[1] == '\n')) ) {
-        if( recvline( line, HTTP_HEADER_MAX, fd ) == NULL ) return -1;
-        dprintf(log, DEBUG, "Just got header line: %s", line);
-        strncat( buf, line, len-strlen(line)-5 );
-        buf[len-1]='\0';
+/* How long a decoy request waits for redirect_host to be looked up, which
+ * only happens if it is the first one */
+#define PROXY_DNS_WAIT 5
+
+/* Idle connections to redirect_host kept for decoy requests, and for how
+ * long. Keep it below the keep-alive timeout of the server there */
+#define DECOY_POOL_MAX 4
+#define DECOY_POOL_IDLE 10
+
+/* How many decoy responses are cached, for how long, and how large they
+ * may be to be cached at all */
+#define DECOY_CACHE_ENTRIES 32
+#define DECOY_CACHE_TTL 60
+#define DECOY_CACHE_MAX_BODY 65536
+
+const http_tmpl_t rsp_200 = HTTP_TMPL(HEAD_200, TAIL_NONE, "");
+const http_tmpl_t rsp_204 = HTTP_TMPL(HEAD_204, TAIL_NONE, "");
+const http_tmpl_t rsp_400 = HTTP_TMPL(HEAD_400, TAIL_PLAIN, BODY_400);
+const http_tmpl_t rsp_412 = HTTP_TMPL(HEAD_412, TAIL_NONE, BODY_412);
+const http_tmpl_t rsp_500_busy =
+                       HTTP_TMPL(HEAD_500_BUSY, TAIL_PLAIN, BODY_500_BUSY);
+const http_tmpl_t rsp_500_err =
+                       HTTP_TMPL(HEAD_500_ERR, TAIL_PLAIN, BODY_500_ERR);
+const http_tmpl_t rsp_501 = HTTP_TMPL(HEAD_501, TAIL_PLAIN, BODY_501);
+const http_tmpl_t rsp_503 = HTTP_TMPL(HEAD_503, TAIL_PLAIN, BODY_503);
+
+/* The URIs of the POST requests, and what parse_request() maps them to */
+static const struct {
+    const char *uri;
+    size_t len;
+    int reqtype;
+} post_uris[] = {
+    { "CP1", 3, REQ_CP1 },
+    { "CP2", 3, REQ_CP2 },
+    { "S",   1, REQ_S   },
+    { "P",   1, REQ_P   },
+    { "CR",  2, REQ_CR  },
+    { "R",   1, REQ_R   },
+    { "F",   1, REQ_F   },
+    { NULL,  0, 0       }
+};
+
+char *slice_copy( const slice_t *s, char *buf, size_t len ) {
+    size_t n = min(s->len, len-1);
+
+    memcpy(buf, s->ptr, n);
+    buf[n] = '\0';
+    return buf;
+}
+
+int slice_eq( const slice_t *s, const char *str ) {
+    return s->ptr && strlen(str) == s->len && 
+        !xstrncasecmp(s->ptr, str, s->len);
+}
+
+/* Returns nonzero if the comma-separated list in v contains token tok */
+static int has_token( const char *v, size_t vlen, const char *tok ) {
+    size_t tlen = strlen(tok);
+    const char *end = v + vlen;
+
+    while( v < end ) {
+        while( v < end && (*v == ' ' || *v == ',') ) v++;
+        if( (size_t)(end - v) >= tlen && !xstrncasecmp(v, tok, tlen) &&
+            (v + tlen == end || v[tlen] == ',' || v[tlen] == ' ') ) return 1;
+        while( v < end && *v != ',' ) v++;
     }
-    cp=buf+strlen(buf);
-    while( cp > buf && (*(cp-1) == '\r' || *(cp-1) == '\n') ) cp--;
-    strcpy( cp, "\r\n\r\n" );
     return 0;
 }
 
-inline char *header_value( const char *headers, const char *header_name ){
-    char *cp;
+/*
+ * Returns the seconds of the max-age or s-maxage directive in the
+ * Cache-Control value v, or 0 if there is none.
+ */
+static unsigned long max_age( const char *v, size_t vlen ) {
+    const char *end = v + vlen;
+    unsigned long age = 0;
+    size_t n;
+
+    while( v < end ) {
+        while( v < end && (*v == ' ' || *v == ',') ) v++;
+        n = 0;
+        if( (size_t)(end - v) > 8 && !xstrncasecmp(v, "max-age=", 8) ) n = 8;
+        if( (size_t)(end - v) > 9 && !xstrncasecmp(v, "s-maxage=", 9) ) n = 9;
+        if( n ) {
+            for( v += n, age = 0; v < end && isdigit((int)*v); v++ ) {
+                if( age < 1000000000 ) age = age * 10 + (*v - '0');
+            }
+        }
+        while( v < end && *v != ',' ) v++;
+    }
+    return age;
+}
+
+/*
+ * Maps a request line straight to its REQ_* type. Requests are of the form
+ * (this is a regex):
+ *
+ * (POST (http://host(:port)?)?/(CP[12]|S|P|CR|R|F)|GET .*) HTTP/1\.[01]
+ */
+static int request_type( const char *p, size_t len ) {
+    const char *end = p + len, *uri, *uend;
+    int get, i;
+
+    if( len > 4 && !xstrncasecmp(p, "GET ", 4) ) {
+        get = 1;
+        uri = p + 4;
+    } else if( len > 5 && !xstrncasecmp(p, "POST ", 5) ) {
+        get = 0;
+        uri = p + 5;
+    } else {
+        dprintf(log, DEBUG, "This is neither POST nor GET.");
+        return REQ_ERR;
+    }
+
+    while( uri < end && *uri == ' ' ) uri++;
+    if( (uend=memchr(uri, ' ', end - uri)) == NULL ) uend = end;
+
+    /* If we're now on http://, skip http://host.name and move to the path */
+    if( (uend - uri > 7 && !xstrncasecmp(uri, "http://", 7)) ||
+        (uend - uri > 8 && !xstrncasecmp(uri, "https://", 8)) ) {
+        uri = memchr(uri, '/', uend - uri) + 2;
+        if( (uri=memchr(uri, '/', uend - uri)) == NULL ) {
+            return get ? REQ_GET : REQ_ERR;
+        }
+    }
+    /* Skip the leading /  */
+    if( uri < uend && *uri == '/' ) uri++;
+
+    /* A GET is either a WebSocket upgrade or something for the decoy */
+    if( get ) {
+        if( uend - uri == 2 && !xstrncasecmp(uri, "WS", 2) ) return REQ_WS;
+        return REQ_GET;
+    }
+
+    for( i=0; post_uris[i].uri; i++ ) {
+        if( (size_t)(uend - uri) == post_uris[i].len &&
+            !xstrncasecmp(uri, post_uris[i].uri, post_uris[i].len) ) {
+            return post_uris[i].reqtype;
+        }
+    }
+
+    lprintf(log, WARN, "Unknown request: \"%.*s\"", (int)(uend - uri), uri);
+    return REQ_ERR;
+}
 
-    if( !headers ) return NULL;
+/*
+ * Reads the three numbers separated by blanks in the value from v up to
+ * end, which need not be NUL terminated. Returns 0 on success, -1 if there
+ * are not exactly three that fit.
+ */
+static int parse_uints( const char *v, const char *end, unsigned int *a,
+                        unsigned int *b, unsigned int *c ) {
+    unsigned int *n[3];
+    unsigned long x;
+    int i;
 
-    while( (cp=strstr(headers, header_name)) ) {
-        if( cp == headers || cp[-1] == '\n' ) {
-            if( !(cp=strchr(cp, ':')) ) continue;
-            while (*(++cp) == ' ');
-            return cp;
+    n[0] = a;
+    n[1] = b;
+    n[2] = c;
+    for( i = 0; i < 3; i++ ) {
+        while( v < end && (*v == ' ' || *v == '\t') ) v++;
+        if( v == end || !isdigit((int)*v) ) return -1;
+        for( x = 0; v < end && isdigit((int)*v); v++ ) {
+            if( x > (UINT_MAX - (*v - '0')) / 10 ) return -1;
+            x = x * 10 + (*v - '0');
         }
+        *n[i] = x;
     }
-    return NULL;
+    return v == end ? 0 : -1;
 }
 
-inline int get_content_length( char *headers ) {
-    char *cp = header_value(headers, HDR_CONTENT_LENGTH);
-    int len;
+/*
+ * Picks out the header fields htun cares about from one header line.
+ * Returns -1 if one of them is not acceptable.
+ */
+static int parse_header( const char *p, size_t len, http_msg_t *msg ) {
+    const char *colon = memchr(p, ':', len), *v, *end = p + len;
+    size_t nlen, vlen;
+
+    if( !colon ) return 0;
+    nlen = colon - p;
+
+    for( v = colon + 1; v < end && (*v == ' ' || *v == '\t'); v++ );
+    while( end > v && (end[-1] == ' ' || end[-1] == '\t') ) end--;
+    vlen = end - v;
 
-    if( !cp ) return -1;
-    if( cp[0] == '0' && isspace(cp[1]) ) return 0;
-    len = strtol(cp, NULL, 0);
-    return len ? len : -1;
+#define IS_HDR(name) (nlen == sizeof(name)-1 && !xstrncasecmp(p, name, nlen))
+    if( IS_HDR("Content-Length") ) {
+        msg->content_length = 0;
+        while( v < end && isdigit((int)*v) ) {
+            msg->content_length = msg->content_length * 10 + (*v++ - '0');
+            if( msg->content_length > HTTP_MAX_LENGTH ) return -1;
+        }
+        if( !vlen ) msg->content_length = -1;
+    } else if( IS_HDR("Connection") || IS_HDR("Proxy-Connection") ) {
+        if( has_token(v, vlen, "close") ) msg->keepalive = 0;
+        else if( has_token(v, vlen, "keep-alive") ) msg->keepalive = 1;
+    } else if( IS_HDR("Transfer-Encoding") ) {
+        msg->chunked = has_token(v, vlen, "chunked");
+    } else if( IS_HDR("Upgrade") ) {
+        msg->upgrade.ptr = v;
+        msg->upgrade.len = vlen;
+    } else if( IS_HDR("Sec-WebSocket-Key") ) {
+        msg->ws_key.ptr = v;
+        msg->ws_key.len = vlen;
+    } else if( IS_HDR("Sec-WebSocket-Accept") ) {
+        msg->ws_accept.ptr = v;
+        msg->ws_accept.len = vlen;
+    } else if( IS_HDR("Cache-Control") ) {
+        if( has_token(v, vlen, "no-store") || has_token(v, vlen, "private") ||
+            has_token(v, vlen, "no-cache") ) msg->nocache = 1;
+        if( has_token(v, vlen, "public") || max_age(v, vlen) > 0 ) {
+            msg->cacheable = 1;
+        }
+    } else if( IS_HDR("Set-Cookie") || IS_HDR("Vary") ||
+               IS_HDR("Authorization") || IS_HDR("Cookie") ) {
+        /* a response for this client only, or a request for one */
+        msg->nocache = 1;
+    } else if( IS_HDR("X-Htun-Seq") ) {
+        msg->seq = strtoul(v, NULL, 10);
+    } else if( IS_HDR("X-Htun-Ack") ) {
+        msg->ack = strtoul(v, NULL, 10);
+        msg->rtx = 1;
+    } else if( IS_HDR("X-Htun-Win") ) {
+        msg->win = strtol(v, NULL, 10);
+        if( msg->win < 0 ) msg->win = 0;
+    } else if( IS_HDR("X-Htun-Enc") ) {
+        msg->enc = zbatch_parse(v, vlen);
+    } else if( IS_HDR("X-Htun-Time") ) {
+        if( parse_uints(v, end, &msg->ts, &msg->echo, &msg->held) == -1 ) {
+            msg->ts = 0;
+        }
+    }
+#undef IS_HDR
+    return 0;
 }
 
-char *getbody( int fd, char *headers, int *len ) {
-    char *buf;
-    
-    *len = get_content_length(headers);
-    if( *len < 1 ) { *len = 0; return NULL; }
+int http_parse( const char *buf, size_t len, size_t *scan, http_msg_t *msg ) {
+    const char *p, *nl, *end;
+    size_t hlen = 0, n;
 
-    if( (buf=readloop(fd, *len)) == NULL ) return NULL;
+    /* Look for the blank line ending the headers, starting where we left off */
+    while( (nl=memchr(buf + *scan, '\n', len - *scan)) ) {
+        n = nl - (buf + *scan);
+        *scan = nl - buf + 1;
+        if( n == 0 || (n == 1 && nl[-1] == '\r') ) {
+            hlen = *scan;
+            break;
+        }
+    }
+    if( !hlen ) return 0;
+    end = buf + hlen;
 
-    return buf;
+    msg->reqtype = REQ_ERR;
+    msg->status = 0;
+    msg->content_length = -1;
+    msg->chunked = 0;
+    msg->nocache = 0;
+    msg->cacheable = 0;
+    msg->seq = msg->ack = 0;
+    msg->rtx = 0;
+    msg->win = -1;
+    msg->enc = 0;
+    msg->ts = 0;
+    msg->upgrade.ptr = msg->ws_key.ptr = msg->ws_accept.ptr = NULL;
+    msg->upgrade.len = msg->ws_key.len = msg->ws_accept.len = 0;
+    msg->head.ptr = buf;
+    msg->head.len = hlen;
+
+    /* The first line is the request or status line */
+    nl = memchr(buf, '\n', hlen);
+    n = nl - buf;
+    if( n && buf[n-1] == '\r' ) n--;
+    msg->line.ptr = buf;
+    msg->line.len = n;
+    msg->hdrs.ptr = nl + 1;
+    msg->hdrs.len = end - (nl + 1);
+
+    if( n > 12 && !strncmp(buf, "HTTP/1.", 7) && buf[8] == ' ' ) {
+        if( !isdigit((int)buf[9]) || !isdigit((int)buf[10]) ||
+            !isdigit((int)buf[11]) ) return -1;
+        msg->keepalive = (buf[7] == '1');
+        msg->status = (buf[9]-'0')*100 + (buf[10]-'0')*10 + (buf[11]-'0');
+        if( msg->status < 100 || msg->status > 599 ) return -1;
+    } else {
+        msg->keepalive = n > 3 && !strncmp(buf + n - 3, "1.1", 3);
+        msg->reqtype = request_type(buf, n);
+    }
+
+    for( p = nl + 1; p < end; p = nl + 1 ) {
+        nl = memchr(p, '\n', end - p);
+        n = nl - p;
+        if( n && p[n-1] == '\r' ) n--;
+        if( n && parse_header(p, n, msg) == -1 ) return -1;
+    }
+
+    return hlen;
 }
 
-/* 
- * Parses the request in line, and places the results in req.
- * returns -1 on failure, 0 on success.
- *
- * Requests are of the form (this is a regex):
- *
- * POST (http://x.x.x.x)?/(C(P[12])?|S|CR|R) HTTP/1.0
- *  where ### is one octect of an IP address, and the '?' is given only on a
- *  poll-only request.
- */
-int parse_request( int clisock, char *reqbuf ) {
-    char req[HTTP_REQUESTLINE_MAX];
-    char *ptr = req;
-    char **ptrptr = &ptr;
-    char *method;
-    char *uri;
+int http_take_msg( rbuf_t *rb, http_msg_t *msg ) {
+    int rc;
+
+    /* Skip any empty lines left over before the message */
+    while( !rb->scan && rb_avail(rb) &&
+           (rb->buf[rb->start] == '\r' || rb->buf[rb->start] == '\n') ) {
+        rb_consume(rb, 1);
+    }
+
+    rc = http_parse(rb->buf + rb->start, rb_avail(rb), &rb->scan, msg);
+    if( rc > 0 ) {
+        dprintf(log, DEBUG, "Got message: %.*s", (int)msg->line.len,
+                msg->line.ptr);
+        rb_consume(rb, rc);
+        rb->scan = 0;
+        return 1;
+    }
+    if( rc < 0 ) {
+        lprintf(log, WARN, "Malformed HTTP message on fd #%d.", rb->fd);
+        rb->scan = 0;
+        return -1;
+    }
+    return 0;
+}
+
+int http_read_msg( rbuf_t *rb, http_msg_t *msg ) {
+    int rc;
+
+    while( (rc=http_take_msg(rb, msg)) == 0 ) {
+        if( rb_fill(rb) <= 0 ) break;
+    }
+    if( rc > 0 ) return 0;
+
+    rb->scan = 0;
+    return -1;
+}
+
+char *getbody( rbuf_t *rb, http_msg_t *msg, long *len ) {
+    *len = msg->content_length;
+    if( *len < 1 || *len > HTTP_MAX_BODY ) { *len = 0; return NULL; }
+
+    return readloop(rb, *len);
+}
+
+int parse_request( rbuf_t *rb, http_msg_t *msg ) {
+    int clisock = rb->fd;
     struct timeval tv;
     fd_set fds;
     int rc;
+    char c;
 
-    tv.tv_usec = 0;
-    tv.tv_sec = config->u.s.idle_disconnect;
-
-    FD_ZERO(&fds);
-    FD_SET(clisock, &fds);
-    
-    dprintf(log, DEBUG, "Entering select() on client fd #%d.", clisock);
-    rc = select(clisock+1, &fds, NULL, NULL, &tv);
-    if( rc == 0 ) {
-        dprintf(log, WARN, 
-                "select() on fd #%d timed out with no request.", clisock);
-        return REQ_NONE;
-    } else if ( rc == -1 ) {
-        lprintf(log, WARN,
-                "select() on fd #%d: %s", clisock, strerror(errno));
-        return REQ_ERR;
-    } else if ( recv(clisock, &req, 1, MSG_PEEK) == -1 && errno == EPIPE ) {
-        lprintf(log, WARN,
-                "select() on fd #%d exited: Connection reset by peer.",
-                clisock);
-        return REQ_ERR;
-    } else {
-        dprintf(log, DEBUG, "select() on fd %d retured with data.", clisock);
+    /* Only wait for the client if it hasn't sent the next request already */
+    if( !rb_avail(rb) ) {
+        tv.tv_usec = 0;
+        tv.tv_sec = config->u.s.idle_disconnect;
+
+        FD_ZERO(&fds);
+        FD_SET(clisock, &fds);
+
+        dprintf(log, DEBUG, "Entering select() on client fd #%d.", clisock);
+        rc = select(clisock+1, &fds, NULL, NULL, &tv);
+        if( rc == 0 ) {
+            dprintf(log, WARN, 
+                    "select() on fd #%d timed out with no request.", clisock);
+            return REQ_NONE;
+        } else if ( rc == -1 ) {
+            lprintf(log, WARN,
+                    "select() on fd #%d: %s", clisock, strerror(errno));
+            return REQ_NONE;
+        } else if ( recv(clisock, &c, 1, MSG_PEEK) == -1 && errno == EPIPE ) {
+            lprintf(log, WARN,
+                    "select() on fd #%d exited: Connection reset by peer.",
+                    clisock);
+            return REQ_NONE;
+        } else {
+            dprintf(log, DEBUG, "select() on fd %d retured with data.",
+                    clisock);
+        }
     }
 
-    dprintf(log, DEBUG, 
-            "Came out of select() on client fd #%d with data.", clisock);
- 
-    if( recvline(req, HTTP_REQUESTLINE_MAX, clisock) == NULL ) return REQ_ERR;
-    
-    chomp(req);
+    if( http_read_msg(rb, msg) == -1 ) return REQ_NONE;
 
-    if( reqbuf ) strcpy(reqbuf,req);
+    dprintf(log, DEBUG, "parsing request: %.*s", (int)msg->line.len,
+            msg->line.ptr);
 
-    dprintf( log, DEBUG, "parsing request: %s", req );
-    
-    /* If no space on the line, return */
-    if( strchr(req, ' ') == NULL ) {
-        lprintf(log, WARN, 
-                "Client sent request with no space.");
+    if( msg->status ) {
+        lprintf(log, WARN, "Client sent a response instead of a request.");
         return REQ_ERR;
     }
- 
-    /* Get the method */
-    if( (method=strtok_r(req, " ", ptrptr)) == NULL ) {
-        lprintf(log, WARN, 
-                "Could not tokenize request line method.");
-        return REQ_ERR;
+    return msg->reqtype;
+}
+
+
+/*
+ * Formats n in decimal at the end of the len bytes at buf, returning where
+ * the number starts.
+ */
+static char *fmt_ulong( char *buf, size_t len, unsigned long n ) {
+    char *p = buf + len;
+
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while( n );
+    return p;
+}
+
+/* Points the header slots of iov at t, with clen formatted into num */
+static void fill_header( const http_tmpl_t *t, size_t clen, char *num,
+                         size_t numlen, struct iovec *iov ) {
+    char *p = fmt_ulong(num, numlen, clen);
+
+    iov[0].iov_base = (char *)t->head;
+    iov[0].iov_len = t->headlen;
+    iov[1].iov_base = p;
+    iov[1].iov_len = num + numlen - p;
+    iov[2].iov_base = (char *)t->tail;
+    iov[2].iov_len = t->taillen;
+}
+
+int http_sendv( int fd, const http_tmpl_t *t, size_t clen,
+                struct iovec *iov, int cnt ) {
+    char num[24];
+
+    fill_header(t, clen, num, sizeof(num), iov);
+    return writev_all(fd, iov, cnt);
+}
+
+int http_send( int fd, const http_tmpl_t *t, const char *body, size_t len ) {
+    struct iovec iov[HTTP_IOV_HDR + 1];
+
+    if( body == NULL ) {
+        body = t->body;
+        len = t->bodylen;
     }
+    iov[HTTP_IOV_HDR].iov_base = (char *)body;
+    iov[HTTP_IOV_HDR].iov_len = len;
 
-    /* First look for a GET request */
-    if( !xstrcasecmp(method, "get") ) {
-        dprintf(log, DEBUG, "This is a GET request.");
-        return REQ_GET;
+    return http_sendv(fd, t, len, iov, HTTP_IOV_HDR + (len ? 1 : 0));
+}
+
+int http_out_queue( http_out_t *o, const http_tmpl_t *t, queue_t *q,
+                    size_t amount ) {
+    size_t total = 0, max = q->nr_nodes;
+    struct iovec *iov;
+    char **pkts;
+    int cnt = 0;
+
+    /* q only ever holds whole packets, so amount takes at most this many.
+     * Writing moves the iov bases along, so remember the packets. */
+    iov = malloc((HTTP_IOV_HDR + max) * sizeof(*iov) + max * sizeof(*pkts));
+    if( iov == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() iovec!");
+        return -1;
     }
+    pkts = (char **)(iov + HTTP_IOV_HDR + max);
 
-    /* Return error if it's not a post request */
-    if( xstrcasecmp(method, "post") != 0 ) {
-        dprintf(log, DEBUG, "This is neither POST nor GET.");
-        return REQ_ERR;
+    while( total < amount && (size_t)cnt < max ) {
+        if( (pkts[cnt]=q_remove(q, 0, NULL)) == NULL ) break;
+        iov[HTTP_IOV_HDR + cnt].iov_base = pkts[cnt];
+        iov[HTTP_IOV_HDR + cnt].iov_len = iplen(pkts[cnt]);
+        total += iplen(pkts[cnt]);
+        cnt++;
     }
-    
-    /* Get the URI */
-    if( (uri=strtok_r(NULL, " ", ptrptr)) == NULL ) {
-        lprintf(log, WARN, 
-                "Could not tokenize request line URI.");
-        return REQ_ERR;
+    if( total != amount ) {
+        lprintf(log, WARN, "premature end of queue (%lu of %lu bytes)",
+                (unsigned long)total, (unsigned long)amount);
     }
-    
-    /* If we're now on http://, skip http://host.name and move to the IP */
-    if( !strncmp(uri, "http://", 7) || !strncmp(uri, "https://", 8) ) {
-        uri=strstr(uri,"//");
-        uri+=2;
-        if( (uri=strchr(uri,'/')) == NULL ) return REQ_ERR;
+
+    fill_header(t, total, o->num, sizeof(o->num), iov);
+    o->clen = total;
+    o->iov = iov;
+    o->cur = 0;
+    o->cnt = HTTP_IOV_HDR + cnt;
+    o->pkts = pkts;
+    o->npkts = cnt;
+    o->mem = iov;
+    o->enc = 0;
+    return cnt;
+}
+
+void http_out_body( http_out_t *o, const http_tmpl_t *t, const char *body,
+                    size_t len ) {
+    if( body == NULL ) {
+        body = t->body;
+        len = t->bodylen;
     }
-    /* Skip the leading /  */
-    uri++;
-
-    chomp(uri);
-
-    dprintf(log, DEBUG, "Should be URI: \"%s\"", uri);
- 
-    if( !xstrcasecmp(uri, "CP1") ) {
-        dprintf(log, DEBUG, "This is a CP1 request");
-        return REQ_CP1;
-    } else if( !xstrcasecmp(uri, "P") ) {
-        dprintf(log, DEBUG, "This is an P request");
-        return REQ_P;
-    } else if( !xstrcasecmp(uri, "S") ) {
-        dprintf(log, DEBUG, "This is an S request");
-        return REQ_S;
-    } else if( !xstrcasecmp(uri, "CP2") ) {
-        dprintf(log, DEBUG, "This is a CP2 request");
-        return REQ_CP2;
-    } else if( !xstrcasecmp(uri, "CR") ) {
-        dprintf(log, DEBUG, "This is a CR request");
-        return REQ_CR;
-    } else if( !xstrcasecmp(uri, "R") ) {
-        dprintf(log, DEBUG, "This is an R request");
-        return REQ_R;
-    } else if( !xstrcasecmp(uri, "F") ) {
-        dprintf(log, DEBUG, "This is an F request");
-        return REQ_F;
+    fill_header(t, len, o->num, sizeof(o->num), o->small);
+    o->clen = len;
+    o->small[HTTP_IOV_HDR].iov_base = (char *)body;
+    o->small[HTTP_IOV_HDR].iov_len = len;
+    o->iov = o->small;
+    o->cur = 0;
+    o->cnt = HTTP_IOV_HDR + (len ? 1 : 0);
+    o->pkts = NULL;
+    o->npkts = 0;
+    o->mem = NULL;
+    o->enc = 0;
+}
+
+void http_out_batch( http_out_t *o, const http_tmpl_t *t, char **pkts,
+                     int npkts, size_t size ) {
+    struct iovec *iov = o->small;
+    int i;
+
+    if( npkts > 1 ) {
+        if( (iov=malloc((HTTP_IOV_HDR + npkts) * sizeof(*iov))) == NULL ) {
+            /* o ends up with nothing to write, which the caller sees
+             * as a failed send and retries */
+            lprintf(log, ERROR, "Unable to malloc() iovec!");
+            o->iov = o->small;
+            o->mem = o->pkts = NULL;
+            o->npkts = o->cnt = o->cur = o->enc = 0;
+            return;
+        }
+    }
+    for( i=0; i < npkts; i++ ) {
+        iov[HTTP_IOV_HDR + i].iov_base = pkts[i];
+        iov[HTTP_IOV_HDR + i].iov_len = iplen(pkts[i]);
+    }
+
+    fill_header(t, size, o->num, sizeof(o->num), iov);
+    o->clen = size;
+    o->iov = iov;
+    o->cur = 0;
+    o->cnt = HTTP_IOV_HDR + npkts;
+    o->pkts = NULL;
+    o->npkts = 0;
+    o->mem = iov == o->small ? NULL : iov;
+    o->enc = 0;
+}
+
+void http_out_rtx( http_out_t *o, const http_tmpl_t *t, rtx_batch_t *b,
+                   unsigned long ack, long win, lat_t *lat ) {
+    if( b->z ) {
+        http_out_body(o, t, b->z, b->zlen);
+        o->enc = b->enc;
     } else {
-        lprintf(log, WARN, "Unknown request: \"%s\"", uri);
-        return REQ_ERR;
+        http_out_batch(o, t, b->pkts, b->npkts, b->size);
     }
+    http_out_seq(o, b->seq, ack, win, lat);
 }
 
+void http_out_seq( http_out_t *o, unsigned long seq, unsigned long ack,
+                   long win, lat_t *lat ) {
+    unsigned int ts, echo, held;
+    char hdrs[sizeof(o->num)], *p;
+    size_t n;
 
-/* FIXME: redir_host & redir_port should soon be in the config */
-int proxy_request( int clisock, char *req, char *hdrs ) {
-    int s, len;
-    struct hostent host, *result = &host;
-    char hostdata[4096];
-    struct sockaddr_in addr;
-    char *body;
-    char srvhdrs[HTTP_HEADERS_MAX];
-    char **lines = splitlines(hdrs);
+    /* The extra headers ride along behind the Content-Length digits */
+    if( seq ) {
+        n = snprintf(hdrs, sizeof(hdrs), "\r\n" HDR_SEQ "%lu\r\n" HDR_ACK
+                "%lu", seq, ack);
+    } else {
+        n = snprintf(hdrs, sizeof(hdrs), "\r\n" HDR_ACK "%lu", ack);
+    }
+    n += snprintf(hdrs + n, sizeof(hdrs) - n, "\r\n" HDR_WIN "%ld", win);
+    if( o->enc ) {
+        n += snprintf(hdrs + n, sizeof(hdrs) - n, "\r\n" HDR_ENC "%s",
+                      zbatch_names(o->enc));
+    }
+    if( lat ) {
+        lat_stamp(lat, &ts, &echo, &held);
+        n += snprintf(hdrs + n, sizeof(hdrs) - n, "\r\n" HDR_TIME "%u %u %u",
+                      ts, echo, held);
+    }
+    p = fmt_ulong(o->num, sizeof(o->num) - n, o->clen);
+    memcpy(o->num + sizeof(o->num) - n, hdrs, n);
+    o->iov[1].iov_base = p;
+    o->iov[1].iov_len = o->num + sizeof(o->num) - p;
+}
+
+int http_out_write( int fd, http_out_t *o ) {
+    struct iovec *iov;
+    ssize_t rc;
+
+    while( o->cur < o->cnt ) {
+        iov = o->iov + o->cur;
+        if( (rc=writev(fd, iov, min(o->cnt - o->cur, HTUN_IOV_MAX))) < 0 ) {
+            if( errno == EINTR ) continue;
+            if( errno == EAGAIN ) return 0;
+            lprintf(log, WARN, "Writing to fd #%d: %s.", fd, strerror(errno));
+            http_out_free(o);
+            return -1;
+        }
+        while( o->cur < o->cnt && (size_t)rc >= iov->iov_len ) {
+            rc -= iov->iov_len;
+            iov++;
+            o->cur++;
+        }
+        if( o->cur < o->cnt ) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    http_out_free(o);
+    return 1;
+}
+
+void http_out_free( http_out_t *o ) {
     int i;
 
-    if( !lines ) {
-        lprintf(log, WARN, "Could not splitlines() on client headers");
-        goto err_1;
+    for( i = 0; i < o->npkts; i++ ) free(o->pkts[i]);
+    free(o->mem);
+    o->mem = NULL;
+    o->pkts = NULL;
+    o->npkts = o->cnt = o->cur = 0;
+}
+
+int http_out_send( int fd, http_out_t *o ) {
+    int rc;
+
+    if( !http_out_pending(o) ) return -1;
+
+    /* fd blocks, so this only comes back once it is all out or failed */
+    while( (rc=http_out_write(fd, o)) == 0 );
+
+    return rc == -1 ? -1 : 0;
+}
+
+int http_send_queue( int fd, const http_tmpl_t *t, queue_t *q, size_t amount ) {
+    http_out_t o;
+    int cnt;
+
+    if( (cnt=http_out_queue(&o, t, q, amount)) == -1 ) return -1;
+
+    return http_out_send(fd, &o) == -1 ? -1 : cnt;
+}
+
+/*
+ * Copies a message body from rb to fd as it arrives, without holding more
+ * than a buffer's worth of it. len of -1 means up to the end of the stream.
+ */
+static int forward_body( rbuf_t *rb, int fd, long len ) {
+    size_t n;
+    int rc;
+
+    while( len != 0 ) {
+        if( !rb_avail(rb) ) {
+            if( (rc=rb_fill(rb)) == 0 && len < 0 ) return 0;
+            if( rc <= 0 ) return -1;
+        }
+        n = rb_avail(rb);
+        if( len > 0 && (long)n > len ) n = len;
+        if( write(fd, rb->buf + rb->start, n) != (ssize_t)n ) return -1;
+        rb_consume(rb, n);
+        if( len > 0 ) len -= n;
     }
+    return 0;
+}
 
-    chomp(req);
+/*
+ * Copies one line from rb to fd, placing at most len-1 bytes of it in buf.
+ * Returns the length of the line, or -1 on failure.
+ */
+static int forward_line( rbuf_t *rb, int fd, char *buf, size_t len ) {
+    char *line, *nl;
+    size_t n;
 
-    if( (result=resolve(config->u.s.redir_host, &host, hostdata, sizeof(hostdata)))
-            == NULL ) {
-        lprintf(log, WARN, "Could not resolve host %s.",
-                config->u.s.redir_host);
-        goto err_1;
+    while( (nl=memchr(rb->buf + rb->start, '\n', rb_avail(rb))) == NULL ) {
+        if( rb_fill(rb) <= 0 ) return -1;
     }
-    
-    if( (s=socket(PF_INET,SOCK_STREAM,IPPROTO_TCP)) == -1 ) {
-        lprintf(log, ERROR, "Could not get socket.");
-        goto err_1;
+    line = rb->buf + rb->start;
+    n = nl - line + 1;
+    if( write(fd, line, n) != (ssize_t)n ) return -1;
+    memcpy(buf, line, min(n, len-1));
+    buf[min(n, len-1)] = '\0';
+    rb_consume(rb, n);
+    return n;
+}
+
+/*
+ * Copies a chunked body from rb to fd as it is, up to and including the
+ * last chunk and the trailer, so the connection can be used again.
+ */
+static int forward_chunked( rbuf_t *rb, int fd ) {
+    char line[32];
+    unsigned long size;
+    int n;
+
+    /* each chunk is its size in hex on a line, then the data and a CRLF */
+    do {
+        if( forward_line(rb, fd, line, sizeof(line)) == -1 ) return -1;
+        size = strtoul(line, NULL, 16);
+        if( size && forward_body(rb, fd, size + 2) == -1 ) return -1;
+    } while( size );
+
+    /* then the trailer, up to a blank line */
+    do {
+        if( (n=forward_line(rb, fd, line, sizeof(line))) == -1 ) return -1;
+    } while( n > 2 || (n == 2 && line[0] != '\r') );
+    return 0;
+}
+
+/*
+ * Decoy requests go to redirect_host over keep-alive connections that are
+ * kept for the next one, and the responses to plain GETs are cached for a
+ * while, so a scanner going over the site costs us little. At most a
+ * quarter of the server's worker threads relay decoy requests at a time,
+ * the others are left for tunnel clients, which take a few threads each.
+ */
+static struct {
+    rbuf_t *rb;
+    struct sockaddr_in addr;    /* redirect_host may move */
+    time_t since;
+} decoy_pool[DECOY_POOL_MAX];
+static int decoy_npool = 0;
+
+static struct {
+    char uri[HTTP_REQUESTLINE_MAX];
+    char *rsp;                  /* header block and body */
+    size_t len;
+    time_t expires;
+    time_t used;
+} decoy_cache[DECOY_CACHE_ENTRIES];
+
+static int decoy_busy = 0;
+static pthread_mutex_t decoy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+extern tpool_t *tpool; /* from server.c */
+
+/* Counts a decoy request in, returns 0 if there are too many already */
+static int decoy_enter( void ) {
+    int ok;
+
+    pthread_mutex_lock(&decoy_mutex);
+    if( (ok=decoy_busy < max(tpool->num_threads / 4, 1)) ) decoy_busy++;
+    pthread_mutex_unlock(&decoy_mutex);
+    return ok;
+}
+
+static void decoy_leave( void ) {
+    pthread_mutex_lock(&decoy_mutex);
+    decoy_busy--;
+    pthread_mutex_unlock(&decoy_mutex);
+}
+
+static void decoy_close( rbuf_t *rb ) {
+    close(rb->fd);
+    rb_free(&rb);
+}
+
+/*
+ * A pooled connection is no good once the server has closed it or sent
+ * something unasked, or has sat long enough that the server may close it
+ * just as we use it.
+ */
+static int decoy_alive( int i, time_t now ) {
+    struct pollfd pfd;
+
+    if( now - decoy_pool[i].since >= DECOY_POOL_IDLE ) return 0;
+    if( rb_avail(decoy_pool[i].rb) ) return 0;
+    pfd.fd = decoy_pool[i].rb->fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+/*
+ * Returns a connection to addr, a pooled one if there is one, in which case
+ * *reused is set. Returns NULL on failure.
+ */
+static rbuf_t *decoy_connect( struct sockaddr_in *addr, int *reused ) {
+    time_t now = time(NULL);
+    rbuf_t *rb = NULL;
+    int s;
+
+    pthread_mutex_lock(&decoy_mutex);
+    while( rb == NULL && decoy_npool > 0 ) {
+        decoy_npool--;
+        if( decoy_pool[decoy_npool].addr.sin_addr.s_addr ==
+                addr->sin_addr.s_addr &&
+            decoy_pool[decoy_npool].addr.sin_port == addr->sin_port &&
+            decoy_alive(decoy_npool, now) ) {
+            rb = decoy_pool[decoy_npool].rb;
+        } else {
+            decoy_close(decoy_pool[decoy_npool].rb);
+        }
     }
+    pthread_mutex_unlock(&decoy_mutex);
 
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = *(unsigned long *)(result->h_addr_list[0]);
-    addr.sin_port = config->u.s.redir_port;
+    if( (*reused=(rb != NULL)) ) return rb;
 
-    if( connect(s, (struct sockaddr *)&addr, sizeof(addr)) == -1 ) {
+    if( (s=socket(PF_INET,SOCK_STREAM,IPPROTO_TCP)) == -1 ) {
+        lprintf(log, ERROR, "Could not get socket.");
+        return NULL;
+    }
+    if( connect(s, (struct sockaddr *)addr, sizeof(*addr)) == -1 ) {
         lprintf(log, WARN, "Could not connect to %s at IP %s:%d.",
-                config->u.s.redir_host, inet_ntoa(addr.sin_addr),
-                ntohs(addr.sin_port));
-        goto err_2;
+                config->u.s.redir_host, inet_ntoa(addr->sin_addr),
+                ntohs(addr->sin_port));
+        close(s);
+        return NULL;
+    }
+    if( (rb=rb_new(s)) == NULL ) close(s);
+    return rb;
+}
+
+/* Keeps a connection whose last response was read in full for next time */
+static void decoy_release( rbuf_t *rb, struct sockaddr_in *addr ) {
+    pthread_mutex_lock(&decoy_mutex);
+    if( decoy_npool < DECOY_POOL_MAX ) {
+        decoy_pool[decoy_npool].rb = rb;
+        decoy_pool[decoy_npool].addr = *addr;
+        decoy_pool[decoy_npool].since = time(NULL);
+        decoy_npool++;
+        rb = NULL;
     }
+    pthread_mutex_unlock(&decoy_mutex);
+
+    if( rb ) decoy_close(rb);
+}
 
-    dprintf(log, DEBUG, "sending server: %s", req);
-    fdprintf(s, "%s\r\n", req);
+/*
+ * Places the URI of msg in uri if it is a GET without a body, credentials
+ * or cookies, which is what gets cached. Returns nonzero if it is.
+ */
+static int decoy_uri( http_msg_t *msg, char *uri, size_t len ) {
+    const char *p = msg->line.ptr, *end = p + msg->line.len, *sp;
+    slice_t u;
+
+    if( msg->content_length > 0 || msg->chunked || msg->nocache ) return 0;
+    if( msg->line.len < 4 || strncmp(p, "GET ", 4) ) return 0;
+    for( p += 4; p < end && *p == ' '; p++ );
+    if( (sp=memchr(p, ' ', end - p)) == NULL ) sp = end;
+    if( (size_t)(sp - p) >= len ) return 0;
+
+    u.ptr = p;
+    u.len = sp - p;
+    slice_copy(&u, uri, len);
+    return 1;
+}
 
-    for( i=0; lines[i]; i++ ) {
-        if( !strncmp(lines[i], HDR_CONNECTION, sizeof(HDR_CONNECTION)-1) ||
-            !strncmp(lines[i], HDR_HOST, sizeof(HDR_HOST)-1) ) continue;
-        if( strlen(lines[i]) <= 1 ) continue;
-        chomp(lines[i]);
-        dprintf(log, DEBUG, "sending server: %s", lines[i]);
-        fdprintf(s, "%s\r\n", lines[i]);
+/* Sends the cached response to uri if there is one. Returns 0 if it did. */
+static int decoy_cache_send( int fd, const char *uri ) {
+    time_t now = time(NULL);
+    char *rsp = NULL;
+    size_t len = 0;
+    int i;
+
+    pthread_mutex_lock(&decoy_mutex);
+    for( i = 0; i < DECOY_CACHE_ENTRIES; i++ ) {
+        if( !decoy_cache[i].rsp || decoy_cache[i].expires <= now ||
+            strcmp(decoy_cache[i].uri, uri) ) continue;
+        /* copy it, the client may be slow to take it */
+        if( (rsp=malloc(decoy_cache[i].len)) != NULL ) {
+            len = decoy_cache[i].len;
+            memcpy(rsp, decoy_cache[i].rsp, len);
+            decoy_cache[i].used = now;
+        }
+        break;
     }
-    
-    dprintf(log, DEBUG, "sending server: '" HDR_HOST "%s:%d\r\n'",
-            config->u.s.redir_host, ntohs(config->u.s.redir_port));
-    fdprintf(s, HDR_HOST "%s:%d\r\n", config->u.s.redir_host,
-            ntohs(config->u.s.redir_port));
-    dprintf(log, DEBUG, "sending server: '" HDR_CONNECTION "Close\r\n\r\n'");
-    fdprintf(s, HDR_CONNECTION "Close\r\n\r\n");
+    pthread_mutex_unlock(&decoy_mutex);
 
-    if( (body=getbody(clisock, hdrs, &len)) ) {
-        write(s, body, len);
-        free(body);
+    if( rsp == NULL ) return -1;
+    dprintf(log, DEBUG, "decoy response to %s from the cache", uri);
+    /* if the client went away, there is nobody to send an error to */
+    if( write(fd, rsp, len) != (ssize_t)len ) {
+        dprintf(log, DEBUG, "client left before the decoy response");
     }
+    free(rsp);
+    return 0;
+}
 
-    getheaders(s, srvhdrs, sizeof(srvhdrs));
-    write(clisock, srvhdrs, strlen(srvhdrs));
+/*
+ * Keeps the DYNAMICALLY ALLOCATED response rsp to uri, in place of the
+ * least recently used or expired one.
+ */
+static void decoy_cache_put( const char *uri, char *rsp, size_t len ) {
+    time_t now = time(NULL);
+    int i, victim = 0;
 
-    if( (body=getbody(s, srvhdrs, &len)) ) {
-        write(clisock, body, len);
-        free(body);
+    pthread_mutex_lock(&decoy_mutex);
+    for( i = 0; i < DECOY_CACHE_ENTRIES; i++ ) {
+        if( decoy_cache[i].rsp && !strcmp(decoy_cache[i].uri, uri) ) {
+            victim = i;
+            break;
+        }
+        if( !decoy_cache[i].rsp || decoy_cache[i].expires <= now ) {
+            victim = i;
+        } else if( decoy_cache[victim].rsp &&
+                   decoy_cache[victim].expires > now &&
+                   decoy_cache[i].used < decoy_cache[victim].used ) {
+            victim = i;
+        }
     }
+    free(decoy_cache[victim].rsp);
+    strcpy(decoy_cache[victim].uri, uri);
+    decoy_cache[victim].rsp = rsp;
+    decoy_cache[victim].len = len;
+    decoy_cache[victim].expires = now + DECOY_CACHE_TTL;
+    decoy_cache[victim].used = now;
+    pthread_mutex_unlock(&decoy_mutex);
+}
+
+/* Passes the request msg, with its body from rb, on to the server on s */
+static int decoy_send_request( rbuf_t *rb, http_msg_t *msg, int s ) {
+    const char *p, *nl, *end, *run;
+    char hosthdr[HTTP_HEADER_MAX];
+    struct iovec iov[PROXY_IOV];
+    int cnt = 0;
+
+    dprintf(log, DEBUG, "sending server: %.*s", (int)msg->line.len,
+            msg->line.ptr);
 
-    close(s);
-    free(lines);
+    /* Pass the header block on as runs of the lines we keep, straight out
+     * of the read buffer. The blank line at the end is not kept. */
+    run = msg->head.ptr;
+    for( p = msg->hdrs.ptr, end = p + msg->hdrs.len; p < end; p = nl + 1 ) {
+        nl = memchr(p, '\n', end - p);
+        if( *p != '\r' && *p != '\n' &&
+            xstrncasecmp(p, HDR_CONNECTION, sizeof(HDR_CONNECTION)-1) &&
+            xstrncasecmp(p, HDR_HOST, sizeof(HDR_HOST)-1) ) continue;
+
+        if( p > run ) {
+            iov[cnt].iov_base = (char *)run;
+            iov[cnt].iov_len = p - run;
+            if( ++cnt == PROXY_IOV - 1 ) {
+                if( writev_all(s, iov, cnt) == -1 ) return -1;
+                cnt = 0;
+            }
+        }
+        run = nl + 1;
+    }
+
+    iov[cnt].iov_base = hosthdr;
+    iov[cnt].iov_len = snprintf(hosthdr, sizeof(hosthdr),
+            HDR_HOST "%s:%d\r\n" HDR_CONNECTION "Keep-Alive\r\n\r\n",
+            config->u.s.redir_host, ntohs(config->u.s.redir_port));
+    if( iov[cnt].iov_len >= sizeof(hosthdr) ) return -1;
+    dprintf(log, DEBUG, "sending server: '%s'", hosthdr);
+    if( writev_all(s, iov, cnt + 1) == -1 ) return -1;
+
+    /* A request without a Content-Length has no body */
+    if( msg->content_length > 0 &&
+        forward_body(rb, s, msg->content_length) == -1 ) return -1;
     return 0;
+}
 
-err_2:
-    close(s);
-err_1:
-    free(lines);
-    return -1;
+/*
+ * Passes the response on srb on to fd. If uri is given and the response
+ * may be cached, it is. Returns 1 if srb can be used for another request,
+ * 0 if not, or -1 if the response was cut short.
+ */
+static int decoy_relay( rbuf_t *srb, http_msg_t *srvmsg, int head_only,
+                        int fd, const char *uri ) {
+    long len = srvmsg->content_length;
+    char *rsp;
+    int rc;
+
+    if( head_only || srvmsg->status < 200 || srvmsg->status == 204 ||
+        srvmsg->status == 304 ) {
+        len = 0;
+    } else if( srvmsg->chunked ) {
+        if( write(fd, srvmsg->head.ptr, srvmsg->head.len) < 0 ) return -1;
+        if( forward_chunked(srb, fd) == -1 ) return -1;
+        return srvmsg->keepalive;
+    }
+
+    /* small enough to keep a copy of, and the server says we may */
+    if( uri && len >= 0 && len <= DECOY_CACHE_MAX_BODY &&
+        srvmsg->cacheable && !srvmsg->nocache &&
+        (srvmsg->status == 200 || srvmsg->status == 301 ||
+         srvmsg->status == 404) &&
+        (rsp=malloc(srvmsg->head.len + len)) != NULL ) {
+        memcpy(rsp, srvmsg->head.ptr, srvmsg->head.len);
+        if( rb_read(srb, rsp + srvmsg->head.len, len) == -1 ) {
+            free(rsp);
+            return -1;
+        }
+        rc = write(fd, rsp, srvmsg->head.len + len);
+        decoy_cache_put(uri, rsp, srvmsg->head.len + len);
+        return rc < 0 ? -1 : srvmsg->keepalive;
+    }
+
+    if( write(fd, srvmsg->head.ptr, srvmsg->head.len) < 0 ) return -1;
+    /* no length and not chunked means the body goes up to EOF */
+    if( forward_body(srb, fd, len) == -1 ) return -1;
+    return len >= 0 && srvmsg->keepalive;
 }
 
+int proxy_request( rbuf_t *rb, http_msg_t *msg ) {
+    int clisock = rb->fd;
+    struct sockaddr_in addr;
+    rbuf_t *srb;
+    http_msg_t srvmsg;
+    char uri[HTTP_REQUESTLINE_MAX];
+    int get, head_only, reused, rc = -1;
+
+    /* a GET we answered lately needs no trip to the server */
+    get = decoy_uri(msg, uri, sizeof(uri));
+    if( get && decoy_cache_send(clisock, uri) == 0 ) return 0;
+
+    if( !decoy_enter() ) {
+        lprintf(log, WARN, "Too many decoy requests at once, turning one "
+                "away.");
+        return -1;
+    }
+
+    if( dns_lookup(config->u.s.redir_host, &addr.sin_addr, PROXY_DNS_WAIT)
+            == -1 ) {
+        lprintf(log, WARN, "Could not resolve host %s.",
+                config->u.s.redir_host);
+        goto out;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = config->u.s.redir_port;
+
+    for(;;) {
+        if( (srb=decoy_connect(&addr, &reused)) == NULL ) goto out;
+        if( decoy_send_request(rb, msg, srb->fd) == 0 &&
+            http_read_msg(srb, &srvmsg) == 0 ) break;
+        decoy_close(srb);
+
+        /* the server may have closed a pooled connection just now. Try a
+         * fresh one, unless the request body is gone already */
+        if( !reused || msg->content_length > 0 ) goto out;
+    }
+
+    head_only = msg->line.len > 5 && !strncmp(msg->line.ptr, "HEAD ", 5);
+    switch( decoy_relay(srb, &srvmsg, head_only, clisock, get ? uri : NULL) ) {
+        case 1:
+            decoy_release(srb, &addr);
+            break;
+        case -1:
+            lprintf(log, WARN, "Response from %s was cut short.",
+                    config->u.s.redir_host);
+            /* fall through */
+        default:
+            decoy_close(srb);
+            break;
+    }
+    rc = 0;
+
+out:
+    decoy_leave();
+    return rc;
+}
@@ -0,0 +1,162 @@
+/* -------------------------------------------------------------------------
+ * lat.c - htun per stage latency histograms and clock exchange
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "log.h"
+#include "lat.h"
+
+const char *lat_stages[LAT_STAGES] = {
+    "tun_read", "sendq", "send", "recvq", "tun_write", "rtt", "owd"
+};
+
+unsigned int lat_now( void ) {
+    struct timespec ts;
+    unsigned int t;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t = (unsigned int)ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+    return t ? t : 1;
+}
+
+/* The bucket of v: exact below LAT_SUB, then LAT_SUB per power of two */
+static inline int lat_bucket( unsigned int v ) {
+    int e;
+
+    if( v < LAT_SUB ) return v;
+    e = 31 - __builtin_clz(v);
+    return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+        ((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* The highest value that goes in bucket i */
+static inline unsigned int lat_top( int i ) {
+    int e = (i >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+
+    if( i < LAT_SUB ) return i;
+    return ((unsigned int)(LAT_SUB + (i & (LAT_SUB - 1))) <<
+            (e - LAT_SUB_BITS)) + ((1U << (e - LAT_SUB_BITS)) - 1);
+}
+
+lat_t *lat_new( void ) {
+    lat_t *l;
+
+    if( (l=calloc(1, sizeof(lat_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() latency histograms!");
+        return NULL;
+    }
+    pthread_mutex_init(&l->lock, NULL);
+    return l;
+}
+
+void lat_free( lat_t **l ) {
+    if( !*l ) return;
+    pthread_mutex_destroy(&(*l)->lock);
+    free(*l);
+    *l = NULL;
+}
+
+void lat_reset( lat_t *l ) {
+    if( !l ) return;
+    pthread_mutex_lock(&l->lock);
+    l->peer_ts = l->peer_at = 0;
+    l->have_base = 0;
+    pthread_mutex_unlock(&l->lock);
+}
+
+void lat_add( lat_hist_t *h, unsigned int usec ) {
+    __sync_fetch_and_add(&h->b[lat_bucket(usec)], 1);
+    __sync_fetch_and_add(&h->sum, usec);
+    __sync_fetch_and_add(&h->count, 1);
+}
+
+void lat_since( lat_t *l, int stage, unsigned int start ) {
+    if( l && start ) lat_add(&l->h[stage], lat_now() - start);
+}
+
+unsigned int lat_quantile( const lat_hist_t *h, double q ) {
+    unsigned long want, seen = 0;
+    int i;
+
+    if( !h->count ) return 0;
+    want = q * h->count;
+    if( want < 1 ) want = 1;
+    for( i=0; i<LAT_BUCKETS; i++ ) {
+        if( (seen += h->b[i]) >= want ) return lat_top(i);
+    }
+    return lat_top(LAT_BUCKETS - 1);
+}
+
+void lat_stamp( lat_t *l, unsigned int *ts, unsigned int *echo,
+                unsigned int *held ) {
+    *ts = lat_now();
+    pthread_mutex_lock(&l->lock);
+    *echo = l->peer_ts;
+    *held = l->peer_ts ? *ts - l->peer_at : 0;
+    pthread_mutex_unlock(&l->lock);
+}
+
+void lat_peer( lat_t *l, unsigned int ts, unsigned int echo,
+               unsigned int held ) {
+    unsigned int now = lat_now();
+    int rtt, owd;
+
+    if( !l || !ts ) return;
+
+    /* a reply to something we sent before, by our own clock */
+    if( echo && (rtt=(int)(now - echo - held)) >= 0 ) {
+        lat_add(&l->h[LAT_RTT], rtt);
+    }
+
+    pthread_mutex_lock(&l->lock);
+    l->peer_ts = ts;
+    l->peer_at = now;
+    owd = (int)(now - ts);
+    if( !l->have_base || owd < l->owd_base ) {
+        l->owd_base = owd;
+        l->have_base = 1;
+    }
+    owd -= l->owd_base;
+    pthread_mutex_unlock(&l->lock);
+
+    lat_add(&l->h[LAT_OWD], owd);
+}
+
+void lat_log( lat_t *l, const char *who ) {
+    lat_hist_t *h;
+    int i;
+
+    if( !l ) return;
+    for( i=0; i<LAT_STAGES; i++ ) {
+        h = &l->h[i];
+        if( !h->count ) continue;
+        lprintf(log, INFO, "%s %s: n=%lu avg=%luus p50=%uus p90=%uus "
+                "p99=%uus p99.9=%uus", who, lat_stages[i], h->count,
+                h->sum / h->count, lat_quantile(h, 0.5),
+                lat_quantile(h, 0.9), lat_quantile(h, 0.99),
+                lat_quantile(h, 0.999));
+    }
+}
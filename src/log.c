@@ -29,77 +29,382 @@
 #include <errno.h>
 #include <time.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "common.h"
 #include "log.h"
 #include "util.h"
 
-/* Allows printf()-like interface to file descriptors without the
- * complications that arise from mixing stdio and low level calls 
- * FIXME: Needs date and time before logfile entries.
+#ifdef CLOCK_REALTIME_COARSE
+#define LOG_CLOCK CLOCK_REALTIME_COARSE
+#else
+#define LOG_CLOCK CLOCK_REALTIME
+#endif
+
+/* How much the writer gathers for one write() */
+#define LOG_BATCH_SIZE 65536
+
+/*
+ * A thread's lines, as a 2 byte length followed by the line. Only the
+ * thread that owns the ring moves head and only the writer moves tail.
  */
-int lprintf_real( const char *func, log_t *log, unsigned int level, char *fmt, ... ) {
-    int fd;
-    int rc;
-    va_list ap;
-    time_t now;
-    char date[50];
-    static char line[LOGLINE_MAX];
-    static char threadnum[10];
-    int cnt;
-    static char *levels[6] = { "[(bad)] ", 
-                               "[debug] ", 
-                               "[info ] ", 
-                               "[warn ] ", 
-                               "[error] ", 
-                               "[fatal] " };
+typedef struct log_ring {
+    char buf[LOG_RING_SIZE];
+    volatile unsigned long head;
+    volatile unsigned long tail;
+    volatile unsigned long dropped;
+    volatile int dead;              /* its thread has exited */
+    struct log_ring *next;
+} log_ring_t;
 
-    if(!log) return -1;
+/* New rings are pushed onto the front; only the writer takes them off */
+static log_ring_t *volatile rings = NULL;
+static __thread log_ring_t *my_ring = NULL;
+static __thread int ring_gone = 0;  /* the thread is exiting, write direct */
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
 
-    /* If this is debug info, and we're not logging it, return */
-    if( !(log->flags&LOG_DEBUG) && level == DEBUG ) return 0;
+/* The log whose writer is running, to flush at exit() */
+static log_t *started = NULL;
+
+/* The date is only made again when the second changes */
+static __thread time_t date_sec = -1;
+static __thread char date[32];
 
-    fd=log->fd;
+static const char *levels[6] = { "[(bad)] ", 
+                                 "[debug] ", 
+                                 "[info ] ", 
+                                 "[warn ] ", 
+                                 "[error] ", 
+                                 "[fatal] " };
+
+/* Formats a line of level into line, returning its length */
+static size_t log_vformat( char *line, const char *func, log_t *log,
+                           unsigned int level, const char *fmt, va_list ap ) {
+    struct timespec ts;
+    struct tm tm;
+    char threadnum[24];
+    size_t cnt;
 
-    /* Prepare the date string */
     if( !(log->flags&LOG_NODATE) ) {
-        now=time(NULL);
-        strcpy(date,ctime(&now));
-        date[strlen(date)-6]=' ';
-        date[strlen(date)-5]='\0';
+        clock_gettime(LOG_CLOCK, &ts);
+        if( ts.tv_sec != date_sec ) {
+            localtime_r(&ts.tv_sec, &tm);
+            strftime(date, sizeof(date), "%a %b %e %H:%M:%S", &tm);
+            date_sec = ts.tv_sec;
+        }
     }
 
     if( !(log->flags&LOG_NOTID) ) {
         sprintf(threadnum, "(%lu) ", pthread_self());
     }
 
-    cnt = snprintf(line, sizeof(line), "%s%s%s%s%s",
-                   log->flags&LOG_NODATE ? "" : date,
-                   log->flags&LOG_NOLVL  ? "" : 
-                       (level > FATAL ? levels[0] : levels[level]),
-                   log->flags&LOG_NOTID ? "" : threadnum,
-                   log->flags&LOG_FUNC ? func : "",
-                   log->flags&LOG_FUNC ? ": " : "");
+    if( log->flags&LOG_NODATE ) {
+        cnt = 0;
+    } else {
+        cnt = snprintf(line, LOGLINE_MAX, "%s.%03ld ", date,
+                       ts.tv_nsec / 1000000);
+    }
+    cnt += snprintf(line + cnt, LOGLINE_MAX - cnt, "%s%s%s%s",
+                    log->flags&LOG_NOLVL  ? "" : 
+                        (level > FATAL ? levels[0] : levels[level]),
+                    log->flags&LOG_NOTID ? "" : threadnum,
+                    log->flags&LOG_FUNC ? func : "",
+                    log->flags&LOG_FUNC ? ": " : "");
+    if( cnt >= LOGLINE_MAX ) cnt = LOGLINE_MAX - 1;
+
+    /* leaves room for the '\n' */
+    vsnprintf(line + cnt, LOGLINE_MAX - 1 - cnt, fmt, ap);
+    line[LOGLINE_MAX-2] = '\0';
+
+    if( !(log->flags&LOG_NOLF) ) {
+        chomp(line);
+        strcat(line, "\n");
+    }
+    return strlen(line);
+}
+
+static size_t log_format( char *line, const char *func, log_t *log,
+                          unsigned int level, const char *fmt, ... ) {
+    va_list ap;
+    size_t len;
 
     va_start(ap, fmt);
-    vsnprintf(line+cnt, sizeof(line)-cnt, fmt, ap);
+    len = log_vformat(line, func, log, level, fmt, ap);
     va_end(ap);
+    return len;
+}
 
-    line[sizeof(line)-1] = '\0';
+/* Writes out all len bytes of buf, without logging about it */
+static int log_write( int fd, const char *buf, size_t len ) {
+    ssize_t rc;
 
-    if( !(log->flags&LOG_NOLF) ) {
-        chomp(line);
-        strcpy(line+strlen(line), "\n");
+    while( len > 0 ) {
+        if( (rc=write(fd, buf, len)) < 0 ) {
+            if( errno == EINTR ) continue;
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
     }
-        
-    sem_wait(&log->sem);
-    rc = write(fd, line, strlen(line));
+    return 0;
+}
+
+/********************************************************************
+ *** The rings
+ ********************************************************************/
+
+/* The writer frees the ring once it is dead and drained, so we let go */
+static void ring_exit( void *r ) {
+    my_ring = NULL;
+    ring_gone = 1;
+    __atomic_store_n(&((log_ring_t *)r)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init( void ) {
+    pthread_key_create(&ring_key, ring_exit);
+}
+
+/*
+ * Returns the calling thread's ring, making it if need be, or NULL once the
+ * thread has given it up on its way out.
+ */
+static log_ring_t *ring_get( void ) {
+    log_ring_t *r;
+
+    if( my_ring ) return my_ring;
+    if( ring_gone ) return NULL;
+
+    pthread_once(&ring_once, ring_key_init);
+    if( (r=calloc(1, sizeof(log_ring_t))) == NULL ) return NULL;
+    do {
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    } while( !__sync_bool_compare_and_swap(&rings, r->next, r) );
+    pthread_setspecific(ring_key, r);
+    return my_ring = r;
+}
+
+/* Copies len bytes of src to pos in the ring, wrapping around */
+static inline void ring_copy_in( log_ring_t *r, unsigned long pos,
+                                 const char *src, size_t len ) {
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t n = min(len, LOG_RING_SIZE - off);
+
+    memcpy(r->buf + off, src, n);
+    memcpy(r->buf, src + n, len - n);
+}
+
+static inline void ring_copy_out( log_ring_t *r, unsigned long pos,
+                                  char *dst, size_t len ) {
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t n = min(len, LOG_RING_SIZE - off);
+
+    memcpy(dst, r->buf + off, n);
+    memcpy(dst + n, r->buf, len - n);
+}
+
+/*
+ * Puts a line on r. Returns nonzero if the ring is over half full now, or
+ * -1 if there was no room for the line.
+ */
+static int ring_put( log_ring_t *r, const char *line, size_t len ) {
+    unsigned long head = r->head;
+    unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    unsigned char hdr[2];
+
+    if( head + 2 + len - tail > LOG_RING_SIZE ) {
+        __sync_fetch_and_add(&r->dropped, 1);
+        return -1;
+    }
+    hdr[0] = len >> 8;
+    hdr[1] = len & 0xFF;
+    ring_copy_in(r, head, (char *)hdr, 2);
+    ring_copy_in(r, head + 2, line, len);
+
+    /* the line has to be there before the writer sees the new head */
+    __atomic_store_n(&r->head, head + 2 + len, __ATOMIC_RELEASE);
+    return head + 2 + len - tail > LOG_RING_SIZE / 2;
+}
+
+/*
+ * Moves as many whole lines off r as fit in the room bytes at buf.
+ * Returns the number of bytes moved.
+ */
+static size_t ring_take( log_ring_t *r, char *buf, size_t room ) {
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = r->tail;
+    unsigned char hdr[2];
+    size_t len, total = 0;
+
+    while( tail != head ) {
+        ring_copy_out(r, tail, (char *)hdr, 2);
+        len = hdr[0] << 8 | hdr[1];
+        if( total + len > room ) break;
+        ring_copy_out(r, tail + 2, buf + total, len);
+        total += len;
+        tail += 2 + len;
+    }
+
+    /* done reading before the owner may write there again */
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    return total;
+}
+
+/********************************************************************
+ *** The writer
+ ********************************************************************/
+
+static inline void log_wake( log_t *log ) {
+    if( !__atomic_load_n(&log->waking, __ATOMIC_RELAXED) &&
+        !__sync_lock_test_and_set(&log->waking, 1) ) {
+        sem_post(&log->sem);
+    }
+}
+
+/*
+ * Writes out what is on all rings, freeing those of exited threads.
+ * Returns the number of bytes written.
+ */
+static size_t log_drain( log_t *log, char *buf, size_t size ) {
+    log_ring_t *r, *prev = NULL, *next;
+    unsigned long dropped = 0;
+    size_t len = 0, n, total = 0;
+    int dead;
+
+    for( r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = next ) {
+        next = r->next;
+        dead = __atomic_load_n(&r->dead, __ATOMIC_ACQUIRE);
+        do {
+            if( (n=ring_take(r, buf + len, size - len)) == 0 && len ) {
+                log_write(log->fd, buf, len);
+                total += len;
+                len = 0;
+                n = ring_take(r, buf, size);
+            }
+            len += n;
+        } while( n );
+        dropped += __sync_lock_test_and_set(&r->dropped, 0);
+
+        if( dead && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail ) {
+            if( prev ) {
+                prev->next = next;
+                free(r);
+                continue;
+            }
+            if( __sync_bool_compare_and_swap(&rings, r, next) ) {
+                free(r);
+                continue;
+            }
+        }
+        prev = r;
+    }
+
+    if( dropped ) {
+        if( size - len < LOGLINE_MAX ) {
+            log_write(log->fd, buf, len);
+            total += len;
+            len = 0;
+        }
+        len += log_format(buf + len, __FUNCTION__, log, WARN,
+                          "%lu lines dropped, the log could not keep up",
+                          dropped);
+    }
+    if( len ) {
+        log_write(log->fd, buf, len);
+        total += len;
+    }
+    return total;
+}
+
+static void *log_writer( void *log_in ) {
+    log_t *log = (log_t *)log_in;
+    char *buf = malloc(LOG_BATCH_SIZE);
+    struct timespec ts;
+
+    if( buf == NULL ) return NULL;
+
+    while( !__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE) ) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += LOG_FLUSH_MSEC * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        sem_timedwait(&log->sem, &ts);
+        __atomic_store_n(&log->waking, 0, __ATOMIC_RELAXED);
+        log_drain(log, buf, LOG_BATCH_SIZE);
+    }
+
+    /* what was logged while we were stopping */
+    while( log_drain(log, buf, LOG_BATCH_SIZE) ) ;
+    free(buf);
+    return NULL;
+}
+
+static void log_stop( log_t *log ) {
+    if( !log->running ) return;
+    __atomic_store_n(&log->running, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
     sem_post(&log->sem);
+    pthread_join(log->writer, NULL);
+    if( started == log ) started = NULL;
+}
+
+static void log_atexit( void ) {
+    if( started ) log_stop(started);
+}
+
+/********************************************************************
+ *** The interface
+ ********************************************************************/
+
+/* Allows printf()-like interface to file descriptors without the
+ * complications that arise from mixing stdio and low level calls 
+ */
+int lprintf_real( const char *func, log_t *log, unsigned int level, char *fmt, ... ) {
+    char line[LOGLINE_MAX];
+    log_ring_t *r;
+    va_list ap;
+    size_t len;
+    int rc;
+
+    if(!log) return -1;
+
+    /* If this is debug info, and we're not logging it, return */
+    if( !(log->flags&LOG_DEBUG) && level == DEBUG ) return 0;
+
+    va_start(ap, fmt);
+    len = log_vformat(line, func, log, level, fmt, ap);
+    va_end(ap);
+
+    if( !__atomic_load_n(&log->running, __ATOMIC_RELAXED) ||
+        (r=ring_get()) == NULL ) {
+        return log_write(log->fd, line, len);
+    }
 
-    if( !rc ) errno = 0;
-    return rc;
+    /* errors go out at once, the rest when the writer gets to them */
+    if( (rc=ring_put(r, line, len)) != 0 || level >= ERROR ) log_wake(log);
+    return rc == -1 ? -1 : 0;
+}
+
+int log_rl_pass( const char *func, log_t *log, unsigned int level,
+                 log_rl_t *rl ) {
+    time_t now = time(NULL) / LOG_RL_SECS;
+    time_t window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+    unsigned int dropped;
+
+    if( now != window &&
+        __sync_bool_compare_and_swap(&rl->window, window, now) ) {
+        __atomic_store_n(&rl->lines, 0, __ATOMIC_RELAXED);
+        if( (dropped=__sync_lock_test_and_set(&rl->dropped, 0)) ) {
+            lprintf_real(func, log, level, "(left out %u more lines like "
+                         "the next)", dropped);
+        }
+    }
+    if( __sync_add_and_fetch(&rl->lines, 1) <= LOG_RL_BURST ) return 1;
+    __sync_fetch_and_add(&rl->dropped, 1);
+    return 0;
 }
 
 log_t *log_open( char *fname, int flags ) {
@@ -110,6 +415,7 @@ log_t *log_open( char *fname, int flags ) {
         goto log_open_a;
     }
     log->flags=flags;
+    log->running = 0;
     if( !strcmp(fname,"-") ) {
         log->fd = 2;
     } else {
@@ -122,7 +428,7 @@ log_t *log_open( char *fname, int flags ) {
                 fname, strerror(errno));
         goto log_open_b;
     }
-    if( sem_init(&log->sem, 0, 1) == -1 ) {
+    if( sem_init(&log->sem, 0, 0) == -1 ) {
         fprintf(stderr, "log_open: Could not initialize log semaphore.");
         goto log_open_c;
     }
@@ -136,11 +442,39 @@ log_open_a:
     return NULL;
 }
 
+int log_start( log_t *log ) {
+    static int registered = 0;
+    sigset_t all, old;
+    int rc;
+
+    if( log->running ) return 0;
+    log->stop = 0;
+    log->waking = 0;
+
+    /* the signals are for the main thread to sigwait() for */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    rc = pthread_create(&log->writer, NULL, log_writer, log);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if( rc != 0 ) {
+        lprintf(log, WARN, "Unable to start the log writer: %s",
+                strerror(rc));
+        return -1;
+    }
+
+    log->running = 1;
+    started = log;
+    if( !registered ) {
+        atexit(log_atexit);
+        registered = 1;
+    }
+    return 0;
+}
+
 void log_close( log_t *log ) {
-    sem_wait(&log->sem);
+    log_stop(log);
     sem_destroy(&log->sem);
     close(log->fd);
     free(log);
     return;
 }
-
@@ -192,5 +192,8 @@ int main( int argc, char *argv[] ) {
     sigaddset(&newmask, SIGWINCH);
     sigprocmask( SIG_BLOCK, &newmask, NULL );
 
+    /* From here on a thread writes the log, now that we have forked */
+    if( log ) log_start(log);
+
     return config->is_server ? server_main() : client_main();
 }
@@ -0,0 +1,399 @@
+/* -------------------------------------------------------------------------
+ * metrics.c - htun server counters and their Prometheus endpoint
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "log.h"
+#include "http.h"
+#include "server.h"
+#include "util.h"
+#include "metrics.h"
+
+/* How long a scrape may take to send its request */
+#define MET_RECV_SECS 5
+
+#define HEAD_METRICS "HTTP/1.0 200 OK\r\n" \
+                     HDR_CONNECTION "Close\r\n" \
+                     HDR_CONTENT_LENGTH
+#define TAIL_METRICS "\r\n" \
+                     HDR_CONTENT_TYPE "text/plain; version=0.0.4\r\n" \
+                     "\r\n"
+#define HEAD_404     "HTTP/1.0 404 Not Found\r\n" \
+                     HDR_CONNECTION "Close\r\n" \
+                     HDR_CONTENT_LENGTH
+#define BODY_404     "Try /metrics\n"
+
+static const http_tmpl_t rsp_metrics = HTTP_TMPL(HEAD_METRICS, TAIL_METRICS, "");
+static const http_tmpl_t rsp_404 = HTTP_TMPL(HEAD_404, TAIL_PLAIN, BODY_404);
+
+extern tpool_t *tpool; /* from server.c */
+
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+} counters[MET_COUNTERS] = {
+    { "htun_connections_accepted_total", "",
+      "Connections given to a worker thread." },
+    { "htun_connections_refused_total", "reason=\"rate\"",
+      "Connections closed at accept." },
+    { "htun_connections_refused_total", "reason=\"load\"", NULL },
+    { "htun_connections_refused_total", "reason=\"junk\"", NULL },
+    { "htun_connections_refused_total", "reason=\"full\"", NULL },
+    { "htun_batches_total", "dir=\"tx\"",
+      "Batches sent to (tx) and taken from (rx) the clients." },
+    { "htun_batches_total", "dir=\"rx\"", NULL },
+    { "htun_batches_resent_total", "",
+      "Batches sent again because the client did not ack them." },
+    { "htun_packets_dropped_total", "reason=\"proto\"",
+      "Packets dropped on the way to or from the tun devices." },
+    { "htun_packets_dropped_total", "reason=\"dup_segment\"", NULL },
+    { "htun_packets_dropped_total", "reason=\"dup_batch\"", NULL },
+    { "htun_sessions_total", "",
+      "Sessions started by new clients and by known ones not resuming." },
+    { "htun_reconnects_total", "",
+      "Connects of clients the server already knew." },
+};
+
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *help;
+    double scale;           /* what the counted values are divided by */
+    unsigned long le[MET_BUCKETS]; /* bucket bounds, a 0 ends them */
+} hists[MET_HISTS] = {
+    { "htun_batch_packets", "dir=\"tx\"", "Packets in each batch.", 1,
+      { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 } },
+    { "htun_batch_packets", "dir=\"rx\"", NULL, 1,
+      { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 } },
+    { "htun_handler_seconds", "",
+      "Time taken by connect and send requests of the clients.", 1e6,
+      { 100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000,
+        5000000 } },
+};
+
+typedef struct {
+    unsigned long c[MET_COUNTERS];
+    unsigned long h[MET_HISTS][MET_BUCKETS+1];
+    unsigned long sum[MET_HISTS];
+} __attribute__((aligned(64))) met_shard_t;
+
+static met_shard_t shards[MET_SHARDS];
+static int next_shard = 0;
+static __thread met_shard_t *my_shard = NULL;
+
+/* A growing buffer the scrape is written into */
+typedef struct {
+    char *p;
+    size_t len;
+    size_t size;
+} met_buf_t;
+
+static inline met_shard_t *met_shard( void ) {
+    if( !my_shard ) {
+        my_shard = &shards[__sync_fetch_and_add(&next_shard, 1) % MET_SHARDS];
+    }
+    return my_shard;
+}
+
+void met_add( int id, unsigned long n ) {
+    __sync_fetch_and_add(&met_shard()->c[id], n);
+}
+
+void met_observe( int id, unsigned long value ) {
+    met_shard_t *s = met_shard();
+    int i;
+
+    for( i=0; i<MET_BUCKETS && hists[id].le[i]; i++ ) {
+        if( value <= hists[id].le[i] ) break;
+    }
+    if( i < MET_BUCKETS && !hists[id].le[i] ) i = MET_BUCKETS;
+    __sync_fetch_and_add(&s->h[id][i], 1);
+    __sync_fetch_and_add(&s->sum[id], value);
+}
+
+void met_client( met_client_t *m, int dir, size_t len ) {
+    __sync_fetch_and_add(&m->bytes[dir], len);
+    __sync_fetch_and_add(&m->pkts[dir], 1);
+}
+
+/* Appends to b like printf(). Gives up quietly if it cannot grow b. */
+static void met_printf( met_buf_t *b, const char *fmt, ... ) {
+    va_list ap;
+    char *tmp;
+    int n;
+
+    for(;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->p + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+        if( n < 0 ) return;
+        if( b->len + n < b->size ) break;
+        if( (tmp=realloc(b->p, b->size*2 + n)) == NULL ) return;
+        b->p = tmp;
+        b->size = b->size*2 + n;
+    }
+    b->len += n;
+}
+
+/* Writes name and its labels, if it has any, followed by a space */
+static void met_name( met_buf_t *b, const char *name, const char *suffix,
+                      const char *labels ) {
+    if( *labels ) met_printf(b, "%s%s{%s} ", name, suffix, labels);
+    else met_printf(b, "%s%s ", name, suffix);
+}
+
+/* Writes the help and type lines of a metric, unless help is NULL */
+static void met_head( met_buf_t *b, const char *name, const char *help,
+                      const char *type ) {
+    if( !help ) return;
+    met_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void met_counters( met_buf_t *b ) {
+    unsigned long v;
+    int id, i;
+
+    for( id=0; id<MET_COUNTERS; id++ ) {
+        for( v=0, i=0; i<MET_SHARDS; i++ ) v += shards[i].c[id];
+        met_head(b, counters[id].name, counters[id].help, "counter");
+        met_name(b, counters[id].name, "", counters[id].labels);
+        met_printf(b, "%lu\n", v);
+    }
+}
+
+static void met_hists( met_buf_t *b ) {
+    const char *sep;
+    unsigned long cnt, sum;
+    double scale;
+    int id, i, j;
+
+    for( id=0; id<MET_HISTS; id++ ) {
+        sep = *hists[id].labels ? "," : "";
+        scale = hists[id].scale;
+        met_head(b, hists[id].name, hists[id].help, "histogram");
+
+        /* the buckets count everything up to their bound */
+        for( cnt=0, i=0; i<=MET_BUCKETS; i++ ) {
+            if( i < MET_BUCKETS && !hists[id].le[i] ) continue;
+            for( j=0; j<MET_SHARDS; j++ ) cnt += shards[j].h[id][i];
+            if( i == MET_BUCKETS ) {
+                met_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %lu\n",
+                           hists[id].name, hists[id].labels, sep, cnt);
+            } else {
+                met_printf(b, "%s_bucket{%s%sle=\"%g\"} %lu\n",
+                           hists[id].name, hists[id].labels, sep,
+                           hists[id].le[i] / scale, cnt);
+            }
+        }
+        for( sum=0, j=0; j<MET_SHARDS; j++ ) sum += shards[j].sum[id];
+        met_name(b, hists[id].name, "_sum", hists[id].labels);
+        met_printf(b, "%g\n", sum / scale);
+        met_name(b, hists[id].name, "_count", hists[id].labels);
+        met_printf(b, "%lu\n", cnt);
+    }
+}
+
+/* Writes the number of queue q of c, in bytes if bytes is set */
+static void met_queue( met_buf_t *b, clidata_t *c, const char *name,
+                       const char *which, queue_t *q, int bytes ) {
+    if( !q ) return;
+    met_printf(b, "%s{mac=\"%s\",queue=\"%s\"} %lu\n", name, c->macaddr,
+               which, (unsigned long)(bytes ? q->totsize : q->nr_nodes));
+}
+
+/* The quantiles of each stage of c, then their sums and counts */
+static void met_lat( met_buf_t *b, clidata_t *c ) {
+    static const double qs[4] = { 0.5, 0.9, 0.99, 0.999 };
+    lat_hist_t *h;
+    int i, q;
+
+    if( c->lat == NULL ) return;
+    for( i=0; i<LAT_STAGES; i++ ) {
+        h = &c->lat->h[i];
+        if( !h->count ) continue;
+        for( q=0; q<4; q++ ) {
+            met_printf(b, "htun_latency_seconds{mac=\"%s\",stage=\"%s\","
+                       "quantile=\"%g\"} %.6f\n", c->macaddr, lat_stages[i],
+                       qs[q], lat_quantile(h, qs[q]) / 1e6);
+        }
+        met_printf(b, "htun_latency_seconds_sum{mac=\"%s\",stage=\"%s\"} "
+                   "%.6f\n", c->macaddr, lat_stages[i], h->sum / 1e6);
+        met_printf(b, "htun_latency_seconds_count{mac=\"%s\",stage=\"%s\"} "
+                   "%lu\n", c->macaddr, lat_stages[i], h->count);
+    }
+}
+
+static void met_clients( met_buf_t *b ) {
+    static const char *dirs[2] = { "tx", "rx" };
+    clidata_t *c;
+    int n = 0, d;
+
+    pthread_mutex_lock(&clients->lock);
+
+    /* Prometheus wants all lines of a metric together */
+    met_head(b, "htun_client_bytes_total",
+             "Bytes sent to (tx) and taken from (rx) each client.", "counter");
+    for( c = clients->head; c; c = c->next, n++ ) {
+        for( d=0; d<2; d++ ) {
+            met_printf(b, "htun_client_bytes_total{mac=\"%s\",dir=\"%s\"} "
+                       "%lu\n", c->macaddr, dirs[d], c->met.bytes[d]);
+        }
+    }
+    met_head(b, "htun_client_packets_total",
+             "Packets sent to (tx) and taken from (rx) each client.",
+             "counter");
+    for( c = clients->head; c; c = c->next ) {
+        for( d=0; d<2; d++ ) {
+            met_printf(b, "htun_client_packets_total{mac=\"%s\",dir=\"%s\"} "
+                       "%lu\n", c->macaddr, dirs[d], c->met.pkts[d]);
+        }
+    }
+    met_head(b, "htun_client_queue_packets",
+             "Packets queued for (send) and from (recv) each client.",
+             "gauge");
+    for( c = clients->head; c; c = c->next ) {
+        met_queue(b, c, "htun_client_queue_packets", "send", c->sendq, 0);
+        met_queue(b, c, "htun_client_queue_packets", "recv", c->recvq, 0);
+    }
+    met_head(b, "htun_client_queue_bytes",
+             "Bytes queued for (send) and from (recv) each client.", "gauge");
+    for( c = clients->head; c; c = c->next ) {
+        met_queue(b, c, "htun_client_queue_bytes", "send", c->sendq, 1);
+        met_queue(b, c, "htun_client_queue_bytes", "recv", c->recvq, 1);
+    }
+    met_head(b, "htun_latency_seconds",
+             "Time packets spend in each stage, per client.", "summary");
+    for( c = clients->head; c; c = c->next ) met_lat(b, c);
+
+    pthread_mutex_unlock(&clients->lock);
+
+    met_head(b, "htun_clients", "Clients the server keeps data for.",
+             "gauge");
+    met_printf(b, "htun_clients %d\n", n);
+    met_head(b, "htun_pending_requests",
+             "Connections waiting for a worker thread.", "gauge");
+    met_printf(b, "htun_pending_requests %d\n", tpool->cur_queue_size);
+}
+
+/* Answers the one request of a scrape on fd */
+static void met_serve( int fd ) {
+    struct timeval tv = { MET_RECV_SECS, 0 };
+    met_buf_t b;
+    http_msg_t msg;
+    rbuf_t *rb;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if( (rb=rb_new(fd)) == NULL ) return;
+    if( http_read_msg(rb, &msg) == -1 ) goto cleanup1;
+
+    if( msg.line.len < 13 || strncmp(msg.line.ptr, "GET /metrics", 12) ||
+        (msg.line.ptr[12] != ' ' && msg.line.ptr[12] != '?') ) {
+        http_send(fd, &rsp_404, NULL, 0);
+        goto cleanup1;
+    }
+
+    b.len = 0;
+    b.size = 8192;
+    if( (b.p=malloc(b.size)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() metrics buffer!");
+        goto cleanup1;
+    }
+    met_counters(&b);
+    met_hists(&b);
+    met_clients(&b);
+    http_send(fd, &rsp_metrics, b.p, b.len);
+    free(b.p);
+
+cleanup1:
+    rb_free(&rb);
+}
+
+static void *met_thread( void *sockp ) {
+    int sock = *(int *)sockp;
+    int fd;
+
+    free(sockp);
+    while( 1 ) {
+        if( (fd=accept(sock, NULL, NULL)) == -1 ) {
+            if( errno != EINTR ) {
+                lprintf(log, WARN, "metrics accept(): %s", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+        met_serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int met_start( unsigned short port ) {
+    struct sockaddr_in addr;
+    pthread_t tid;
+    int *sockp, sockopt = 1;
+
+    if( (sockp=malloc(sizeof(int))) == NULL ) return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if( (*sockp=socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 ) {
+        lprintf(log, ERROR, "Creating metrics socket: %s", strerror(errno));
+        goto cleanup1;
+    }
+    setsockopt(*sockp, SOL_SOCKET, SO_REUSEADDR, &sockopt, sizeof(sockopt));
+    if( bind(*sockp, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(*sockp, HTUN_SOCKPENDING) == -1 ) {
+        lprintf(log, ERROR, "Binding metrics to 127.0.0.1:%d: %s", port,
+                strerror(errno));
+        goto cleanup2;
+    }
+    if( pthread_create(&tid, NULL, met_thread, sockp) ) {
+        lprintf(log, ERROR, "Could not create metrics thread");
+        goto cleanup2;
+    }
+    pthread_detach(tid);
+
+    lprintf(log, INFO, "Serving metrics on 127.0.0.1:%d/metrics.", port);
+    return 0;
+
+cleanup2:
+    close(*sockp);
+cleanup1:
+    free(sockp);
+    return -1;
+}
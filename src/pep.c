@@ -0,0 +1,610 @@
+/* -------------------------------------------------------------------------
+ * pep.c - htun split TCP, carrying TCP byte streams instead of packets
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/netfilter_ipv4.h>
+
+#include "common.h"
+#include "log.h"
+#include "queue.h"
+#include "pep.h"
+
+#define PEP_S_OPENING 0
+#define PEP_S_OPEN    1
+#define PEP_S_RESET   2
+
+typedef struct _pep_stream_t {
+    pep_t *pep;
+    unsigned long id;
+    int fd;
+    struct sockaddr_in dst;
+    queue_t *in;            /* DATA and FIN frames to write out to fd */
+    unsigned long sent;     /* stream offset of the next byte we send */
+    unsigned long rcvd;     /* and of the next byte we expect */
+    long unacked;           /* bytes sent the peer has not written out */
+    int state;
+    struct _pep_stream_t *next;
+} pep_stream_t;
+
+struct _pep_t {
+    pep_send_t send;
+    void *arg;
+    int accept_opens;
+    int dead;               /* pep_destroy() was called */
+    int listener;
+    int accepting;          /* the acceptor thread runs */
+    pthread_t acceptor;
+    unsigned long next_id;
+    pep_stream_t *streams;
+    int nstreams;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;    /* a stream changed state or got credit */
+};
+
+static inline void put32( char *p, unsigned long v ) {
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static inline unsigned long get32( const char *p ) {
+    return (unsigned long)(p[0] & 0xFF) << 24 | (p[1] & 0xFF) << 16 |
+        (p[2] & 0xFF) << 8 | (p[3] & 0xFF);
+}
+
+/* Returns a new frame with room for len bytes of data, or NULL */
+static char *pep_frame( int type, unsigned long id, unsigned long arg,
+                        size_t len ) {
+    char *f;
+
+    if( (f=calloc(1, PEP_HDR_LEN + len)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() split TCP frame!");
+        return NULL;
+    }
+    f[2] = (PEP_PROTO >> 8) & 0xFF;
+    f[3] = PEP_PROTO & 0xFF;
+    f[5] = type;
+    f[6] = ((PEP_HDR_LEN + len - 4) >> 8) & 0xFF;
+    f[7] = (PEP_HDR_LEN + len - 4) & 0xFF;
+    put32(f + 8, id);
+    put32(f + 12, arg);
+    return f;
+}
+
+/* Sends f to the peer, with p->mutex held so frames keep their order */
+static void pep_send_locked( pep_t *p, char *f ) {
+    if( f == NULL ) return;
+    if( p->dead ) {
+        free(f);
+        return;
+    }
+    p->send(p->arg, f);
+}
+
+static inline void pep_reply( pep_t *p, int type, unsigned long id,
+                              unsigned long arg ) {
+    pep_send_locked(p, pep_frame(type, id, arg, 0));
+}
+
+/*
+ * Gives up on stream s, waking both of its threads. Call with p->mutex
+ * held. Telling the peer is up to the caller.
+ */
+static void pep_reset_locked( pep_stream_t *s ) {
+    char *f;
+
+    if( s->state == PEP_S_RESET ) return;
+    s->state = PEP_S_RESET;
+    if( s->fd != -1 ) shutdown(s->fd, SHUT_RDWR);
+    if( (f=pep_frame(PEP_RST, s->id, 0, 0)) != NULL &&
+        q_add(s->in, f, 0, PEP_HDR_LEN) == -1 ) free(f);
+    pthread_cond_broadcast(&s->pep->cond);
+}
+
+static int write_all( int fd, const char *buf, size_t len ) {
+    ssize_t n;
+
+    while( len > 0 ) {
+        if( (n=send(fd, buf, len, MSG_NOSIGNAL)) == -1 ) {
+            if( errno == EINTR ) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Returns nonzero if a peer may have us connect to dst: not to loopback,
+ * the any address, multicast or broadcast, nor into the tunnel's own
+ * networks, where the server's tun addresses are.
+ */
+static int pep_dst_ok( struct sockaddr_in *dst ) {
+    unsigned long a = ntohl(dst->sin_addr.s_addr);
+    iprange_t *r;
+
+    if( dst->sin_port == 0 ) return 0;
+    if( (a >> 24) == 0 || (a >> 24) == IN_LOOPBACKNET || a >= 0xE0000000UL ) {
+        return 0;
+    }
+    for( r = config->u.s.ipr; r != NULL; r = r->next ) {
+        if( ip_ok(r, &dst->sin_addr) ) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Connects to dst, giving up after PEP_OPEN_TIMEOUT. Returns the socket.
+ * Addresses of our own, which we can bind to, are refused.
+ */
+static int pep_connect( struct sockaddr_in *dst ) {
+    struct sockaddr_in self;
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int fd, err = 0, fl;
+
+    if( (fd=socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 ) return -1;
+    self = *dst;
+    self.sin_port = 0;
+    if( bind(fd, (struct sockaddr *)&self, sizeof(self)) == 0 ) {
+        lprintf(log, WARN, "split TCP: refusing to connect to %s, one of "
+                "our own addresses", inet_ntoa(dst->sin_addr));
+        close(fd);
+        return -1;
+    }
+    fl = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+
+    if( connect(fd, (struct sockaddr *)dst, sizeof(*dst)) == -1 ) {
+        if( errno != EINPROGRESS ) goto err;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if( poll(&pfd, 1, PEP_OPEN_TIMEOUT * 1000) != 1 ) {
+            errno = ETIMEDOUT;
+            goto err;
+        }
+        if( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+            err != 0 ) {
+            errno = err;
+            goto err;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fl);
+    return fd;
+
+err:
+    lprintf(log, INFO, "split TCP: connecting to %s:%d: %s",
+            inet_ntoa(dst->sin_addr), ntohs(dst->sin_port), strerror(errno));
+    close(fd);
+    return -1;
+}
+
+static inline void set_nodelay( int fd ) {
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * thread
+ *
+ * reads what the local end sends into DATA frames, as long as the peer has
+ * room for them
+ */
+static void *pep_reader( void *arg ) {
+    pep_stream_t *s = (pep_stream_t *)arg;
+    pep_t *p = s->pep;
+    char buf[PEP_MAX_DATA], *f;
+    struct timespec ts;
+    ssize_t n;
+
+    /* the client waits for the server to get through to the destination */
+    pthread_mutex_lock(&p->mutex);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += PEP_OPEN_TIMEOUT;
+    while( s->state == PEP_S_OPENING ) {
+        if( pthread_cond_timedwait(&p->cond, &p->mutex, &ts) == ETIMEDOUT &&
+            s->state == PEP_S_OPENING ) {
+            lprintf(log, WARN, "split TCP: no answer to opening stream %lu "
+                    "to %s:%d", s->id, inet_ntoa(s->dst.sin_addr),
+                    ntohs(s->dst.sin_port));
+            pep_reply(p, PEP_RST, s->id, 0);
+            pep_reset_locked(s);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    for(;;) {
+        pthread_mutex_lock(&p->mutex);
+        while( s->state == PEP_S_OPEN && s->unacked >= PEP_WINDOW ) {
+            pthread_cond_wait(&p->cond, &p->mutex);
+        }
+        if( s->state != PEP_S_OPEN ) break;
+        pthread_mutex_unlock(&p->mutex);
+
+        while( (n=read(s->fd, buf, sizeof(buf))) == -1 && errno == EINTR );
+
+        pthread_mutex_lock(&p->mutex);
+        if( s->state != PEP_S_OPEN ) break;
+        if( n > 0 ) {
+            if( (f=pep_frame(PEP_DATA, s->id, s->sent, n)) == NULL ) {
+                pep_reply(p, PEP_RST, s->id, 0);
+                pep_reset_locked(s);
+                break;
+            }
+            memcpy(f + PEP_HDR_LEN, buf, n);
+            s->sent += n;
+            s->unacked += n;
+            pep_send_locked(p, f);
+        } else {
+            pep_reply(p, n == 0 ? PEP_FIN : PEP_RST, s->id, 0);
+            if( n == -1 ) pep_reset_locked(s);
+            break;
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return NULL;
+}
+
+/*
+ * thread
+ *
+ * connects to the destination on the server, then writes what the peer
+ * sends out to the local end, and frees the stream once both directions
+ * are done
+ */
+static void *pep_stream( void *arg ) {
+    pep_stream_t *s = (pep_stream_t *)arg, **sp;
+    pep_t *p = s->pep;
+    pthread_t reader;
+    unsigned long consumed = 0;
+    int fd = -1, reading = 0, last;
+    size_t n;
+    char *f;
+
+    if( s->fd == -1 ) {
+        fd = pep_connect(&s->dst);
+        pthread_mutex_lock(&p->mutex);
+        if( s->state == PEP_S_RESET || fd == -1 ) {
+            if( s->state != PEP_S_RESET ) pep_reply(p, PEP_RST, s->id, 0);
+            s->state = PEP_S_RESET;
+            pthread_mutex_unlock(&p->mutex);
+            if( fd != -1 ) close(fd);
+            goto out;
+        }
+        set_nodelay(fd);
+        s->fd = fd;
+        s->state = PEP_S_OPEN;
+        pep_reply(p, PEP_OK, s->id, 0);
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    if( pthread_create(&reader, NULL, pep_reader, s) != 0 ) {
+        pthread_mutex_lock(&p->mutex);
+        pep_reply(p, PEP_RST, s->id, 0);
+        pep_reset_locked(s);
+        pthread_mutex_unlock(&p->mutex);
+        goto out;
+    }
+    reading = 1;
+
+    while( (f=q_remove(s->in, Q_WAIT, NULL)) != NULL ) {
+        if( f[5] == PEP_DATA ) {
+            n = iplen(f) - PEP_HDR_LEN;
+            if( get32(f + 12) != (s->rcvd & 0xFFFFFFFFUL) ||
+                write_all(s->fd, f + PEP_HDR_LEN, n) == -1 ) {
+                if( get32(f + 12) != (s->rcvd & 0xFFFFFFFFUL) ) {
+                    lprintf(log, WARN, "split TCP: stream %lu lost data, "
+                            "resetting it", s->id);
+                }
+                free(f);
+                pthread_mutex_lock(&p->mutex);
+                pep_reply(p, PEP_RST, s->id, 0);
+                pep_reset_locked(s);
+                pthread_mutex_unlock(&p->mutex);
+                break;
+            }
+            s->rcvd += n;
+
+            /* the peer may send more once this much is out */
+            if( (consumed += n) >= PEP_WINDOW / 4 ) {
+                pthread_mutex_lock(&p->mutex);
+                pep_reply(p, PEP_ACK, s->id, consumed);
+                pthread_mutex_unlock(&p->mutex);
+                consumed = 0;
+            }
+            free(f);
+            continue;
+        }
+
+        /* FIN leaves the other direction open, RST closes it as well */
+        if( f[5] == PEP_FIN ) shutdown(s->fd, SHUT_WR);
+        free(f);
+        break;
+    }
+
+out:
+    if( reading ) pthread_join(reader, NULL);
+
+    pthread_mutex_lock(&p->mutex);
+    for( sp = &p->streams; *sp != s; sp = &(*sp)->next );
+    *sp = s->next;
+    p->nstreams--;
+    last = p->dead && p->nstreams == 0 && !p->accepting;
+    pthread_mutex_unlock(&p->mutex);
+
+    dprintf(log, DEBUG, "split TCP: stream %lu done", s->id);
+    if( s->fd != -1 ) close(s->fd);
+    q_destroy(&s->in);
+    free(s);
+
+    if( last ) {
+        pthread_mutex_destroy(&p->mutex);
+        pthread_cond_destroy(&p->cond);
+        free(p);
+    }
+    return NULL;
+}
+
+/*
+ * Starts stream id, to the local end fd on the client or to be connected
+ * to dst on the server (fd -1). Call with p->mutex held.
+ */
+static int pep_open_stream( pep_t *p, unsigned long id, int fd,
+                            struct sockaddr_in *dst ) {
+    pep_stream_t *s;
+    pthread_t tid;
+
+    if( (s=calloc(1, sizeof(pep_stream_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() split TCP stream!");
+        return -1;
+    }
+    if( (s->in=q_init()) == NULL ) {
+        free(s);
+        return -1;
+    }
+    s->pep = p;
+    s->id = id;
+    s->fd = fd;
+    s->dst = *dst;
+    s->state = PEP_S_OPENING;
+
+    if( pthread_create(&tid, NULL, pep_stream, s) != 0 ) {
+        lprintf(log, ERROR, "split TCP: could not start stream thread");
+        q_destroy(&s->in);
+        free(s);
+        return -1;
+    }
+    pthread_detach(tid);
+
+    s->next = p->streams;
+    p->streams = s;
+    p->nstreams++;
+    return 0;
+}
+
+/*
+ * thread
+ *
+ * takes the connections REDIRECTed to us and opens a stream for each
+ */
+static void *pep_acceptor( void *arg ) {
+    pep_t *p = (pep_t *)arg;
+    struct sockaddr_in dst;
+    socklen_t len;
+    unsigned long id;
+    char *f;
+    int fd;
+
+    for(;;) {
+        if( (fd=accept(p->listener, NULL, NULL)) == -1 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) continue;
+            break;
+        }
+
+        /* where the connection was headed before it was redirected */
+        len = sizeof(dst);
+        if( getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &dst, &len) == -1 ) {
+            lprintf(log, WARN, "split TCP: connection was not redirected: %s",
+                    strerror(errno));
+            close(fd);
+            continue;
+        }
+        set_nodelay(fd);
+
+        pthread_mutex_lock(&p->mutex);
+        id = p->next_id++;
+        f = pep_frame(PEP_OPEN, id, ntohl(dst.sin_addr.s_addr), 0);
+        if( p->dead || f == NULL || pep_open_stream(p, id, fd, &dst) == -1 ) {
+            free(f);
+            close(fd);
+        } else {
+            f[16] = (ntohs(dst.sin_port) >> 8) & 0xFF;
+            f[17] = ntohs(dst.sin_port) & 0xFF;
+            pep_send_locked(p, f);
+            dprintf(log, DEBUG, "split TCP: stream %lu to %s:%d", id,
+                    inet_ntoa(dst.sin_addr), ntohs(dst.sin_port));
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    if( !p->dead ) {
+        lprintf(log, ERROR, "split TCP: accept() failed: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+pep_t *pep_new( pep_send_t send, void *arg, int accept_opens ) {
+    pep_t *p;
+
+    if( (p=calloc(1, sizeof(pep_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() split TCP endpoint!");
+        return NULL;
+    }
+    p->send = send;
+    p->arg = arg;
+    p->accept_opens = accept_opens;
+    p->listener = -1;
+    /* so streams of an earlier run are not taken for ours */
+    p->next_id = (unsigned long)time(NULL) << 8;
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return p;
+}
+
+int pep_listen( pep_t *p, unsigned short port ) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    if( (p->listener=socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 ) {
+        lprintf(log, ERROR, "split TCP: socket(): %s", strerror(errno));
+        return -1;
+    }
+    setsockopt(p->listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if( bind(p->listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(p->listener, HTUN_SOCKPENDING) == -1 ) {
+        lprintf(log, ERROR, "split TCP: cannot listen on port %d: %s", port,
+                strerror(errno));
+        goto err;
+    }
+
+    if( pthread_create(&p->acceptor, NULL, pep_acceptor, p) != 0 ) goto err;
+    p->accepting = 1;
+    lprintf(log, INFO, "split TCP: taking connections on port %d", port);
+    return 0;
+
+err:
+    close(p->listener);
+    p->listener = -1;
+    return -1;
+}
+
+void pep_input( pep_t *p, char *f ) {
+    struct sockaddr_in dst;
+    unsigned long id, arg;
+    pep_stream_t *s;
+    int type;
+
+    if( iplen(f) < PEP_HDR_LEN ) {
+        free(f);
+        return;
+    }
+    type = f[5];
+    id = get32(f + 8);
+    arg = get32(f + 12);
+
+    pthread_mutex_lock(&p->mutex);
+    for( s = p->streams; s != NULL && s->id != id; s = s->next );
+
+    switch( type ) {
+        case PEP_OPEN:
+            if( s != NULL ) break;
+            memset(&dst, 0, sizeof(dst));
+            dst.sin_family = AF_INET;
+            dst.sin_addr.s_addr = htonl(arg);
+            dst.sin_port = htons((f[16] & 0xFF) << 8 | (f[17] & 0xFF));
+            if( !p->accept_opens || p->dead || !pep_dst_ok(&dst) ||
+                pep_open_stream(p, id, -1, &dst) == -1 ) {
+                dprintf(log, DEBUG, "split TCP: refusing stream %lu", id);
+                pep_reply(p, PEP_RST, id, 0);
+            }
+            break;
+        case PEP_OK:
+            if( s != NULL && s->state == PEP_S_OPENING ) {
+                s->state = PEP_S_OPEN;
+                pthread_cond_broadcast(&p->cond);
+            }
+            break;
+        case PEP_ACK:
+            if( s != NULL ) {
+                s->unacked -= arg;
+                pthread_cond_broadcast(&p->cond);
+            }
+            break;
+        case PEP_DATA:
+        case PEP_FIN:
+            if( s == NULL ) {
+                /* a stream we forgot, say from before a restart */
+                pep_reply(p, PEP_RST, id, 0);
+            } else if( s->state != PEP_S_RESET &&
+                       q_add(s->in, f, 0, iplen(f)) == 0 ) {
+                f = NULL;
+            }
+            break;
+        case PEP_RST:
+            if( s != NULL ) pep_reset_locked(s);
+            break;
+    }
+    pthread_mutex_unlock(&p->mutex);
+    free(f);
+}
+
+void pep_destroy( pep_t **pp ) {
+    pep_t *p = *pp;
+    pep_stream_t *s;
+    int last;
+
+    if( p == NULL ) return;
+    *pp = NULL;
+
+    pthread_mutex_lock(&p->mutex);
+    p->dead = 1;
+    for( s = p->streams; s != NULL; s = s->next ) pep_reset_locked(s);
+    /* wakes the acceptor out of accept() */
+    if( p->listener != -1 ) shutdown(p->listener, SHUT_RDWR);
+    pthread_mutex_unlock(&p->mutex);
+
+    if( p->accepting ) pthread_join(p->acceptor, NULL);
+    if( p->listener != -1 ) close(p->listener);
+
+    pthread_mutex_lock(&p->mutex);
+    p->accepting = 0;
+    last = p->nstreams == 0;
+    pthread_mutex_unlock(&p->mutex);
+
+    if( last ) {
+        pthread_mutex_destroy(&p->mutex);
+        pthread_cond_destroy(&p->cond);
+        free(p);
+    }
+}
@@ -111,6 +111,7 @@ int q_add( queue_t *q, void *data, int flags, size_t size ){
 
     newnode->data=data;
     newnode->size=size;
+    newnode->added = q->wait ? lat_now() : 0;
     newnode->next=NULL;
 
     /* This is the case where we will be able to add the item */
@@ -135,12 +136,20 @@ int q_add( queue_t *q, void *data, int flags, size_t size ){
 
     if( flags&Q_PUSH ) {
         /* Add the request to the head of the queue */
+        newnode->prev = NULL;
         newnode->next = q->head;
+        if( q->head ) q->head->prev = newnode;
+        else {
+            q->tail = &newnode->next;
+            q->last = newnode;
+        }
         q->head = newnode;
     } else {
         /* Add the request to the tail of the queue */
+        newnode->prev = q->last;
         *(q->tail) = newnode;
         q->tail = &newnode->next;
+        q->last = newnode;
     }
 
     q->nr_nodes++;
@@ -157,6 +166,102 @@ cleanup:
     return rc;
 }
 
+/* Appends a new node for data. Call with the queue locked. */
+static inline int q_append( queue_t *q, void *data, size_t size ) {
+    qnode_t *newnode;
+
+    if( q->max_nodes && q->nr_nodes >= q->max_nodes ) return -1;
+    if( (newnode=malloc(sizeof(qnode_t))) == NULL ) {
+        lprintf( log, ERROR, "Unable to malloc space for new node!" );
+        return -1;
+    }
+    newnode->data=data;
+    newnode->size=size;
+    newnode->added = q->wait ? lat_now() : 0;
+    newnode->next=NULL;
+    newnode->prev = q->last;
+    *(q->tail) = newnode;
+    q->tail = &newnode->next;
+    q->last = newnode;
+    q->nr_nodes++;
+    q->totsize += size;
+    gettimeofday(&(q->lastadd), NULL);
+    return 0;
+}
+
+/* Adds a request to the tail unless the same is queued near it already. */
+int q_add_unique( queue_t *q, void *data, size_t size,
+                  int (*same)( const void *item, const void *data ) ) {
+    qnode_t *node;
+    int rc=0, n;
+
+    if( !q ) {
+        lprintf(log, WARN, "passed null queue!");
+        return -1;
+    }
+
+    q_lock(q, &q->writers);
+
+    for( node = q->last, n = 0; node && n < Q_SCAN_MAX;
+         node = node->prev, n++ ) {
+        if( same(node->data, data) ) {
+            q->dupsize += size;
+            rc = 1;
+            goto cleanup;
+        }
+    }
+    rc = q_append(q, data, size);
+
+cleanup:
+    q_unlock(rc==0?&q->reader_cond:NULL);
+
+    return rc;
+}
+
+/*
+ * Returns the node data may take the place of, or NULL. Looking back from
+ * the tail, the first item that is not unrelated decides. Call with the
+ * queue locked.
+ */
+static qnode_t *q_superseded( queue_t *q, void *data,
+        int (*supersedes)( const void *item, const void *data ) ) {
+    qnode_t *node;
+    int r, n;
+
+    for( node = q->last, n = 0; node && n < Q_SCAN_MAX;
+         node = node->prev, n++ ) {
+        if( (r=supersedes(node->data, data)) != 0 ) return r > 0 ? node : NULL;
+    }
+    return NULL;
+}
+
+/* Adds a request in place of one it supersedes, or to the tail. */
+int q_replace( queue_t *q, void *data, size_t size,
+               int (*supersedes)( const void *item, const void *data ),
+               void **old ) {
+    qnode_t *node;
+    volatile int rc=0;  /* q_lock() does a setjmp() */
+
+    *old = NULL;
+    if( !q ) {
+        lprintf(log, WARN, "passed null queue!");
+        return -1;
+    }
+
+    q_lock(q, &q->writers);
+
+    if( (node=q_superseded(q, data, supersedes)) != NULL ) {
+        *old = node->data;
+        q->totsize += size - node->size;
+        node->data = data;
+        node->size = size;
+    } else rc = q_append(q, data, size);
+
+    q_unlock(rc==-1?NULL:&q->reader_cond);
+
+    return rc;
+}
+
 /* Pop a request from the head of the queue. */
 void *q_remove( queue_t *q, int flags, const struct timespec *wait ){
     qnode_t *tmp;
@@ -213,7 +318,11 @@ void *q_remove( queue_t *q, int flags, const struct timespec *wait ){
     tmp=q->head;
     data=tmp->data;
     q->totsize -= tmp->size;
-    if( (q->head=tmp->next) == NULL ) q->tail = &q->head;
+    if( q->wait && tmp->added ) lat_add(q->wait, lat_now() - tmp->added);
+    if( (q->head=tmp->next) == NULL ) {
+        q->tail = &q->head;
+        q->last = NULL;
+    } else q->head->prev = NULL;
     free(tmp);
     q->nr_nodes--;
 
@@ -265,6 +374,12 @@ int q_timedwait( queue_t *q, struct timespec *ts_in ) {
     return rc;
 }
 
+void q_wake( queue_t *q ) {
+    pthread_mutex_lock(&q->mutex);
+    pthread_cond_broadcast(&q->reader_cond);
+    pthread_mutex_unlock(&q->mutex);
+}
+
 /* Allocates and initializes a new queue_t */
 queue_t *q_init( void ) {
     queue_t *q = calloc(1, sizeof(queue_t));
@@ -0,0 +1,279 @@
+/* -------------------------------------------------------------------------
+ * rtx.c - htun retransmit buffer for packet batches
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "log.h"
+#include "queue.h"
+#include "rtx.h"
+#include "zbatch.h"
+
+rtx_t *rtx_init( void ) {
+    rtx_t *r;
+
+    if( (r=calloc(1, sizeof(rtx_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() retransmit buffer!");
+        return NULL;
+    }
+    r->tail = &r->head;
+    r->next_seq = 1;
+    r->win = RTX_WINDOW;
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_mutex_init(&r->txmutex, NULL);
+    return r;
+}
+
+static void batch_free( rtx_batch_t *b ) {
+    int i;
+
+    for( i=0; i < b->npkts; i++ ) free(b->pkts[i]);
+    free(b->z);
+    free(b);
+}
+
+/* Drops the list's hold on every batch, and the one made ahead, which
+ * nobody else has. Call with r locked. */
+static void drop_batches( rtx_t *r ) {
+    rtx_batch_t *b;
+
+    while( (b=r->head) != NULL ) {
+        r->head = b->next;
+        if( --b->refs == 0 ) batch_free(b);
+    }
+    r->tail = &r->head;
+    if( r->ready ) batch_free(r->ready);
+    r->ready = NULL;
+}
+
+void rtx_destroy( rtx_t **r ) {
+    if( !*r ) return;
+    drop_batches(*r);
+    pthread_mutex_destroy(&(*r)->mutex);
+    pthread_mutex_destroy(&(*r)->txmutex);
+    free(*r);
+    *r = NULL;
+}
+
+void rtx_reset( rtx_t *r ) {
+    pthread_mutex_lock(&r->txmutex);
+    pthread_mutex_lock(&r->mutex);
+    drop_batches(r);
+    r->next_seq = 1;
+    r->rcvd = 0;
+    r->win = RTX_WINDOW;
+    vj_reset(&r->vjtx);
+    vj_reset(&r->vjrx);
+    aead_reset(&r->aead);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_mutex_unlock(&r->txmutex);
+}
+
+/* Returns the oldest unacked batch, held for the caller, or NULL */
+static rtx_batch_t *rtx_resend( rtx_t *r ) {
+    rtx_batch_t *b;
+
+    pthread_mutex_lock(&r->mutex);
+    if( (b=r->head) != NULL ) {
+        b->refs++;
+        b->sends++;
+    }
+    pthread_mutex_unlock(&r->mutex);
+    return b;
+}
+
+/*
+ * Makes a new batch of up to amount bytes of packets off q, encoded, but
+ * not numbered yet. Returns NULL if there is nothing to send. Call with
+ * r->txmutex held.
+ */
+static rtx_batch_t *rtx_make( rtx_t *r, queue_t *q, size_t amount ) {
+    rtx_batch_t *b;
+    size_t max;
+    char *pkt;
+
+    /* Take at most what is queued now, so the array is big enough */
+    if( amount == 0 || (max=q->nr_nodes) == 0 ) return NULL;
+
+    if( (b=malloc(sizeof(*b) + max * sizeof(char *))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() batch!");
+        return NULL;
+    }
+    b->pkts = (char **)(b + 1);
+    b->npkts = 0;
+    b->size = 0;
+    b->z = NULL;
+    b->zlen = 0;
+    b->enc = 0;
+    b->refs = 2;
+    b->sends = 1;
+    b->next = NULL;
+
+    while( b->size < amount && (size_t)b->npkts < max ) {
+        if( (pkt=q_remove(q, 0, NULL)) == NULL ) break;
+        b->pkts[b->npkts++] = pkt;
+        b->size += iplen(pkt);
+    }
+    if( b->npkts == 0 ) {
+        free(b);
+        return NULL;
+    }
+
+    /* Once per batch, by whoever made it and outside r->mutex, so resends
+     * and acks never wait on it */
+    if( r->enc ) b->z = zbatch_encode(&r->vjtx, &r->aead, r->enc, b->pkts,
+                                      b->npkts, b->size, &b->zlen, &b->enc);
+
+    /* Better lost than sent in the clear */
+    if( (r->enc & ZB_AEAD) && !b->z ) {
+        lprintf(log, ERROR, "Dropping %d packets that could not be sealed.",
+                b->npkts);
+        batch_free(b);
+        return NULL;
+    }
+    return b;
+}
+
+rtx_batch_t *rtx_next( rtx_t *r, queue_t *q, size_t amount ) {
+    rtx_batch_t *b;
+    size_t win;
+
+    /* A resend is handed out without waiting on whoever makes a batch */
+    if( (b=rtx_resend(r)) != NULL ) return b;
+
+    /* Only one batch is made at a time, both channels send new ones, and
+     * each goes through the compression state and the sealing counter */
+    pthread_mutex_lock(&r->txmutex);
+    if( (b=rtx_resend(r)) != NULL ) goto out;
+    pthread_mutex_lock(&r->mutex);
+    win = max(r->win, 1);
+    b = r->ready;
+    r->ready = NULL;
+    pthread_mutex_unlock(&r->mutex);
+
+    /* Else what the peer has room for */
+    if( b == NULL &&
+        (b=rtx_make(r, q, min(amount, min(win, RTX_MAX_BATCH)))) == NULL ) {
+        goto out;
+    }
+
+    pthread_mutex_lock(&r->mutex);
+    b->seq = r->next_seq++;
+    *r->tail = b;
+    r->tail = &b->next;
+    pthread_mutex_unlock(&r->mutex);
+out:
+    pthread_mutex_unlock(&r->txmutex);
+    return b;
+}
+
+void rtx_prepare( rtx_t *r, queue_t *q ) {
+    rtx_batch_t *b;
+    size_t full;
+    int due;
+
+    /* Nothing to take off the sender without encodings, and no waiting
+     * on whoever makes a batch already */
+    if( !r->enc || pthread_mutex_trylock(&r->txmutex) != 0 ) return;
+
+    pthread_mutex_lock(&r->mutex);
+    full = min(max(r->win, 1), RTX_MAX_BATCH);
+    due = r->head != NULL && r->ready == NULL && q->totsize >= full;
+    pthread_mutex_unlock(&r->mutex);
+
+    if( due && (b=rtx_make(r, q, full)) != NULL ) {
+        pthread_mutex_lock(&r->mutex);
+        r->ready = b;
+        pthread_mutex_unlock(&r->mutex);
+    }
+    pthread_mutex_unlock(&r->txmutex);
+}
+
+int rtx_pending( rtx_t *r ) {
+    int rc;
+
+    pthread_mutex_lock(&r->mutex);
+    rc = r->head != NULL || r->ready != NULL;
+    pthread_mutex_unlock(&r->mutex);
+    return rc;
+}
+
+void rtx_put( rtx_t *r, rtx_batch_t *b ) {
+    int last;
+
+    pthread_mutex_lock(&r->mutex);
+    last = --b->refs == 0;
+    pthread_mutex_unlock(&r->mutex);
+    if( last ) batch_free(b);
+}
+
+void rtx_ack( rtx_t *r, unsigned long seq, long win ) {
+    rtx_batch_t *b, *gone = NULL;
+
+    pthread_mutex_lock(&r->mutex);
+    if( win >= 0 ) {
+        if( win < RTX_MAX_BATCH && r->win >= RTX_MAX_BATCH ) {
+            dprintf(log, DEBUG, "peer window down to %ld bytes", win);
+        }
+        r->win = win;
+    }
+    while( (b=r->head) != NULL && !SEQ_AFTER(b->seq, seq) ) {
+        r->head = b->next;
+        if( --b->refs == 0 ) {
+            b->next = gone;
+            gone = b;
+        }
+    }
+    if( !r->head ) r->tail = &r->head;
+    pthread_mutex_unlock(&r->mutex);
+
+    while( (b=gone) != NULL ) {
+        gone = b->next;
+        batch_free(b);
+    }
+}
+
+int rtx_dup( rtx_t *r, unsigned long seq ) {
+    int rc;
+
+    pthread_mutex_lock(&r->mutex);
+    rc = !SEQ_AFTER(seq, r->rcvd);
+    pthread_mutex_unlock(&r->mutex);
+    return rc;
+}
+
+void rtx_recv( rtx_t *r, unsigned long seq ) {
+    pthread_mutex_lock(&r->mutex);
+    if( SEQ_AFTER(seq, r->rcvd) ) r->rcvd = seq;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+unsigned long rtx_rcvd( rtx_t *r ) {
+    unsigned long seq;
+
+    pthread_mutex_lock(&r->mutex);
+    seq = r->rcvd;
+    pthread_mutex_unlock(&r->mutex);
+    return seq;
+}
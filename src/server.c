@@ -45,130 +45,184 @@
 #include "util.h"
 #include "srvproto2.h"
 #include "srvproto1.h"
+#include "srvws.h"
+#include "websock.h"
 #include "iprange.h"
 #include "clidata.h"
+#include "pep.h"
+#include "dns.h"
+#include "tls.h"
+#include "admit.h"
+#include "metrics.h"
+#include "lat.h"
 
 tpool_t *tpool;
 clidata_list_t *clients=NULL;
 
+/* Set if the clients talk TLS to us */
+static SSL_CTX *tls_ctx = NULL;
+
 /* 
  * The threads in the threadpool that handle incoming clients run this as
  * their main function.
  */
 void client_handler( void *clisock_in ) {
     int reqtype;
-    char req[HTTP_REQUESTLINE_MAX];
-    char hdrs[HTTP_HEADERS_MAX];
+    http_msg_t msg;
+    rbuf_t *rb;
     clidata_t *client=NULL;
+    ws_chan_t *wsch=NULL;
     int clisock;
     int rc=0;
     int chantype=0;
+    struct sockaddr_in peer;
+    socklen_t peerlen = sizeof(peer);
+    struct timeval t1, t2;
     
     if( !clisock_in ) {
         lprintf(log, ERROR, "Received null socket pointer!");
         return;
     }
     clisock = *((int*)clisock_in);
+    if( getpeername(clisock, (struct sockaddr *)&peer, &peerlen) == -1 ) {
+        peer.sin_addr.s_addr = INADDR_ANY;
+    }
+
+    /* The handshake is made here, so it holds up no other client */
+    if( tls_ctx ) {
+        int fd = tls_accept(tls_ctx, clisock);
+
+        if( fd == -1 ) {
+            close(clisock);
+            return;
+        }
+        clisock = fd;
+    }
+
+    if( (rb=rb_new(clisock)) == NULL ) {
+        close(clisock);
+        return;
+    }
 
     while( 1 ) {
-        if( (reqtype=parse_request(clisock, req)) == REQ_NONE ) {
-            lprintf(log, INFO, "disconnect on socket #%d",
+        if( (reqtype=parse_request(rb, &msg)) == REQ_NONE ) {
+            lprintf_rl(log, INFO, "disconnect on socket #%d",
                     clisock);
             goto ch_error;
         }
+        gettimeofday(&t1, NULL);
         
-        dprintf(log, DEBUG, "About to get headers from client");
-        if( getheaders(clisock, hdrs, HTTP_HEADERS_MAX) == -1 ) {
-            lprintf(log, WARN, 
-                "Couldn't receive HTTP hdrs from client.");
-            goto ch_error;
-        }
-        
+        /* A WS request that is not a proper upgrade is just a GET */
+        if( reqtype == REQ_WS && !ws_is_upgrade(&msg) ) reqtype = REQ_GET;
+
         /* if chantype == 0, this is initial request. Should be CP or CR */
         if( chantype == 0 ) {
             switch( reqtype ) {
                 case REQ_CP1:
-                    lprintf(log, INFO, 
+                    lprintf_rl(log, INFO, 
                             "Configuring protocol 1 channel");
-                    client = handle_cp(clisock, hdrs, 1);
+                    client = handle_cp(rb, &msg, 1);
                     break;
                 case REQ_CP2:
-                    lprintf(log, INFO, 
+                    lprintf_rl(log, INFO, 
                             "Configuring protocol 2 channel 1");
-                    client = handle_cp(clisock, hdrs, 2);
+                    client = handle_cp(rb, &msg, 2);
                     break;
                 case REQ_CR:
-                    lprintf(log, INFO, 
+                    lprintf_rl(log, INFO, 
                             "Configuring protocol 2 channel 2");
-                    client = handle_cr(clisock, hdrs);
+                    client = handle_cr(rb, &msg);
+                    break;
+                case REQ_WS:
+                    lprintf_rl(log, INFO, 
+                            "Configuring WebSocket channel");
+                    client = handle_ws(rb, &msg, &wsch);
                     break;
                 case REQ_GET:
                 default:
-                    lprintf(log, WARN, 
-                            "Redirecting bad request: '%s'", 
-                            chomp(req));
-                    if( proxy_request(clisock, req, hdrs) == -1 ) {
-                        fdprintf(clisock, RESPONSE_503);
+                    lprintf_rl(log, WARN, 
+                            "Redirecting bad request: '%.*s'", 
+                            (int)msg.line.len, msg.line.ptr);
+                    if( proxy_request(rb, &msg) == -1 ) {
+                        http_send(clisock, &rsp_503, NULL, 0);
                     }
                     goto ch_error;
             }
             /* If client is null, it means the handler failed */
             if( !client ) goto ch_error;
+            admit_known(peer.sin_addr);
             /* 
              * Now that we've established a valid channel, set chantype so we
              * know to expect non-configuration messages in the future 
              */
             chantype = reqtype;
+
+            /* From here on a WebSocket channel carries no HTTP requests */
+            if( chantype == REQ_WS ) {
+                rc = handle_ws_data(wsch, rb);
+                goto ch_error;
+            }
         } else if( chantype == REQ_CP1 ) {
             switch( reqtype ) {
                 case REQ_S:
-                    rc=handle_s_p1(client, hdrs);
+                    rc=handle_s_p1(client, rb, &msg);
                     break;
                 case REQ_P:
-                    rc=handle_p_p1(client, hdrs);
+                    rc=handle_p_p1(client, rb, &msg);
                     break;
                 case REQ_F:
                     lprintf(log, INFO, "Client %s requested a close.",
                             client->macaddr);
                     rc=handle_f_p1(&client);
+                    rb_free(&rb);
                     return;
                 default:
                     lprintf(log, WARN, 
-                        "Bad request on proto1 chan: %s.",
-                        chomp(req)); 
+                        "Bad request on proto1 chan: %.*s.",
+                        (int)msg.line.len, msg.line.ptr); 
                     handle_f_p1(&client);
+                    rb_free(&rb);
                     return;
             }
         } else if( chantype == REQ_CP2 ) {
             switch( reqtype ) {
                 case REQ_S:
-                    rc=handle_s_p2(client, hdrs);
+                    rc=handle_s_p2(client, rb, &msg);
                     break;
                 case REQ_F:
                     lprintf(log, INFO, "Client %s requested a close.",
                             client->macaddr);
                     rc=handle_f_p2(&client);
+                    rb_free(&rb);
                     return;
                 default:
                     lprintf(log, WARN, 
-                        "Bad request on proto2 chan 1: %s.",
-                        chomp(req)); 
+                        "Bad request on proto2 chan 1: %.*s.",
+                        (int)msg.line.len, msg.line.ptr); 
                     handle_f_p1(&client);
+                    rb_free(&rb);
                     return;
             }
         } else if( chantype == REQ_CR ) {
             switch( reqtype ) {
                 case REQ_R:
-                    rc=handle_r_p2(client, hdrs);
+                    rc=handle_r_p2(client, rb, &msg);
                     break;
                 default:
                     lprintf(log, WARN, 
-                        "Bad request on proto2 chan 2: %s.",
-                        chomp(req)); 
+                        "Bad request on proto2 chan 2: %.*s.",
+                        (int)msg.line.len, msg.line.ptr); 
                     handle_f_p1(&client);
+                    rb_free(&rb);
                     return;
             }
         }
+        /* P and R requests wait for packets for the client */
+        if( reqtype != REQ_P && reqtype != REQ_R ) {
+            gettimeofday(&t2, NULL);
+            met_observe(MET_H_HANDLER, (t2.tv_sec - t1.tv_sec) * 1000000 +
+                        t2.tv_usec - t1.tv_usec);
+        }
         if( rc == -1 ) {
             lprintf(log, INFO, 
                     "proto handler failed. returning.");
@@ -176,20 +230,32 @@ void client_handler( void *clisock_in ) {
         }
     }
     /* Should not get here, but just in case... */
+    rb_free(&rb);
     return;
 
 ch_error:
+    rb_free(&rb);
+    /* its next channel is let in ahead of others from when this one ends */
+    if( chantype != 0 ) admit_known(peer.sin_addr);
+    /* A client that connected again has another channel in its place */
     if( chantype == REQ_CP1 || chantype == REQ_CP2 ) {
-        close(client->chan1);
-        client->chan1 = -1;
-        client->lastuse = time(NULL);
+        if( drop_chan(clients, &client->chan1, clisock) ) {
+            client->lastuse = time(NULL);
+        }
     } else if( chantype == REQ_CR ) {
-        close(client->chan2);
-        client->chan2 = -1;
-        client->lastuse = time(NULL);
-    } else {
-        close(clisock);
+        if( drop_chan(clients, &client->chan2, clisock) ) {
+            client->lastuse = time(NULL);
+        }
+    } else if( chantype == REQ_WS ) {
+        if( drop_chan(clients, &client->chan1, clisock) ) {
+            /* one that said it is leaving is not coming back for its queue */
+            client->lastuse = rc == 0 ? 0 : time(NULL);
+        }
+        /* the ws sender may still be using it */
+        ws_release(wsch);
+        return;
     }
+    close(clisock);
     return;
 }
 
@@ -201,6 +267,8 @@ static void tunfile_reader( void *clidata_in )
 {
     clidata_t *clidata = (clidata_t*)clidata_in;
     char *pkt;
+    unsigned int t;
+    int rc, len;
 
     dprintf(log, DEBUG, "starting, tunfd #%d", clidata->tunfd);
 
@@ -208,7 +276,35 @@ static void tunfile_reader( void *clidata_in )
 
     while( 1 ) {
         if( (pkt=get_packet(clidata->tunfd)) == NULL ) break;
-        if( q_add(clidata->sendq, pkt, Q_WAIT, iplen(pkt)) == -1 ) break;
+        t = lat_now();
+
+        /* only protocol 3 frames tell the client what else a packet is */
+        if( pi_proto(pkt) != PI_IPV4 && !clidata->framed ) {
+            met_add(MET_DROP_PROTO, 1);
+            free(pkt);
+            continue;
+        }
+        tun_clamp_mss(pkt, clidata->mtu);
+        len = pktlen(pkt);
+        shape_wait(clidata->shape_tx, len);
+
+        /* dropped if it resends a segment the client has not got yet */
+        if( tun_is_segment(pkt) ) {
+            rc = q_add_unique(clidata->sendq, pkt, iplen(pkt),
+                              tun_same_segment);
+            if( rc != 0 ) free(pkt);
+            if( rc == -1 ) break;
+            if( rc == 1 ) met_add(MET_DROP_DUPSEG, 1);
+            else met_client(&clidata->met, MET_TX, len);
+        } else {
+            if( q_add(clidata->sendq, pkt, Q_WAIT, len) == -1 ) break;
+            met_client(&clidata->met, MET_TX, len);
+            lat_since(clidata->lat, LAT_TUN, t);
+        }
+
+        /* a full batch is deflated here rather than by the request handler
+         * that sends it */
+        rtx_prepare(clidata->rtx, clidata->sendq);
     }
 
     lprintf(log, INFO, "Tunfile Reader exiting.");
@@ -224,7 +320,8 @@ static void tunfile_writer( void *clidata_in )
     clidata_t *clidata = (clidata_t*)clidata_in;
     char *data;
     queue_t *recvq = clidata->recvq;
-    int rc;
+    unsigned int t;
+    int rc, len;
 
     dprintf(log, DEBUG, "starting, tunfd #%d", clidata->tunfd);
 
@@ -232,12 +329,24 @@ static void tunfile_writer( void *clidata_in )
 
     while(1) {
         if( (data=q_remove(recvq, Q_WAIT, NULL)) == NULL ) break;
+        len = is_pep(data) ? iplen(data) : pktlen(data);
+        shape_wait(clidata->shape_rx, len);
+        met_client(&clidata->met, MET_RX, len);
+
+        if( is_pep(data) ) {
+            /* not a packet, the tun device would refuse it */
+            if( clidata->pep ) pep_input(clidata->pep, data);
+            else free(data);
+            continue;
+        }
 
-        rc = write(clidata->tunfd, data, iplen(data));
+        t = lat_now();
+        rc = write(clidata->tunfd, data, pktlen(data));
+        lat_since(clidata->lat, LAT_TUNW, t);
         if( rc != -1 ) errno = 0;
         dprintf(log, DEBUG, 
                 "writing %d byte pkt to tunfd: %s",
-                iplen(data), strerror(errno));
+                pktlen(data), strerror(errno));
         if( rc == -1 ) {
             free(data);
             break;
@@ -294,6 +403,7 @@ static int create_srvsock( unsigned short port )
         close(sock);
         return -1;
     }
+    admit_listen(sock);
 
     lprintf( log, INFO, "HTun daemon bound to port %d and listening.",
             ntohs(addr.sin_port) );
@@ -301,8 +411,8 @@ static int create_srvsock( unsigned short port )
     return sock;
 }
 
-/* Wait for a request */
-static int request_wait( int srvsock )
+/* Wait for a request, placing where it came from in src */
+static int request_wait( int srvsock, struct in_addr *src )
 {
     int clisock;
     struct sockaddr_in cliaddr;
@@ -311,10 +421,11 @@ static int request_wait( int srvsock )
     clisock=accept(srvsock, (struct sockaddr *) &cliaddr, &cliaddr_len);
 
     if( clisock == -1 ) {
-        lprintf(log, WARN, "accept() failed: %s.\n", strerror(errno));
+        lprintf_rl(log, WARN, "accept() failed: %s.\n", strerror(errno));
     } else {
-        lprintf(log, INFO, "Accepted connection from %s, fd #%d.\n",
+        lprintf_rl(log, INFO, "Accepted connection from %s, fd #%d.\n",
                 inet_ntoa(cliaddr.sin_addr), clisock);
+        *src = cliaddr.sin_addr;
     }
 
     return clisock;
@@ -323,20 +434,32 @@ static int request_wait( int srvsock )
 /* Listens for incoming connections and dispatches the clients to the tpool */
 static void *dispatcher( void *srvsock_in ) {
     int srvsock = *((int*)srvsock_in);
-    int clisock;
+    int clisock, rc;
+    struct in_addr src;
 
     while(1){
-        if( (clisock=request_wait(srvsock)) == -1 ){
-            lprintf( log, WARN, "dispatcher: request_wait() failed.\n" );
+        if( (clisock=request_wait(srvsock, &src)) == -1 ){
+            lprintf_rl( log, WARN, "dispatcher: request_wait() failed.\n" );
+            continue;
+        }
+
+        /* read without the lock, it only needs to be about right */
+        if( (rc=admit(clisock, src, tpool->cur_queue_size,
+                      tls_ctx != NULL)) != ADMIT_OK ) {
+            met_add(rc == ADMIT_RATE ? MET_REFUSED_RATE :
+                    rc == ADMIT_LOAD ? MET_REFUSED_LOAD : MET_REFUSED_JUNK, 1);
+            close(clisock);
             continue;
         }
         
         if( tpool_add_work(tpool,client_handler,&clisock) == -1 ) {
-            lprintf( log, INFO, 
+            lprintf_rl( log, INFO, 
                     "Request queue full. Dumping client.\n" );
+            met_add(MET_REFUSED_FULL, 1);
             close(clisock);
             continue;
         }
+        met_add(MET_ACCEPTED, 1);
     }
 }
 
@@ -360,13 +483,14 @@ int srv_start_tunfile_reader( clidata_t *client )
                 "Unable to create sendq for new client!");
         goto cleanup1;
     }
+    if( client->lat ) client->sendq->wait = &client->lat->h[LAT_SENDQ];
 
     /* Start tunfile reader */
     dprintf(log, DEBUG, "About to start tunfile reader");
     if( tpool_add_work(tpool, tunfile_reader, client) == -1 ) {
         dprintf(log, DEBUG,
                 "starting tunfile reader: Too busy");
-        fdprintf(clisock, RESPONSE_500_BUSY);
+        http_send(clisock, &rsp_500_busy, NULL, 0);
         goto cleanup2;
     }
     return 0;
@@ -377,6 +501,27 @@ cleanup1:
     return -1;
 }
 
+/*
+ * Queues a split TCP frame for the client like a packet from the tun. It
+ * is called with the streams locked, so the frame is only charged to the
+ * client's rate, and its tunfile_reader() waits for it.
+ */
+static int pep_to_client( void *clidata_in, char *frame )
+{
+    clidata_t *clidata = (clidata_t*)clidata_in;
+
+    shape_charge(clidata->shape_tx, iplen(frame));
+    met_client(&clidata->met, MET_TX, iplen(frame));
+
+    /* protocol 2 makes the sendq once the second channel is up */
+    if( clidata->sendq == NULL ||
+        q_add(clidata->sendq, frame, 0, iplen(frame)) != 0 ) {
+        free(frame);
+        return -1;
+    }
+    return 0;
+}
+
 /* For export. Duty Free. */
 int srv_start_tunfile_writer( clidata_t *client ) 
 {
@@ -397,6 +542,13 @@ int srv_start_tunfile_writer( clidata_t *client )
                 "Unable to create recvq for new client!");
         goto cleanup1;
     }
+    if( client->lat ) client->recvq->wait = &client->lat->h[LAT_RECVQ];
+
+    /* Even with split_tcp off it is there to refuse the streams */
+    if( (client->pep=pep_new(pep_to_client, client,
+                             config->u.s.split_tcp)) == NULL ) {
+        goto cleanup2;
+    }
 
     /* Start tunfile writer */
     dprintf(log, DEBUG, 
@@ -404,12 +556,13 @@ int srv_start_tunfile_writer( clidata_t *client )
     if( tpool_add_work(tpool, tunfile_writer, client) == -1 ) {
         dprintf(log, DEBUG,
                 "starting tunfile writer: Too busy");
-        fdprintf(clisock, RESPONSE_500_BUSY);
+        http_send(clisock, &rsp_500_busy, NULL, 0);
         goto cleanup2;
     }
     return 0;
 
 cleanup2:
+    pep_destroy(&client->pep);
     q_destroy(&client->recvq);
 cleanup1:
     return -1;
@@ -439,6 +592,8 @@ static void dump_stats( void ) {
                 c->sendq->head, c->sendq->nr_nodes, c->sendq->totsize,
                 c->sendq->readers, c->sendq->writers, c->sendq->shutdown,
                 c->sendq->lastadd.tv_sec, c->sendq->lastadd.tv_usec);
+            lprintf(log, INFO, "\tSuppressed: %lu bytes of retransmissions",
+                c->sendq->dupsize);
         } else {
             lprintf(log, INFO, "\tSend Queue: NULL");
         }
@@ -451,6 +606,7 @@ static void dump_stats( void ) {
         } else {
             lprintf(log, INFO, "\tRecv Queue: NULL");
         }
+        lat_log(c->lat, c->macaddr);
         c = c->next;
     }
 
@@ -458,6 +614,13 @@ static void dump_stats( void ) {
     return;
 }
 
+/* looks redirect_host up ahead, so that no decoy request has to wait */
+static inline void prefetch_redir_host( void ) {
+    struct in_addr addr;
+
+    if( config->u.s.redir_host ) dns_lookup(config->u.s.redir_host, &addr, 0);
+}
+
 int server_main( void ) {
     sigset_t newmask;
     pthread_t dispatchers[2];
@@ -478,6 +641,13 @@ int server_main( void ) {
         goto cleanup2;
     }
 
+    if( *config->u.s.tls_cert &&
+        (tls_ctx=tls_server_ctx(config->u.s.tls_cert, *config->u.s.tls_key ?
+                        config->u.s.tls_key : config->u.s.tls_cert)) == NULL ) {
+        lprintf( log, FATAL, "Fatal: Could not set up TLS." );
+        goto cleanup3;
+    }
+
     /* Get our server socket */
     if( (socks[0]=create_srvsock(ntohs(config->u.s.server_ports[0]))) == -1 ) {
         lprintf( log, FATAL, "Fatal: Could not create server socket." );
@@ -502,7 +672,10 @@ int server_main( void ) {
     }
 
     
+    shape_total(config->u.s.rate_total);
+    if( config->u.s.metrics_port ) met_start(config->u.s.metrics_port);
     lprintf( log, INFO, "HTun server daemon started successfully." );
+    prefetch_redir_host();
     
     /* Set up our SIGALRM system for clidata_list cleanup */
     alarm(60);
@@ -518,6 +691,8 @@ int server_main( void ) {
                 tmp=config;
                 config=read_config(config->cfgfile);
                 free(tmp);
+                shape_total(config->u.s.rate_total);
+                prefetch_redir_host();
                 break;
             case SIGINT:
             case SIGTERM:
@@ -0,0 +1,217 @@
+/* -------------------------------------------------------------------------
+ * shape.c - htun per-client rate limit functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "log.h"
+#include "shape.h"
+
+/* All buckets with a limit, for sharing out the spare rate */
+static shape_t *shapes = NULL;
+static pthread_mutex_t shape_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long total_rate = 0;
+static struct timeval period_start;
+
+static inline long msec_since( const struct timeval *tv,
+                               const struct timeval *now ) {
+    return (now->tv_sec - tv->tv_sec) * 1000L +
+        (now->tv_usec - tv->tv_usec) / 1000L;
+}
+
+shape_t *shape_new( void ) {
+    shape_t *s;
+
+    if( (s=calloc(1, sizeof(shape_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() rate limit!");
+        return NULL;
+    }
+    gettimeofday(&s->last, NULL);
+    return s;
+}
+
+/* Takes s off the list of limited buckets. Call with shape_lock held. */
+static void shape_unlink( shape_t *s ) {
+    shape_t **p;
+
+    for( p = &shapes; *p; p = &(*p)->next ) {
+        if( *p == s ) {
+            *p = s->next;
+            break;
+        }
+    }
+    s->next = NULL;
+}
+
+void shape_free( shape_t **s ) {
+    if( !*s ) return;
+    pthread_mutex_lock(&shape_lock);
+    shape_unlink(*s);
+    pthread_mutex_unlock(&shape_lock);
+    free(*s);
+    *s = NULL;
+}
+
+void shape_set( shape_t *s, unsigned long rate, unsigned long burst ) {
+    if( !s ) return;
+    pthread_mutex_lock(&shape_lock);
+    shape_unlink(s);
+    s->rate = rate;
+    s->burst = burst ? burst : max(rate / 8, SHAPE_MIN_BURST);
+    s->extra = 0;
+    s->tokens = s->burst;
+    gettimeofday(&s->last, NULL);
+    if( rate ) {
+        s->next = shapes;
+        shapes = s;
+    }
+    pthread_mutex_unlock(&shape_lock);
+}
+
+void shape_total( unsigned long rate ) {
+    shape_t *s;
+
+    pthread_mutex_lock(&shape_lock);
+    total_rate = rate;
+    for( s = shapes; s; s = s->next ) s->extra = 0;
+    gettimeofday(&period_start, NULL);
+    pthread_mutex_unlock(&shape_lock);
+}
+
+/*
+ * Once a period, shares out what the limited clients leave of the total:
+ * the total less what those within their rate used and the rates of those
+ * that ran into them. A client that did not run into its rate keeps the
+ * extra it used. Call with shape_lock held.
+ */
+static void shape_share( const struct timeval *now ) {
+    unsigned long given = 0, spare, used;
+    long ms = msec_since(&period_start, now);
+    shape_t *s;
+    int busy = 0;
+
+    if( ms < SHAPE_PERIOD_MSEC ) return;
+    period_start = *now;
+    if( !total_rate ) return;
+
+    for( s = shapes; s; s = s->next ) {
+        used = s->used * 1000.0 / ms;
+        if( s->throttled ) {
+            given += s->rate;
+            busy++;
+        } else {
+            given += used;
+            s->extra = used > s->rate ? used - s->rate : 0;
+        }
+    }
+    spare = total_rate > given ? total_rate - given : 0;
+
+    for( s = shapes; s; s = s->next ) {
+        if( s->throttled ) s->extra = spare / busy;
+        s->used = 0;
+        s->throttled = 0;
+    }
+    if( busy ) {
+        dprintf(log, DEBUG, "%d clients at their rate share %lu bytes/s",
+                busy, spare);
+    }
+}
+
+/* Takes len bytes from s, returning how many seconds it is owed for */
+static double shape_take( shape_t *s, size_t len ) {
+    struct timeval now;
+    double rate, owed = 0;
+
+    if( !s || !s->rate ) return 0;
+
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&shape_lock);
+    shape_share(&now);
+
+    rate = s->rate + s->extra;
+    s->tokens += msec_since(&s->last, &now) * rate / 1000.0;
+    if( s->tokens > s->burst ) s->tokens = s->burst;
+    s->last = now;
+
+    /* Taken now and waited for after, so the bucket can run into debt */
+    s->tokens -= len;
+    s->used += len;
+    if( s->tokens < 0 ) {
+        s->throttled = 1;
+        owed = -s->tokens / rate;
+    }
+    pthread_mutex_unlock(&shape_lock);
+    return owed;
+}
+
+void shape_charge( shape_t *s, size_t len ) {
+    shape_take(s, len);
+}
+
+void shape_wait( shape_t *s, size_t len ) {
+    struct timespec ts;
+    double owed = shape_take(s, len);
+
+    if( owed > 0 ) {
+        ts.tv_sec = (time_t)owed;
+        ts.tv_nsec = (long)((owed - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+int shape_add_rule( shape_rule_t **rules, const char *macaddr,
+                    unsigned long rate, unsigned long burst ) {
+    shape_rule_t *r;
+    char mac[13];
+    int i = 0;
+
+    for( ; *macaddr && i < 12; macaddr++ ) {
+        if( *macaddr == ':' ) continue;
+        if( !isxdigit((unsigned char)*macaddr) ) return -1;
+        mac[i++] = toupper((unsigned char)*macaddr);
+    }
+    if( i != 12 || *macaddr ) return -1;
+    mac[i] = '\0';
+
+    if( (r=malloc(sizeof(*r))) == NULL ) return -1;
+    strcpy(r->macaddr, mac);
+    r->rate = rate;
+    r->burst = burst;
+    r->next = *rules;
+    *rules = r;
+    return 0;
+}
+
+shape_rule_t *shape_rule( shape_rule_t *rules, const char *macaddr ) {
+    for( ; rules; rules = rules->next ) {
+        if( !strcasecmp(rules->macaddr, macaddr) ) return rules;
+    }
+    return NULL;
+}
@@ -35,6 +35,7 @@
 #include "util.h"
 #include "srvproto2.h"
 #include "tun.h"
+#include "metrics.h"
 
 
 int handle_f_p1( clidata_t **clientp ) {
@@ -116,92 +117,57 @@ end:
     return q->totsize;
 }
 
-static inline int send_queue( queue_t *q, int fd, size_t amount ) {
-    unsigned int sent=0;
-    int cnt, totcnt=0;
-    char *pkt;
+static inline int send_queue( clidata_t *client, http_msg_t *msg, int fd,
+                               size_t amount ) {
+    int totcnt;
 
     if( amount == 0 ) {
         dprintf(log, DEBUG, "no data to send to client");
-        fdprintf(fd, RESPONSE_204);
     } else {
         dprintf(log, DEBUG, "data to send.");
-        fdprintf(fd, RESPONSE_200_NOBODY, amount);
-
-        while( sent < amount ) {
-            if( (pkt=q_remove(q, 0, NULL)) == NULL ) {
-                lprintf(log, WARN, "q_remove failed!");
-                return -1;
-            }
-            if( (cnt=write(fd, pkt, iplen(pkt))) < 0 ) {
-                lprintf(log, INFO, "send failed: %s",
-                        strerror(errno));
-                free(pkt);
-                return -1;
-            }
-            dprintf(log, DEBUG, "wrote %d bytes to client", cnt);
-            totcnt++;
-            sent += iplen(pkt);
-            free(pkt);
-        }
-        lprintf(log, INFO, "Sent %d bytes in %d pkts.", 
-                sent, totcnt);
+    }
+    if( (totcnt=send_batch(client, fd, msg, amount)) == -1 ) {
+        lprintf(log, INFO, "send failed");
+        return -1;
+    }
+    if( totcnt > 0 ) {
+        dprintf(log, DEBUG, "Sent %lu bytes in %d pkts.", 
+                (unsigned long)amount, totcnt);
+        met_add(MET_BATCHES_TX, 1);
+        met_observe(MET_H_BATCH_TX, totcnt);
     }
     return 0;
 }
 
-int handle_p_p1( clidata_t *client, char *hdrs ) {
+int handle_p_p1( clidata_t *client, rbuf_t *rb, http_msg_t *msg ) {
     char *pkt;
     queue_t *sendq = client->sendq;
     int chan1 = client->chan1;
-    int tmp;
+    long tmp;
 
-    pkt=getbody(chan1, hdrs, &tmp);
+    pkt=getbody(rb, msg, &tmp);
     free(pkt);
-    
-    send_queue(sendq, chan1, sendq->totsize);
+
+    if( msg->rtx ) rtx_ack(client->rtx, msg->ack, msg->win);
+    lat_peer(client->lat, msg->ts, msg->echo, msg->held);
+    send_queue(client, msg, chan1, sendq->totsize);
 
     dprintf(log, DEBUG, "returning");
     return 0;
 }
 
 
-int handle_s_p1( clidata_t *client, char *hdrs ) {
-    int gotten=0, cnt=0;
-    int expected = get_content_length(hdrs);
-    char *pkt;
-    queue_t *recvq = client->recvq;
-    queue_t *sendq = client->sendq;
+int handle_s_p1( clidata_t *client, rbuf_t *rb, http_msg_t *msg ) {
     int chan1 = client->chan1;
 
-    if( !expected ) {
-        lprintf(log, WARN,  
-                "Client sent no Content-Length. Dropping.");
-        return -1;
-    }
+    if( take_batch(client, rb, msg, chan1) == -1 ) return -1;
 
-    while( gotten < expected ) {
-        if( (pkt=get_packet(chan1)) == NULL ) {
-            lprintf(log, WARN, 
-                    "get_packet() failed. Dropping client.");
-            fdprintf(chan1, RESPONSE_500_ERR);
-            return -1;
-        }
-        cnt++;
-        gotten += iplen(pkt);
-        dprintf(log, DEBUG, "got %d of %d bytes from client",
-                gotten, expected);
-        if( (q_add(recvq, pkt, Q_WAIT, iplen(pkt))) == -1 ) {
-            lprintf(log, WARN, "q_add() failed. Dropping client.");
-            fdprintf(chan1, RESPONSE_500_ERR);
-            free(pkt);
-            return -1;
-        }
+    /* A batch the client missed goes back without waiting for more */
+    if( msg->rtx && rtx_pending(client->rtx) ) {
+        send_queue(client, msg, chan1, 0);
+    } else {
+        send_queue(client, msg, chan1, sendq_wait(client->sendq));
     }
-    lprintf(log, INFO, "Got %d bytes in %d pkts.",
-            gotten, cnt);
-
-    send_queue(sendq, chan1, sendq_wait(client->sendq));
 
     dprintf(log, DEBUG, "returning");
 
@@ -23,12 +23,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <fcntl.h>
 
 #include "common.h"
 #include "log.h"
@@ -40,46 +42,134 @@
 #include "srvproto2.h"
 #include "tun.h"
 #include "queue.h"
+#include "rtx.h"
+#include "zbatch.h"
+#include "aead.h"
+#include "metrics.h"
+
+/* Fills token with SESSION_TOKEN_LEN random hex digits */
+static void new_session_token( char *token ) {
+    unsigned char rnd[SESSION_TOKEN_LEN/2];
+    int fd, i, got = 0;
+
+    if( (fd=open("/dev/urandom", O_RDONLY)) != -1 ) {
+        got = read(fd, rnd, sizeof(rnd)) == sizeof(rnd);
+        close(fd);
+    }
+    if( !got ) {
+        lprintf(log, WARN, "Unable to read /dev/urandom, using rand()");
+        for( i=0; i < (int)sizeof(rnd); i++ ) rnd[i] = rand() & 0xFF;
+    }
+    for( i=0; i < (int)sizeof(rnd); i++ ) {
+        sprintf(token + 2*i, "%02x", rnd[i]);
+    }
+}
 
-clidata_t *handle_cp( int clisock, char *hdrs, int proto ) {
-    char *macaddr;
-    iprange_t *ranges=NULL;
-    iprange_t **rangep=&ranges;
-    char *body;
-    char **lines;
-    clidata_t *client;
-    char buf[CP2_OK_MAXBODY];
-    int i;
-    int len;
+/* Throws away what was queued for a session that is not coming back */
+static void flush_queue( queue_t *q ) {
+    char *pkt;
+    int cnt = 0;
 
-    /* Get body of request. body gets malloc()d data */
-    if( (body=getbody(clisock, hdrs, &len)) == NULL ) {
-        lprintf(log, WARN, "Client did not send expected amount");
-        goto cleanup1;
+    if( !q ) return;
+    while( (pkt=q_remove(q, 0, NULL)) != NULL ) {
+        free(pkt);
+        cnt++;
     }
-    dprintf(log, DEBUG, "Got body: %s", body);
+    if( cnt ) lprintf(log, INFO, "Dropped %d packets of the old session.", cnt);
+}
 
-    /* Split lines of input. lines get malloc()d data */
-    if( (lines=splitlines(body)) == NULL ) {
-        lprintf(log, ERROR,
-                "Problem splittling lines with splitlines()");
-        fdprintf(clisock, RESPONSE_500_ERR);
-        goto cleanup2;
+int connect_reply( clidata_t *client, char *buf, size_t len ) {
+    char ip1[16], ip2[16];
+    size_t i;
+
+    strcpy(ip1,inet_ntoa(client->cliaddr));
+    strcpy(ip2,inet_ntoa(client->srvaddr));
+    i = snprintf(buf, len, "%s\n%s\n%s\n" MTU_LINE "%d\n", ip1, ip2,
+                 client->token, client->mtu);
+    if( (client->rtx->enc & (ZB_VJ | ZB_DEFLATE)) && i < len ) {
+        i += snprintf(buf + i, len - i, COMPRESS_LINE "%s\n",
+                      zbatch_names(client->rtx->enc & (ZB_VJ | ZB_DEFLATE)));
     }
-    dprintf(log, DEBUG, "split lines successfully.");
+    if( (client->rtx->enc & ZB_AEAD) && i < len ) {
+        unsigned char answer[AEAD_PROOF_LEN];
+        char proof[2*AEAD_PROOF_LEN+1];
+
+        /* over this connect's nonce, so it is no good for the next one */
+        aead_auth(answer, config->u.s.psk, 1, client->macaddr, client->token,
+                  client->nonce, client->authtime);
+        aead_hex(proof, answer, AEAD_PROOF_LEN);
+        i += snprintf(buf + i, len - i, CRYPT_LINE "%s %s\n",
+                      aead_name(client->rtx->aead.cipher), proof);
+    }
+    if( client->framed && i < len ) {
+        i += snprintf(buf + i, len - i, FRAMES_LINE "3\n");
+    }
+    return min(i, len - 1);
+}
+
+clidata_t *register_client( int clisock, char **lines, int proto, int *err ) {
+    char *macaddr, *token=NULL;
+    iprange_t *ranges=NULL;
+    iprange_t **rangep=&ranges;
+    clidata_t *client;
+    shape_rule_t *rule;
+    unsigned char nonce[AEAD_NONCE_LEN], auth[AEAD_PROOF_LEN];
+    unsigned long authtime=0, now=time(NULL);
+    int i, mtu=0, enc=0, framed=0, cipher=0, authed=0;
+
+    *err = 500;
 
     /* Set macaddr based on the first line */
     if( (macaddr=lines[0]) == NULL ) {
         lprintf(log, WARN,
                 "Client did not send MAC address line!");
-        fdprintf(clisock, RESPONSE_400);
-        goto cleanup3;
+        *err = 400;
+        return NULL;
     }
     chomp(macaddr);
     dprintf(log, DEBUG, "Got macaddr %s.", macaddr);
+    if( !mac_ok(macaddr) ) {
+        lprintf(log, WARN, "Client sent an invalid MAC address. Dropping.");
+        *err = 400;
+        return NULL;
+    }
 
     /* Interpret the ipranges. make_iprange() ranges gets malloc()d data */
     for( i=1; lines[i]; i++ ) {
+        if( !strncmp(lines[i], SESSION_LINE, sizeof(SESSION_LINE)-1) ) {
+            token = chomp(lines[i] + sizeof(SESSION_LINE)-1);
+            continue;
+        }
+        if( !strncmp(lines[i], MTU_LINE, sizeof(MTU_LINE)-1) ) {
+            mtu = atoi(lines[i] + sizeof(MTU_LINE)-1);
+            continue;
+        }
+        if( !strncmp(lines[i], COMPRESS_LINE, sizeof(COMPRESS_LINE)-1) ) {
+            enc = zbatch_parse(lines[i], strlen(lines[i])) &
+                (ZB_VJ | ZB_DEFLATE);
+            continue;
+        }
+        if( !strncmp(lines[i], CRYPT_LINE, sizeof(CRYPT_LINE)-1) ) {
+            char *name = chomp(lines[i] + sizeof(CRYPT_LINE)-1), *hex, *t;
+
+            if( (hex=strchr(name, ' ')) != NULL ) {
+                *hex++ = '\0';
+                if( aead_unhex(nonce, hex, sizeof(nonce)) == 0 ) {
+                    cipher = aead_cipher(name);
+                }
+                /* the time and the proof it has the psk */
+                if( (t=strchr(hex, ' ')) != NULL &&
+                    (hex=strchr(t + 1, ' ')) != NULL ) {
+                    authtime = strtoul(t + 1, NULL, 10);
+                    authed = aead_unhex(auth, hex + 1, sizeof(auth)) == 0;
+                }
+            }
+            continue;
+        }
+        if( !strncmp(lines[i], FRAMES_LINE, sizeof(FRAMES_LINE)-1) ) {
+            framed = atoi(lines[i] + sizeof(FRAMES_LINE)-1) == 3;
+            continue;
+        }
         dprintf(log, DEBUG, "About to convert %s", lines[i]);
         if( (*rangep=make_iprange(lines[i])) == NULL ) {
             if( *lines[i] ) {
@@ -94,9 +184,31 @@ clidata_t *handle_cp( int clisock, char *hdrs, int proto ) {
 
     if( ranges == NULL ) {
         lprintf(log, WARN, "Client sent no ip ranges. Dropping.");
-        fdprintf(clisock, RESPONSE_400);
-        goto cleanup3;
+        *err = 400;
+        return NULL;
+    }
+
+    /* With a psk nothing goes unsealed, so we need the client to ask */
+    if( *config->u.s.psk && (proto == 0 || !cipher) ) {
+        lprintf(log, WARN, "Client %s did not ask for sealed batches, "
+                "which our psk requires. Dropping.", macaddr);
+        free_iprange_list(&ranges);
+        *err = 400;
+        return NULL;
+    }
+
+    /* and for proof that it has the psk, before it may touch a session */
+    if( *config->u.s.psk && (!authed || authtime + AEAD_AUTH_WINDOW < now ||
+            authtime > now + AEAD_AUTH_WINDOW ||
+            !aead_auth_ok(auth, config->u.s.psk, 0, macaddr, token, nonce,
+                          authtime)) ) {
+        lprintf(log, WARN, "Client %s could not prove it has our psk. "
+                "Dropping.", macaddr);
+        free_iprange_list(&ranges);
+        *err = 400;
+        return NULL;
     }
+    if( !*config->u.s.psk ) cipher = 0;
     dprintf(log, DEBUG,
             "About to get clidata for MAC addr %s.", macaddr);
 
@@ -107,66 +219,168 @@ clidata_t *handle_cp( int clisock, char *hdrs, int proto ) {
         if( (client=add_clidata(clients, macaddr)) == NULL ) {
             lprintf(log, WARN,
                     "Could not create clidata! Dropping client.");
-            fdprintf(clisock, RESPONSE_500_ERR);
             free_iprange_list(&ranges);
-            goto cleanup3;
+            return NULL;
         }
+        met_add(MET_SESSIONS, 1);
         client->iprange = ranges;
         client->chan1 = clisock;
+        memcpy(client->nonce, nonce, sizeof(nonce));
+        client->authtime = authtime;
+        new_session_token(client->token);
+        if( (client->rtx=rtx_init()) == NULL ) goto cleanup;
+        if( (client->fr=fr_init()) == NULL ) goto cleanup;
+        if( (client->shape_tx=shape_new()) == NULL ) goto cleanup;
+        if( (client->shape_rx=shape_new()) == NULL ) goto cleanup;
+        if( (client->lat=lat_new()) == NULL ) goto cleanup;
+        client->fr->lat = client->lat;
+
+        /* The smaller of what the client asks for and what we are set to,
+         * or what fits our connection to it */
+        if( config->tun_mtu && (mtu <= 0 || config->tun_mtu < mtu) ) {
+            mtu = config->tun_mtu;
+        }
+        if( mtu <= 0 ) {
+            mtu = tun_transport_mtu(clisock, proto != 0 ? TUN_PKT_OVERHEAD :
+                    framed ? TUN_FR_OVERHEAD : TUN_WS_OVERHEAD);
+        }
+        client->mtu = tun_clip_mtu(mtu);
 
         dprintf(log, DEBUG, "About to call srv_tun_alloc()");
         if( srv_tun_alloc(client, clients) == -1 ) {
-            fdprintf(clisock, RESPONSE_503);
-            goto cleanup4;
+            *err = 503;
+            goto cleanup;
         }
 
-        if( proto == 1 ) {
-            if( srv_start_tunfile_reader(client) == -1 ) goto cleanup4;
+        /* Protocol 2 starts the reader once the receive channel is up */
+        if( proto != 2 ) {
+            if( srv_start_tunfile_reader(client) == -1 ) goto cleanup;
         }
-        if( srv_start_tunfile_writer(client) == -1 ) goto cleanup4;
+        if( srv_start_tunfile_writer(client) == -1 ) goto cleanup;
 
     } else {
         char ip1[16], ip2[16];
+
+        /* a proof seen before is someone playing back a connect */
+        if( *config->u.s.psk && (authtime < client->authtime ||
+                !memcmp(nonce, client->nonce, sizeof(nonce))) ) {
+            lprintf(log, WARN, "Client %s sent a psk proof it has used "
+                    "before. Dropping.", macaddr);
+            free_iprange_list(&ranges);
+            *err = 400;
+            return NULL;
+        }
+        memcpy(client->nonce, nonce, sizeof(nonce));
+        client->authtime = authtime;
+
         strcpy(ip1, inet_ntoa(client->srvaddr));
         strcpy(ip2, inet_ntoa(client->cliaddr));
         lprintf(log, INFO,
                 "Client %s found. localip=%s, peerip=%s.", macaddr, ip1, ip2);
-
-        if( client->chan1 != -1 ) {
-            lprintf(log, WARN, 
-                "Client chan1 appears to be connected already. Dropping old.");
-            close(client->chan1);
-            client->chan1 = -1;
-        }
-        if( client->chan2 != -1 ) {
-            lprintf(log, WARN, 
-                "Client chan2 appears to be connected already. Dropping old.");
-            close(client->chan2);
-            client->chan2 = -1;
+        met_add(MET_RECONNECTS, 1);
+
+        /* Whatever was queued for it is only any use to the same session */
+        if( token && !strcmp(token, client->token) ) {
+            lprintf(log, INFO, "Client %s resumed its session.", macaddr);
+            fr_resume(client->fr);
+        } else {
+            lprintf(log, INFO, "Client %s started a new session.", macaddr);
+            met_add(MET_SESSIONS, 1);
+            flush_queue(client->sendq);
+            rtx_reset(client->rtx);
+            fr_reset(client->fr);
+            lat_reset(client->lat);
+            new_session_token(client->token);
         }
+
+        /* their handlers close them once they let go */
+        replace_chan(clients, &client->chan1);
+        replace_chan(clients, &client->chan2);
         if( client->iprange ) free_iprange_list( &client->iprange );
         client->iprange = ranges;
         client->chan1 = clisock;
     }
 
+    /* Set on every connect, the client may have been restarted */
+    if( proto == 0 ) enc = 0;
+    if( !config->u.s.compress ) enc &= ~ZB_DEFLATE;
+    if( !config->u.s.compress_headers ) enc &= ~ZB_VJ;
+    /* The keys stay with the session, for the batches it still holds */
+    if( cipher ) {
+        if( !client->rtx->aead.cipher ) {
+            aead_setup(&client->rtx->aead, cipher, config->u.s.psk,
+                       client->token, nonce, 1);
+        }
+        enc |= ZB_AEAD;
+    }
+    client->rtx->enc = enc;
+    client->framed = proto == 0 && framed;
+
+    if( (rule=shape_rule(config->u.s.rates, macaddr)) != NULL ) {
+        shape_set(client->shape_tx, rule->rate, rule->burst);
+        shape_set(client->shape_rx, rule->rate, rule->burst);
+    } else {
+        shape_set(client->shape_tx, config->u.s.rate_limit,
+                  config->u.s.rate_burst);
+        shape_set(client->shape_rx, config->u.s.rate_limit,
+                  config->u.s.rate_burst);
+    }
 
-    dprintf(log, DEBUG, "About to respond to client");
+    return client;
 
-    {
-        char ip1[16], ip2[16];
+cleanup:
+    remove_clidata(clients, client->macaddr);
+    return NULL;
+}
 
-        strcpy(ip1,inet_ntoa(client->cliaddr));
-        strcpy(ip2,inet_ntoa(client->srvaddr));
-        sprintf(buf, "%s\n%s\n", ip1, ip2);
+
+clidata_t *handle_cp( rbuf_t *rb, http_msg_t *msg, int proto ) {
+    int clisock = rb->fd;
+    char *body;
+    char **lines;
+    clidata_t *client;
+    char buf[CP2_OK_MAXBODY];
+    long len;
+    int err;
+
+    /* Get body of request. body gets malloc()d data */
+    if( (body=getbody(rb, msg, &len)) == NULL ) {
+        lprintf(log, WARN, "Client did not send expected amount");
+        goto cleanup1;
+    }
+    dprintf(log, DEBUG, "Got body: %s", body);
+
+    /* Split lines of input. lines get malloc()d data */
+    if( (lines=splitlines(body)) == NULL ) {
+        lprintf(log, ERROR,
+                "Problem splittling lines with splitlines()");
+        http_send(clisock, &rsp_500_err, NULL, 0);
+        goto cleanup2;
+    }
+    dprintf(log, DEBUG, "split lines successfully.");
+
+    if( (client=register_client(clisock, lines, proto, &err)) == NULL ) {
+        switch( err ) {
+            case 400:
+                http_send(clisock, &rsp_400, NULL, 0);
+                break;
+            case 503:
+                http_send(clisock, &rsp_503, NULL, 0);
+                break;
+            default:
+                http_send(clisock, &rsp_500_err, NULL, 0);
+                break;
+        }
+        goto cleanup3;
     }
 
-    fdprintf(clisock, RESPONSE_200, strlen(buf), buf);
+    dprintf(log, DEBUG, "About to respond to client");
+
+    http_send(clisock, &rsp_200, buf, connect_reply(client, buf, sizeof(buf)));
 
     dprintf(log, DEBUG, "Returning");
     return client;
 
-cleanup4:
-    remove_clidata(clients, client->macaddr);
 cleanup3:
     free(lines);
 cleanup2:
@@ -176,14 +390,15 @@ cleanup1:
 }
 
 
-clidata_t *handle_cr( int clisock, char *hdrs ) {
+clidata_t *handle_cr( rbuf_t *rb, http_msg_t *msg ) {
+    int clisock = rb->fd;
     char *macaddr;
     char *body;
     char **lines;
     clidata_t *client;
-    int len;
+    long len;
 
-    if( (body=getbody(clisock, hdrs, &len)) == NULL ) {
+    if( (body=getbody(rb, msg, &len)) == NULL ) {
         lprintf(log, WARN, 
                 "Client did not send the expected amount");
         goto cleanup1;
@@ -193,7 +408,7 @@ clidata_t *handle_cr( int clisock, char *hdrs ) {
     if( (lines=splitlines(body)) == NULL ) {
         lprintf(log, ERROR, 
                 "Problem splittling lines with splitlines()");
-        fdprintf(clisock, RESPONSE_500_ERR);
+        http_send(clisock, &rsp_500_err, NULL, 0);
         goto cleanup2;
     }
     dprintf(log, DEBUG, "split lines successfully.");
@@ -201,11 +416,16 @@ clidata_t *handle_cr( int clisock, char *hdrs ) {
     if( (macaddr=lines[0]) == NULL ) {
         lprintf(log, WARN, 
                 "Client did not send MAC address line!");
-        fdprintf(clisock, RESPONSE_400);
+        http_send(clisock, &rsp_400, NULL, 0);
         goto cleanup3;
     }
     chomp(macaddr);
     dprintf(log, DEBUG, "Got macaddr %s.", macaddr);
+    if( !mac_ok(macaddr) ) {
+        lprintf(log, WARN, "Client sent an invalid MAC address. Dropping.");
+        http_send(clisock, &rsp_400, NULL, 0);
+        goto cleanup3;
+    }
 
     dprintf(log, DEBUG, 
             "About to get clidata for MAC addr %s.", macaddr);
@@ -213,30 +433,37 @@ clidata_t *handle_cr( int clisock, char *hdrs ) {
     if( (client=get_clidata(clients, macaddr)) == NULL ) {
         lprintf(log, INFO, 
                 "Client tried to connect chan2 before chan1");
-        fdprintf(clisock, RESPONSE_412);
+        http_send(clisock, &rsp_412, NULL, 0);
         goto cleanup3;
     }
 
     dprintf(log, DEBUG, 
             "Clidata found for MAC addr %s.", macaddr);
 
-    client->chan2 = clisock;
-
-    dprintf(log, DEBUG, "Creating recvq for new send channel");
-    if( (client->sendq=q_init()) == NULL ) {
-        lprintf(log, ERROR, 
-                "Unable to create recvq for new client!");
+    /* Clients that know about sessions send the token along, and with a
+     * psk they must, so nobody else takes the channel over */
+    if( (*config->u.s.psk && (!lines[1] ||
+            strncmp(lines[1], SESSION_LINE, sizeof(SESSION_LINE)-1))) ||
+        (lines[1] &&
+         !strncmp(lines[1], SESSION_LINE, sizeof(SESSION_LINE)-1) &&
+         strcmp(chomp(lines[1] + sizeof(SESSION_LINE)-1), client->token)) ) {
+        lprintf(log, INFO, 
+                "Client %s sent chan2 with a stale session token", macaddr);
+        http_send(clisock, &rsp_412, NULL, 0);
         goto cleanup3;
     }
 
-    if( srv_start_tunfile_reader(client) == -1 ) {
+    replace_chan(clients, &client->chan2);
+    client->chan2 = clisock;
+
+    /* A reconnecting chan2 picks up the queue the reader still fills */
+    if( client->sendq == NULL && srv_start_tunfile_reader(client) == -1 ) {
         dprintf(log, DEBUG, "About to start tunfile reader");
-        fdprintf(clisock, RESPONSE_500_BUSY);
         goto cleanup3;
     }
 
     dprintf(log, DEBUG, "About to respond to client");
-    fdprintf(clisock, RESPONSE_204);
+    http_send(clisock, &rsp_204, NULL, 0);
 
     dprintf(log, DEBUG, "Returning");
     return client;
@@ -253,7 +480,7 @@ int handle_f_p2( clidata_t **client ) {
     pthread_t reader = (*client)->reader;
     pthread_t writer = (*client)->writer;
 
-    fdprintf((*client)->chan1, RESPONSE_204);
+    http_send((*client)->chan1, &rsp_204, NULL, 0);
     
     remove_clidata(clients, (*client)->macaddr);
 
@@ -265,105 +492,187 @@ int handle_f_p2( clidata_t **client ) {
     return 0;
 }
 
-int handle_s_p2( clidata_t *client, char *hdrs ) {
+int take_batch( clidata_t *client, rbuf_t *rb, http_msg_t *msg, int fd ) {
     int gotten=0;
-    int expected = get_content_length(hdrs);
+    int expected = msg->content_length;
     char *pkt;
-    int cnt=0;
+    int cnt=0, dup;
     queue_t *recvq = client->recvq;
-    int chan1 = client->chan1;
 
-    if( !expected ) {
+    if( expected < 1 ) {
         lprintf(log, WARN, 
                 "Client sent no Content-Length. Dropping.");
         return -1;
     }
 
+    if( !zbatch_allowed(&client->rtx->aead, msg->enc) ) {
+        lprintf(log, WARN, "Client sent a batch that is not sealed. "
+                "Dropping client.");
+        http_send(fd, &rsp_400, NULL, 0);
+        return -1;
+    }
+
+    if( msg->rtx ) rtx_ack(client->rtx, msg->ack, msg->win);
+    lat_peer(client->lat, msg->ts, msg->echo, msg->held);
+    dup = msg->seq && rtx_dup(client->rtx, msg->seq);
+
+    if( msg->enc ) {
+        if( (cnt=zbatch_recv(rb, expected, msg->enc, &client->rtx->vjrx,
+                             &client->rtx->aead,
+                             dup ? NULL : recvq)) == -1 ) {
+            lprintf(log, WARN, "Bad encoded batch. Dropping client.");
+            http_send(fd, &rsp_500_err, NULL, 0);
+            return -1;
+        }
+        gotten = expected;
+    }
+
     while( gotten < expected ) {
-        if( (pkt=get_packet(chan1)) == NULL ) {
+        if( (pkt=rb_get_packet(rb)) == NULL ) {
             lprintf(log, WARN, 
                     "get_packet() failed. Dropping client.");
-            fdprintf(chan1, RESPONSE_500_ERR);
+            http_send(fd, &rsp_500_err, NULL, 0);
             return -1;
         }
         cnt++;
         gotten += iplen(pkt);
         dprintf(log, DEBUG, "got %d of %d bytes from client",
                 gotten, expected);
-        if( (q_add(recvq, pkt, Q_WAIT, iplen(pkt))) == -1 ) {
+        if( dup ) {
+            free(pkt);
+        } else if( (q_add(recvq, pkt, Q_WAIT, iplen(pkt))) == -1 ) {
             lprintf(log, WARN, "q_add() failed. Dropping client.");
-            fdprintf(chan1, RESPONSE_500_ERR);
+            http_send(fd, &rsp_500_err, NULL, 0);
+            free(pkt);
             return -1;
         }
     }
-    lprintf(log, INFO, "Got  %d bytes in %d pkts",
-            gotten, cnt);
 
-    fdprintf(chan1, RESPONSE_204);
+    /* Only a batch that came in whole counts as taken. The part of one that
+     * was cut off is sent again, and the inner TCP copes with the dups. */
+    if( dup ) {
+        dprintf(log, DEBUG, "Dropped %d pkts of batch %lu, sent before.",
+                cnt, msg->seq);
+        met_add(MET_DROP_DUPBAT, cnt);
+    } else {
+        if( msg->seq ) rtx_recv(client->rtx, msg->seq);
+        dprintf(log, DEBUG, "Got  %d bytes in %d pkts",
+                gotten, cnt);
+        met_add(MET_BATCHES_RX, 1);
+        met_observe(MET_H_BATCH_RX, cnt);
+    }
     return 0;
+}
 
+int send_batch( clidata_t *client, int fd, http_msg_t *msg, size_t amount ) {
+    rtx_batch_t *b;
+    http_out_t o;
+    unsigned int t;
+    int cnt;
+
+    /* Clients that do not ack get their packets once, the old way */
+    if( !msg->rtx ) {
+        if( amount == 0 ) return http_send(fd, &rsp_204, NULL, 0);
+        t = lat_now();
+        cnt = http_send_queue(fd, &rsp_200, client->sendq, amount);
+        lat_since(client->lat, LAT_SEND, t);
+        return cnt;
+    }
+
+    if( (b=rtx_next(client->rtx, client->sendq, amount)) == NULL ) {
+        return send_ack(client, fd, msg);
+    }
+    if( b->sends > 1 ) {
+        dprintf(log, DEBUG, "Resending batch %lu, %d pkts.", b->seq,
+                b->npkts);
+        met_add(MET_RESENDS, 1);
+    }
+
+    http_out_rtx(&o, &rsp_200, b, rtx_rcvd(client->rtx),
+                 rtx_window(client->recvq), client->lat);
+    t = lat_now();
+    cnt = http_out_send(fd, &o) == -1 ? -1 : b->npkts;
+    lat_since(client->lat, LAT_SEND, t);
+    rtx_put(client->rtx, b);
+    return cnt;
 }
 
-int handle_r_p2( clidata_t *client, char *hdrs ) {
-    int expected = get_content_length(hdrs);
+int send_ack( clidata_t *client, int fd, http_msg_t *msg ) {
+    http_out_t o;
+
+    if( !msg->rtx && !msg->seq ) return http_send(fd, &rsp_204, NULL, 0);
+
+    http_out_body(&o, &rsp_204, NULL, 0);
+    http_out_seq(&o, 0, rtx_rcvd(client->rtx), rtx_window(client->recvq),
+                 client->lat);
+    return http_out_send(fd, &o);
+}
+
+int handle_s_p2( clidata_t *client, rbuf_t *rb, http_msg_t *msg ) {
+    int chan1 = client->chan1;
+
+    if( take_batch(client, rb, msg, chan1) == -1 ) return -1;
+
+    send_ack(client, chan1, msg);
+    return 0;
+
+}
+
+int handle_r_p2( clidata_t *client, rbuf_t *rb, http_msg_t *msg ) {
+    long expected = msg->content_length;
     queue_t *sendq = client->sendq;
     int chan2 = client->chan2;
     struct timespec ts;
     char *body;
     int sex;
-    char *pkt;
 
-    if( !expected ) {
+    if( expected < 1 ) {
         lprintf(log, WARN, 
                 "Client sent no Content-Length. Dropping.");
         goto cleanup1;
     }
 
-    if( (body=getbody(chan2, hdrs, &expected)) == NULL ) {
+    if( (body=getbody(rb, msg, &expected)) == NULL ) {
         lprintf(log, WARN, "getbody() failed. Dropping client.");
         goto cleanup1;
     }
 
     if( (sex=strtol(body, NULL, 0)) == 0 ) {
         lprintf(log, WARN, "Client sent invalid seconds spec.");
-        fdprintf(chan2, RESPONSE_400);
+        http_send(chan2, &rsp_400, NULL, 0);
         goto cleanup2;
     }
 
     ts.tv_nsec = 0;
     ts.tv_sec = sex;
 
+    if( msg->rtx ) rtx_ack(client->rtx, msg->ack, msg->win);
+    lat_peer(client->lat, msg->ts, msg->echo, msg->held);
+
     dprintf(log, DEBUG, "waiting up to %d seconds.", sex);
 
-    if( q_timedwait(sendq, &ts) ) {
-        int sent=0, total, cnt=0;
+    /* What the client missed last time goes out without waiting */
+    if( (msg->rtx && rtx_pending(client->rtx)) || q_timedwait(sendq, &ts) ) {
+        size_t total = sendq->totsize;
+        int cnt;
 
         dprintf(log, DEBUG, "returned from wait, with data");
-        total = sendq->totsize;
-        fdprintf(chan2, RESPONSE_200_NOBODY, sendq->totsize);
-
-        while( sent < total ) {
-            if( (pkt=q_remove(sendq, 0, NULL)) == NULL ) {
-                lprintf(log, WARN, "q_remove failed!");
-                goto cleanup2;
-            }
-            if( write(chan2, pkt, iplen(pkt)) < 0 ) {
-                lprintf(log, INFO, "send failed: %s",
-                        strerror(errno));
-                free(pkt);
-                goto cleanup2;
-            }
-            cnt++;
-            sent += iplen(pkt);
-            free(pkt);
+        if( (cnt=send_batch(client, chan2, msg, total)) == -1 ) {
+            lprintf(log, INFO, "send failed");
+            goto cleanup2;
+        }
+        dprintf(log, DEBUG, "Sent %lu bytes in %d pkts",
+                (unsigned long)total, cnt);
+        if( cnt > 0 ) {
+            met_add(MET_BATCHES_TX, 1);
+            met_observe(MET_H_BATCH_TX, cnt);
         }
-        lprintf(log, INFO, "Sent %d bytes in %d pkts",
-                sent, cnt);
     } else {
         dprintf(log, DEBUG, "returned from wait, with NO data");
-        if( client->chan2 != -1 ) fdprintf(chan2, RESPONSE_204);
+        if( client->chan2 != -1 ) send_ack(client, chan2, msg);
     }
     
+    free(body);
     return 0;
 
 
@@ -0,0 +1,210 @@
+/* -------------------------------------------------------------------------
+ * srvws.c - htun WebSocket channel functions for the server side
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>, 
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "log.h"
+#include "http.h"
+#include "util.h"
+#include "clidata.h"
+#include "server.h"
+#include "tpool.h"
+#include "srvproto2.h"
+#include "srvws.h"
+#include "websock.h"
+#include "frame.h"
+#include "queue.h"
+#include "metrics.h"
+
+extern tpool_t *tpool; /* from server.c */
+
+void ws_release( ws_chan_t *ch ) {
+    int fd = ch->fd;
+
+    ch->stop = 1;
+    shutdown(fd, SHUT_RDWR);
+    if( ch->client->sendq ) q_wake(ch->client->sendq);
+    if( __sync_sub_and_fetch(&ch->refs, 1) == 0 ) {
+        dprintf(log, DEBUG, "closing WebSocket fd #%d", fd);
+        close(fd);
+        free(ch);
+    }
+}
+
+/*
+ * Runs in the thread pool, sending the client's queued packets down its
+ * WebSocket channel while the handler thread reads from it. With protocol 3
+ * it also keeps the channel alive while there is nothing to send.
+ */
+static void ws_sender( void *chp ) {
+    ws_chan_t *ch = (ws_chan_t *)chp;
+    clidata_t *client = ch->client;
+    int fd = ch->fd;
+    struct timespec ts;
+    unsigned int t;
+    int rc;
+
+    dprintf(log, DEBUG, "ws sender starting on fd #%d", fd);
+
+    while( !ch->stop && client->sendq ) {
+        ts.tv_sec = 1;
+        ts.tv_nsec = 0;
+        if( !q_timedwait(client->sendq, &ts) ) {
+            if( client->framed && !ch->stop &&
+                fr_tick(client->fr, fd, 0) == -1 ) break;
+            continue;
+        }
+        if( ch->stop ) break;
+        t = lat_now();
+        if( client->framed ) rc = fr_send(client->fr, fd, client->sendq, 0);
+        else rc = ws_send_batch(fd, client->sendq, 0);
+        if( rc > 0 ) lat_since(client->lat, LAT_SEND, t);
+        if( rc == -1 ) {
+            lprintf(log, INFO, "WebSocket send to %s failed.",
+                    client->macaddr);
+            break;
+        }
+        if( rc > 0 ) {
+            met_add(MET_BATCHES_TX, 1);
+            met_observe(MET_H_BATCH_TX, rc);
+        }
+        client->lastuse = time(NULL);
+    }
+
+    /* wakes up the handler if it was us that stopped */
+    ws_release(ch);
+}
+
+clidata_t *handle_ws( rbuf_t *rb, http_msg_t *msg, ws_chan_t **chan ) {
+    int clisock = rb->fd;
+    char key[WS_KEY_LEN+1];
+    char accept[WS_ACCEPT_LEN+1];
+    char buf[CP2_OK_MAXBODY];
+    char *body, **lines;
+    clidata_t *client;
+    ws_chan_t *ch;
+    struct iovec iov[3];
+    size_t len;
+    int opcode, err;
+
+    slice_copy(&msg->ws_key, key, sizeof(key));
+    ws_accept_key(key, accept);
+
+    iov[0].iov_base = HEAD_101;
+    iov[0].iov_len = sizeof(HEAD_101)-1;
+    iov[1].iov_base = accept;
+    iov[1].iov_len = WS_ACCEPT_LEN;
+    iov[2].iov_base = TAIL_NONE;
+    iov[2].iov_len = sizeof(TAIL_NONE)-1;
+    if( writev_all(clisock, iov, 3) == -1 ) return NULL;
+
+    /* The first message carries what a CP2 body would */
+    if( (body=ws_recv_message(rb, &opcode, &len, 1)) == NULL ) {
+        lprintf(log, WARN, "Client did not send its WebSocket config.");
+        goto cleanup1;
+    }
+    dprintf(log, DEBUG, "Got config message: %s", body);
+
+    if( (lines=splitlines(body)) == NULL ) {
+        lprintf(log, ERROR,
+                "Problem splittling lines with splitlines()");
+        goto cleanup2;
+    }
+
+    if( (client=register_client(clisock, lines, 0, &err)) == NULL ) {
+        lprintf(log, WARN, "Could not register WebSocket client (%d).", err);
+        goto cleanup3;
+    }
+
+    len = connect_reply(client, buf, sizeof(buf));
+    if( ws_send_frame(clisock, WS_OP_TEXT, buf, len, 0) == -1 ) {
+        goto cleanup4;
+    }
+
+    if( (ch=malloc(sizeof(ws_chan_t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() WebSocket channel!");
+        goto cleanup4;
+    }
+    ch->client = client;
+    ch->fd = clisock;
+    ch->refs = 2;
+    ch->stop = 0;
+    if( tpool_add_work(tpool, ws_sender, ch) == -1 ) {
+        lprintf(log, WARN, "starting ws sender: Too busy");
+        free(ch);
+        goto cleanup4;
+    }
+
+    free(lines);
+    free(body);
+    *chan = ch;
+    return client;
+
+cleanup4:
+    if( drop_chan(clients, &client->chan1, clisock) ) {
+        client->lastuse = time(NULL);
+    }
+cleanup3:
+    free(lines);
+cleanup2:
+    free(body);
+cleanup1:
+    {
+        char bye[2] = { 1011 >> 8, 1011 & 0xFF }; /* internal error */
+        ws_send_frame(clisock, WS_OP_CLOSE, bye, 2, 0);
+    }
+    return NULL;
+}
+
+int handle_ws_data( ws_chan_t *ch, rbuf_t *rb ) {
+    clidata_t *client = ch->client;
+    int rc;
+
+    for(;;) {
+        if( client->framed ) rc = fr_recv(client->fr, rb, client->recvq, 1);
+        else rc = ws_recv_batch(rb, client->recvq, 1);
+        if( rc < 0 ) break;
+        if( rc > 0 ) {
+            met_add(MET_BATCHES_RX, 1);
+            met_observe(MET_H_BATCH_RX, rc);
+        }
+        client->lastuse = time(NULL);
+    }
+
+    if( rc == -2 ) {
+        lprintf(log, INFO, "Client %s closed its WebSocket channel.",
+                client->macaddr);
+        return 0;
+    }
+    lprintf(log, INFO, "WebSocket channel of %s went down.", client->macaddr);
+    return -1;
+}
@@ -0,0 +1,285 @@
+/* -------------------------------------------------------------------------
+ * tls.c - htun TLS transport functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "common.h"
+#include "log.h"
+#include "tls.h"
+
+typedef struct {
+    SSL *ssl;
+    int fd;                 /* the TLS connection */
+    int pair;               /* our end of what htun uses instead */
+} tls_relay_t;
+
+/* Logs what went wrong last in OpenSSL, after msg */
+static void tls_error( const char *msg, int fd ) {
+    unsigned long e = ERR_get_error();
+    char buf[256];
+
+    ERR_error_string_n(e, buf, sizeof(buf));
+    lprintf(log, WARN, "%s on fd #%d: %s", msg, fd,
+            e ? buf : strerror(errno));
+    ERR_clear_error();
+}
+
+/* What both ends set up alike */
+static SSL_CTX *tls_ctx( const SSL_METHOD *method ) {
+    SSL_CTX *ctx;
+
+    if( (ctx=SSL_CTX_new(method)) == NULL ) {
+        tls_error("Unable to make a TLS context", -1);
+        return NULL;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    /* The relay polls, so SSL_read() must not wait out records it eats */
+    SSL_CTX_clear_mode(ctx, SSL_MODE_AUTO_RETRY);
+    if( SSL_CTX_set_cipher_list(ctx, TLS_CIPHERS) != 1 ) {
+        tls_error("Unable to set the TLS ciphers", -1);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+SSL_CTX *tls_server_ctx( const char *cert, const char *key ) {
+    SSL_CTX *ctx;
+
+    if( (ctx=tls_ctx(TLS_server_method())) == NULL ) return NULL;
+    if( SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1 ) {
+        tls_error("Unable to load the TLS certificate and key", -1);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+SSL_CTX *tls_client_ctx( const char *ca ) {
+    SSL_CTX *ctx;
+
+    if( (ctx=tls_ctx(TLS_client_method())) == NULL ) return NULL;
+    if( (*ca ? SSL_CTX_load_verify_locations(ctx, ca, NULL) :
+               SSL_CTX_set_default_verify_paths(ctx)) != 1 ) {
+        tls_error("Unable to load the CA certificates", -1);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    return ctx;
+}
+
+/* Sets how long a read or write on fd may block, 0 for forever */
+static void tls_timeout( int fd, int secs ) {
+    struct timeval tv;
+
+    tv.tv_sec = secs;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static int tls_write_all( int fd, const char *buf, int len ) {
+    int n;
+
+    while( len > 0 ) {
+        if( (n=write(fd, buf, len)) == -1 ) {
+            if( errno == EINTR ) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * thread
+ *
+ * Moves data between a TLS connection and the socketpair end htun uses,
+ * until either side closes.
+ */
+static void *tls_relay( void *arg ) {
+    tls_relay_t *t = arg;
+    struct pollfd pfd[2];
+    char buf[16384];
+    int n;
+
+    pfd[0].fd = t->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = t->pair;
+    pfd[1].events = POLLIN;
+
+    while( 1 ) {
+        /* OpenSSL may hold a record it read already */
+        if( poll(pfd, 2, SSL_pending(t->ssl) ? 0 : -1) == -1 ) {
+            if( errno == EINTR ) continue;
+            break;
+        }
+        if( SSL_pending(t->ssl) || pfd[0].revents ) {
+            if( (n=SSL_read(t->ssl, buf, sizeof(buf))) <= 0 ) {
+                if( SSL_get_error(t->ssl, n) != SSL_ERROR_WANT_READ ) break;
+            } else if( tls_write_all(t->pair, buf, n) == -1 ) {
+                break;
+            }
+        }
+        if( pfd[1].revents ) {
+            if( (n=read(t->pair, buf, sizeof(buf))) <= 0 ) {
+                if( n == -1 && errno == EINTR ) continue;
+                break;
+            }
+            if( SSL_write(t->ssl, buf, n) <= 0 ) break;
+        }
+    }
+
+    dprintf(log, DEBUG, "TLS relay for fd #%d done", t->fd);
+    SSL_shutdown(t->ssl);
+    SSL_free(t->ssl);
+    close(t->fd);
+    close(t->pair);
+    free(t);
+    return NULL;
+}
+
+/*
+ * Hands the TLS connection on fd over to the kernel, or else to a relay
+ * thread. Returns the descriptor to use, or -1 with ssl freed.
+ */
+static int tls_finish( SSL *ssl, int fd ) {
+    static int warned = 0;
+    tls_relay_t *t;
+    pthread_t tid;
+    int sv[2];
+
+    tls_timeout(fd, 0);
+
+    if( BIO_get_ktls_send(SSL_get_wbio(ssl)) &&
+        BIO_get_ktls_recv(SSL_get_rbio(ssl)) ) {
+        dprintf(log, DEBUG, "kTLS took over fd #%d", fd);
+        SSL_free(ssl);
+        return fd;
+    }
+
+    if( !warned ) {
+        warned = 1;
+        lprintf(log, WARN, "kTLS is not available (is the tls module "
+                "loaded?), TLS goes through a relay thread.");
+    }
+    if( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1 ) {
+        lprintf(log, ERROR, "socketpair() failed: %s", strerror(errno));
+        SSL_free(ssl);
+        return -1;
+    }
+    if( (t=malloc(sizeof(*t))) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() TLS relay!");
+        goto err;
+    }
+    t->ssl = ssl;
+    t->fd = fd;
+    t->pair = sv[1];
+    if( pthread_create(&tid, NULL, tls_relay, t) ) {
+        lprintf(log, ERROR, "Unable to start TLS relay thread!");
+        free(t);
+        goto err;
+    }
+    pthread_detach(tid);
+    dprintf(log, DEBUG, "TLS on fd #%d relayed to fd #%d", fd, sv[0]);
+    return sv[0];
+
+err:
+    close(sv[0]);
+    close(sv[1]);
+    SSL_free(ssl);
+    return -1;
+}
+
+int tls_accept( SSL_CTX *ctx, int fd ) {
+    SSL *ssl;
+
+    if( (ssl=SSL_new(ctx)) == NULL || SSL_set_fd(ssl, fd) != 1 ) {
+        tls_error("Unable to set up TLS", fd);
+        SSL_free(ssl);
+        return -1;
+    }
+    tls_timeout(fd, TLS_HANDSHAKE_SECS);
+    if( SSL_accept(ssl) != 1 ) {
+        tls_error("TLS handshake failed", fd);
+        SSL_free(ssl);
+        return -1;
+    }
+    dprintf(log, DEBUG, "TLS with %s on fd #%d", SSL_get_cipher(ssl), fd);
+    return tls_finish(ssl, fd);
+}
+
+int tls_connect( SSL_CTX *ctx, int fd, const char *host ) {
+    SSL *ssl;
+    int ok;
+
+    if( (ssl=SSL_new(ctx)) == NULL || SSL_set_fd(ssl, fd) != 1 ) {
+        tls_error("Unable to set up TLS", fd);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    /* The certificate has to be for the server we asked for */
+    if( inet_addr(host) != INADDR_NONE ) {
+        ok = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    } else {
+        ok = SSL_set_tlsext_host_name(ssl, host) && SSL_set1_host(ssl, host);
+    }
+    if( !ok ) {
+        tls_error("Unable to set the TLS server name", fd);
+        SSL_free(ssl);
+        return -1;
+    }
+
+    tls_timeout(fd, TLS_HANDSHAKE_SECS);
+    if( SSL_connect(ssl) != 1 ) {
+        if( SSL_get_verify_result(ssl) != X509_V_OK ) {
+            lprintf(log, WARN, "Server certificate on fd #%d: %s", fd,
+                    X509_verify_cert_error_string(
+                        SSL_get_verify_result(ssl)));
+        }
+        tls_error("TLS handshake failed", fd);
+        SSL_free(ssl);
+        return -1;
+    }
+    dprintf(log, DEBUG, "TLS with %s on fd #%d", SSL_get_cipher(ssl), fd);
+    return tls_finish(ssl, fd);
+}
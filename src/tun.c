@@ -29,6 +29,7 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <net/route.h>
@@ -286,6 +287,20 @@ static inline int tun_up(int sd, struct ifreq *ifr) {
     return 0;
 }
 
+/*
+ * Sets the MTU of the interface given by ifr. sd is a socket descriptor.
+ */
+static inline int tun_setmtu(int sd, struct ifreq *ifr, int mtu) {
+    ifr->ifr_mtu = mtu;
+    if( ioctl(sd, SIOCSIFMTU, ifr) == -1 ) {
+        lprintf(log, ERROR, "Setting %s MTU %d: %s", ifr->ifr_name, mtu,
+                strerror(errno));
+        return -1;
+    }
+    lprintf(log, INFO, "Set %s MTU to %d.", ifr->ifr_name, mtu);
+    return 0;
+}
+
 /*
  * Sets tun specific flags. tunfd is a filedes to the tun device file.
  */
@@ -438,6 +453,9 @@ outta_here:
     /* set no checksumming, etc */
     tun_setflags(clidata->tunfd);
 
+    /* not fatal, the MSS clamp still keeps TCP segments small enough */
+    if( clidata->mtu ) tun_setmtu(sd, &ifr, clidata->mtu);
+
     /* Bring up the interface */
     if( tun_up(sd, &ifr) == -1 ) goto alloc_error;
 
@@ -458,7 +476,7 @@ alloc_error_1:
  * local and peer ip
  * returns the tunfd
  */
-int cli_tun_alloc( struct in_addr local, struct in_addr peer )
+int cli_tun_alloc( struct in_addr local, struct in_addr peer, int mtu )
 {
     struct ifreq ifr;
     int fd, sock;
@@ -490,6 +508,8 @@ int cli_tun_alloc( struct in_addr local, struct in_addr peer )
         return -1;
     }
 
+    if( mtu ) tun_setmtu(sock, &ifr, mtu);
+
     if( tun_up(sock, &ifr) == -1 ) {
         lprintf( log, FATAL, "bringing up tun dev\n");
         return -1;
@@ -499,3 +519,175 @@ int cli_tun_alloc( struct in_addr local, struct in_addr peer )
     
     return fd;
 }
+
+int tun_clip_mtu( int mtu ) {
+    return min(max(mtu, TUN_MIN_MTU), TUN_MAX_MTU);
+}
+
+int tun_transport_mtu( int sock, int overhead ) {
+    socklen_t len = sizeof(int);
+    int mss;
+
+    /* the MSS of the connection is known once it is established */
+    if( getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) == -1 ||
+        mss <= 0 ) {
+        return TUN_MAX_MTU;
+    }
+    return tun_clip_mtu(mss - overhead);
+}
+
+/*
+ * Adds new - old to the 16 bit ones' complement checksum at sum (RFC 1624).
+ * odd says the value sits at an odd offset of what is checksummed.
+ */
+static inline void csum_replace( unsigned char *sum, unsigned short old,
+                                 unsigned short new, int odd ) {
+    unsigned long s;
+
+    if( odd ) {
+        old = (old >> 8) | (old << 8);
+        new = (new >> 8) | (new << 8);
+    }
+    s = ~(sum[0] << 8 | sum[1]) & 0xFFFF;
+    s += (~old & 0xFFFF) + new;
+    s = (s & 0xFFFF) + (s >> 16);
+    s = (s & 0xFFFF) + (s >> 16);
+    s = ~s & 0xFFFF;
+    sum[0] = s >> 8;
+    sum[1] = s & 0xFF;
+}
+
+void tun_clamp_mss( char *pkt, int mtu ) {
+    unsigned char *ip = (unsigned char *)pkt + 4, *tcp;
+    unsigned short mss = mtu - 40, old;
+    int len = iplen(pkt) - 4, ihl, doff, i;
+
+    if( mtu <= 0 || len < 40 || (ip[0] >> 4) != 4 ) return;
+    ihl = (ip[0] & 0x0F) * 4;
+
+    /* only the first fragment has the TCP header */
+    if( ip[9] != IPPROTO_TCP || ((ip[6] & 0x1F) | ip[7]) != 0 ) return;
+    if( ihl < 20 || ihl + 20 > len ) return;
+
+    tcp = ip + ihl;
+    if( !(tcp[13] & 0x02) ) return;     /* SYN and SYN-ACK only */
+    doff = (tcp[12] >> 4) * 4;
+    if( doff < 20 || ihl + doff > len ) return;
+
+    for( i = 20; i < doff; ) {
+        if( tcp[i] == TCPOPT_EOL ) break;
+        if( tcp[i] == TCPOPT_NOP ) {
+            i++;
+            continue;
+        }
+        if( i + 1 >= doff || tcp[i+1] < 2 || i + tcp[i+1] > doff ) break;
+        if( tcp[i] == TCPOPT_MAXSEG && tcp[i+1] == TCPOLEN_MAXSEG ) {
+            old = tcp[i+2] << 8 | tcp[i+3];
+            if( old <= mss ) return;
+            tcp[i+2] = mss >> 8;
+            tcp[i+3] = mss & 0xFF;
+            csum_replace(tcp + 16, old, mss, i & 1);
+            dprintf(log, DEBUG, "clamped MSS %u to %u", old, mss);
+            return;
+        }
+        i += tcp[i+1];
+    }
+}
+
+int tun_pure_ack( const char *pkt ) {
+    const unsigned char *ip = (const unsigned char *)pkt + 4, *tcp;
+    int len = iplen(pkt) - 4, ihl, doff, i;
+
+    if( len < 40 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_TCP ) return 0;
+    if( ((ip[6] & 0x3F) | ip[7]) != 0 ) return 0;   /* MF or an offset */
+    ihl = (ip[0] & 0x0F) * 4;
+    if( ihl < 20 || ihl + 20 > len ) return 0;
+
+    tcp = ip + ihl;
+    doff = (tcp[12] >> 4) * 4;
+    if( tcp[13] != 0x10 || doff < 20 || ihl + doff != len ) return 0;
+
+    /* a SACK block or anything else we do not know would be lost */
+    for( i = 20; i < doff; ) {
+        if( tcp[i] == TCPOPT_EOL ) break;
+        if( tcp[i] == TCPOPT_NOP ) {
+            i++;
+            continue;
+        }
+        if( tcp[i] != TCPOPT_TIMESTAMP || i + TCPOLEN_TIMESTAMP > doff ||
+            tcp[i+1] != TCPOLEN_TIMESTAMP ) {
+            return 0;
+        }
+        i += TCPOLEN_TIMESTAMP;
+    }
+    return 1;
+}
+
+int tun_ack_supersedes( const void *item, const void *pkt ) {
+    const unsigned char *o = (const unsigned char *)item + 4;
+    const unsigned char *n = (const unsigned char *)pkt + 4;
+    const unsigned char *otcp, *ntcp;
+    unsigned long oack, nack;
+    int len = iplen((const char *)item) - 4, ihl;
+
+    /* addresses and protocol, then ports. A fragment we cannot place. */
+    if( len < 40 || (o[0] >> 4) != 4 || o[9] != IPPROTO_TCP ||
+        memcmp(o + 12, n + 12, 8) ) {
+        return 0;
+    }
+    ihl = (o[0] & 0x0F) * 4;
+    if( ((o[6] & 0x3F) | o[7]) != 0 || ihl < 20 || ihl + 20 > len ) return -1;
+    otcp = o + ihl;
+    ntcp = n + (n[0] & 0x0F) * 4;
+    if( memcmp(otcp, ntcp, 4) ) return 0;
+
+    /* same connection, then sequence number and window */
+    if( !tun_pure_ack(item) || memcmp(otcp + 4, ntcp + 4, 4) ||
+        memcmp(otcp + 14, ntcp + 14, 2) ) {
+        return -1;
+    }
+
+    oack = (unsigned long)otcp[8] << 24 | otcp[9] << 16 | otcp[10] << 8 |
+        otcp[11];
+    nack = (unsigned long)ntcp[8] << 24 | ntcp[9] << 16 | ntcp[10] << 8 |
+        ntcp[11];
+    return nack != oack && ((nack - oack) & 0xFFFFFFFFUL) < 0x80000000UL ?
+        1 : -1;
+}
+
+int tun_is_segment( const char *pkt ) {
+    const unsigned char *ip = (const unsigned char *)pkt + 4, *tcp;
+    int len = iplen(pkt) - 4, ihl, doff;
+
+    if( len < 40 || (ip[0] >> 4) != 4 || ip[9] != IPPROTO_TCP ) return 0;
+    if( ((ip[6] & 0x3F) | ip[7]) != 0 ) return 0;   /* MF or an offset */
+    ihl = (ip[0] & 0x0F) * 4;
+    if( ihl < 20 || ihl + 20 > len ) return 0;
+
+    tcp = ip + ihl;
+    doff = (tcp[12] >> 4) * 4;
+    if( doff < 20 || ihl + doff > len ) return 0;
+
+    /* an empty ACK is not a retransmission, and may be a duplicate ACK */
+    return ihl + doff < len || (tcp[13] & 0x07);
+}
+
+int tun_same_segment( const void *item, const void *pkt ) {
+    const unsigned char *o = (const unsigned char *)item + 4;
+    const unsigned char *n = (const unsigned char *)pkt + 4;
+    const unsigned char *otcp, *ntcp;
+
+    /* the IP ids differ, so the packets are compared field by field */
+    if( iplen((const char *)item) != iplen((const char *)pkt) ||
+        o[0] != n[0] || o[9] != n[9] || memcmp(o + 12, n + 12, 8) ||
+        !tun_is_segment(item) ) {
+        return 0;
+    }
+
+    otcp = o + (o[0] & 0x0F) * 4;
+    ntcp = n + (n[0] & 0x0F) * 4;
+    if( (otcp[12] >> 4) != (ntcp[12] >> 4) ) return 0;
+
+    /* ports and sequence number, then SYN, FIN and RST */
+    return !memcmp(otcp, ntcp, 8) && (otcp[13] & 0x07) == (ntcp[13] & 0x07);
+}
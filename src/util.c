@@ -54,41 +54,113 @@ int xstrncasecmp( const char *s1, const char *s2, int n ){
     else return tolower(*p1)-tolower(*p2);
 }
 
-int fdprintf(int fd, char *fmt, ...) {
-    FILE *fp = fdopen(dup(fd), "w");
+int writev_all( int fd, struct iovec *iov, int cnt ) {
+    ssize_t rc;
+
+    while( cnt > 0 ) {
+        if( (rc=writev(fd, iov, min(cnt, HTUN_IOV_MAX))) < 0 ) {
+            if( errno == EINTR ) continue;
+            lprintf(log, WARN, "Writing to fd #%d: %s.", fd, strerror(errno));
+            return -1;
+        }
+        while( cnt > 0 && (size_t)rc >= iov->iov_len ) {
+            rc -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if( cnt > 0 ) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return 0;
+}
+
+rbuf_t *rb_new( int fd ) {
+    rbuf_t *rb = malloc(sizeof(rbuf_t));
+
+    if( !rb ) {
+        lprintf(log, ERROR, "Unable to malloc() read buffer!");
+        return NULL;
+    }
+    rb_reset(rb, fd);
+    return rb;
+}
+
+void rb_free( rbuf_t **rb ) {
+    if( !rb || !*rb ) return;
+    free(*rb);
+    *rb = NULL;
+}
+
+int rb_fill( rbuf_t *rb ) {
     int rc;
-    va_list ap;
- 
-    va_start(ap, fmt);
-    rc=vfprintf(fp, fmt, ap);
-    fflush(fp);
-    fclose(fp);
-    va_end(ap);
+
+    /* Make room at the end by moving what's left over to the front */
+    if( rb->end == sizeof(rb->buf) && rb->start ) {
+        memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+        rb->end -= rb->start;
+        rb->start = 0;
+    }
+    if( rb->end == sizeof(rb->buf) ) {
+        lprintf(log, WARN, "Read buffer for fd #%d is full.", rb->fd);
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    while( (rc=read(rb->fd, rb->buf + rb->end, sizeof(rb->buf) - rb->end))
+            < 0 && errno == EINTR );
+
+    if( rc < 0 ) {
+        if( errno != EAGAIN ) {
+            lprintf(log, WARN, "Reading from sock fd %d: %s.", rb->fd,
+                    strerror(errno));
+        }
+        return -1;
+    }
+    if( rc == 0 ) {
+        dprintf(log, DEBUG, "fd #%d closed by peer.", rb->fd);
+        return 0;
+    }
+    dprintf(log, DEBUG, "read() returned %d.", rc);
+    rb->end += rc;
     return rc;
 }
 
-char *recvline( char *buf, int len, int fd ){
-    char c=0;
-    int ctr=0;
+int rb_read( rbuf_t *rb, char *buf, size_t len ) {
+    size_t cnt = min(rb_avail(rb), len), n;
+    int rc;
 
-    while( ctr < len-2 ){
-        if( c != '\n' && read(fd,&c,1) == 1 ){
-            buf[ctr]=c;
-            ctr++;
-        } else {
-            break;
+    memcpy(buf, rb->buf + rb->start, cnt);
+    rb_consume(rb, cnt);
+
+    while( cnt < len ) {
+        /* Large remainders go straight to the caller's buffer */
+        if( len - cnt >= sizeof(rb->buf) / 4 ) {
+            if( (rc=read(rb->fd, buf + cnt, len - cnt)) <= 0 ) {
+                if( rc < 0 && errno == EINTR ) continue;
+                if( rc < 0 ) {
+                    lprintf(log, WARN, "Reading from sock fd %d: %s.",
+                            rb->fd, strerror(errno));
+                }
+                goto short_read;
+            }
+            cnt += rc;
+            continue;
         }
+
+        if( rb_fill(rb) <= 0 ) goto short_read;
+        n = min(rb_avail(rb), len - cnt);
+        memcpy(buf + cnt, rb->buf + rb->start, n);
+        rb_consume(rb, n);
+        cnt += n;
     }
-    if( ctr == len-2 ){
-        while( c != '\n' && read(fd,&c,1) == 1 ) ctr++;
-        lprintf( log, WARN,
-                "line exceeded buffer space by %d bytes.",
-                ctr-len);
-    }
-    buf[ctr]='\0';
+    return 0;
 
-    if( *buf == '\0' ) return NULL;
-    else return buf;
+short_read:
+    lprintf(log, WARN, "Reading from sock fd %d: Read %d bytes, expected %d",
+            rb->fd, (int)cnt, (int)len);
+    return -1;
 }
 
 int recvflush( int s ) {
@@ -127,34 +199,19 @@ int recvflush( int s ) {
 }
 
 /* 
- * Reads exactly len bytes from fd and returns the data in a dynamically
+ * Reads exactly len bytes from rb and returns the data in a dynamically
  * allocated buffer
  */
-char *readloop( int fd, size_t len ) {
-    size_t cnt=0;
-    int rc;
+char *readloop( rbuf_t *rb, size_t len ) {
     char *buf = malloc(len+1);
 
     if(!buf) return NULL;
 
     dprintf(log, DEBUG, "attempting to read %d bytes from fd #%d",
-            len, fd);
-    while( cnt < len ) {
-        if( (rc=read(fd,buf+cnt,len-cnt)) <= 0 ) {
-            if( rc < 0 ) {
-                if( errno == EINTR ) continue;
-                lprintf(log, WARN, "Reading from sock fd %d: %s.", fd,
-                        strerror(errno));
-            } else {
-                lprintf(log, WARN, 
-                        "Reading from sock fd %d: Read %d bytes, expected %d",
-                        fd, cnt, len);
-            }
-            free(buf);
-            return NULL;
-        }
-        dprintf(log, DEBUG, "read() returned %d.", rc);
-        cnt += rc;
+            len, rb->fd);
+    if( rb_read(rb, buf, len) == -1 ) {
+        free(buf);
+        return NULL;
     }
     buf[len] = '\0';
 
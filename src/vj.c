@@ -0,0 +1,404 @@
+/* -------------------------------------------------------------------------
+ * vj.c - htun TCP/IP header compression functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "log.h"
+#include "vj.h"
+#include "zbatch.h"
+
+/*
+ * Offsets into a packet: the PI header, then IPv4 at 4 and TCP at 24. The
+ * IP header has no options, or the packet goes as it is.
+ */
+#define IP_ID     8
+#define IP_CSUM   14
+#define TCP_SEQ   28
+#define TCP_ACK   32
+#define TCP_DOFF  36
+#define TCP_FLAGS 37
+#define TCP_WIN   38
+#define TCP_CSUM  40
+#define TCP_OPTS  44
+
+/* Change bits of a VJ_DELTA record, in the order the fields follow */
+#define VJ_ID    0x01       /* IP id, unless it went up by one */
+#define VJ_SEQ   0x02       /* sequence number delta */
+#define VJ_ACK   0x04       /* ack number delta */
+#define VJ_WIN   0x08       /* window */
+#define VJ_FLAGS 0x10       /* TCP flags */
+#define VJ_TS    0x20       /* timestamp deltas, if that is all the options */
+#define VJ_OPTS  0x40       /* the options as they are */
+
+static inline unsigned long get32( const unsigned char *p ) {
+    return (unsigned long)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put32( unsigned char *p, unsigned long v ) {
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+/* Numbers go 7 bits to a byte, low bits first, the top bit saying more */
+static inline unsigned char *put_var( unsigned char *p, unsigned long v ) {
+    while( v >= 0x80 ) {
+        *p++ = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline const unsigned char *get_var( const unsigned char *p,
+                                            const unsigned char *end,
+                                            unsigned long *v ) {
+    int shift;
+
+    for( *v = 0, shift = 0; p < end && shift < 35; shift += 7 ) {
+        *v |= (unsigned long)(*p & 0x7F) << shift;
+        if( !(*p++ & 0x80) ) {
+            *v &= 0xFFFFFFFFUL;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* The header checksum of the IPv4 header (without options) at ip */
+static void ip_csum( unsigned char *ip ) {
+    unsigned long s = 0;
+    int i;
+
+    ip[10] = ip[11] = 0;
+    for( i = 0; i < 20; i += 2 ) s += ip[i] << 8 | ip[i+1];
+    s = (s & 0xFFFF) + (s >> 16);
+    s = (s & 0xFFFF) + (s >> 16);
+    s = ~s & 0xFFFF;
+    ip[10] = s >> 8;
+    ip[11] = s & 0xFF;
+}
+
+/* Returns the length of the headers of a packet we compress, else 0 */
+static size_t vj_hdrlen( const unsigned char *pkt, size_t len ) {
+    const unsigned char *ip = pkt + 4;
+    size_t hlen;
+
+    if( len < TCP_OPTS || ip[0] != 0x45 || ip[9] != IPPROTO_TCP ) return 0;
+    if( ((ip[6] & 0x3F) | ip[7]) != 0 ) return 0;   /* MF or an offset */
+
+    /* SYN, FIN, RST and URG are rare, and go as they are */
+    if( pkt[TCP_FLAGS] & 0x27 ) return 0;
+    hlen = 24 + (pkt[TCP_DOFF] >> 4) * 4;
+    return hlen < TCP_OPTS || hlen > len ? 0 : hlen;
+}
+
+/* Nonzero if the only options are the usual NOP, NOP, timestamp */
+static inline int vj_is_ts( const unsigned char *hdr, size_t hlen ) {
+    return hlen == TCP_OPTS + 12 && hdr[TCP_OPTS] == 1 &&
+        hdr[TCP_OPTS+1] == 1 && hdr[TCP_OPTS+2] == 8 && hdr[TCP_OPTS+3] == 10;
+}
+
+/* Nonzero if pkt can go as changes to s: what is not sent must match */
+static inline int vj_fits( const vj_slot_t *s, const unsigned char *pkt,
+                           size_t hlen ) {
+    return s->len == (int)hlen &&
+        !memcmp(s->hdr, pkt, 6) &&              /* PI, version and TOS */
+        !memcmp(s->hdr + 10, pkt + 10, 4) &&    /* DF, TTL and protocol */
+        s->hdr[TCP_DOFF] == pkt[TCP_DOFF] &&
+        !memcmp(s->hdr + 42, pkt + 42, 2);      /* urgent pointer */
+}
+
+void vj_reset( vj_t *c ) {
+    memset(c, 0, sizeof(*c));
+}
+
+/* The slot of the connection of pkt, or one to take over for it */
+static int vj_slot( vj_t *c, const unsigned char *pkt, int *found ) {
+    int i, lru = 0;
+
+    for( i = 0; i < VJ_SLOTS; i++ ) {
+        vj_slot_t *s = &c->slot[i];
+
+        /* addresses, then ports */
+        if( s->len && !memcmp(s->hdr + 16, pkt + 16, 8) &&
+            !memcmp(s->hdr + 24, pkt + 24, 4) ) {
+            *found = 1;
+            return i;
+        }
+        if( s->used < c->slot[lru].used ) lru = i;
+    }
+    *found = 0;
+    return lru;
+}
+
+/* Writes the VJ_DELTA record of pkt against s at o, returning its end */
+static unsigned char *vj_delta( vj_slot_t *s, const unsigned char *pkt,
+                                size_t hlen, size_t len, unsigned char *o ) {
+    unsigned char *bits;
+    unsigned long d;
+
+    *(bits=o++) = 0;
+    *o++ = pkt[TCP_CSUM];
+    *o++ = pkt[TCP_CSUM+1];
+
+    if( (((s->hdr[IP_ID] << 8 | s->hdr[IP_ID+1]) + 1) & 0xFFFF) !=
+        (pkt[IP_ID] << 8 | pkt[IP_ID+1]) ) {
+        *bits |= VJ_ID;
+        *o++ = pkt[IP_ID];
+        *o++ = pkt[IP_ID+1];
+    }
+    if( (d=(get32(pkt + TCP_SEQ) - get32(s->hdr + TCP_SEQ)) & 0xFFFFFFFFUL) ) {
+        *bits |= VJ_SEQ;
+        o = put_var(o, d);
+    }
+    if( (d=(get32(pkt + TCP_ACK) - get32(s->hdr + TCP_ACK)) & 0xFFFFFFFFUL) ) {
+        *bits |= VJ_ACK;
+        o = put_var(o, d);
+    }
+    if( memcmp(s->hdr + TCP_WIN, pkt + TCP_WIN, 2) ) {
+        *bits |= VJ_WIN;
+        *o++ = pkt[TCP_WIN];
+        *o++ = pkt[TCP_WIN+1];
+    }
+    if( s->hdr[TCP_FLAGS] != pkt[TCP_FLAGS] ) {
+        *bits |= VJ_FLAGS;
+        *o++ = pkt[TCP_FLAGS];
+    }
+    if( memcmp(s->hdr + TCP_OPTS, pkt + TCP_OPTS, hlen - TCP_OPTS) ) {
+        if( vj_is_ts(s->hdr, hlen) && vj_is_ts(pkt, hlen) ) {
+            *bits |= VJ_TS;
+            o = put_var(o, (get32(pkt + TCP_OPTS + 4) -
+                            get32(s->hdr + TCP_OPTS + 4)) & 0xFFFFFFFFUL);
+            o = put_var(o, (get32(pkt + TCP_OPTS + 8) -
+                            get32(s->hdr + TCP_OPTS + 8)) & 0xFFFFFFFFUL);
+        } else {
+            *bits |= VJ_OPTS;
+            memcpy(o, pkt + TCP_OPTS, hlen - TCP_OPTS);
+            o += hlen - TCP_OPTS;
+        }
+    }
+
+    o = put_var(o, len - hlen);
+    memcpy(o, pkt + hlen, len - hlen);
+    return o + len - hlen;
+}
+
+char *vj_encode( vj_t *c, char **pkts, int npkts, size_t size, size_t *len ) {
+    unsigned char *buf, *o, *pkt;
+    size_t plen, hlen;
+    int i, n, found;
+
+    /* No record is longer than its packet plus the type and slot bytes */
+    if( (buf=malloc(size + 2 * npkts)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() header compression buffer!");
+        return NULL;
+    }
+
+    for( o = buf, i = 0; i < npkts; i++ ) {
+        pkt = (unsigned char *)pkts[i];
+        plen = iplen(pkts[i]);
+
+        if( (hlen=vj_hdrlen(pkt, plen)) == 0 ) {
+            *o++ = VJ_RAW;
+            memcpy(o, pkt, plen);
+            o += plen;
+            continue;
+        }
+
+        n = vj_slot(c, pkt, &found);
+        c->slot[n].used = ++c->clock;
+        *o++ = found && vj_fits(&c->slot[n], pkt, hlen) ? VJ_DELTA : VJ_FULL;
+        *o++ = n;
+        if( o[-2] == VJ_DELTA ) {
+            o = vj_delta(&c->slot[n], pkt, hlen, plen, o);
+        } else {
+            memcpy(o, pkt, plen);
+            o += plen;
+        }
+        memcpy(c->slot[n].hdr, pkt, hlen);
+        c->slot[n].len = hlen;
+    }
+
+    *len = o - buf;
+    dprintf(log, DEBUG, "header compression: %d pkts from %lu to %lu bytes",
+            npkts, (unsigned long)size, (unsigned long)*len);
+    return (char *)buf;
+}
+
+/* Makes room for need more bytes at *buf, which holds used of *size */
+static int vj_room( unsigned char **buf, size_t *size, size_t used,
+                    size_t need ) {
+    unsigned char *tmp;
+    size_t n = *size;
+
+    if( used + need <= n ) return 0;
+    while( n < used + need ) n *= 2;
+    if( n > ZBATCH_MAX ) n = ZBATCH_MAX;
+    if( used + need > n ) {
+        lprintf(log, WARN, "Header compressed batch decodes past %d bytes.",
+                ZBATCH_MAX);
+        return -1;
+    }
+    if( (tmp=realloc(*buf, n)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() header decode buffer!");
+        return -1;
+    }
+    *buf = tmp;
+    *size = n;
+    return 0;
+}
+
+/* Decodes the VJ_DELTA record at p into the packet at out, which has room
+ * for the headers. Returns the end of what was read, or NULL if bogus. */
+static const unsigned char *vj_undelta( vj_slot_t *s, const unsigned char *p,
+                                        const unsigned char *end,
+                                        unsigned char *out, size_t *plen,
+                                        unsigned char **buf, size_t *size ) {
+    unsigned char *hdr = out;
+    size_t hlen = s->len, off = out - *buf;
+    unsigned long v;
+    int bits;
+
+    if( end - p < 3 ) return NULL;
+    bits = *p++;
+    memcpy(hdr, s->hdr, hlen);
+    hdr[TCP_CSUM] = *p++;
+    hdr[TCP_CSUM+1] = *p++;
+
+    if( bits & VJ_ID ) {
+        if( end - p < 2 ) return NULL;
+        hdr[IP_ID] = *p++;
+        hdr[IP_ID+1] = *p++;
+    } else {
+        v = (hdr[IP_ID] << 8 | hdr[IP_ID+1]) + 1;
+        hdr[IP_ID] = (v >> 8) & 0xFF;
+        hdr[IP_ID+1] = v & 0xFF;
+    }
+    if( bits & VJ_SEQ ) {
+        if( (p=get_var(p, end, &v)) == NULL ) return NULL;
+        put32(hdr + TCP_SEQ, get32(hdr + TCP_SEQ) + v);
+    }
+    if( bits & VJ_ACK ) {
+        if( (p=get_var(p, end, &v)) == NULL ) return NULL;
+        put32(hdr + TCP_ACK, get32(hdr + TCP_ACK) + v);
+    }
+    if( bits & VJ_WIN ) {
+        if( end - p < 2 ) return NULL;
+        hdr[TCP_WIN] = *p++;
+        hdr[TCP_WIN+1] = *p++;
+    }
+    if( bits & VJ_FLAGS ) {
+        if( p >= end ) return NULL;
+        hdr[TCP_FLAGS] = *p++;
+    }
+    if( bits & VJ_TS ) {
+        if( !vj_is_ts(hdr, hlen) ) return NULL;
+        if( (p=get_var(p, end, &v)) == NULL ) return NULL;
+        put32(hdr + TCP_OPTS + 4, get32(hdr + TCP_OPTS + 4) + v);
+        if( (p=get_var(p, end, &v)) == NULL ) return NULL;
+        put32(hdr + TCP_OPTS + 8, get32(hdr + TCP_OPTS + 8) + v);
+    } else if( bits & VJ_OPTS ) {
+        if( (size_t)(end - p) < hlen - TCP_OPTS ) return NULL;
+        memcpy(hdr + TCP_OPTS, p, hlen - TCP_OPTS);
+        p += hlen - TCP_OPTS;
+    }
+
+    if( (p=get_var(p, end, &v)) == NULL || v > (size_t)(end - p) ||
+        hlen - 4 + v > 0xFFFF ) {
+        return NULL;
+    }
+    memcpy(s->hdr, hdr, hlen);
+
+    /* the payload may not fit behind the headers yet */
+    if( vj_room(buf, size, off + hlen, v) == -1 ) return NULL;
+    out = *buf + off;
+    memcpy(out + hlen, p, v);
+    out[6] = ((hlen - 4 + v) >> 8) & 0xFF;
+    out[7] = (hlen - 4 + v) & 0xFF;
+    ip_csum(out + 4);
+    *plen = hlen + v;
+    return p + v;
+}
+
+char *vj_decode( vj_t *c, const char *buf, size_t blen, size_t *len ) {
+    const unsigned char *p = (const unsigned char *)buf, *end = p + blen;
+    unsigned char *out = NULL;
+    size_t size = min(blen * 2 + 1024, ZBATCH_MAX), used = 0, plen, hlen;
+    vj_t *tmp;
+    int type, n;
+
+    /* Worked on a copy, so a corrupt batch leaves c as it was */
+    if( (tmp=malloc(sizeof(*tmp))) == NULL ||
+        (out=malloc(size)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() header decode buffer!");
+        goto err;
+    }
+    memcpy(tmp, c, sizeof(*tmp));
+
+    while( p < end ) {
+        type = *p++;
+        if( type == VJ_DELTA ) {
+            if( p >= end || (n=*p++) >= VJ_SLOTS || !tmp->slot[n].len ||
+                vj_room(&out, &size, used, VJ_MAX_HDR) == -1 ||
+                (p=vj_undelta(&tmp->slot[n], p, end, out + used, &plen,
+                              &out, &size)) == NULL ) {
+                goto bad;
+            }
+            used += plen;
+            continue;
+        }
+
+        n = 0;
+        if( type == VJ_FULL && (p >= end || (n=*p++) >= VJ_SLOTS) ) goto bad;
+        if( type > VJ_FULL || end - p < 8 || (plen=iplen((const char *)p)) <
+            8 || plen > (size_t)(end - p) ) {
+            goto bad;
+        }
+        if( type == VJ_FULL ) {
+            if( (hlen=vj_hdrlen(p, plen)) == 0 ) goto bad;
+            memcpy(tmp->slot[n].hdr, p, hlen);
+            tmp->slot[n].len = hlen;
+        }
+        if( vj_room(&out, &size, used, plen) == -1 ) goto err;
+        memcpy(out + used, p, plen);
+        used += plen;
+        p += plen;
+    }
+
+    memcpy(c, tmp, sizeof(*tmp));
+    free(tmp);
+    *len = used;
+    return (char *)out;
+
+bad:
+    lprintf(log, WARN, "Corrupt header compressed batch.");
+err:
+    free(tmp);
+    free(out);
+    return NULL;
+}
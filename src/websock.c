@@ -0,0 +1,315 @@
+/* -------------------------------------------------------------------------
+ * websock.c - htun WebSocket (RFC 6455) framing and handshake functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aead.h"
+#include "common.h"
+#include "http.h"
+#include "log.h"
+#include "queue.h"
+#include "util.h"
+#include "websock.h"
+
+/********************************************************************
+ *** SHA-1, only needed to compute Sec-WebSocket-Accept
+ ********************************************************************/
+
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32-(n))))
+
+static void sha1_block( unsigned long *h, const unsigned char *p ) {
+    unsigned long w[80], a, b, c, d, e, t;
+    int i;
+
+    for( i=0; i<16; i++ ) {
+        w[i] = (unsigned long)p[4*i]<<24 | p[4*i+1]<<16 | p[4*i+2]<<8 |
+               p[4*i+3];
+    }
+    for( i=16; i<80; i++ ) {
+        w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1) & 0xFFFFFFFF;
+    }
+
+    a=h[0]; b=h[1]; c=h[2]; d=h[3]; e=h[4];
+    for( i=0; i<80; i++ ) {
+        if( i < 20 )      t = ((b & c) | (~b & d)) + 0x5A827999;
+        else if( i < 40 ) t = (b ^ c ^ d) + 0x6ED9EBA1;
+        else if( i < 60 ) t = ((b & c) | (b & d) | (c & d)) + 0x8F1BBCDC;
+        else              t = (b ^ c ^ d) + 0xCA62C1D6;
+        t = (ROL(a, 5) + t + e + w[i]) & 0xFFFFFFFF;
+        e = d; d = c; c = ROL(b, 30) & 0xFFFFFFFF; b = a; a = t;
+    }
+    h[0] = (h[0]+a) & 0xFFFFFFFF;
+    h[1] = (h[1]+b) & 0xFFFFFFFF;
+    h[2] = (h[2]+c) & 0xFFFFFFFF;
+    h[3] = (h[3]+d) & 0xFFFFFFFF;
+    h[4] = (h[4]+e) & 0xFFFFFFFF;
+}
+
+/* Hashes len bytes of data (len < 120) into the 20 byte digest md */
+static void sha1_short( const char *data, size_t len, unsigned char *md ) {
+    unsigned long h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                           0x10325476, 0xC3D2E1F0 };
+    unsigned char buf[128];
+    size_t blocks = (len + 8) / 64 + 1;
+    unsigned long long bits = (unsigned long long)len * 8;
+    size_t i;
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, data, len);
+    buf[len] = 0x80;
+    for( i=0; i<8; i++ ) buf[blocks*64-1-i] = (bits >> (8*i)) & 0xFF;
+
+    for( i=0; i<blocks; i++ ) sha1_block(h, buf + 64*i);
+    for( i=0; i<20; i++ ) md[i] = (h[i/4] >> (24 - 8*(i%4))) & 0xFF;
+}
+
+/********************************************************************
+ *** Handshake helpers
+ ********************************************************************/
+
+int ws_is_upgrade( const http_msg_t *msg ) {
+    return slice_eq(&msg->upgrade, "websocket") &&
+        msg->ws_key.len == WS_KEY_LEN;
+}
+
+void ws_make_key( char *key ) {
+    unsigned char raw[16];
+
+    aead_random(raw, sizeof(raw));
+    base64_encode(key, (char *)raw, sizeof(raw));
+}
+
+void ws_accept_key( const char *key, char *accept ) {
+    char buf[WS_KEY_LEN + sizeof(WS_GUID)];
+    unsigned char md[20];
+
+    snprintf(buf, sizeof(buf), "%s%s", key, WS_GUID);
+    sha1_short(buf, strlen(buf), md);
+    base64_encode(accept, (char *)md, sizeof(md));
+}
+
+/********************************************************************
+ *** Framing
+ ********************************************************************/
+
+/* Builds a frame header into hdr, returning its length */
+static inline size_t ws_frame_header( unsigned char *hdr, int opcode,
+                                      size_t len, unsigned char *maskkey ) {
+    size_t n = 2;
+    int i;
+
+    hdr[0] = 0x80 | (opcode & 0x0F);
+    if( len < 126 ) {
+        hdr[1] = len;
+    } else if( len < 65536 ) {
+        hdr[1] = 126;
+        hdr[2] = (len >> 8) & 0xFF;
+        hdr[3] = len & 0xFF;
+        n = 4;
+    } else {
+        hdr[1] = 127;
+        for( i=0; i<8; i++ ) {
+            hdr[2+i] = ((unsigned long long)len >> (56 - 8*i)) & 0xFF;
+        }
+        n = 10;
+    }
+    if( maskkey ) {
+        hdr[1] |= 0x80;
+        memcpy(hdr+n, maskkey, 4);
+        n += 4;
+    }
+    return n;
+}
+
+static inline void ws_mask( char *data, size_t len, unsigned char *key ) {
+    size_t i;
+    for( i=0; i<len; i++ ) data[i] ^= key[i & 3];
+}
+
+int ws_send_frame( int fd, int opcode, char *data, size_t len, int mask ) {
+    unsigned char hdr[14], key[4];
+    struct iovec iov[2];
+
+    if( mask ) {
+        aead_random(key, sizeof(key));
+        ws_mask(data, len, key);
+    }
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = ws_frame_header(hdr, opcode, len, mask ? key : NULL);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+    return writev_all(fd, iov, len ? 2 : 1);
+}
+
+int ws_send_batch( int fd, queue_t *q, int mask ) {
+    size_t total = 0, size = min(q->totsize, WS_MAX_MESSAGE);
+    char *buf, *pkt;
+    int cnt = 0, rc;
+
+    if( (buf=malloc(size + HTUN_MAXPACKET)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() batch buffer!");
+        return -1;
+    }
+
+    /* Pack everything that is queued right now into one message */
+    while( total < size ) {
+        if( (pkt=q_remove(q, 0, NULL)) == NULL ) break;
+        memcpy(buf + total, pkt, iplen(pkt));
+        total += iplen(pkt);
+        cnt++;
+        free(pkt);
+    }
+
+    rc = ws_send_frame(fd, WS_OP_BIN, buf, total, mask);
+    free(buf);
+
+    dprintf(log, DEBUG, "sent %d pkts (%lu bytes) in one message", cnt, total);
+    return rc == -1 ? -1 : cnt;
+}
+
+char *ws_recv_message( rbuf_t *rb, int *opcode, size_t *len, int mask ) {
+    int fd = rb->fd;
+    unsigned char hdr[14], key[4];
+    unsigned long long flen;
+    char *msg = NULL, *tmp;
+    size_t total = 0;
+    int op, fin, i;
+
+    *opcode = -1;
+    while( 1 ) {
+        if( rb_read(rb, (char *)hdr, 2) == -1 ) goto err;
+        fin = hdr[0] & 0x80;
+        op = hdr[0] & 0x0F;
+        flen = hdr[1] & 0x7F;
+
+        /* Frames from the client must be masked, frames from the server
+         * must not */
+        if( !(hdr[1] & 0x80) != !mask ) {
+            lprintf(log, WARN, "Peer on fd #%d violated masking rules.", fd);
+            goto err;
+        }
+
+        if( flen == 126 ) {
+            if( rb_read(rb, (char *)hdr, 2) == -1 ) goto err;
+            flen = hdr[0] << 8 | hdr[1];
+        } else if( flen == 127 ) {
+            if( rb_read(rb, (char *)hdr, 8) == -1 ) goto err;
+            for( flen=0, i=0; i<8; i++ ) flen = flen << 8 | hdr[i];
+        }
+        if( mask && rb_read(rb, (char *)key, 4) == -1 ) goto err;
+
+        if( total + flen > WS_MAX_MESSAGE + HTUN_MAXPACKET ) {
+            lprintf(log, WARN, "Peer on fd #%d sent a %llu byte frame.",
+                    fd, flen);
+            goto err;
+        }
+
+        /* Control frames may arrive between fragments of a message */
+        if( op & 0x8 ) {
+            char ctl[125];
+
+            if( flen > sizeof(ctl) || !fin ) goto err;
+            if( rb_read(rb, ctl, flen) == -1 ) goto err;
+            if( mask ) ws_mask(ctl, flen, key);
+            if( op == WS_OP_CLOSE ) {
+                dprintf(log, DEBUG, "peer on fd #%d sent close", fd);
+                ws_send_frame(fd, WS_OP_CLOSE, ctl, min(flen, 2), !mask);
+                goto err;
+            }
+            if( op == WS_OP_PING &&
+                ws_send_frame(fd, WS_OP_PONG, ctl, flen, !mask) == -1 ) {
+                goto err;
+            }
+            continue;
+        }
+
+        if( (op == WS_OP_CONT) != (msg != NULL) ) {
+            lprintf(log, WARN, "Peer on fd #%d broke message framing.", fd);
+            goto err;
+        }
+        if( op != WS_OP_CONT ) *opcode = op;
+
+        if( (tmp=realloc(msg, total + flen + 1)) == NULL ) {
+            lprintf(log, ERROR, "Unable to malloc() message buffer!");
+            goto err;
+        }
+        msg = tmp;
+        if( rb_read(rb, msg + total, flen) == -1 ) goto err;
+        if( mask ) ws_mask(msg + total, flen, key);
+        total += flen;
+        msg[total] = '\0';
+
+        if( fin ) break;
+    }
+
+    *len = total;
+    return msg;
+
+err:
+    free(msg);
+    return NULL;
+}
+
+int ws_recv_batch( rbuf_t *rb, queue_t *q, int mask ) {
+    int fd = rb->fd;
+    char *msg, *pkt;
+    size_t len, off = 0;
+    int opcode, cnt = 0;
+
+    if( (msg=ws_recv_message(rb, &opcode, &len, mask)) == NULL ) return -1;
+    if( opcode != WS_OP_BIN ) {
+        lprintf(log, WARN, "Ignoring non-binary message on fd #%d.", fd);
+        free(msg);
+        return 0;
+    }
+
+    while( off + 20 <= len ) {
+        size_t plen = iplen(msg + off);
+
+        if( plen < 20 || off + plen > len ) {
+            lprintf(log, WARN, "Truncated packet in message on fd #%d.", fd);
+            break;
+        }
+        if( (pkt=malloc(plen)) == NULL ) {
+            lprintf(log, ERROR, "Unable to malloc() space for packet!");
+            break;
+        }
+        memcpy(pkt, msg + off, plen);
+        if( q_add(q, pkt, Q_WAIT, plen) == -1 ) {
+            free(msg);
+            return -1;
+        }
+        off += plen;
+        cnt++;
+    }
+
+    free(msg);
+    return cnt;
+}
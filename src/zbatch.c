@@ -0,0 +1,302 @@
+/* -------------------------------------------------------------------------
+ * zbatch.c - htun packet batch encoding functions
+ * Copyright (C) 2002 Moshe Jacobson <moshe@runslinux.net>,
+ *                    Ola Nordstrm <ola@triblock.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ * -------------------------------------------------------------------------
+ */
+/* $Id$ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+#include "aead.h"
+#include "common.h"
+#include "log.h"
+#include "queue.h"
+#include "rtx.h"
+#include "util.h"
+#include "vj.h"
+#include "zbatch.h"
+
+/* Indexed by the ZB_* bits, names in the order the encodings are applied */
+static const char *zb_names[] = { "", "vj", "deflate", "vj, deflate",
+                                  "aead", "vj, aead", "deflate, aead",
+                                  "vj, deflate, aead" };
+
+int zbatch_parse( const char *s, size_t len ) {
+    const char *end = s + len;
+    size_t n;
+    int enc = 0;
+
+    while( s < end ) {
+        for( n = 0; s + n < end && !strchr(", \t\r\n", s[n]); n++ );
+        if( n == 2 && !strncasecmp(s, "vj", n) ) enc |= ZB_VJ;
+        if( n == 7 && !strncasecmp(s, "deflate", n) ) enc |= ZB_DEFLATE;
+        if( n == 4 && !strncasecmp(s, "aead", n) ) enc |= ZB_AEAD;
+        s += n ? n : 1;
+    }
+    return enc;
+}
+
+const char *zbatch_names( int enc ) {
+    return zb_names[enc & (ZB_VJ | ZB_DEFLATE | ZB_AEAD)];
+}
+
+/*
+ * Deflates the n buffers at bufs, size bytes in all, into one DYNAMICALLY
+ * ALLOCATED buffer. The buffers are packets, unless lens gives their
+ * lengths. Returns NULL if the batch is too small, does not shrink by at
+ * least a sixteenth, or something failed.
+ */
+static char *zb_deflate( char **bufs, const size_t *lens, int n, size_t size,
+                         size_t *zlen ) {
+    z_stream zs;
+    size_t max;
+    char *z;
+    int i, rc = Z_OK;
+
+    if( size < ZBATCH_MIN ) return NULL;
+
+    /* Anything longer than this is not worth sending deflated */
+    max = size - size / 16;
+    if( (z=malloc(max)) == NULL ) {
+        lprintf(log, ERROR, "Unable to malloc() compression buffer!");
+        return NULL;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if( deflateInit(&zs, Z_BEST_SPEED) != Z_OK ) {
+        lprintf(log, ERROR, "Unable to set up deflate: %s",
+                zs.msg ? zs.msg : "unknown error");
+        free(z);
+        return NULL;
+    }
+    zs.next_out = (Bytef *)z;
+    zs.avail_out = max;
+
+    for( i=0; i < n && rc == Z_OK; i++ ) {
+        zs.next_in = (Bytef *)bufs[i];
+        zs.avail_in = lens ? lens[i] : iplen(bufs[i]);
+        rc = deflate(&zs, i == n - 1 ? Z_FINISH : Z_NO_FLUSH);
+        if( rc == Z_OK && zs.avail_in ) rc = Z_BUF_ERROR;
+    }
+    *zlen = zs.total_out;
+    deflateEnd(&zs);
+
+    /* Z_OK or Z_BUF_ERROR here means it did not fit in max bytes */
+    if( rc != Z_STREAM_END ) {
+        free(z);
+        return NULL;
+    }
+    dprintf(log, DEBUG, "deflated %lu bytes to %lu", size, *zlen);
+    return z;
+}
+
+/*
+ * Inflates what zb_deflate() made into a DYNAMICALLY ALLOCATED buffer,
+ * placing its length in *len. Returns NULL if the data is corrupt or would
+ * inflate to more than a batch can hold.
+ */
+static char *zb_inflate( const char *z, size_t zlen, size_t *len ) {
+    z_stream zs;
+    size_t size = zlen * 4 + 1024;
+    char *buf = NULL, *tmp;
+    int rc;
+
+    memset(&zs, 0, sizeof(zs));
+    if( inflateInit(&zs) != Z_OK ) {
+        lprintf(log, ERROR, "Unable to set up inflate: %s",
+                zs.msg ? zs.msg : "unknown error");
+        return NULL;
+    }
+    zs.next_in = (Bytef *)z;
+    zs.avail_in = zlen;
+
+    do {
+        size = min(size, ZBATCH_MAX);
+        if( (tmp=realloc(buf, size)) == NULL ) {
+            lprintf(log, ERROR, "Unable to malloc() inflate buffer!");
+            goto err;
+        }
+        buf = tmp;
+        zs.next_out = (Bytef *)buf + zs.total_out;
+        zs.avail_out = size - zs.total_out;
+
+        rc = inflate(&zs, Z_FINISH);
+        if( rc == Z_STREAM_END ) break;
+        if( rc != Z_BUF_ERROR && rc != Z_OK ) {
+            lprintf(log, WARN, "Corrupt deflated batch: %s",
+                    zs.msg ? zs.msg : "unknown error");
+            goto err;
+        }
+        if( zs.avail_out ) {
+            lprintf(log, WARN, "Truncated deflated batch.");
+            goto err;
+        }
+        if( size == ZBATCH_MAX ) {
+            lprintf(log, WARN, "Deflated batch inflates past %d bytes.",
+                    ZBATCH_MAX);
+            goto err;
+        }
+        size *= 2;
+    } while( 1 );
+
+    *len = zs.total_out;
+    inflateEnd(&zs);
+    return buf;
+
+err:
+    inflateEnd(&zs);
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Seals the n packets at pkts, size bytes in all, or the buffer z of zlen
+ * bytes that they were encoded into, which is freed.
+ */
+static char *zb_seal( aead_t *a, char **pkts, int n, size_t size, char *z,
+                      size_t *zlen ) {
+    char *buf, *sealed;
+    size_t off = 0;
+    int i;
+
+    if( z == NULL ) {
+        if( (buf=malloc(size ? size : 1)) == NULL ) {
+            lprintf(log, ERROR, "Unable to malloc() sealing buffer!");
+            return NULL;
+        }
+        for( i=0; i < n; i++ ) {
+            memcpy(buf + off, pkts[i], iplen(pkts[i]));
+            off += iplen(pkts[i]);
+        }
+        sealed = aead_seal(a, buf, off, zlen);
+        free(buf);
+        return sealed;
+    }
+    sealed = aead_seal(a, z, *zlen, zlen);
+    free(z);
+    return sealed;
+}
+
+char *zbatch_encode( vj_t *vj, aead_t *a, int enc, char **pkts, int npkts,
+                     size_t size, size_t *zlen, int *used ) {
+    char *hc = NULL, *z = NULL;
+
+    *used = 0;
+    if( (enc & ZB_VJ) &&
+        (hc=vj_encode(vj, pkts, npkts, size, zlen)) != NULL ) {
+        *used = ZB_VJ;
+        pkts = &hc;
+        npkts = 1;
+        size = *zlen;
+    }
+    if( (enc & ZB_DEFLATE) &&
+        (z=zb_deflate(pkts, hc ? &size : NULL, npkts, size, zlen)) != NULL ) {
+        *used |= ZB_DEFLATE;
+        free(hc);
+        hc = NULL;
+    } else if( hc ) {
+        z = hc;
+        *zlen = size;
+    }
+    if( enc & ZB_AEAD ) {
+        if( (z=zb_seal(a, pkts, npkts, size, z, zlen)) == NULL ) {
+            *used = 0;
+            return NULL;
+        }
+        *used |= ZB_AEAD;
+    }
+    return z;
+}
+
+char *zbatch_decode( vj_t *vj, aead_t *a, int enc, const char *z,
+                     size_t zlen, size_t *len ) {
+    char *opened = NULL, *buf = NULL, *out;
+
+    if( enc & ZB_AEAD ) {
+        if( (opened=aead_open(a, z, zlen, len)) == NULL ) return NULL;
+        if( !(enc & (ZB_VJ | ZB_DEFLATE)) ) return opened;
+        z = opened;
+        zlen = *len;
+    }
+    if( enc & ZB_DEFLATE ) {
+        buf = zb_inflate(z, zlen, len);
+        free(opened);
+        if( buf == NULL || !(enc & ZB_VJ) ) return buf;
+        z = buf;
+        zlen = *len;
+    }
+    out = vj_decode(vj, z, zlen, len);
+    free(buf ? buf : opened);
+    return out;
+}
+
+int zbatch_queue( const char *buf, size_t len, queue_t *q ) {
+    size_t off = 0, plen;
+    char *pkt;
+    int cnt = 0;
+
+    while( off < len ) {
+        if( len - off < 8 || (plen=iplen(buf + off)) < 8 ||
+            plen > len - off ) {
+            lprintf(log, WARN, "Bad packet length in encoded batch.");
+            return -1;
+        }
+        if( q ) {
+            if( (pkt=malloc(plen)) == NULL ) {
+                lprintf(log, ERROR, "Unable to malloc() space for packet!");
+                return -1;
+            }
+            memcpy(pkt, buf + off, plen);
+            if( q_add(q, pkt, Q_WAIT, plen) == -1 ) {
+                free(pkt);
+                return -1;
+            }
+        }
+        off += plen;
+        cnt++;
+    }
+    return cnt;
+}
+
+int zbatch_recv( rbuf_t *rb, size_t len, int enc, vj_t *vj, aead_t *a,
+                 queue_t *q ) {
+    char *z, *buf;
+    size_t blen;
+    int cnt;
+
+    if( len > ZBATCH_MAX + AEAD_OVERHEAD ) {
+        lprintf(log, WARN, "Encoded batch of %lu bytes on fd #%d is too big.",
+                len, rb->fd);
+        return -1;
+    }
+    if( (z=readloop(rb, len)) == NULL ) return -1;
+    if( q == NULL ) {
+        free(z);
+        return 0;
+    }
+    buf = zbatch_decode(vj, a, enc, z, len, &blen);
+    free(z);
+    if( buf == NULL ) return -1;
+
+    cnt = zbatch_queue(buf, blen, q);
+    free(buf);
+    return cnt;
+}